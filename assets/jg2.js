@@ -1222,9 +1222,14 @@ function html_log(l, now, count, next)
 	     "</td></tr>";
 	}
 	
-	if (next && n === count) {
+	/*
+	 * "next" is the first commit not listed, so the next page starts
+	 * exactly there... don't carry ?ofs= along or it skips that many more.
+	 * A path log may stop scanning with a short page and still have one.
+	 */
+	if (next) {
 		s += "<tr><td colspan=5><a href='"+
-			makeurl(reponame, "log", rpath, null, next.oid, qofs) +
+			makeurl(reponame, "log", rpath, null, next.oid, null) +
 			"'>next</a></td></tr>";
 	}
 	
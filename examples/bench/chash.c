@@ -0,0 +1,165 @@
+/*
+ * chash.c: microbenchmark for computing cache entry names
+ *
+ * Copyright (C) 2025 Andy Green <andy@warmcat.com>
+ *
+ * This file is made available under the Creative Commons CC0 1.0
+ * Universal Public Domain Dedication.
+ *
+ * Every request computes a cache name from the job, count, refs digest, repo
+ * path, mode, path and oid, and then the cache query hashes the resulting
+ * name again with a suffix.  This times doing that both ways the library can,
+ *
+ *  - md5, with a reused context for the job items and one allocated and freed
+ *    for the query, which is how it was always done before and what you still
+ *    get with JG2_VHOST_MD5_CACHE_KEYS
+ *
+ *  - the default 2 x XXH64 through struct jg2_chash, with nothing allocated
+ *
+ * It builds against the library's private headers so it exercises the real
+ * hash code.  Give it an optional iteration count
+ *
+ *   jg2-bench-chash [iterations]
+ */
+
+#include "private.h"
+#include "hash/private.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+static const char *repo_path = "/srv/repositories/libwebsockets.git",
+		  *mode = "tree", *path = "lib/roles/http/server/server.c",
+		  *search = "lws_service";
+
+static const unsigned char refs[JG2_CHASH_LEN] = {
+	0x1f, 0x44, 0x8b, 0x90, 0x0e, 0x21, 0x53, 0x7c,
+	0xa6, 0x3d, 0x02, 0xe8, 0x71, 0x9b, 0xc4, 0x55
+}, oid[20] = {
+	0x6b, 0xd2, 0x07, 0x1a, 0x94, 0x3e, 0x5c, 0x80, 0xf1, 0x2d,
+	0x48, 0xb7, 0x93, 0x0a, 0xe6, 0x15, 0x7f, 0xc9, 0x22, 0x5e
+};
+
+/* keeps the loops from being optimized away */
+static volatile unsigned char sink;
+
+static uint64_t
+now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ((uint64_t)ts.tv_sec * 1000000000ull) + (uint64_t)ts.tv_nsec;
+}
+
+/* the same items, in the same order, as __jg2_job_compute_cache_hash() */
+
+static void
+key_items(struct jg2_chash *ch, int n)
+{
+	uint16_t je = 3 + (JG2_JSON_EPOCH << 8);
+	uint32_t c32 = (uint32_t)n;
+
+	jg2_chash_upd(ch, &je, 2);
+	jg2_chash_upd(ch, &c32, 4);
+	jg2_chash_upd(ch, search, strlen(search));
+	jg2_chash_upd(ch, refs, sizeof(refs));
+	jg2_chash_upd(ch, repo_path, strlen(repo_path));
+	jg2_chash_upd(ch, mode, strlen(mode));
+	jg2_chash_upd(ch, path, strlen(path));
+	jg2_chash_upd(ch, oid, sizeof(oid));
+}
+
+/* the job hash, then the query hash the same way as __jg2_cache_query_v() */
+
+static void
+cache_key(struct jg2_vhost *vh, jg2_md5_context md5, int n, unsigned char *out)
+{
+	unsigned char h[JG2_CHASH_LEN];
+	jg2_md5_context q = NULL;
+	struct jg2_chash ch;
+	char name[64];
+	int m;
+
+	jg2_chash_init(&ch, vh, md5);
+	key_items(&ch, n);
+	jg2_chash_fini(&ch, h);
+
+	md5_to_hex_cstr(name, h);
+	m = (int)strlen(name);
+	m += lws_snprintf(name + m, sizeof(name) - (unsigned int)m, "-json");
+
+	if (jg2_chash_md5(vh)) {
+		q = vh->cfg.md5_alloc();
+		if (!q)
+			return;
+	}
+
+	jg2_chash_init(&ch, vh, q);
+	jg2_chash_upd(&ch, name, (unsigned int)m);
+	jg2_chash_fini(&ch, out);
+
+	free(q);
+}
+
+static void
+report(const char *name, uint64_t ns, int iterations, uint64_t base)
+{
+	printf("  %-28s %8.1f ns/key", name, (double)ns / iterations);
+	if (base)
+		printf("  (%.2fx)", (double)base / (double)ns);
+	printf("\n");
+}
+
+int
+main(int argc, char *argv[])
+{
+	int iterations = 1000000, n;
+	unsigned char out[16];
+	struct jg2_vhost vh, vh_md5;
+	jg2_md5_context md5;
+	uint64_t t, t_md5;
+
+	if (argc > 1)
+		iterations = atoi(argv[1]);
+	if (iterations < 1)
+		iterations = 1;
+
+	md5 = jg2_md5_alloc();
+	if (!md5)
+		return 1;
+
+	/* only the cfg members are looked at by the chash code */
+
+	memset(&vh, 0, sizeof(vh));
+	memset(&vh_md5, 0, sizeof(vh_md5));
+	vh_md5.cfg.flags = JG2_VHOST_MD5_CACHE_KEYS;
+	vh_md5.cfg.md5_alloc = jg2_md5_alloc;
+	vh_md5.cfg.md5_init = jg2_md5_init;
+	vh_md5.cfg.md5_upd = jg2_md5_upd;
+	vh_md5.cfg.md5_fini = jg2_md5_fini;
+
+	printf("%d cache keys each:\n", iterations);
+
+	t = now_ns();
+	for (n = 0; n < iterations; n++) {
+		cache_key(&vh_md5, md5, n, out);
+		sink ^= out[0];
+	}
+	t_md5 = now_ns() - t;
+	report("md5", t_md5, iterations, 0);
+
+	t = now_ns();
+	for (n = 0; n < iterations; n++) {
+		cache_key(&vh, NULL, n, out);
+		sink ^= out[0];
+	}
+	report("xxh64 x 2", now_ns() - t, iterations, t_md5);
+
+	free(md5);
+
+	return 0;
+}
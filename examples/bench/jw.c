@@ -0,0 +1,905 @@
+/*
+ * jw.c: equivalence test and benchmark for the jg2_jw_* JSON writers
+ *
+ * Copyright (C) 2025 Andy Green <andy@warmcat.com>
+ *
+ * This file is made available under the Creative Commons CC0 1.0
+ * Universal Public Domain Dedication.
+ *
+ * The per-commit and per-entry records in the log, commit, tree and refs JSON
+ * are written with the typed jg2_jw_* emitters instead of CTX_BUF_APPEND()
+ * format strings.  This keeps the format string versions of those records as
+ * a reference, and makes a bare repo (using git fast-import, so git must be in
+ * the PATH) with names, emails, messages, paths and ref names full of control
+ * chars, quotes, html chars and utf-8, more than eight refs on one commit and
+ * annotated tags.  Then it
+ *
+ *  - renders every oid with its alias list, signature, commit and tag
+ *    summary, log entry, tree entry and diffstat entry both ways, checking
+ *    the output and where it ended are the same byte for byte.  Apart from
+ *    the log entries, which go through the summary fragment cache, each is
+ *    also rendered into every smaller buffer size, to check it's truncated
+ *    the same way
+ *
+ *  - times rendering all of the records, apart from the log entries, both
+ *    ways
+ *
+ * It exits nonzero if there was any difference.  Give it an empty dir, it
+ * leaves the repo there for next time
+ *
+ *   jg2-bench-jw /tmp/jg2-jw
+ */
+
+#include "private.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#define COMMITS		200
+#define BUF_SIZE	(64 * 1024)
+#define REPEATS		50
+
+#if LIBGIT2_HAS_DIFF_FILE_ID
+#define diff_file_oid(f) (&(f)->id)
+#else
+#define diff_file_oid(f) (&(f)->oid)
+#endif
+
+enum {
+	REC_OID,
+	REC_SIG,
+	REC_COMMIT,
+	REC_TAG,
+	REC_TREE,
+	REC_DIFF,
+	REC_LOG,
+};
+
+static const char * const rec_names[] = {
+	"oid", "signature", "commit", "tag", "tree entry", "diffstat", "log",
+};
+
+#define F_SUBSEQUENT	1
+#define F_DECO		2
+#define F_NUMSTAT	4
+#define F_BIN		8
+#define F_LARGE		16
+
+struct rec {
+	int type;
+	int flags;
+	const void *o;		/* the oid, signature, commit, tag or delta */
+	char *name;		/* tree entry name */
+	unsigned int mode;	/* tree entry mode */
+	uint64_t a, b;		/* tree entry size, or diffstat add and del */
+	const git_oid *lastc;	/* tree entry last commit, may be NULL */
+};
+
+/* "name <email>", with control, json and html chars and utf-8 */
+
+static const char * const idents[] = {
+	"Zo\xc3\xab \xc3\x85ngstr\xc3\xb6m <zoe@example.com>",
+	"\xe6\x97\xa5\xe6\x9c\xac\xe8\xaa\x9e <\xc3\xbc@\xe4\xbe\x8b.jp>",
+	"ctl \x01" "a\x1f" "b\x7f" "c\ttab <ctl\x02@example.com>",
+	"q \"uo\" te \\ back & amp = eq <a&b=c\"d@example.com>",
+	"Ve\xcc\x81ronique-Ma\xc3\xaft\xc3\xa9 de la Montagne-Saint-\xc3\x89"
+		"tienne du Ch\xc3\xa2teau-Neuf <veronique.de.la.montagne"
+		".saint.etienne@a.very.long.subdomain.example.com>",
+};
+
+static const char * const msgs[] = {
+	"plain subject",
+	"ctl \x01 \x1f \x7f and\ttab, \"quotes\" \\ <b>html</b> & a=b",
+	"\xc3\xbc\xc3\xb1\xc3\xae\xc3\xa7\xc3\xb8\xc3\xb0\xc3\xa9 \xe6\x97\xa5"
+		"\xe6\x9c\xac\xe8\xaa\x9e \xf0\x9f\x90\x99",
+	"a long subject that goes on past the hundred bytes the summaries "
+		"keep, so it gets an ellipsis \xe2\x80\xa6 and then some more",
+	"multi\r\nline\n\nwith a body",
+	"",
+};
+
+static const char * const paths[] = {
+	"README",
+	"src/main.c",
+	"ctl\001name",
+	"tab\tname",
+	"quote\"name",
+	"back\\slash",
+	"html<&>=",
+	"\xc3\xbc\xc3\xb1\xc3\xae/\xe6\x97\xa5\xe6\x9c\xac.txt",
+	"a-file-name-that-is-longer-than-the-one-hundred-and-twenty-eight-"
+		"bytes-a-tree-listing-keeps-\xc3\xa9\xc3\xa9\xc3\xa9\xc3\xa9"
+		"\xc3\xa9\xc3\xa9\xc3\xa9\xc3\xa9-so-it-is-cut",
+};
+
+/* these all point to the tip, along with master and TAGS_AT_TIP more */
+
+static const char * const refs[] = {
+	"refs/heads/gr\xc3\xb6\xc3\x9f" "e",
+	"refs/heads/\xe3\x83\x96\xe3\x83\xa9\xe3\x83\xb3\xe3\x83\x81/\xe9\x95"
+		"\xb7\xe3\x81\x84\xe5\x90\x8d\xe5\x89\x8d-a-long-branch-name",
+	"refs/heads/amp&eq=lt<gt>",
+	"refs/tags/q\"uote",
+	"refs/tags/v1.0-\xc3\xbc\xc3\xb1\xc3\xae",
+};
+
+#define TAGS_AT_TIP	6
+
+static const char * const tzs[] = { "+0000", "+1345", "-0730", "-1200" };
+
+static const uint64_t nums[] = {
+	0, 1, 9, 10, 4095, 4294967296ull, 18446744073709551615ull
+};
+
+static char buf_old[BUF_SIZE], buf_new[BUF_SIZE];
+
+static struct rec *recs;
+static int count_recs, alloc_recs;
+static git_object **objs;
+static int count_objs, alloc_objs;
+#if LIBGIT2_HAS_DIFF
+static git_diff **diffs;
+static int count_diffs, alloc_diffs;
+#endif
+
+static uint64_t
+now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ((uint64_t)ts.tv_sec * 1000000000ull) + (uint64_t)ts.tv_nsec;
+}
+
+/*
+ * The records as they were written with format strings, before the typed
+ * emitters
+ */
+
+static void
+old_time_json(const git_time *t, struct jg2_ctx *ctx)
+{
+	CTX_BUF_APPEND("{ \"time\": %llu, \"offset\": %d }",
+		       (unsigned long long)t->time, t->offset);
+}
+
+static void
+old_name_email_json(const char *name, const char *email, struct jg2_ctx *ctx)
+{
+	char e[JG2_IDENT_LEN], e1[JG2_IDENT_LEN], md5_hex[33];
+
+	if (!name)
+		name = "unknown";
+
+	if (!email)
+		email = "unknown";
+
+	ellipsis_purify(e, name, sizeof(e));
+	ellipsis_purify(e1, email, sizeof(e1));
+
+	CTX_BUF_APPEND(" \"name\": \"%s\", \"email\": \"%s\", \"md5\": \"%s\" ",
+		       e, e1, md5_to_hex_cstr(md5_hex,
+					      email_md5(ctx->vhost, email)));
+}
+
+static void
+old_signature_json(const git_signature *sig, struct jg2_ctx *ctx)
+{
+	CTX_BUF_APPEND("{ \"git_time\": ");
+	old_time_json(&sig->when, ctx);
+
+	CTX_BUF_APPEND(",");
+	old_name_email_json(sig->name, sig->email, ctx);
+
+	CTX_BUF_APPEND(" }");
+}
+
+static void
+old_alias_list(const git_oid *oid, struct jg2_ctx *ctx)
+{
+	const struct jg2_ref *aliases[JG2_DECO_ALIASES];
+	char pure[32];
+	int n, m = 0;
+
+	n = jg2_oid_to_ref_names(oid, ctx, aliases, LWS_ARRAY_SIZE(aliases));
+
+	while (m < n) {
+		CTX_BUF_APPEND("%c\"%s\"", !m ? ' ' : ',', ellipsis_purify(pure,
+			       aliases[m]->ref_name, sizeof(pure)));
+		m++;
+	}
+}
+
+static void
+old_json_oid(const git_oid *oid, struct jg2_ctx *ctx)
+{
+	char oid_hex[GIT_OID_HEXSZ + 1];
+
+	CTX_BUF_APPEND("{ \"oid\": \"%s\", "
+		       "\"alias\": [", oid_to_hex_cstr(oid_hex, oid));
+
+	if (ctx->deco_markers)
+		CTX_BUF_APPEND("%c%s", JG2_DECO_START, oid_hex);
+
+	old_alias_list(oid, ctx);
+
+	if (ctx->deco_markers)
+		CTX_BUF_APPEND("%c", JG2_DECO_END);
+
+	CTX_BUF_APPEND("]}");
+}
+
+static void
+old_commit_summary(git_commit *commit, struct jg2_ctx *ctx)
+{
+	char summary[JG2_SUMMARY_LEN];
+
+	CTX_BUF_APPEND("\"type\":\"commit\",\n \"time\": %llu,\n"
+			"\"time_ofs\": %llu,\n \"oid_tree\": ",
+			(unsigned long long)git_commit_time(commit),
+			(unsigned long long)git_commit_time_offset(commit));
+
+	old_json_oid(git_commit_tree_id(commit), ctx);
+
+	CTX_BUF_APPEND(",\n\"oid\":");
+
+	old_json_oid(git_commit_id(commit), ctx);
+
+	CTX_BUF_APPEND(",\n \"msg\": \"%s\",\n \"sig_commit\": ",
+		       commit_summary_msg(summary, commit));
+
+	old_signature_json(git_commit_committer(commit), ctx);
+
+	CTX_BUF_APPEND(",\n\"sig_author\": ");
+
+	old_signature_json(git_commit_author(commit), ctx);
+}
+
+static void
+old_tag_summary(git_tag *tag, struct jg2_ctx *ctx)
+{
+	char summary[JG2_SUMMARY_LEN];
+
+	CTX_BUF_APPEND("\"type\":\"tag\",\n \"oid_tag\": ");
+
+	old_json_oid(git_tag_target_id(tag), ctx);
+
+	CTX_BUF_APPEND(",\n \"type_tag\": \"%s\",\n"
+		"\"msg_tag\": \"%s\",\n \"sig_tagger\": ",
+		otype_name(git_tag_target_type(tag)),
+		ellipsis_purify(summary, git_tag_message(tag),
+				sizeof(summary)));
+
+	old_signature_json(git_tag_tagger(tag), ctx);
+}
+
+static void
+old_log_entry(struct jg2_ctx *ctx, git_commit *c)
+{
+	CTX_BUF_APPEND("%c\n{ \"name\": ",
+		       ctx->subsequent ? ',' : ' ');
+
+	old_json_oid(git_commit_id(c), ctx);
+
+	CTX_BUF_APPEND(",\n"
+			"\"summary\": {\n");
+
+	old_commit_summary(c, ctx);
+
+	CTX_BUF_APPEND("}}");
+}
+
+static void
+old_tree_entry(struct jg2_ctx *ctx, int first, const char *name,
+	       unsigned int mode, uint64_t size, const git_oid *lastc)
+{
+	char pure[128];
+
+	CTX_BUF_APPEND("%c\n{ \"name\": \"%s\","
+		       "\"mode\": \"%u\", \"size\":%llu",
+		       first ? ' ' : ',',
+		       ellipsis_purify(pure, name, sizeof(pure)),
+		       mode, (unsigned long long)size);
+
+	if (lastc) {
+		char hex[GIT_OID_HEXSZ + 1];
+
+		oid_to_hex_cstr(hex, lastc);
+		CTX_BUF_APPEND(",\"last_commit\":\"%s\"", hex);
+	}
+
+	CTX_BUF_APPEND("}");
+}
+
+#if LIBGIT2_HAS_DIFF
+static const char diff_status[] = " ADMRCI?T";
+
+static void
+old_diffstat(struct jg2_ctx *ctx, const git_diff_delta *delta, size_t add,
+	     size_t del, int bin, int large)
+{
+	char pure[256], pure1[256], ho[GIT_OID_HEXSZ + 1], hn[GIT_OID_HEXSZ + 1];
+
+	CTX_BUF_APPEND("%c\n{ \"path\": \"%s\", \"old_path\": \"%s\", "
+		       "\"status\": \"%c\"",
+		       ctx->subsequent ? ',' : ' ',
+		       ellipsis_purify(pure, delta->new_file.path, sizeof(pure)),
+		       ellipsis_purify(pure1, delta->old_file.path,
+				       sizeof(pure1)),
+		       (size_t)delta->status < sizeof(diff_status) - 1 ?
+				diff_status[delta->status] : '?');
+
+	if (ctx->numstat)
+		CTX_BUF_APPEND(", \"add\": %llu, \"del\": %llu",
+			       (unsigned long long)add,
+			       (unsigned long long)del);
+
+	CTX_BUF_APPEND(", \"old\": \"%s\", \"new\": \"%s\"%s%s }",
+		       oid_to_hex_cstr(ho, diff_file_oid(&delta->old_file)),
+		       oid_to_hex_cstr(hn, diff_file_oid(&delta->new_file)),
+		       bin ? ", \"binary\": 1" : "",
+		       large ? ", \"large\": 1" : "");
+
+	ctx->subsequent = 1;
+}
+#endif
+
+static void
+render(struct jg2_ctx *ctx, const struct rec *r, int old)
+{
+	ctx->subsequent = !!(r->flags & F_SUBSEQUENT);
+	ctx->deco_markers = !!(r->flags & F_DECO);
+	ctx->numstat = !!(r->flags & F_NUMSTAT);
+
+	switch (r->type) {
+	case REC_OID:
+		if (old)
+			old_json_oid(r->o, ctx);
+		else
+			jg2_json_oid(r->o, ctx);
+		break;
+	case REC_SIG:
+		if (old)
+			old_signature_json(r->o, ctx);
+		else
+			signature_json(r->o, ctx);
+		break;
+	case REC_COMMIT:
+		if (old)
+			old_commit_summary((git_commit *)r->o, ctx);
+		else
+			commit_summary((git_commit *)r->o, ctx);
+		break;
+	case REC_TAG:
+		if (old)
+			old_tag_summary((git_tag *)r->o, ctx);
+		else
+			tag_summary((git_tag *)r->o, ctx);
+		break;
+	case REC_TREE:
+		if (old)
+			old_tree_entry(ctx, !(r->flags & F_SUBSEQUENT), r->name,
+				       r->mode, r->a, r->lastc);
+		else
+			tree_entry_json(ctx, !(r->flags & F_SUBSEQUENT),
+					r->name, r->mode, r->a, r->lastc);
+		break;
+#if LIBGIT2_HAS_DIFF
+	case REC_DIFF:
+		if (old)
+			old_diffstat(ctx, r->o, (size_t)r->a, (size_t)r->b,
+				     !!(r->flags & F_BIN),
+				     !!(r->flags & F_LARGE));
+		else
+			diffstat_json(ctx, r->o, (size_t)r->a, (size_t)r->b,
+				      !!(r->flags & F_BIN),
+				      !!(r->flags & F_LARGE));
+		break;
+#endif
+	case REC_LOG:
+		if (old)
+			old_log_entry(ctx, (git_commit *)r->o);
+		else
+			job_log_entry(ctx, git_commit_id((git_commit *)r->o),
+				      (git_commit *)r->o);
+		break;
+	}
+}
+
+/* render r both ways into size bytes, returns nonzero if they differ */
+
+static int
+compare(struct jg2_ctx *ctx, const struct rec *r, size_t size, size_t span)
+{
+	size_t lo, ln;
+
+	memset(buf_old, 0xaa, span);
+	memset(buf_new, 0xaa, span);
+
+	ctx->p = buf_old;
+	ctx->end = buf_old + size;
+	render(ctx, r, 1);
+	lo = lws_ptr_diff(ctx->p, buf_old);
+
+	ctx->p = buf_new;
+	ctx->end = buf_new + size;
+	render(ctx, r, 0);
+	ln = lws_ptr_diff(ctx->p, buf_new);
+
+	if (lo == ln && !memcmp(buf_old, buf_new, span))
+		return 0;
+
+	fprintf(stderr, "%s record, buffer size %d: used %d / %d\n"
+			"  format strings: %.*s\n  jg2_jw_*:       %.*s\n",
+		rec_names[r->type], (int)size, (int)lo, (int)ln,
+		(int)lo, buf_old, (int)ln, buf_new);
+
+	return 1;
+}
+
+static int
+check(struct jg2_ctx *ctx, const struct rec *r)
+{
+	size_t len, span, size;
+
+	/* at the full size first, to see how much it writes */
+
+	if (compare(ctx, r, BUF_SIZE, BUF_SIZE))
+		return 1;
+
+	len = lws_ptr_diff(ctx->p, buf_new);
+	span = len + 64 < BUF_SIZE ? len + 64 : BUF_SIZE;
+
+	/*
+	 * The log entry summary comes from the fragment cache the second
+	 * time, and the cache only keeps whole ones
+	 */
+
+	if (r->type == REC_LOG)
+		return compare(ctx, r, BUF_SIZE, span);
+
+	for (size = 0; size <= len + 1; size++)
+		if (compare(ctx, r, size, span))
+			return 1;
+
+	return 0;
+}
+
+static struct rec *
+rec_add(int type, int flags, const void *o)
+{
+	struct rec *r;
+	void *p;
+
+	if (count_recs == alloc_recs) {
+		alloc_recs = alloc_recs ? alloc_recs * 2 : 1024;
+		p = realloc(recs, (size_t)alloc_recs * sizeof(*recs));
+		if (!p)
+			return NULL;
+		recs = p;
+	}
+
+	r = &recs[count_recs++];
+	memset(r, 0, sizeof(*r));
+	r->type = type;
+	r->flags = flags;
+	r->o = o;
+
+	return r;
+}
+
+/* objects the records point into, freed at the end */
+
+static int
+obj_keep(git_object *o)
+{
+	void *p;
+
+	if (count_objs == alloc_objs) {
+		alloc_objs = alloc_objs ? alloc_objs * 2 : 256;
+		p = realloc(objs, (size_t)alloc_objs * sizeof(*objs));
+		if (!p)
+			return 1;
+		objs = p;
+	}
+
+	objs[count_objs++] = o;
+
+	return 0;
+}
+
+static int
+tree_cb(const char *root, const git_tree_entry *te, void *payload)
+{
+	const git_oid *tip = payload;
+	struct rec *r;
+	int n = count_recs;
+
+	r = rec_add(REC_TREE, n & 1 ? F_SUBSEQUENT : 0, NULL);
+	if (!r)
+		return -1;
+
+	r->name = strdup(git_tree_entry_name(te));
+	r->mode = (unsigned int)git_tree_entry_filemode(te);
+	r->a = nums[n % LWS_ARRAY_SIZE(nums)];
+	r->lastc = n % 3 ? tip : NULL;
+
+	return r->name ? 0 : -1;
+}
+
+#if LIBGIT2_HAS_DIFF
+static int
+diff_recs(git_repository *repo, git_commit *c)
+{
+	git_tree *tree = NULL, *ptree = NULL;
+	git_commit *parent;
+	git_diff *diff;
+	size_t n, k;
+	struct rec *r;
+	void *p;
+	int f, e;
+
+	if (git_commit_tree(&tree, c))
+		return 1;
+
+	if (git_commit_parentcount(c) && !git_commit_parent(&parent, c, 0)) {
+		git_commit_tree(&ptree, parent);
+		git_commit_free(parent);
+	}
+
+	e = git_diff_tree_to_tree(&diff, repo, ptree, tree, NULL);
+	git_tree_free(ptree);
+	git_tree_free(tree);
+	if (e)
+		return 1;
+
+	if (count_diffs == alloc_diffs) {
+		alloc_diffs = alloc_diffs ? alloc_diffs * 2 : 256;
+		p = realloc(diffs, (size_t)alloc_diffs * sizeof(*diffs));
+		if (!p) {
+			git_diff_free(diff);
+			return 1;
+		}
+		diffs = p;
+	}
+	diffs[count_diffs++] = diff;
+
+	for (n = 0; n < git_diff_num_deltas(diff); n++) {
+		k = (size_t)count_recs;
+		f = n ? F_SUBSEQUENT : 0;
+		if (k & 1)
+			f |= F_NUMSTAT;
+		if (k % 7 == 3)
+			f |= F_BIN;
+		if (k % 11 == 5)
+			f |= F_LARGE;
+
+		r = rec_add(REC_DIFF, f, git_diff_get_delta(diff, n));
+		if (!r)
+			return 1;
+		r->a = nums[k % LWS_ARRAY_SIZE(nums)];
+		r->b = nums[(k / 3) % LWS_ARRAY_SIZE(nums)];
+	}
+
+	return 0;
+}
+#endif
+
+/* every commit on master, every ref, and the tip's tree */
+
+static int
+collect(git_repository *repo)
+{
+	git_reference_iterator *iter_ref;
+	const git_oid *tip = NULL;
+	git_generic_ptr u;
+	git_reference *ref;
+	git_revwalk *walk;
+	git_tree *tree;
+	git_oid oid;
+	int n = 0, f;
+
+	if (git_revwalk_new(&walk, repo))
+		return 1;
+
+	if (git_revwalk_push_ref(walk, "refs/heads/master")) {
+		git_revwalk_free(walk);
+		return 1;
+	}
+
+	while (!git_revwalk_next(&oid, walk)) {
+		if (git_commit_lookup(&u.commit, repo, &oid) ||
+		    obj_keep(u.obj))
+			break;
+
+		if (!tip)
+			tip = git_commit_id(u.commit);
+
+		f = n & 1 ? F_DECO : 0;
+		if (!rec_add(REC_COMMIT, f, u.commit) ||
+		    !rec_add(REC_LOG, n ? F_SUBSEQUENT : 0, u.commit) ||
+		    !rec_add(REC_OID, f, git_commit_id(u.commit)) ||
+		    !rec_add(REC_SIG, 0, git_commit_committer(u.commit)) ||
+		    !rec_add(REC_SIG, 0, git_commit_author(u.commit)))
+			break;
+#if LIBGIT2_HAS_DIFF
+		if (diff_recs(repo, u.commit))
+			break;
+#endif
+		n++;
+	}
+	git_revwalk_free(walk);
+
+	if (n != COMMITS + 1) {
+		fprintf(stderr, "found %d commits\n", n);
+		return 1;
+	}
+
+	if (git_reference_iterator_new(&iter_ref, repo))
+		return 1;
+
+	while (!git_reference_next(&ref, iter_ref)) {
+		const git_oid *o = git_reference_target(ref);
+
+		if (!o || git_object_lookup(&u.obj, repo, o, GIT_OBJ_ANY) ||
+		    obj_keep(u.obj)) {
+			git_reference_free(ref);
+			continue;
+		}
+		git_reference_free(ref);
+
+		if (!rec_add(REC_OID, 0, git_object_id(u.obj)) ||
+		    !rec_add(REC_OID, F_DECO, git_object_id(u.obj)))
+			break;
+
+		if (git_object_type(u.obj) == GIT_OBJ_TAG &&
+		    (!rec_add(REC_TAG, 0, u.tag) ||
+		     (git_tag_tagger(u.tag) &&
+		      !rec_add(REC_SIG, 0, git_tag_tagger(u.tag)))))
+			break;
+	}
+	git_reference_iterator_free(iter_ref);
+
+	if (git_tree_lookup(&tree, repo,
+			    git_commit_tree_id((git_commit *)objs[0])))
+		return 1;
+
+	n = git_tree_walk(tree, GIT_TREEWALK_PRE, tree_cb, (void *)tip);
+	git_tree_free(tree);
+
+	return n;
+}
+
+/* paths are always quoted, with anything unusual as octal */
+
+static void
+fi_path(FILE *f, const char *p)
+{
+	fputc('"', f);
+	while (*p) {
+		unsigned char c = (unsigned char)*p++;
+
+		if (c == '"' || c == '\\')
+			fprintf(f, "\\%c", c);
+		else
+			if (c < 0x20 || c >= 0x7f)
+				fprintf(f, "\\%03o", c);
+			else
+				fputc(c, f);
+	}
+	fputc('"', f);
+}
+
+static void
+fi_data(FILE *f, const char *s, size_t len)
+{
+	fprintf(f, "data %d\n", (int)len);
+	fwrite(s, 1, len, f);
+	fputc('\n', f);
+}
+
+static int
+make_repo(const char *path)
+{
+	static const char bin[] = "\x89PNG\r\n\x1a\n\0\0\0\rIHDR";
+	char cmd[512], b[16];
+	size_t m;
+	FILE *f;
+	int n;
+
+	snprintf(cmd, sizeof(cmd), "git init -q --bare '%s'", path);
+	if (system(cmd))
+		return 1;
+
+	snprintf(cmd, sizeof(cmd), "git --git-dir='%s' fast-import --quiet",
+		 path);
+	f = popen(cmd, "w");
+	if (!f)
+		return 1;
+
+	for (n = 1; n <= COMMITS + 1; n++) {
+		const char *msg = msgs[n % LWS_ARRAY_SIZE(msgs)];
+
+		fprintf(f, "commit refs/heads/master\nmark :%d\n"
+			   "author %s %d %s\ncommitter %s %d %s\n", n,
+			idents[n % LWS_ARRAY_SIZE(idents)], 1500000000 + n,
+			tzs[n % LWS_ARRAY_SIZE(tzs)],
+			idents[(n + 1) % LWS_ARRAY_SIZE(idents)],
+			1500000000 + (n * 3600),
+			tzs[(n + 1) % LWS_ARRAY_SIZE(tzs)]);
+		fi_data(f, msg, strlen(msg));
+		if (n > 1)
+			fprintf(f, "from :%d\n", n - 1);
+
+		if (n == 1) {
+			for (m = 0; m < LWS_ARRAY_SIZE(paths); m++) {
+				fprintf(f, "M 100644 inline ");
+				fi_path(f, paths[m]);
+				fprintf(f, "\n");
+				fi_data(f, "1\n", 2);
+			}
+			fprintf(f, "M 100755 inline run.sh\n");
+			fi_data(f, "#!/bin/sh\n", 10);
+			fprintf(f, "M 120000 inline link\n");
+			fi_data(f, paths[7], strlen(paths[7]));
+			fprintf(f, "M 160000 1234567890123456789012345678901234567890"
+				   " sub\n");
+		} else {
+			/* change one file, and now and then delete one */
+
+			fprintf(f, "M 100644 inline ");
+			fi_path(f, paths[n % LWS_ARRAY_SIZE(paths)]);
+			fprintf(f, "\n");
+			m = (size_t)snprintf(b, sizeof(b), "%d\n", n);
+			fi_data(f, b, m);
+			if (n % 10 == 5) {
+				fprintf(f, "D ");
+				fi_path(f, paths[(n / 10) %
+						 LWS_ARRAY_SIZE(paths)]);
+				fprintf(f, "\n");
+			}
+			if (n % 10 == 7) {
+				fprintf(f, "M 100644 inline bin.dat\n");
+				fi_data(f, bin, sizeof(bin) - 1);
+			}
+		}
+		fprintf(f, "\n");
+	}
+
+	for (m = 0; m < LWS_ARRAY_SIZE(refs); m++)
+		fprintf(f, "reset %s\nfrom :%d\n\n", refs[m], COMMITS + 1);
+	for (n = 0; n < TAGS_AT_TIP; n++)
+		fprintf(f, "reset refs/tags/t%d\nfrom :%d\n\n", n, COMMITS + 1);
+
+	/* annotated tags, of the tip and of an old commit */
+
+	fprintf(f, "tag t\xc3\xa4g-\xe6\x97\xa5\xe6\x9c\xac\nfrom :%d\n"
+		   "tagger %s 1600000000 -0930\n", COMMITS + 1, idents[2]);
+	fi_data(f, msgs[1], strlen(msgs[1]));
+	fprintf(f, "tag old-&-<long>\nfrom :10\ntagger %s 1500000000 +0545\n",
+		idents[4]);
+	fi_data(f, msgs[3], strlen(msgs[3]));
+
+	return !!pclose(f);
+}
+
+static uint64_t
+time_recs(struct jg2_ctx *ctx, int old)
+{
+	uint64_t t;
+	int n, m;
+
+	t = now_ns();
+	for (n = 0; n < REPEATS; n++)
+		for (m = 0; m < count_recs; m++) {
+			if (recs[m].type == REC_LOG)
+				continue;
+			ctx->p = old ? buf_old : buf_new;
+			ctx->end = ctx->p + BUF_SIZE;
+			render(ctx, &recs[m], old);
+		}
+
+	return now_ns() - t;
+}
+
+int
+main(int argc, char *argv[])
+{
+	int counts[REC_LOG + 1], fails = 0, timed = 0, ret = 1, n;
+	struct jg2_vhost_config config;
+	git_repository *repo = NULL;
+	struct jg2_vhost *vh = NULL;
+	struct jg2_ctx *ctx = NULL;
+	char path[256];
+	uint64_t t_old, t_new;
+	struct stat s;
+
+	if (argc < 2) {
+		fprintf(stderr, "Usage: %s <empty dir>\n", argv[0]);
+		return 1;
+	}
+
+	snprintf(path, sizeof(path), "%s/jw.git", argv[1]);
+
+	if (stat(path, &s) && make_repo(path)) {
+		fprintf(stderr, "failed to create %s\n", path);
+		return 1;
+	}
+
+	git_libgit2_init();
+
+	if (git_repository_open(&repo, path))
+		goto bail;
+
+	memset(&config, 0, sizeof(config));
+	config.virtual_base_urlpath = "/git";
+	config.repo_base_dir = argv[1];
+	config.acl_user = "@all";
+
+	vh = jg2_vhost_create(&config);
+	if (!vh) {
+		fprintf(stderr, "failed to create vhost\n");
+		goto bail;
+	}
+
+	ctx = calloc(1, sizeof(*ctx));
+	if (!ctx)
+		goto bail;
+
+	ctx->vhost = vh;
+	ctx->reftab = jg2_reftab_create(repo);
+	if (!ctx->reftab || collect(repo)) {
+		fprintf(stderr, "failed to read %s\n", path);
+		goto bail;
+	}
+
+	memset(counts, 0, sizeof(counts));
+	for (n = 0; n < count_recs; n++) {
+		counts[recs[n].type]++;
+		fails += check(ctx, &recs[n]);
+		if (recs[n].type != REC_LOG)
+			timed++;
+	}
+
+	printf("%d records, %d differences\n", count_recs, fails);
+	for (n = 0; n <= REC_LOG; n++)
+		printf("  %-12s %6d\n", rec_names[n], counts[n]);
+
+	printf("rendering %d records %d times:\n", timed, REPEATS);
+
+	t_old = time_recs(ctx, 1);
+	t_new = time_recs(ctx, 0);
+	printf("  %-28s %8.1f ns/record\n", "format strings",
+	       (double)t_old / ((double)timed * REPEATS));
+	printf("  %-28s %8.1f ns/record  (%.2fx)\n", "jg2_jw_*",
+	       (double)t_new / ((double)timed * REPEATS),
+	       (double)t_old / (double)(t_new | 1));
+
+	ret = !!fails;
+
+bail:
+	for (n = 0; n < count_recs; n++)
+		free(recs[n].name);
+	free(recs);
+#if LIBGIT2_HAS_DIFF
+	for (n = 0; n < count_diffs; n++)
+		git_diff_free(diffs[n]);
+	free(diffs);
+#endif
+	for (n = 0; n < count_objs; n++)
+		git_object_free(objs[n]);
+	free(objs);
+	if (ctx)
+		free(ctx->reftab); /* it's a single allocation */
+	free(ctx);
+	if (vh)
+		jg2_vhost_destroy(vh);
+	git_repository_free(repo);
+	git_libgit2_shutdown();
+
+	return ret;
+}
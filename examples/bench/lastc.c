@@ -0,0 +1,297 @@
+/*
+ * lastc.c: benchmark for building and updating the last commit index
+ *
+ * Copyright (C) 2025 Andy Green <andy@warmcat.com>
+ *
+ * This file is made available under the Creative Commons CC0 1.0
+ * Universal Public Domain Dedication.
+ *
+ * Tree listings of a branch show the last commit to touch each entry, from a
+ * per-branch index the index thread keeps in the cache dir.  This makes a
+ * bare repo with a linear history of 100000 commits by default (using git
+ * fast-import, so git must be in the PATH), each changing a few of 2000
+ * files, plus 500 files that only the first commit touched, so the walk has
+ * to go all the way back.  Then it times
+ *
+ *  - building the index from scratch, after a tree listing asks for it
+ *
+ *  - updating it after 100 more commits are added to the branch, which
+ *    only walks the new commits
+ *
+ *  - rebuilding it after the branch is rewound 50 commits, which has to
+ *    start again from scratch
+ *
+ * Each is timed from when the repo is marked as having changed refs, the way
+ * the refchange notification does it, until the index for the new tip is in
+ * place.  It calls the update itself rather than waiting for the index
+ * thread's next pass.
+ *
+ * Give it an empty dir, it leaves the repo there for next time, each run
+ * leaving it 50 commits longer
+ *
+ *   jg2-bench-lastc /tmp/jg2-lastc [commits]
+ */
+
+#include "private.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define LIVE_FILES	2000
+#define OLD_FILES	500
+
+static const char *ref = "refs/heads/master";
+static uint32_t rs = 0x9e3779b9;
+
+static uint64_t
+now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ((uint64_t)ts.tv_sec * 1000000000ull) + (uint64_t)ts.tv_nsec;
+}
+
+static uint32_t
+rnd(void)
+{
+	rs ^= rs << 13;
+	rs ^= rs >> 17;
+	rs ^= rs << 5;
+
+	return rs;
+}
+
+/*
+ * Adds commits first to first + count - 1 on master.  The first commit of a
+ * new repo adds all the files, the rest each change one to three live ones.
+ */
+
+static int
+fast_import(const char *path, int first, int count)
+{
+	char cmd[512];
+	int n, m, k;
+	FILE *f;
+
+	lws_snprintf(cmd, sizeof(cmd), "git --git-dir='%s' fast-import "
+				       "--quiet", path);
+	f = popen(cmd, "w");
+	if (!f)
+		return 1;
+
+	for (n = first; n < first + count; n++) {
+		fprintf(f, "commit refs/heads/master\n"
+			   "committer bench <bench@example.com> %d +0000\n"
+			   "data 8\nc%07d\n", 1500000000 + n, n);
+		if (n == first && first > 1)
+			fprintf(f, "from refs/heads/master^0\n");
+
+		if (n == 1) {
+			for (m = 0; m < OLD_FILES; m++)
+				fprintf(f, "M 100644 inline old/o%d/f%04d\n"
+					   "data 4\nold\n", m % 10, m);
+			for (m = 0; m < LIVE_FILES; m++)
+				fprintf(f, "M 100644 inline src/d%02d/f%04d\n"
+					   "data 8\nc%07d\n", m % 40, m, n);
+		} else
+			for (k = 1 + (int)(rnd() % 3); k; k--) {
+				m = (int)(rnd() % LIVE_FILES);
+				fprintf(f, "M 100644 inline src/d%02d/f%04d\n"
+					   "data 8\nc%07d\n", m % 40, m, n);
+			}
+		fprintf(f, "\n");
+	}
+
+	return !!pclose(f);
+}
+
+/* a tree listing of the branch, which asks for the index */
+
+static int
+list_tree(struct jg2_vhost *vh)
+{
+	struct jg2_ctx_create_args args;
+	struct jg2_ctx *ctx;
+	const char *mimetype;
+	unsigned long length;
+	char buf[4096];
+	size_t used;
+	int done;
+
+	memset(&args, 0, sizeof(args));
+	args.repo_path = "/lastc/tree";
+	args.mimetype = &mimetype;
+	args.length = &length;
+
+	if (jg2_ctx_create(vh, &ctx, &args)) {
+		fprintf(stderr, "failed to create ctx\n");
+		return 1;
+	}
+
+	do {
+		done = jg2_ctx_fill(ctx, buf, sizeof(buf), &used, NULL);
+	} while (!done);
+
+	jg2_ctx_destroy(ctx);
+
+	return done < 0;
+}
+
+/*
+ * Marks the repo's refs as changed and brings the index up to date with the
+ * branch, returns how long it took, or 0 if it failed
+ */
+
+static uint64_t
+update(struct jg2_vhost *vh, struct jg2_repo *r, git_repository *repo)
+{
+	uint64_t t, deadline;
+	git_oid want, tip;
+
+	if (jg2_oid_lookup(repo, &want, ref))
+		return 0;
+
+	t = now_ns();
+	deadline = t + (3600 * 1000000000ull);
+
+	pthread_mutex_lock(&vh->lock); /* ======================== vhost lock */
+	pthread_mutex_lock(&r->lock); /* ========================= jrepo lock */
+	r->lastc_stale = 1;
+	pthread_mutex_unlock(&r->lock); /*---------------------- jrepo unlock */
+	pthread_mutex_unlock(&vh->lock); /* -------------------- vhost unlock */
+
+	/* if the index thread got there first, this just waits for it */
+
+	while (jg2_lastc_ref_tip(r, ref, &tip) || !git_oid_equal(&tip, &want)) {
+		if (now_ns() > deadline)
+			return 0;
+		jg2_vhost_lastc_update(vh);
+		usleep(1000);
+	}
+
+	return now_ns() - t;
+}
+
+static int
+report(const char *name, uint64_t ns)
+{
+	if (!ns) {
+		fprintf(stderr, "%s failed\n", name);
+		return 1;
+	}
+
+	printf("  %-34s %10.1f ms\n", name, (double)ns / 1000000.0);
+
+	return 0;
+}
+
+int
+main(int argc, char *argv[])
+{
+	char path[256], cache[256], cmd[600];
+	struct jg2_vhost_config config;
+	git_repository *repo = NULL;
+	struct jg2_vhost *vh = NULL;
+	int count = 100000, ret = 1;
+	struct jg2_repo *r;
+	struct stat s;
+	uint64_t t;
+
+	if (argc < 2) {
+		fprintf(stderr, "Usage: %s <empty dir> [commits]\n", argv[0]);
+		return 1;
+	}
+	if (argc > 2)
+		count = atoi(argv[2]);
+	if (count < 100 || count > 9999999)
+		return 1;
+
+	lws_snprintf(path, sizeof(path), "%s/lastc.git", argv[1]);
+
+	if (stat(path, &s)) {
+		lws_snprintf(cmd, sizeof(cmd), "git init -q --bare '%s'", path);
+		t = now_ns();
+		if (system(cmd) || fast_import(path, 1, count)) {
+			fprintf(stderr, "failed to create %s\n", path);
+			return 1;
+		}
+		printf("created %d commits in %.1fs\n", count,
+		       (double)(now_ns() - t) / 1000000000.0);
+	}
+
+	/* the cache has to be empty each time for the index to be built */
+
+	lws_snprintf(cache, sizeof(cache), "%s/cacheXXXXXX", argv[1]);
+	if (!mkdtemp(cache))
+		return 1;
+
+	git_libgit2_init();
+
+	if (git_repository_open(&repo, path))
+		goto bail;
+
+	memset(&config, 0, sizeof(config));
+	config.virtual_base_urlpath = "/git";
+	config.repo_base_dir = argv[1];
+	config.json_cache_base = cache;
+	config.acl_user = "@all";
+	config.repo_idle_secs = 3600;
+
+	vh = jg2_vhost_create(&config);
+	if (!vh) {
+		fprintf(stderr, "failed to create vhost\n");
+		goto bail;
+	}
+
+	/* the listing opens the repo and asks for the branch's index */
+
+	if (list_tree(vh))
+		goto bail;
+
+	pthread_mutex_lock(&vh->lock); /* ======================== vhost lock */
+	r = __jg2_vhost_repo_find(vh, path);
+	pthread_mutex_unlock(&vh->lock); /* -------------------- vhost unlock */
+	if (!r) {
+		fprintf(stderr, "%s isn't open\n", path);
+		goto bail;
+	}
+
+	printf("last commit index for %s:\n", ref);
+
+	if (report("build from scratch", update(vh, r, repo)))
+		goto bail;
+
+	/* more commits on top of the same history */
+
+	if (fast_import(path, count + 1, 100) ||
+	    report("update for 100 new commits", update(vh, r, repo)))
+		goto bail;
+
+	/* the branch goes back, so the old index can't be used */
+
+	lws_snprintf(cmd, sizeof(cmd), "git --git-dir='%s' update-ref %s "
+				       "%s~50", path, ref, ref);
+	if (system(cmd) ||
+	    report("rebuild after rewinding 50", update(vh, r, repo)))
+		goto bail;
+
+	ret = 0;
+
+bail:
+	if (vh)
+		jg2_vhost_destroy(vh);
+	git_repository_free(repo);
+	git_libgit2_shutdown();
+
+	lws_snprintf(cmd, sizeof(cmd), "rm -rf '%s'", cache);
+	if (system(cmd))
+		fprintf(stderr, "failed to remove %s\n", cache);
+
+	return ret;
+}
@@ -0,0 +1,233 @@
+/*
+ * log.c: benchmark for log pagination with ?ofs= on a long history
+ *
+ * Copyright (C) 2025 Andy Green <andy@warmcat.com>
+ *
+ * This file is made available under the Creative Commons CC0 1.0
+ * Universal Public Domain Dedication.
+ *
+ * A log page at ?ofs=N has to find the commit N down the first-parent chain
+ * before it can list anything.  This makes a bare repo with a linear history
+ * of 500000 commits by default (using git fast-import, so git must be in the
+ * PATH), and times getting log pages at increasing offsets
+ *
+ *  - with no cache dir and no commit-graph, so the skip is a revwalk
+ *
+ *  - with a cache dir, so big skips use the first-parent chain file (the
+ *    first page at a big offset creates it)
+ *
+ *  - with a commit-graph written by git, and no cache dir
+ *
+ * Each page is checked to start with the right commit.  Give it an empty
+ * dir, it leaves the repo there for next time, but removes any commit-graph
+ * first
+ *
+ *   jg2-bench-log /tmp/jg2-log [commits]
+ */
+
+#include <libjsongit2.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define OUT_SIZE	(1024 * 1024)
+
+static char out[OUT_SIZE];
+
+static uint64_t
+now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ((uint64_t)ts.tv_sec * 1000000000ull) + (uint64_t)ts.tv_nsec;
+}
+
+/* a linear history of count empty commits, with messages c0000001 on */
+
+static int
+make_repo(const char *path, int count)
+{
+	char cmd[512];
+	FILE *f;
+	int n;
+
+	snprintf(cmd, sizeof(cmd), "git init -q --bare '%s'", path);
+	if (system(cmd))
+		return 1;
+
+	snprintf(cmd, sizeof(cmd), "git --git-dir='%s' fast-import --quiet",
+		 path);
+	f = popen(cmd, "w");
+	if (!f)
+		return 1;
+
+	for (n = 1; n <= count; n++) {
+		fprintf(f, "commit refs/heads/master\nmark :%d\n"
+			   "committer bench <bench@example.com> %d +0000\n"
+			   "data 8\nc%07d\n", n, 1500000000 + n, n);
+		if (n > 1)
+			fprintf(f, "from :%d\n", n - 1);
+		fprintf(f, "\n");
+	}
+
+	return !!pclose(f);
+}
+
+static int
+log_page(struct jg2_vhost *vh, int ofs, int count, uint64_t *ns)
+{
+	struct jg2_ctx_create_args args;
+	struct jg2_ctx *ctx = NULL;
+	const char *mimetype;
+	unsigned long length;
+	size_t used, pos = 0;
+	char url[64], want[16];
+	uint64_t t;
+	int done;
+
+	snprintf(url, sizeof(url), "/log/log?ofs=%d", ofs);
+
+	memset(&args, 0, sizeof(args));
+	args.repo_path = url;
+	args.mimetype = &mimetype;
+	args.length = &length;
+
+	t = now_ns();
+
+	if (jg2_ctx_create(vh, &ctx, &args)) {
+		fprintf(stderr, "failed to create ctx for %s\n", url);
+		return 1;
+	}
+
+	do {
+		done = jg2_ctx_fill(ctx, out + pos, sizeof(out) - 1 - pos,
+				    &used, NULL);
+		pos += used;
+	} while (!done && pos < sizeof(out) - 1);
+	out[pos] = '\0';
+
+	jg2_ctx_destroy(ctx);
+
+	*ns = now_ns() - t;
+
+	/* the page must start at the commit ofs down from the tip */
+
+	snprintf(want, sizeof(want), "c%07d", count - ofs);
+	if (done < 0 || !strstr(out, want)) {
+		fprintf(stderr, "%s: no %s in the page\n", url, want);
+		return 1;
+	}
+
+	return 0;
+}
+
+static int
+pass(const char *name, const char *base, const char *cache, int count)
+{
+	static const int ofs[] = { 0, 100, 1000, 10000, 100000, 1000000 };
+	struct jg2_vhost_config config;
+	struct jg2_vhost *vh;
+	int n, ret = 1;
+	uint64_t ns;
+
+	memset(&config, 0, sizeof(config));
+	config.virtual_base_urlpath = "/git";
+	config.repo_base_dir = base;
+	config.json_cache_base = cache;
+	config.acl_user = "@all";
+
+	vh = jg2_vhost_create(&config);
+	if (!vh) {
+		fprintf(stderr, "failed to create vhost\n");
+		return 1;
+	}
+
+	printf("%s:\n", name);
+
+	for (n = 0; n < (int)(sizeof(ofs) / sizeof(ofs[0])); n++) {
+		int o = ofs[n] < count - 50 ? ofs[n] : count - 50;
+
+		if (log_page(vh, o, count, &ns))
+			goto bail;
+		printf("  ofs %-10d %10.2f ms\n", o, (double)ns / 1000000.0);
+
+		if (o != ofs[n])
+			break;
+	}
+
+	ret = 0;
+
+bail:
+	jg2_vhost_destroy(vh);
+
+	return ret;
+}
+
+int
+main(int argc, char *argv[])
+{
+	char path[256], cache[256], cmd[600];
+	int count = 500000, ret = 1;
+	struct stat s;
+	uint64_t t;
+
+	if (argc < 2) {
+		fprintf(stderr, "Usage: %s <empty dir> [commits]\n", argv[0]);
+		return 1;
+	}
+	if (argc > 2)
+		count = atoi(argv[2]);
+	if (count < 100 || count > 9999999)
+		return 1;
+
+	snprintf(path, sizeof(path), "%s/log.git", argv[1]);
+
+	if (stat(path, &s)) {
+		t = now_ns();
+		if (make_repo(path, count)) {
+			fprintf(stderr, "failed to create %s\n", path);
+			return 1;
+		}
+		printf("created %d commits in %.1fs\n", count,
+		       (double)(now_ns() - t) / 1000000000.0);
+	}
+
+	snprintf(cmd, sizeof(cmd), "%s/objects/info/commit-graph", path);
+	unlink(cmd);
+
+	/* the cache has to be empty each time for the chain to be made */
+
+	snprintf(cache, sizeof(cache), "%s/cacheXXXXXX", argv[1]);
+	if (!mkdtemp(cache))
+		return 1;
+
+	if (pass("revwalk", argv[1], NULL, count) ||
+	    pass("cache dir", argv[1], cache, count))
+		goto bail;
+
+	snprintf(cmd, sizeof(cmd), "git --git-dir='%s' commit-graph write "
+				   "--reachable", path);
+	t = now_ns();
+	if (system(cmd)) {
+		fprintf(stderr, "commit-graph write failed\n");
+		goto bail;
+	}
+	printf("commit-graph written in %.1fs\n",
+	       (double)(now_ns() - t) / 1000000000.0);
+
+	ret = pass("commit-graph", argv[1], NULL, count);
+
+bail:
+	snprintf(cmd, sizeof(cmd), "rm -rf '%s'", cache);
+	if (system(cmd))
+		fprintf(stderr, "failed to remove %s\n", cache);
+
+	return ret;
+}
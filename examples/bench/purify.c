@@ -0,0 +1,296 @@
+/*
+ * purify.c: equivalence test and benchmark for jg2_json_purify()
+ *
+ * Copyright (C) 2025 Andy Green <andy@warmcat.com>
+ *
+ * This file is made available under the Creative Commons CC0 1.0
+ * Universal Public Domain Dedication.
+ *
+ * jg2_json_purify() copies runs of bytes that need no escaping a vector at a
+ * time.  This keeps the original byte-at-a-time version as a reference and
+ *
+ *  - feeds both the same random inputs, with control and html chars, high
+ *    bytes and embedded NULs, and random output and input limits, checking
+ *    the return, the input used and the whole output buffer all match
+ *
+ *  - times both escaping a 32MiB text blob in 64KiB output chunks, the way
+ *    the blob and diff views use it
+ *
+ * It exits nonzero if there was any difference.  Build it with ASan (or run
+ * it under valgrind) to also catch reads past the input.  Give it optional
+ * iteration count and seed
+ *
+ *   jg2-bench-purify [iterations] [seed]
+ */
+
+#include "private.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define MAX_IN		2048
+#define BLOB_SIZE	(32 * 1024 * 1024)
+#define CHUNK		(64 * 1024)
+#define REPEATS		8
+
+/* keeps the loops from being optimized away */
+static volatile unsigned char sink;
+
+static const char *rhex = "0123456789abcdef";
+
+static uint64_t rs;
+
+static uint64_t
+now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ((uint64_t)ts.tv_sec * 1000000000ull) + (uint64_t)ts.tv_nsec;
+}
+
+static uint32_t
+rnd(void)
+{
+	rs ^= rs << 13;
+	rs ^= rs >> 7;
+	rs ^= rs << 17;
+
+	return (uint32_t)(rs >> 16);
+}
+
+/* jg2_json_purify() as it was before the vector scan */
+
+static int
+ref_purify(char *escaped, const char *string, int len, size_t *inlim_totlen)
+{
+	const char *p = string, *op = p;
+	char *q = escaped;
+	int inlim = -1;
+
+	if (inlim_totlen)
+		inlim = *inlim_totlen;
+
+	if (!p) {
+		escaped[0] = '\0';
+		return 0;
+	}
+
+	while (len-- > 6 && (p - op) != inlim && *p) {
+		if (*p == '\t') {
+			p++;
+			*q++ = '\\';
+			*q++ = 't';
+			continue;
+		}
+
+		if (*p == '\n') {
+			p++;
+			*q++ = '\\';
+			*q++ = 'n';
+			continue;
+		}
+
+		if (*p == '\r') {
+			p++;
+			*q++ = '\\';
+			*q++ = 'r';
+			continue;
+		}
+
+		if (*p == '&' || *p == '<' || *p == '>' || *p == '\"' ||
+		    *p == '\\' || *p == '=' || (unsigned char)(*p) < 0x20) {
+			*q++ = '\\';
+			*q++ = 'u';
+			*q++ = '0';
+			*q++ = '0';
+			*q++ = rhex[((*p) >> 4) & 15];
+			*q++ = rhex[(*p) & 15];
+			len -= 5;
+			p++;
+		} else
+			*q++ = *p++;
+	}
+	*q = '\0';
+
+	if (inlim_totlen)
+		*inlim_totlen = p - op;
+
+	return q - escaped;
+}
+
+/* mostly plain text, with a good chance of everything that isn't */
+
+static char
+rnd_char(void)
+{
+	static const char special[] = "\t\n\r\"&<=>\\";
+	uint32_t r = rnd() % 100;
+
+	if (r < 60)
+		return (char)(' ' + (rnd() % 95));
+	if (r < 80)
+		return special[rnd() % (sizeof(special) - 1)];
+	if (r < 88)
+		return (char)(1 + (rnd() % 0x1f));
+	if (r < 98)
+		return (char)(0x80 + (rnd() % 0x80));
+
+	return '\0';
+}
+
+static int
+fuzz(int iterations)
+{
+	size_t il_ref, il_lib, *pil_ref, *pil_lib;
+	char *in, *out_ref, *out_lib;
+	int n, m, inlen, len, r_ref, r_lib, fails = 0;
+	long inlim;
+
+	/* output space for the worst case, plus some to see overwrites */
+
+	out_ref = malloc((MAX_IN * 6) + 64);
+	out_lib = malloc((MAX_IN * 6) + 64);
+	if (!out_ref || !out_lib)
+		return 1;
+
+	for (n = 0; n < iterations; n++) {
+		/* sized exactly, so ASan sees anything read past the NUL */
+
+		inlen = (int)(rnd() % MAX_IN);
+		in = malloc((size_t)inlen + 1);
+		if (!in)
+			return 1;
+
+		/* long clean runs too, so the vector loops get used */
+
+		if (rnd() & 1)
+			for (m = 0; m < inlen; m++)
+				in[m] = (char)('a' + (rnd() % 26));
+		else
+			for (m = 0; m < inlen; m++)
+				in[m] = rnd_char();
+		for (m = (int)(rnd() % 8); m && inlen; m--)
+			in[rnd() % (unsigned int)inlen] = rnd_char();
+		in[inlen] = '\0';
+
+		len = (int)(rnd() % ((unsigned int)(inlen * 6) + 16));
+
+		pil_ref = pil_lib = NULL;
+		inlim = -1;
+		if (rnd() & 1) {
+			il_ref = il_lib = rnd() % ((unsigned int)inlen + 1);
+			inlim = (long)il_ref;
+			pil_ref = &il_ref;
+			pil_lib = &il_lib;
+		}
+
+		memset(out_ref, 0xaa, (MAX_IN * 6) + 64);
+		memset(out_lib, 0xaa, (MAX_IN * 6) + 64);
+
+		r_ref = ref_purify(out_ref, in, len, pil_ref);
+		r_lib = jg2_json_purify(out_lib, in, len, pil_lib);
+
+		if (r_ref != r_lib ||
+		    (pil_ref && il_ref != il_lib) ||
+		    memcmp(out_ref, out_lib, (MAX_IN * 6) + 64)) {
+			fprintf(stderr, "iteration %d: inlen %d, len %d, "
+				"inlim %ld: ret %d / %d, used %ld / %ld\n", n,
+				inlen, len, inlim,
+				r_ref, r_lib, pil_ref ? (long)il_ref : -1L,
+				pil_lib ? (long)il_lib : -1L);
+			fails++;
+		}
+
+		free(in);
+	}
+
+	free(out_ref);
+	free(out_lib);
+
+	return fails;
+}
+
+/* escape the whole blob in CHUNK-sized pieces of output */
+
+static uint64_t
+time_blob(int (*purify)(char *, const char *, int, size_t *),
+	  const char *blob, char *out)
+{
+	size_t pos, used;
+	uint64_t t;
+	int n;
+
+	t = now_ns();
+	for (n = 0; n < REPEATS; n++) {
+		pos = 0;
+		while (pos < BLOB_SIZE) {
+			used = BLOB_SIZE - pos;
+			purify(out, blob + pos, CHUNK, &used);
+			sink ^= (unsigned char)out[0];
+			pos += used;
+		}
+	}
+
+	return now_ns() - t;
+}
+
+static void
+report(const char *name, uint64_t ns, uint64_t base)
+{
+	printf("  %-28s %8.1f MB/s", name, ((double)BLOB_SIZE * REPEATS) /
+					   ((double)ns / 1000.0));
+	if (base)
+		printf("  (%.2fx)", (double)base / (double)ns);
+	printf("\n");
+}
+
+int
+main(int argc, char *argv[])
+{
+	int iterations = 300000, fails, n;
+	uint64_t t_ref;
+	char *blob, *out;
+
+	if (argc > 1)
+		iterations = atoi(argv[1]);
+	rs = argc > 2 ? strtoull(argv[2], NULL, 10) : 0x6a09e667f3bcc909ull;
+	if (!rs)
+		rs = 1;
+
+	fails = fuzz(iterations);
+	printf("%d random inputs: %d differences\n", iterations, fails);
+
+	/* something like source code: mostly clean, with some to escape */
+
+	/* \t, \n and \r only count as one byte of output space, but take two */
+
+	blob = malloc(BLOB_SIZE + 1);
+	out = malloc((CHUNK * 2) + 1);
+	if (!blob || !out)
+		return 1;
+
+	for (n = 0; n < BLOB_SIZE; n++) {
+		uint32_t r = rnd() % 100;
+
+		blob[n] = r < 2 ? '\n' : (r < 3 ? '"' : (r < 4 ? '\t' :
+			  (char)('a' + (r % 26))));
+	}
+	blob[BLOB_SIZE] = '\0';
+
+	printf("escaping %dMiB in %dKiB chunks, %d times:\n",
+	       BLOB_SIZE / (1024 * 1024), CHUNK / 1024, REPEATS);
+
+	t_ref = time_blob(ref_purify, blob, out);
+	report("byte at a time", t_ref, 0);
+	report("jg2_json_purify()", time_blob(jg2_json_purify, blob, out),
+	       t_ref);
+
+	free(blob);
+	free(out);
+
+	return !!fails;
+}
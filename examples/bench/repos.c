@@ -0,0 +1,268 @@
+/*
+ * repos.c: benchmark for finding repos by name with many repos
+ *
+ * Copyright (C) 2025 Andy Green <andy@warmcat.com>
+ *
+ * This file is made available under the Creative Commons CC0 1.0
+ * Universal Public Domain Dedication.
+ *
+ * Every request looks up its repo in the vhost's open repos, and the ACL
+ * checks look it up in the repodir's list of repos, both under a lock.  This
+ * creates a lot of small synthetic bare repos (10000 by default) in a dir,
+ * has a vhost open all of them, and then times
+ *
+ *  - creating and destroying a ctx for each repo, first while opening the
+ *    repo and then again with them all already open
+ *
+ *  - __jg2_vhost_repo_find() against walking vh->repo_list
+ *
+ *  - __jg2_repodir_repo() against walking rd->rei_head
+ *
+ * Give it an empty dir, it leaves the repos there for next time
+ *
+ *   jg2-bench-repos /tmp/jg2-repos [count]
+ */
+
+#include "private.h"
+#include "conf/private.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#define LOOKUPS 1000000
+
+#define lp_to_rei(p, _n) lws_list_ptr_container(p, struct repo_entry_info, _n)
+
+static uint64_t
+now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ((uint64_t)ts.tv_sec * 1000000000ull) + (uint64_t)ts.tv_nsec;
+}
+
+/* a bare repo with one empty commit on master */
+
+static int
+make_repo(const char *path)
+{
+	git_signature *sig = NULL;
+	git_treebuilder *tb = NULL;
+	git_repository *repo;
+	git_oid tree_oid, oid;
+	git_tree *tree = NULL;
+	int ret = 1;
+
+	if (git_repository_init(&repo, path, 1))
+		return 1;
+
+	if (git_treebuilder_new(&tb, repo, NULL) ||
+	    git_treebuilder_write(&tree_oid, tb) ||
+	    git_tree_lookup(&tree, repo, &tree_oid) ||
+	    git_signature_now(&sig, "bench", "bench@example.com") ||
+	    git_commit_create(&oid, repo, "refs/heads/master", sig, sig, NULL,
+			      "initial", tree, 0, NULL))
+		goto bail;
+
+	ret = 0;
+
+bail:
+	git_signature_free(sig);
+	git_tree_free(tree);
+	git_treebuilder_free(tb);
+	git_repository_free(repo);
+
+	return ret;
+}
+
+static int
+ctx_pass(struct jg2_vhost *vh, int count)
+{
+	struct jg2_ctx_create_args args;
+	const char *mimetype;
+	unsigned long length;
+	struct jg2_ctx *ctx;
+	char etag[36], url[32];
+	int n;
+
+	for (n = 0; n < count; n++) {
+		lws_snprintf(url, sizeof(url), "/r%05d", n);
+
+		memset(&args, 0, sizeof(args));
+		args.repo_path = url;
+		args.mimetype = &mimetype;
+		args.length = &length;
+		args.etag = etag;
+		args.etag_length = sizeof(etag);
+
+		if (jg2_ctx_create(vh, &ctx, &args)) {
+			fprintf(stderr, "failed to create ctx for %s\n", url);
+			return 1;
+		}
+		jg2_ctx_destroy(ctx);
+	}
+
+	return 0;
+}
+
+static void
+report(const char *name, uint64_t ns, int count)
+{
+	printf("  %-34s %10.1f ns\n", name, (double)ns / count);
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct jg2_vhost_config config;
+	struct repo_entry_info *rei;
+	int count = 10000, n, made = 0;
+	char path[256], **paths, **names;
+	struct jg2_repodir *rd;
+	struct jg2_vhost *vh;
+	struct jg2_repo *r;
+	lws_list_ptr lp;
+	uint64_t t;
+	void *sink = NULL;
+	struct stat s;
+
+	if (argc < 2) {
+		fprintf(stderr, "Usage: %s <empty dir> [count]\n", argv[0]);
+		return 1;
+	}
+	if (argc > 2)
+		count = atoi(argv[2]);
+	if (count < 1 || count > 99999)
+		return 1;
+
+	paths = malloc(count * sizeof(*paths));
+	names = malloc(count * sizeof(*names));
+	if (!paths || !names)
+		return 1;
+
+	git_libgit2_init();
+
+	t = now_ns();
+	for (n = 0; n < count; n++) {
+		lws_snprintf(path, sizeof(path), "%s/r%05d.git", argv[1], n);
+		paths[n] = strdup(path);
+		names[n] = strdup(path + strlen(argv[1]) + 1);
+		if (!paths[n] || !names[n])
+			return 1;
+		names[n][strlen(names[n]) - 4] = '\0';
+
+		if (!stat(path, &s))
+			continue;
+		if (make_repo(path)) {
+			fprintf(stderr, "failed to create %s\n", path);
+			return 1;
+		}
+		made++;
+	}
+	if (made)
+		printf("created %d repos in %.1fs\n", made,
+		       (double)(now_ns() - t) / 1000000000.0);
+
+	memset(&config, 0, sizeof(config));
+	config.virtual_base_urlpath = "/git";
+	config.repo_base_dir = argv[1];
+	config.acl_user = "@all";
+	config.max_open_repos = count;
+
+	vh = jg2_vhost_create(&config);
+	if (!vh) {
+		fprintf(stderr, "failed to create vhost\n");
+		return 1;
+	}
+
+	printf("%d repos, per ctx create + destroy:\n", count);
+
+	t = now_ns();
+	if (ctx_pass(vh, count))
+		goto bail;
+	report("opening the repo", now_ns() - t, count);
+
+	t = now_ns();
+	if (ctx_pass(vh, count))
+		goto bail;
+	report("repo already open", now_ns() - t, count);
+
+	printf("per lookup, under the lock:\n");
+
+	pthread_mutex_lock(&vh->lock); /* ========================= vhost lock */
+
+	t = now_ns();
+	for (n = 0; n < LOOKUPS; n++)
+		sink = __jg2_vhost_repo_find(vh, paths[(n * 7919) % count]);
+	report("open repo, indexed", now_ns() - t, LOOKUPS);
+
+	t = now_ns();
+	for (n = 0; n < LOOKUPS / 100; n++) {
+		r = vh->repo_list;
+		while (r && strcmp(r->repo_path, paths[(n * 7919) % count]))
+			r = r->next;
+		sink = r;
+	}
+	report("open repo, list walk", now_ns() - t, LOOKUPS / 100);
+
+	pthread_mutex_unlock(&vh->lock); /* --------------------- vhost unlock */
+
+	/*
+	 * Without a gitolite-admin repo the repodir list is never scanned,
+	 * so do it here, the same as when gitolite-admin changes
+	 */
+
+	rd = vh->repodir;
+
+	pthread_mutex_lock(&rd->lock); /* ======================= repodir lock */
+
+	t = now_ns();
+	__jg2_conf_scan_repos(rd);
+	printf("  %-34s %10.1f ms\n", "repodir scan", (double)(now_ns() - t) /
+						      1000000.0);
+
+	t = now_ns();
+	for (n = 0; n < LOOKUPS; n++)
+		sink = __jg2_repodir_repo(rd, names[(n * 7919) % count]);
+	report("repodir entry, indexed", now_ns() - t, LOOKUPS);
+
+	t = now_ns();
+	for (n = 0; n < LOOKUPS / 100; n++) {
+		rei = NULL;
+		lp = rd->rei_head;
+		while (lp) {
+			rei = lp_to_rei(lp, next);
+			if (!strcmp((const char *)(rei + 1),
+				    names[(n * 7919) % count]))
+				break;
+			rei = NULL;
+			lws_list_ptr_advance(lp);
+		}
+		sink = rei;
+	}
+	report("repodir entry, list walk", now_ns() - t, LOOKUPS / 100);
+
+	pthread_mutex_unlock(&rd->lock); /* ------------------- repodir unlock */
+
+	if (!sink)
+		fprintf(stderr, "last lookup failed\n");
+
+bail:
+	jg2_vhost_destroy(vh);
+
+	for (n = 0; n < count; n++) {
+		free(paths[n]);
+		free(names[n]);
+	}
+	free(paths);
+	free(names);
+
+	git_libgit2_shutdown();
+
+	return 0;
+}
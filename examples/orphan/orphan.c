@@ -0,0 +1,234 @@
+/*
+ * orphan.c: test app for followers outliving the leader's client
+ *
+ * Copyright (C) 2025 Andy Green <andy@warmcat.com>
+ *
+ * This file is made available under the Creative Commons CC0 1.0
+ * Universal Public Domain Dedication.
+ *
+ * When several contexts want the same JSON at once, one of them generates it
+ * into the cache and the others follow along reading the cache file as it's
+ * written.  This checks that the followers still get the whole thing if the
+ * leader's client goes away partway through.
+ *
+ * Give it a repo base dir, an empty cache dir, and a url path that produces
+ * more JSON than one small buffer, eg
+ *
+ *   jg2-orphan /srv/repositories /tmp/jg2-cache /git/myrepo/log
+ *
+ * The leader fills one small buffer and is destroyed, then the followers are
+ * run to the end and their JSON compared with what the finished cache entry
+ * gives a new context.  The stats numbers are padded and may differ, so
+ * digits and spaces are allowed to differ.  Returns 0 if they all matched.
+ */
+
+#include <libjsongit2.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <ctype.h>
+
+#define URL_VIRTUAL_PART "/git"
+#define FOLLOWERS 3
+
+struct result {
+	char *buf;
+	size_t len;
+	size_t alloc;
+};
+
+static struct jg2_ctx *
+ctx_create(struct jg2_vhost *vh, const char *urlpath)
+{
+	struct jg2_ctx_create_args args;
+	const char *mimetype;
+	unsigned long length;
+	struct jg2_ctx *ctx;
+	char etag[36];
+
+	memset(&args, 0, sizeof(args));
+
+	args.repo_path = urlpath + strlen(URL_VIRTUAL_PART);
+	args.mimetype = &mimetype;
+	args.length = &length;
+	args.etag = etag;
+	args.etag_length = sizeof(etag);
+
+	if (jg2_ctx_create(vh, &ctx, &args))
+		return NULL;
+
+	return ctx;
+}
+
+/* returns <0 for fail, 0 for more to come, 1 for done */
+
+static int
+fill(struct jg2_ctx *ctx, struct result *r, size_t size)
+{
+	char buf[4096];
+	size_t used;
+	int done;
+
+	done = jg2_ctx_fill(ctx, buf, size, &used, NULL);
+	if (done < 0)
+		return -1;
+
+	if (r->len + used > r->alloc) {
+		char *p = realloc(r->buf, (r->len + used) * 2);
+
+		if (!p)
+			return -1;
+		r->buf = p;
+		r->alloc = (r->len + used) * 2;
+	}
+	memcpy(r->buf + r->len, buf, used);
+	r->len += used;
+
+	return !!done;
+}
+
+static int
+same(const struct result *a, const struct result *b)
+{
+	size_t n;
+
+	if (a->len != b->len)
+		return 0;
+
+	for (n = 0; n < a->len; n++)
+		if (a->buf[n] != b->buf[n] &&
+		    (!(isdigit(a->buf[n]) || a->buf[n] == ' ') ||
+		     !(isdigit(b->buf[n]) || b->buf[n] == ' ')))
+			return 0;
+
+	return 1;
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct jg2_ctx *leader, *ctx, *fctx[FOLLOWERS];
+	struct result lr, ref, fr[FOLLOWERS];
+	struct jg2_vhost_config config;
+	int n, done, left, err = 1;
+	struct jg2_vhost *vh;
+
+	if (argc < 4 || strlen(argv[3]) < strlen(URL_VIRTUAL_PART)) {
+		fprintf(stderr, "Usage: %s <repo base dir> <empty cache dir> "
+				"<\"/git/... url path\">\n", argv[0]);
+
+		return 1;
+	}
+
+	memset(&config, 0, sizeof(config));
+	memset(&lr, 0, sizeof(lr));
+	memset(&ref, 0, sizeof(ref));
+	memset(fr, 0, sizeof(fr));
+	memset(fctx, 0, sizeof(fctx));
+
+	config.virtual_base_urlpath = "/git";
+	config.repo_base_dir = argv[1];
+	config.json_cache_base = argv[2];
+	config.acl_user = "@all";
+
+	vh = jg2_vhost_create(&config);
+	if (!vh) {
+		fprintf(stderr, "failed to open vh\n");
+
+		return 2;
+	}
+
+	/* the leader gets one small buffer's worth done, and goes away */
+
+	leader = ctx_create(vh, argv[3]);
+	if (!leader) {
+		fprintf(stderr, "failed to open ctx for %s\n", argv[3]);
+
+		goto bail;
+	}
+
+	done = fill(leader, &lr, 1024);
+	if (done) {
+		fprintf(stderr, "%s: leader %s in one buffer, try a bigger "
+				"url\n", argv[0], done < 0 ? "failed" :
+				"finished");
+
+		goto bail1;
+	}
+
+	for (n = 0; n < FOLLOWERS; n++) {
+		fctx[n] = ctx_create(vh, argv[3]);
+		if (!fctx[n] || fill(fctx[n], &fr[n], 1024) < 0) {
+			fprintf(stderr, "follower %d failed to start\n", n);
+
+			goto bail1;
+		}
+	}
+
+	jg2_ctx_destroy(leader);
+	leader = NULL;
+
+	/* the followers have to see it through between them */
+
+	do {
+		left = 0;
+		for (n = 0; n < FOLLOWERS; n++) {
+			if (!fctx[n])
+				continue;
+			done = fill(fctx[n], &fr[n], 4096);
+			if (done < 0) {
+				fprintf(stderr, "follower %d failed\n", n);
+
+				goto bail1;
+			}
+			if (done) {
+				jg2_ctx_destroy(fctx[n]);
+				fctx[n] = NULL;
+			} else
+				left++;
+		}
+	} while (left);
+
+	/* what a new ctx gets from the finished cache entry */
+
+	ctx = ctx_create(vh, argv[3]);
+	if (!ctx)
+		goto bail1;
+	do {
+		done = fill(ctx, &ref, 4096);
+	} while (!done);
+	jg2_ctx_destroy(ctx);
+
+	if (done < 0) {
+		fprintf(stderr, "reference fetch failed\n");
+
+		goto bail1;
+	}
+
+	err = 0;
+	for (n = 0; n < FOLLOWERS; n++)
+		if (!same(&fr[n], &ref)) {
+			fprintf(stderr, "follower %d: got %zu, expected %zu\n",
+				n, fr[n].len, ref.len);
+			err = 1;
+		}
+
+	fprintf(stderr, "%s\n", err ? "FAIL" : "PASS");
+
+bail1:
+	if (leader)
+		jg2_ctx_destroy(leader);
+	for (n = 0; n < FOLLOWERS; n++)
+		if (fctx[n])
+			jg2_ctx_destroy(fctx[n]);
+bail:
+	jg2_vhost_destroy(vh);
+
+	free(lr.buf);
+	free(ref.buf);
+	for (n = 0; n < FOLLOWERS; n++)
+		free(fr[n].buf);
+
+	return err;
+}
@@ -0,0 +1,118 @@
+/*
+ * refchange.c: test app for the refchange FIFO
+ *
+ * Copyright (C) 2025 Andy Green <andy@warmcat.com>
+ *
+ * This file is made available under the Creative Commons CC0 1.0
+ * Universal Public Domain Dedication.
+ *
+ * This plays the part of a server with a visitor looking at one repo, for
+ * test-refchange.sh to push to the repo and write its name into the FIFO.
+ *
+ * It creates a vhost with a cache and a refchange FIFO, and a ctx on the repo
+ * which it keeps open, like a browser watching the repo would.  It prints
+ * "ready" once that's set up, and "refchange" each time the library tells it
+ * the repo's refs changed.  It exits after the given number of seconds.
+ *
+ *   jg2-refchange /srv/repositories /tmp/jg2-cache /tmp/jg2-fifo myrepo 20
+ */
+
+#include <libjsongit2.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static volatile int refchanges;
+static int watcher;
+
+static void
+refchange(void *user)
+{
+	/* the library's own prewarm ctxs have no user */
+	if (user == &watcher)
+		refchanges++;
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct jg2_ctx_create_args args;
+	struct jg2_vhost_config config;
+	int secs = 20, seen = 0, done;
+	struct jg2_ctx *ctx = NULL;
+	const char *mimetype;
+	unsigned long length;
+	struct jg2_vhost *vh;
+	char url[128], buf[4096];
+	size_t used;
+
+	if (argc < 5) {
+		fprintf(stderr, "Usage: %s <repo base dir> <cache dir> <fifo> "
+				"<repo name> [secs]\n", argv[0]);
+
+		return 1;
+	}
+	if (argc > 5)
+		secs = atoi(argv[5]);
+
+	memset(&config, 0, sizeof(config));
+	config.virtual_base_urlpath = "/git";
+	config.repo_base_dir = argv[1];
+	config.json_cache_base = argv[2];
+	config.refchange_fifo = argv[3];
+	config.acl_user = "@all";
+	config.refchange = refchange;
+
+	vh = jg2_vhost_create(&config);
+	if (!vh) {
+		fprintf(stderr, "failed to create vhost\n");
+
+		return 1;
+	}
+
+	snprintf(url, sizeof(url), "/%s", argv[4]);
+
+	memset(&args, 0, sizeof(args));
+	args.repo_path = url;
+	args.mimetype = &mimetype;
+	args.length = &length;
+	args.user = &watcher;
+
+	if (jg2_ctx_create(vh, &ctx, &args)) {
+		fprintf(stderr, "failed to create ctx for %s\n", url);
+
+		goto bail;
+	}
+
+	do {
+		done = jg2_ctx_fill(ctx, buf, sizeof(buf), &used, NULL);
+	} while (!done);
+
+	if (done < 0) {
+		fprintf(stderr, "json job failed\n");
+
+		goto bail;
+	}
+
+	printf("ready\n");
+	fflush(stdout);
+
+	/* the cache thread does the work, we just report what it told us */
+
+	for (secs *= 10; secs; secs--) {
+		while (seen != refchanges) {
+			seen++;
+			printf("refchange\n");
+			fflush(stdout);
+		}
+		usleep(100000);
+	}
+
+bail:
+	if (ctx)
+		jg2_ctx_destroy(ctx);
+	jg2_vhost_destroy(vh);
+
+	return 0;
+}
@@ -0,0 +1,85 @@
+#!/bin/sh
+#
+# test-refchange.sh: drives the refchange FIFO like a post-receive hook would
+#
+# Copyright (C) 2025 Andy Green <andy@warmcat.com>
+#
+# This file is made available under the Creative Commons CC0 1.0
+# Universal Public Domain Dedication.
+#
+# Creates a bare repo with one commit in a temp dir, starts jg2-refchange on
+# it, pushes a second commit and writes the repo name into the FIFO.  Then it
+# checks the ctx watching the repo was told about the refchange, and that the
+# repo's views for the new refs were regenerated into the cache.
+#
+#   test-refchange.sh [path to jg2-refchange]
+#
+# Returns 0 and prints PASS if all that happened within a few seconds.
+
+JG2_REFCHANGE=${1:-jg2-refchange}
+
+T=`mktemp -d /tmp/jg2-refchange.XXXXXX` || exit 1
+PID=
+
+fail() {
+	echo "FAIL: $1"
+	[ -n "$PID" ] && kill $PID 2>/dev/null
+	cd /
+	rm -rf $T
+	exit 1
+}
+
+# wait up to 10s for a shell test to pass
+
+wait_for() {
+	n=0
+	while ! eval "$1" ; do
+		n=$(( $n + 1 ))
+		[ $n -gt 100 ] && return 1
+		sleep 0.1
+	done
+	return 0
+}
+
+count_cache() {
+	find $T/cache -type f | wc -l
+}
+
+mkdir $T/repos $T/cache || fail "mkdir"
+
+git init -q --bare $T/repos/test.git || fail "git init"
+git init -q $T/work || fail "git init work"
+cd $T/work
+git -c user.name=test -c user.email=test@example.com \
+	commit -q --allow-empty -m "first" || fail "first commit"
+git push -q $T/repos/test.git HEAD:refs/heads/master || fail "first push"
+
+$JG2_REFCHANGE $T/repos $T/cache $T/fifo test 30 > $T/out 2>$T/err &
+PID=$!
+
+wait_for "grep -q ready $T/out" || fail "jg2-refchange didn't start"
+[ -p $T/fifo ] || fail "no fifo"
+
+# give the cache thread time to start polling the fifo
+
+sleep 3
+BEFORE=`count_cache`
+
+git -c user.name=test -c user.email=test@example.com \
+	commit -q --allow-empty -m "second" || fail "second commit"
+git push -q $T/repos/test.git HEAD:refs/heads/master || fail "second push"
+
+# what the post-receive hook does
+
+timeout 1 sh -c "echo test > $T/fifo" || fail "fifo write"
+
+wait_for "grep -q refchange $T/out" || fail "no refchange callback"
+wait_for "[ \`count_cache\` -gt $BEFORE ]" || fail "views not regenerated"
+
+kill $PID
+wait $PID 2>/dev/null
+cd /
+rm -rf $T
+
+echo PASS
+exit 0
@@ -77,10 +77,20 @@ struct jg2_vhost_config {
 	void *avatar_arg; /**< opaque pointer passed to avatar callback, if set */
 
 #define JG2_VHOST_BLOG_MODE 1
-	unsigned int flags; /* OR-ed flags: JG2_VHOST_BLOG_MODE = "blog mode" */
+#define JG2_VHOST_GZIP 2
+#define JG2_VHOST_MD5_CACHE_KEYS 4
+	unsigned int flags; /* OR-ed flags: JG2_VHOST_BLOG_MODE = "blog mode",
+			       JG2_VHOST_GZIP = store gzip variants of cache
+			       entries and gzip content for clients that
+			       accept it (needs zlib at build time),
+			       JG2_VHOST_MD5_CACHE_KEYS = name cache entries
+			       using md5 via the md5 callbacks below, like
+			       older versions, instead of the faster
+			       internal 128-bit hash */
 	const char *blog_repo_name; /**< the repo name of the blog, if blog mode */
 
-	/* optional md5 acceleration */
+	/* optional md5 acceleration (used for avatar hashes, and for cache
+	 * names if JG2_VHOST_MD5_CACHE_KEYS) */
 
 	jg2_md5_context (*md5_alloc)(void);
 	/**< user code can provide accelerated md5, default of NULL means
@@ -105,16 +115,45 @@ struct jg2_vhost_config {
 	/**< optional hook called when an avatar md5 was computed... eg
 	 * can be used to prime a side-cache with the avatar image
 	 */
+
+	/* members added since need to go at the end, so the offsets of the
+	 * earlier ones don't change for code built against older versions */
+
+	uint64_t hot_cache_size_limit; /**< max heap used to keep recently-
+				    * used cache entries in memory in front
+				    * of the disk cache, 0 means use default
+				    * of 16MiB */
+	const char *refchange_fifo; /**< NULL, or path of a FIFO to create that
+				     * eg, a gitolite post-receive hook can
+				     * write repo names into, one per line, to
+				     * have the refs of the repo looked at
+				     * immediately and its usual views
+				     * regenerated into the cache */
+	unsigned int max_open_repos; /**< max repos to keep open at once,
+				      * more may be open while they are in
+				      * use.  0 means use default of 256 */
+	unsigned int repo_idle_secs; /**< close repos nobody used for this
+				      * long, 0 means use default of 300s */
+	uint64_t summary_cache_size_limit; /**< max heap used to keep
+				    * rendered commit and tag summaries, 0
+				    * means use default of 4MiB */
+	uint64_t diff_size_limit; /**< commit diffs are generated one file
+				    * at a time, files whose blobs or patch
+				    * text are bigger than this are not
+				    * shown.  0 means use default of 16MiB */
 };
 
 struct jg2_ctx_create_args {
 	const char *repo_path; /**< filesystem path to the repo */
 #define JG2_CTX_FLAG_HTML 1
 #define JG2_CTX_FLAG_BOT 2
+#define JG2_CTX_FLAG_FD_SPOOL 4
 	int flags; /**< bitwise-ORed flags: JG2_CTX_FLAG_HTML = generate HTML
 			around the JSON, using the vhost HTML file;
 			absent = pure JSON, JG2_CTX_FLAG_BOT = don't create
-			cache entries for this context */
+			cache entries for this context,
+			JG2_CTX_FLAG_FD_SPOOL = the user can send ranges of
+			cache files itself, see jg2_ctx_fd_range() */
 	const char **mimetype; /**< pointer to const char * to take pointer
 				    to mimetype */
 	unsigned long *length; /**< pointer to unsigned long to take 0 or
@@ -125,6 +164,14 @@ struct jg2_ctx_create_args {
 	const char *authorized; /**< NULL or gitolite name for ACL use */
 	const char *accept_language; /**< client's accept-language hdr if any */
 	void *user; /**< opaque user pointer to attach to ctx */
+
+	/* members added since need to go at the end, so the offsets of the
+	 * earlier ones don't change for code built against older versions */
+
+	const char *accept_encoding; /**< client's accept-encoding hdr if any */
+	const char **content_encoding; /**< NULL, or pointer to const char * set
+					    to NULL or the content encoding
+					    name, eg "gzip" */
 };
 
 /**
@@ -157,6 +204,32 @@ jg2_vhost_create(const struct jg2_vhost_config *config);
 JG2_VISIBLE void
 jg2_vhost_destroy(struct jg2_vhost *vhost);
 
+struct jg2_vhost_stats {
+	uint64_t repo_opens; /**< git repos opened since vhost creation */
+	uint64_t repo_evictions; /**< git repos closed for being idle or to
+				      keep under max_open_repos */
+	unsigned int repos_open; /**< git repos open right now */
+	unsigned int repos_known; /**< repos we hold refs for, open or not */
+
+	uint64_t cache_hits; /**< JSON cache hits */
+	uint64_t cache_tries; /**< JSON cache lookups */
+	uint64_t etag_hits; /**< client etag matched */
+	uint64_t etag_tries; /**< client etag could be checked */
+	uint64_t summary_hits; /**< commit / tag summaries reused */
+	uint64_t summary_misses; /**< commit / tag summaries rendered */
+};
+
+/**
+ * jg2_vhost_get_stats() - get a snapshot of vhost counters
+ *
+ * \param vhost: pointer to the vhost
+ * \param stats: pointer to struct to fill
+ *
+ * Copies out the vhost's counters, eg, for logging or a status page.
+ */
+JG2_VISIBLE void
+jg2_vhost_get_stats(struct jg2_vhost *vhost, struct jg2_vhost_stats *stats);
+
 /**
  * jg2_ctx_create() - create a jg2 connection context
  *
@@ -191,6 +264,25 @@ jg2_ctx_create(struct jg2_vhost *vhost, struct jg2_ctx **ctx,
 JG2_VISIBLE int
 jg2_ctx_destroy(struct jg2_ctx *ctx);
 
+/**
+ * jg2_ctx_cache_probe() - check if the ctx content is all in the cache
+ *
+ * \param ctx: pointer to the context
+ *
+ * This computes the cache hash for the job the ctx will start with, and looks
+ * for it in the in-memory and disk caches.  It doesn't create anything.
+ *
+ * Returns 1 if the whole of the ctx content can be produced by
+ * jg2_ctx_fill() from the cache, without any git work, or 0 if some of it must
+ * be generated.  If 1, the cache entry is held by the ctx so it can't
+ * disappear before use.
+ *
+ * This lets the user decide to serve cached content immediately from a thread
+ * that should not block for long, and only defer the rest to worker threads.
+ */
+JG2_VISIBLE int
+jg2_ctx_cache_probe(struct jg2_ctx *ctx);
+
 /**
  * jg2_ctx_fill() - fill a buffer with content
  *
@@ -209,10 +301,37 @@ jg2_ctx_destroy(struct jg2_ctx *ctx);
  * If the work is bigger than one buffer it returns when the buffer is full
  * and resumes with a new buffer next call to jg2_ctx_fill().
  *
- * Returns < 0 on error, or the amount of buffer bytes written
+ * Returns < 0 on error, 0 if there is more to come, 1 if the content is
+ * complete, or JG2_CTX_FILL_FD_RANGE if the ctx was created with
+ * JG2_CTX_FLAG_FD_SPOOL and the user should send the file range described by
+ * jg2_ctx_fd_range() after the \p used bytes in \p buf, before calling
+ * jg2_ctx_fill() again for the rest of the content.
  */
+#define JG2_CTX_FILL_FD_RANGE 2
+
 JG2_VISIBLE int
 jg2_ctx_fill(struct jg2_ctx *ctx, char *buf, size_t len, size_t *used,
 	     char *outlive);
 
+/**
+ * jg2_ctx_fd_range() - get the file range the user should send
+ *
+ * \param ctx: pointer to the context
+ * \param fd: pointer to int to take the fd to read the range from
+ * \param offset: pointer to take the offset in the file of the range
+ * \param length: pointer to take the length of the range
+ *
+ * After jg2_ctx_fill() returned JG2_CTX_FILL_FD_RANGE, the next part of the
+ * content is a range of a cache file that can go on the wire as it is.  The
+ * user should read it with pread(), without changing the fd file position,
+ * and send it without the need to copy it through jg2_ctx_fill().  The fd
+ * belongs to the ctx and is closed by the next jg2_ctx_fill() or
+ * jg2_ctx_destroy().
+ *
+ * Returns 0 if the range was set, or nonzero if there is no range pending.
+ */
+JG2_VISIBLE int
+jg2_ctx_fd_range(struct jg2_ctx *ctx, int *fd, uint64_t *offset,
+		 uint64_t *length);
+
 #endif /* __LIB_JSON_GIT2_H__b1c6cef9e87b714318802950c4e08a15ffaa6559 */
@@ -31,6 +31,7 @@
 #include <time.h>
 #include <errno.h>
 #include <stdarg.h>
+#include <poll.h>
 
 #include <sys/stat.h>
 #include <sys/time.h>
@@ -38,8 +39,9 @@
 
 /*
  * this lets you hash the vargs and then if non-NULL, add a suffix to the
- * hex md5 chars, and do the cache query flow.  The suffix acts like a namespace
- * on the hash, since cached objects with different suffices can never collide.
+ * hex hash chars, and do the cache query flow.  The suffix acts like a
+ * namespace on the hash, since cached objects with different suffices can
+ * never collide.
  */
 
 int
@@ -47,11 +49,12 @@ __jg2_cache_query_v(struct jg2_ctx *ctx, int flags, const char *suffix,
 		    int *_fd, char *cache, int cache_len, const char *format,
 		    ...)
 {
-	va_list ap;
-	char buf[256], md5_hex[33], *p = md5_hex;
+	char buf[256], md5_hex[(JG2_CHASH_LEN * 2) + 1], *p = md5_hex;
+	unsigned char hash[JG2_CHASH_LEN];
+	jg2_md5_context md5_ctx = NULL;
+	struct jg2_chash ch;
 	int n, l = 0;
-	jg2_md5_context md5_ctx;
-	unsigned char md5[JG2_MD5_LEN];
+	va_list ap;
 
 	if (suffix)
 		l = strlen(suffix);
@@ -60,16 +63,24 @@ __jg2_cache_query_v(struct jg2_ctx *ctx, int flags, const char *suffix,
 	n = vsnprintf(buf, sizeof(buf) - l - 1, format, ap);
 	va_end(ap);
 
-	md5_ctx = ctx->vhost->cfg.md5_alloc();
-	if (!md5_ctx)
-		return LWS_DISKCACHE_QUERY_NO_CACHE;
-	ctx->vhost->cfg.md5_init(md5_ctx);
-	ctx->vhost->cfg.md5_upd(md5_ctx, (unsigned char *)buf, n);
-	ctx->vhost->cfg.md5_fini(md5_ctx, md5);
+	/*
+	 * We may be called while the ctx md5 is in use computing the job
+	 * hash, eg, for ACL checks, so md5 mode needs its own md5 context
+	 */
+
+	if (jg2_chash_md5(ctx->vhost)) {
+		md5_ctx = ctx->vhost->cfg.md5_alloc();
+		if (!md5_ctx)
+			return LWS_DISKCACHE_QUERY_NO_CACHE;
+	}
+
+	jg2_chash_init(&ch, ctx->vhost, md5_ctx);
+	jg2_chash_upd(&ch, buf, n);
+	jg2_chash_fini(&ch, hash);
 
 	free(md5_ctx);
 
-	md5_to_hex_cstr(md5_hex, md5);
+	md5_to_hex_cstr(md5_hex, hash);
 
 	if (suffix) {
 		lws_snprintf(buf, sizeof(buf) - 1, "%s-%s", md5_hex, suffix);
@@ -83,18 +94,68 @@ __jg2_cache_query_v(struct jg2_ctx *ctx, int flags, const char *suffix,
 
 
 
+/*
+ * The cache and index threads do slow work on a vhost, like regenerating views
+ * or building indexes, without holding the global lock.  While they do that,
+ * the vhost is pinned, and jg2_vhost_destroy() waits for it to be unpinned
+ * after taking it off the vhost list.  Each thread keeps its own list of
+ * what it pinned.
+ */
+
+/* requires global lock */
+
+static void
+__jg2_vhost_pin(struct jg2_vhost *vh, struct jg2_vhost **list, int which)
+{
+	vh->pinned++;
+	vh->pinned_next[which] = *list;
+	*list = vh;
+}
+
+static void
+jg2_vhost_unpin(struct jg2_vhost *vh)
+{
+	struct jg2_global *jg2_global = vh->jg2_global;
+
+	pthread_mutex_lock(&jg2_global->lock); /* =============== global lock */
+	if (!--vh->pinned)
+		pthread_cond_broadcast(&jg2_global->unpinned);
+	pthread_mutex_unlock(&jg2_global->lock); /* ----------- global unlock */
+}
+
 /*
  * Check every base cache dir incrementally so it completes over 256s, one dir
  * for each base cache dir per second.
  *
  * The first time we see a cache dir though, do it all at once immediately.
+ *
+ * The same thread looks after noticing ref changes in the open repos.  If we
+ * have inotify, we wait on that between trims and look at the repos it says
+ * changed straight away, only checking all the repos every
+ * JG2_REFWATCH_POLL_SECS in case it missed something.  Otherwise we check all
+ * the repos every second, subject to the per-repo rate limit.
+ *
+ * We also wait on any vhost refchange fifos, repos named on those are looked
+ * at straight away and then their usual views regenerated into the cache,
+ * without holding the global lock.
+ *
+ * When we check all the repos, we also close any that have been idle too
+ * long.
  */
 
+#define JG2_REFWATCH_POLL_SECS 10
+
 void *
 cache_trim_thread(void *d)
 {
 	struct jg2_global *jg2_global = (struct jg2_global *)d;
-	struct jg2_vhost *vh;
+	time_t t, last_trim = 0, last_poll = 0;
+	int all, poll_secs, changed, notified, npfd, first_fifo, n;
+	struct jg2_vhost *vh, *pinned;
+	struct pollfd pfd[16];
+#if defined(JG2_HAVE_SYS_INOTIFY_H)
+	int wds[64];
+#endif
 
 	sleep(2); /* wait for other vhosts that might set size limit */
 
@@ -103,8 +164,13 @@ cache_trim_thread(void *d)
 	while (jg2_global->count_cachedirs) {
 		struct jg2_repodir *rd = jg2_global->cachedir_head;
 
+		t = time(NULL);
+		if (t == last_trim)
+			goto refs;
+		last_trim = t;
+
 		while (rd) {
-			int n, around = 1;
+			int around = 1;
 
 			if (!rd->subsequent)
 				around = 256;
@@ -121,17 +187,147 @@ cache_trim_thread(void *d)
 			rd = rd->next;
 		}
 
-		sleep(1);
+refs:
+		poll_secs = 0;
+		changed = 0;
+		notified = 0;
+		npfd = 0;
+
+#if defined(JG2_HAVE_SYS_INOTIFY_H)
+		if (jg2_global->refwatch_fd != -1) {
+			pfd[npfd].fd = jg2_global->refwatch_fd;
+			pfd[npfd++].events = POLLIN;
+		}
+#endif
+		first_fifo = npfd;
+
+		pthread_mutex_lock(&jg2_global->lock); /* ======= global lock */
+		vh = jg2_global->vhost_head;
+		while (vh && npfd < (int)LWS_ARRAY_SIZE(pfd)) {
+			if (vh->refchange_fd != -1) {
+				pfd[npfd].fd = vh->refchange_fd;
+				pfd[npfd++].events = POLLIN;
+			}
+			vh = vh->vhost_list;
+		}
+		pthread_mutex_unlock(&jg2_global->lock); /* --- global unlock */
+
+		for (n = 0; n < npfd; n++)
+			pfd[n].revents = 0;
+
+		/* with nothing to wait on, this just sleeps for the 1s */
+
+		if (poll(pfd, npfd, 1000) < 0 && errno != EINTR)
+			sleep(1);
+
+#if defined(JG2_HAVE_SYS_INOTIFY_H)
+		if (first_fifo) {
+			if (pfd[0].revents & POLLIN)
+				changed = jg2_refwatch_read(jg2_global, wds,
+							LWS_ARRAY_SIZE(wds));
+			if (changed >= 0)
+				poll_secs = JG2_REFWATCH_POLL_SECS;
+		}
+#endif
+
+		for (n = first_fifo; n < npfd; n++)
+			if (pfd[n].revents & POLLIN)
+				break;
+		if (n != npfd)
+			/* somebody told us about a refchange */
+			notified = 1;
+
+		all = time(NULL) - last_poll >= poll_secs;
+
+		if (!all && !changed && !notified)
+			continue;
+
+		if (all)
+			last_poll = time(NULL);
 
 		pthread_mutex_lock(&jg2_global->lock); /* ======= global lock */
 
+		pinned = NULL;
 		vh = jg2_global->vhost_head;
 		while (vh) {
-			jg2_vhost_repo_reflist_update(vh);
+#if defined(JG2_HAVE_SYS_INOTIFY_H)
+			if (changed > 0) {
+				pthread_mutex_lock(&vh->lock); /* == vhost lock */
+				__jg2_refwatch_mark(vh, wds, changed);
+				pthread_mutex_unlock(&vh->lock); /* vhost unlk */
+			}
+#endif
+			if (notified && vh->refchange_fd != -1)
+				jg2_refchange_fifo_service(vh);
+
+			jg2_vhost_repo_reflist_update(vh, !all);
+			if (all)
+				jg2_vhost_repo_evict_idle(vh);
+
+			/* regenerating views takes a while, do it unlocked */
+			if (vh->prewarm_count)
+				__jg2_vhost_pin(vh, &pinned, JG2_PIN_CACHE);
+
 			vh = vh->vhost_list;
 		}
 
 		pthread_mutex_unlock(&jg2_global->lock); /* --- global unlock */
+
+		while (pinned) {
+			vh = pinned;
+			pinned = vh->pinned_next[JG2_PIN_CACHE];
+
+			jg2_refchange_prewarm(vh);
+			jg2_vhost_unpin(vh);
+		}
+	}
+
+	jg2_safe_libgit2_deinit();
+
+	pthread_exit(NULL);
+
+	return NULL;
+}
+
+/*
+ * The commit metadata and last commit indexes are brought up to date after
+ * refs changed by their own thread.  The first time for a big repo reads all
+ * of its history, which can take minutes, so it's done without the global
+ * lock, and away from the cache thread so refchanges and the cache are still
+ * looked after meanwhile.  Each vhost gets one repo looked at each time
+ * around, see commit-meta.c and last-commit.c.
+ */
+
+static void *
+index_thread(void *d)
+{
+	struct jg2_global *jg2_global = (struct jg2_global *)d;
+	struct jg2_vhost *vh, *pinned;
+
+	jg2_safe_libgit2_init();
+
+	while (jg2_global->count_cachedirs) {
+		sleep(1);
+
+		pinned = NULL;
+
+		pthread_mutex_lock(&jg2_global->lock); /* ======= global lock */
+		vh = jg2_global->vhost_head;
+		while (vh) {
+			if (vh->cachedir)
+				__jg2_vhost_pin(vh, &pinned, JG2_PIN_INDEX);
+			vh = vh->vhost_list;
+		}
+		pthread_mutex_unlock(&jg2_global->lock); /* --- global unlock */
+
+		while (pinned) {
+			vh = pinned;
+			pinned = vh->pinned_next[JG2_PIN_INDEX];
+
+			jg2_vhost_cmeta_update(vh);
+			jg2_vhost_lastc_update(vh);
+			jg2_vhost_unpin(vh);
+		}
 	}
 
 	jg2_safe_libgit2_deinit();
@@ -144,6 +340,8 @@ cache_trim_thread(void *d)
 int
 cache_trim_thread_spawn(struct jg2_global *jg2_global)
 {
+	void *retval;
+
 	if (pthread_create(&jg2_global->cache_thread, NULL,
 			   cache_trim_thread, jg2_global))
 		return 1;
@@ -152,5 +350,19 @@ cache_trim_thread_spawn(struct jg2_global *jg2_global)
 	pthread_setname_np(jg2_global->cache_thread, "cache-trim");
 #endif
 
+	if (pthread_create(&jg2_global->index_thread, NULL,
+			   index_thread, jg2_global)) {
+		/* the cache thread ends when it sees no cachedirs */
+		jg2_global->count_cachedirs--;
+		pthread_join(jg2_global->cache_thread, &retval);
+		jg2_global->count_cachedirs++;
+
+		return 1;
+	}
+
+#if defined(JG2_HAS_PTHREAD_SETNAME_NP)
+	pthread_setname_np(jg2_global->index_thread, "jg2-index");
+#endif
+
 	return 0;
 }
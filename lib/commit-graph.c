@@ -0,0 +1,381 @@
+/*
+ * libjsongit2 - read-only access to git's commit-graph file
+ *
+ * Copyright (C) 2018-2025 Andy Green <andy@warmcat.com>
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation:
+ *  version 2.1 of the License.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ *  MA  02110-1301  USA
+ *
+ * If the repo was gc'd with core.commitGraph (the default since git 2.24),
+ * objects/info/commit-graph has the oid and parents of every commit in a
+ * sorted table.  Walking parents through it is just reading the mmap, without
+ * inflating any commit objects.
+ *
+ * We only deal with the single-file, SHA-1 form.  Split graphs in
+ * objects/info/commit-graphs/ are ignored, and callers fall back to libgit2.
+ * Commits newer than the last gc won't be in it either.
+ *
+ * If it was written with --changed-paths (or commitGraph.changedPaths), it
+ * also has a Bloom filter per commit of the paths that differ from its first
+ * parent, which can tell us a commit definitely didn't touch a path.
+ */
+
+#include "private.h"
+
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define CG_SIGNATURE		0x43475048 /* "CGPH" */
+#define CG_HEADER_LEN		8
+#define CG_CHUNK_ENTRY_LEN	12
+#define CG_CDAT_LEN		(GIT_OID_RAWSZ + 16)
+
+#define CG_CHUNK_OIDF		0x4f494446 /* "OIDF" */
+#define CG_CHUNK_OIDL		0x4f49444c /* "OIDL" */
+#define CG_CHUNK_CDAT		0x43444154 /* "CDAT" */
+#define CG_CHUNK_BIDX		0x42494458 /* "BIDX" */
+#define CG_CHUNK_BDAT		0x42444154 /* "BDAT" */
+
+#define CG_BDAT_HEADER_LEN	12
+#define CG_BLOOM_SEED0		0x293ae76f
+#define CG_BLOOM_SEED1		0x7e646e2c
+
+#define CG_PARENT_NONE		0x70000000
+
+struct jg2_cgraph {
+	const uint8_t *map;
+	size_t len;
+
+	const uint8_t *fanout; /* 256 x be32 cumulative counts */
+	const uint8_t *oids; /* count x oid, sorted */
+	const uint8_t *cdat; /* count x (tree oid, p1, p2, gen + time) */
+
+	const uint8_t *bidx; /* count x be32 end of filter in bloom, or NULL */
+	const uint8_t *bloom; /* the filters */
+	size_t bloom_len;
+	uint32_t bloom_version; /* murmur3 variant, 1 or 2 */
+	uint32_t bloom_hashes;
+
+	uint32_t count;
+};
+
+static const uint8_t *
+cgraph_chunk(const uint8_t *map, size_t len, int chunks, uint32_t id,
+	     size_t *chunk_len)
+{
+	const uint8_t *p = map + CG_HEADER_LEN;
+	uint64_t ofs, next;
+	int n;
+
+	for (n = 0; n < chunks; n++, p += CG_CHUNK_ENTRY_LEN) {
+		if (lws_ser_ru32be(p) != id)
+			continue;
+
+		/* the chunk ends where the next one in the table starts */
+
+		ofs = lws_ser_ru64be(p + 4);
+		next = lws_ser_ru64be(p + CG_CHUNK_ENTRY_LEN + 4);
+		if (ofs > next || next > len)
+			return NULL;
+
+		*chunk_len = (size_t)(next - ofs);
+
+		return map + ofs;
+	}
+
+	return NULL;
+}
+
+static void
+cgraph_bloom_init(struct jg2_cgraph *g, int chunks)
+{
+	size_t bidx_len, bdat_len;
+	const uint8_t *bdat;
+
+	g->bidx = cgraph_chunk(g->map, g->len, chunks, CG_CHUNK_BIDX,
+			       &bidx_len);
+	bdat = cgraph_chunk(g->map, g->len, chunks, CG_CHUNK_BDAT, &bdat_len);
+
+	if (!g->bidx || !bdat || bidx_len < (size_t)g->count * 4 ||
+	    bdat_len < CG_BDAT_HEADER_LEN)
+		goto bail;
+
+	g->bloom_version = lws_ser_ru32be(bdat);
+	g->bloom_hashes = lws_ser_ru32be(bdat + 4);
+	g->bloom = bdat + CG_BDAT_HEADER_LEN;
+	g->bloom_len = bdat_len - CG_BDAT_HEADER_LEN;
+
+	if ((g->bloom_version == 1 || g->bloom_version == 2) &&
+	    g->bloom_hashes && g->bloom_hashes <= 32)
+		return;
+
+bail:
+	g->bidx = NULL;
+}
+
+/*
+ * Returns the commit-graph for the repo with git dir gitdir, or NULL if there
+ * isn't one we can use.
+ */
+
+struct jg2_cgraph *
+jg2_cgraph_open(const char *gitdir)
+{
+	size_t oidf_len, oidl_len, cdat_len;
+	struct jg2_cgraph *g;
+	char path[256];
+	const uint8_t *m;
+	struct stat s;
+	int fd, chunks;
+	void *map;
+
+	lws_snprintf(path, sizeof(path), "%s/objects/info/commit-graph",
+		     gitdir);
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return NULL;
+
+	if (fstat(fd, &s) || s.st_size < CG_HEADER_LEN + CG_CHUNK_ENTRY_LEN) {
+		close(fd);
+
+		return NULL;
+	}
+
+	map = mmap(NULL, (size_t)s.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return NULL;
+
+	m = map;
+	chunks = m[6];
+
+	/* version 1, SHA-1, no base graphs */
+
+	if (lws_ser_ru32be(m) != CG_SIGNATURE || m[4] != 1 || m[5] != 1 ||
+	    m[7] ||
+	    (size_t)s.st_size < CG_HEADER_LEN +
+				((size_t)(chunks + 1) * CG_CHUNK_ENTRY_LEN))
+		goto bail;
+
+	g = jg2_zalloc(sizeof(*g));
+	if (!g)
+		goto bail;
+
+	g->map = m;
+	g->len = (size_t)s.st_size;
+
+	g->fanout = cgraph_chunk(m, g->len, chunks, CG_CHUNK_OIDF, &oidf_len);
+	g->oids = cgraph_chunk(m, g->len, chunks, CG_CHUNK_OIDL, &oidl_len);
+	g->cdat = cgraph_chunk(m, g->len, chunks, CG_CHUNK_CDAT, &cdat_len);
+
+	if (!g->fanout || !g->oids || !g->cdat || oidf_len != 256 * 4)
+		goto bail1;
+
+	g->count = lws_ser_ru32be(g->fanout + (255 * 4));
+	if (oidl_len < (size_t)g->count * GIT_OID_RAWSZ ||
+	    cdat_len < (size_t)g->count * CG_CDAT_LEN)
+		goto bail1;
+
+	cgraph_bloom_init(g, chunks);
+
+	return g;
+
+bail1:
+	free(g);
+bail:
+	lwsl_info("%s: ignoring unusable %s\n", __func__, path);
+	munmap(map, (size_t)s.st_size);
+
+	return NULL;
+}
+
+void
+jg2_cgraph_close(struct jg2_cgraph **pg)
+{
+	struct jg2_cgraph *g = *pg;
+
+	if (!g)
+		return;
+
+	munmap((void *)g->map, g->len);
+	free(g);
+	*pg = NULL;
+}
+
+/*
+ * Find the position of oid in the graph, returns 0 and sets *pos if found,
+ * else nonzero.
+ */
+
+int
+jg2_cgraph_find(const struct jg2_cgraph *g, const git_oid *oid, uint32_t *pos)
+{
+	uint32_t lo = 0, hi, mid;
+	int n;
+
+	if (oid->id[0])
+		lo = lws_ser_ru32be(g->fanout + ((oid->id[0] - 1) * 4));
+	hi = lws_ser_ru32be(g->fanout + (oid->id[0] * 4));
+
+	if (hi > g->count || lo > hi)
+		return 1;
+
+	while (lo < hi) {
+		mid = lo + ((hi - lo) / 2);
+		n = memcmp(oid->id, g->oids + ((size_t)mid * GIT_OID_RAWSZ),
+			   GIT_OID_RAWSZ);
+		if (!n) {
+			*pos = mid;
+
+			return 0;
+		}
+		if (n < 0)
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+
+	return 1;
+}
+
+void
+jg2_cgraph_oid(const struct jg2_cgraph *g, uint32_t pos, git_oid *oid)
+{
+	git_oid_fromraw(oid, g->oids + ((size_t)pos * GIT_OID_RAWSZ));
+}
+
+/*
+ * Returns the graph position of the first parent of the commit at pos, or
+ * JG2_CGRAPH_NONE if it has no parents.
+ */
+
+uint32_t
+jg2_cgraph_parent(const struct jg2_cgraph *g, uint32_t pos)
+{
+	uint32_t p = lws_ser_ru32be(g->cdat + ((size_t)pos * CG_CDAT_LEN) +
+				    GIT_OID_RAWSZ);
+
+	if (p == CG_PARENT_NONE || p >= g->count)
+		return JG2_CGRAPH_NONE;
+
+	return p;
+}
+
+/*
+ * murmur3_32 the way git computes it for the filters.  Version 1 filters were
+ * made with a variant that sign-extended bytes >= 0x80, so we only use those
+ * for pure ASCII paths.
+ */
+
+static uint32_t
+cgraph_rotl(uint32_t v, int n)
+{
+	return (v << n) | (v >> (32 - n));
+}
+
+static uint32_t
+cgraph_murmur3(uint32_t seed, const uint8_t *d, size_t len)
+{
+	const uint32_t c1 = 0xcc9e2d51, c2 = 0x1b873593;
+	uint32_t h = seed, k;
+	size_t n;
+
+	for (n = 0; n + 4 <= len; n += 4) {
+		k = (uint32_t)d[n] | ((uint32_t)d[n + 1] << 8) |
+		    ((uint32_t)d[n + 2] << 16) | ((uint32_t)d[n + 3] << 24);
+		k *= c1;
+		k = cgraph_rotl(k, 15);
+		k *= c2;
+
+		h ^= k;
+		h = cgraph_rotl(h, 13);
+		h = (h * 5) + 0xe6546b64;
+	}
+
+	k = 0;
+	switch (len & 3) {
+	case 3:
+		k ^= (uint32_t)d[n + 2] << 16;
+		/* fallthru */
+	case 2:
+		k ^= (uint32_t)d[n + 1] << 8;
+		/* fallthru */
+	case 1:
+		k ^= d[n];
+		k *= c1;
+		k = cgraph_rotl(k, 15);
+		k *= c2;
+		h ^= k;
+	}
+
+	h ^= (uint32_t)len;
+	h ^= h >> 16;
+	h *= 0x85ebca6b;
+	h ^= h >> 13;
+	h *= 0xc2b2ae35;
+	h ^= h >> 16;
+
+	return h;
+}
+
+/*
+ * Returns 0 if the commit at pos definitely didn't change path (without
+ * leading or trailing /) compared to its first parent, or 1 if it may have,
+ * or we can't tell.
+ */
+
+int
+jg2_cgraph_maybe_changed(const struct jg2_cgraph *g, uint32_t pos,
+			 const char *path, size_t len)
+{
+	uint32_t start = 0, end, h0, h1, bits, bit, n;
+	const uint8_t *f;
+
+	if (!g->bidx)
+		return 1;
+
+	if (g->bloom_version == 1)
+		for (n = 0; n < len; n++)
+			if ((uint8_t)path[n] & 0x80)
+				return 1;
+
+	if (pos)
+		start = lws_ser_ru32be(g->bidx + ((pos - 1) * 4));
+	end = lws_ser_ru32be(g->bidx + (pos * 4));
+
+	/* an empty filter means there wasn't one computed for it */
+
+	if (end <= start || end > g->bloom_len)
+		return 1;
+
+	f = g->bloom + start;
+	bits = (end - start) * 8;
+
+	h0 = cgraph_murmur3(CG_BLOOM_SEED0, (const uint8_t *)path, len);
+	h1 = cgraph_murmur3(CG_BLOOM_SEED1, (const uint8_t *)path, len);
+
+	for (n = 0; n < g->bloom_hashes; n++) {
+		bit = (h0 + (n * h1)) % bits;
+		if (!(f[bit / 8] & (1 << (bit & 7))))
+			return 0;
+	}
+
+	return 1;
+}
@@ -0,0 +1,1018 @@
+/*
+ * libjsongit2 - per-repo commit metadata
+ *
+ * Copyright (C) 2018-2025 Andy Green <andy@warmcat.com>
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation:
+ *  version 2.1 of the License.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ *  MA  02110-1301  USA
+ *
+ * Log, reflist and blog pages are mostly commit summaries, and for each one
+ * we used to inflate the commit and parse its signatures again.  So if there
+ * is a cache dir, the index thread keeps a file per repo there with what the
+ * summaries need for every commit reachable from the refs, in fixed-width
+ * columns sorted by oid.  Jobs mmap it and render summaries from it without
+ * going near the odb.
+ *
+ * The strings are kept already purified the way the summaries emit them, so
+ * the output is the same either way.  Idents are interned, with the md5 of
+ * the raw email in front.
+ *
+ * When the refs change, we only look at the commits that aren't in it yet,
+ * and write a new file from the old one plus those.  Jobs pin the one that
+ * was current when they started, like the reftab.  Commits that aren't in it
+ * yet, and repos without one, are rendered the usual way.
+ */
+
+#include "private.h"
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define CM_MAGIC	0x4a47324d /* "JG2M" */
+#define CM_VERSION	1
+#define CM_HEADER_LEN	16
+
+/*
+ * The columns in file order, each count entries wide.  Times are seconds
+ * since the epoch and offsets minutes east of UTC, like git's.  Idents and
+ * subjects are offsets into the string table that follows the columns.
+ */
+
+enum {
+	CM_COL_OID,
+	CM_COL_TREE,
+	CM_COL_PARENT,	/* first parent index, or JG2_CMETA_NONE / _UNKNOWN */
+	CM_COL_CTIME,
+	CM_COL_COFS,
+	CM_COL_ATIME,
+	CM_COL_AOFS,
+	CM_COL_CIDENT,	/* md5 of raw email, then name\0 email\0 */
+	CM_COL_AIDENT,
+	CM_COL_SUBJECT,	/* subject\0 */
+
+	CM_COL_COUNT
+};
+
+static const uint8_t cm_col_width[] = {
+	GIT_OID_RAWSZ, GIT_OID_RAWSZ, 4, 8, 4, 8, 4, 4, 4, 4
+};
+
+struct jg2_cmeta {
+	int refcount; /* protected by the jrepo lock */
+	const uint8_t *map;
+	size_t len;
+	uint32_t count;
+	const uint8_t *col[CM_COL_COUNT];
+	const char *strings;
+	uint32_t strings_len;
+};
+
+struct cm_ident {
+	const unsigned char *md5;
+	const char *name;
+	const char *email;
+};
+
+static struct jg2_cmeta *
+cmeta_open(const char *path)
+{
+	struct jg2_cmeta *cm;
+	struct stat s;
+	void *map;
+	size_t pos;
+	int fd, n;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return NULL;
+
+	if (fstat(fd, &s) || s.st_size < CM_HEADER_LEN) {
+		close(fd);
+
+		return NULL;
+	}
+
+	map = mmap(NULL, (size_t)s.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return NULL;
+
+	cm = jg2_zalloc(sizeof(*cm));
+	if (!cm)
+		goto bail;
+
+	cm->map = map;
+	cm->len = (size_t)s.st_size;
+
+	if (lws_ser_ru32be(cm->map) != CM_MAGIC ||
+	    lws_ser_ru32be(cm->map + 4) != CM_VERSION)
+		goto bail;
+
+	cm->count = lws_ser_ru32be(cm->map + 8);
+	cm->strings_len = lws_ser_ru32be(cm->map + 12);
+
+	pos = CM_HEADER_LEN;
+	for (n = 0; n < CM_COL_COUNT; n++) {
+		cm->col[n] = cm->map + pos;
+		pos += (size_t)cm->count * cm_col_width[n];
+		if (pos > cm->len)
+			goto bail;
+	}
+
+	/* the string table must end with a NUL, so strlen() stays inside */
+
+	if (cm->len - pos != cm->strings_len ||
+	    (cm->strings_len && cm->map[cm->len - 1]))
+		goto bail;
+
+	cm->strings = (const char *)cm->map + pos;
+	cm->refcount = 1;
+
+	return cm;
+
+bail:
+	lwsl_notice("%s: ignoring bad %s\n", __func__, path);
+	munmap(map, (size_t)s.st_size);
+	free(cm);
+
+	return NULL;
+}
+
+struct jg2_cmeta *
+jg2_cmeta_get(struct jg2_repo *jrepo)
+{
+	struct jg2_cmeta *cm;
+
+	pthread_mutex_lock(&jrepo->lock); /* ===================== jrepo lock */
+	cm = jrepo->cmeta;
+	if (cm)
+		cm->refcount++;
+	pthread_mutex_unlock(&jrepo->lock); /*------------------ jrepo unlock */
+
+	return cm;
+}
+
+void
+jg2_cmeta_put(struct jg2_repo *jrepo, struct jg2_cmeta **pcm)
+{
+	struct jg2_cmeta *cm = *pcm;
+	int n;
+
+	if (!cm)
+		return;
+
+	*pcm = NULL;
+
+	pthread_mutex_lock(&jrepo->lock); /* ===================== jrepo lock */
+	n = !--cm->refcount;
+	pthread_mutex_unlock(&jrepo->lock); /*------------------ jrepo unlock */
+
+	if (!n)
+		return;
+
+	munmap((void *)cm->map, cm->len);
+	free(cm);
+}
+
+/* cm's creation reference passes to jrepo */
+
+static void
+cmeta_swap(struct jg2_repo *jrepo, struct jg2_cmeta *cm)
+{
+	struct jg2_cmeta *old;
+
+	pthread_mutex_lock(&jrepo->lock); /* ===================== jrepo lock */
+	old = jrepo->cmeta;
+	jrepo->cmeta = cm;
+	pthread_mutex_unlock(&jrepo->lock); /*------------------ jrepo unlock */
+
+	jg2_cmeta_put(jrepo, &old);
+}
+
+/* returns 0 and the index in *i if oid is in cm, else 1 */
+
+int
+jg2_cmeta_find(const struct jg2_cmeta *cm, const git_oid *oid, uint32_t *i)
+{
+	uint32_t lo = 0, hi = cm->count, mid;
+	int n;
+
+	while (lo < hi) {
+		mid = lo + ((hi - lo) / 2);
+		n = memcmp(oid->id, cm->col[CM_COL_OID] +
+				    ((size_t)mid * GIT_OID_RAWSZ), GIT_OID_RAWSZ);
+		if (!n) {
+			*i = mid;
+
+			return 0;
+		}
+		if (n < 0)
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+
+	return 1;
+}
+
+void
+jg2_cmeta_oid(const struct jg2_cmeta *cm, uint32_t i, git_oid *oid)
+{
+	git_oid_fromraw(oid, cm->col[CM_COL_OID] + ((size_t)i * GIT_OID_RAWSZ));
+}
+
+uint32_t
+jg2_cmeta_parent(const struct jg2_cmeta *cm, uint32_t i)
+{
+	uint32_t p = lws_ser_ru32be(cm->col[CM_COL_PARENT] + ((size_t)i * 4));
+
+	if (p >= cm->count && p != JG2_CMETA_NONE)
+		return JG2_CMETA_UNKNOWN;
+
+	return p;
+}
+
+static const char *
+cmeta_str(const struct jg2_cmeta *cm, int col, uint32_t i)
+{
+	uint32_t ofs = lws_ser_ru32be(cm->col[col] + ((size_t)i * 4));
+
+	if (ofs >= cm->strings_len)
+		return NULL;
+
+	return cm->strings + ofs;
+}
+
+static int
+cmeta_ident(const struct jg2_cmeta *cm, int col, uint32_t i,
+	    struct cm_ident *id)
+{
+	uint32_t ofs = lws_ser_ru32be(cm->col[col] + ((size_t)i * 4));
+	const char *end = cm->strings + cm->strings_len;
+
+	if (ofs >= cm->strings_len ||
+	    cm->strings_len - ofs <= JG2_MD5_LEN)
+		return 1;
+
+	id->md5 = (const unsigned char *)cm->strings + ofs;
+	id->name = cm->strings + ofs + JG2_MD5_LEN;
+	id->email = id->name + strlen(id->name) + 1;
+
+	return id->email >= end;
+}
+
+static void
+cmeta_sig_json(struct jg2_ctx *ctx, const struct cm_ident *id,
+	       const uint8_t *t, const uint8_t *ofs)
+{
+	struct jg2_jw w;
+	git_time when;
+
+	memset(&when, 0, sizeof(when));
+	when.time = (git_time_t)lws_ser_ru64be(t);
+	when.offset = (int)(int32_t)lws_ser_ru32be(ofs);
+
+	email_md5_seen(ctx->vhost, id->md5);
+
+	jg2_jw_start(&w, ctx, JG2_JW_SIG_MAX + strlen(id->name) +
+			      strlen(id->email));
+	jg2_jw_sig(&w, &when, id->name, id->email, id->md5);
+	jg2_jw_end(&w, ctx);
+}
+
+/*
+ * Emits the same thing commit_summary() would for the commit at index i.
+ * Returns nonzero without emitting anything if the entry is damaged.
+ */
+
+int
+jg2_cmeta_summary(const struct jg2_cmeta *cm, uint32_t i, struct jg2_ctx *ctx)
+{
+	struct cm_ident committer, author;
+	const char *subject;
+	struct jg2_jw w;
+	git_oid oid;
+
+	if (i >= cm->count)
+		return 1;
+
+	subject = cmeta_str(cm, CM_COL_SUBJECT, i);
+	if (!subject || cmeta_ident(cm, CM_COL_CIDENT, i, &committer) ||
+	    cmeta_ident(cm, CM_COL_AIDENT, i, &author))
+		return 1;
+
+	jg2_jw_start(&w, ctx, 64 + (JG2_JW_NUM_MAX * 2));
+	JG2_JW_LIT(&w, "\"type\":\"commit\",\n \"time\": ");
+	jg2_jw_u64(&w, lws_ser_ru64be(cm->col[CM_COL_CTIME] +
+				      ((size_t)i * 8)));
+	JG2_JW_LIT(&w, ",\n\"time_ofs\": ");
+	jg2_jw_u64(&w, (uint64_t)(int64_t)(int32_t)lws_ser_ru32be(
+				cm->col[CM_COL_COFS] + ((size_t)i * 4)));
+	JG2_JW_LIT(&w, ",\n \"oid_tree\": ");
+	jg2_jw_end(&w, ctx);
+
+	git_oid_fromraw(&oid, cm->col[CM_COL_TREE] +
+			      ((size_t)i * GIT_OID_RAWSZ));
+	jg2_json_oid(&oid, ctx);
+
+	jg2_jw_start(&w, ctx, 16);
+	JG2_JW_LIT(&w, ",\n\"oid\":");
+	jg2_jw_end(&w, ctx);
+
+	jg2_cmeta_oid(cm, i, &oid);
+	jg2_json_oid(&oid, ctx);
+
+	jg2_jw_start(&w, ctx, 40 + strlen(subject));
+	JG2_JW_LIT(&w, ",\n \"msg\": \"");
+	jg2_jw_str(&w, subject);
+	JG2_JW_LIT(&w, "\",\n \"sig_commit\": ");
+	jg2_jw_end(&w, ctx);
+
+	cmeta_sig_json(ctx, &committer, cm->col[CM_COL_CTIME] + ((size_t)i * 8),
+		       cm->col[CM_COL_COFS] + ((size_t)i * 4));
+
+	jg2_jw_start(&w, ctx, 20);
+	JG2_JW_LIT(&w, ",\n\"sig_author\": ");
+	jg2_jw_end(&w, ctx);
+
+	cmeta_sig_json(ctx, &author, cm->col[CM_COL_ATIME] + ((size_t)i * 8),
+		       cm->col[CM_COL_AOFS] + ((size_t)i * 4));
+
+	return 0;
+}
+
+/*
+ * Updating it, from the index thread
+ */
+
+struct cm_rec {
+	git_oid oid;
+	git_oid tree;
+	git_oid parent;
+	int64_t ctime;
+	int64_t atime;
+	int32_t cofs;
+	int32_t aofs;
+	uint32_t cident; /* offsets in the new strings */
+	uint32_t aident;
+	uint32_t subject;
+	uint32_t pidx; /* index of the parent in the new file */
+	uint32_t idx; /* index in the new file */
+	char has_parent;
+};
+
+struct cm_build {
+	struct jg2_vhost *vh;
+	git_repository *repo;
+	const struct jg2_cmeta *old;
+	jg2_md5_context md5;
+
+	struct cm_rec *recs;
+	size_t count, recs_alloc;
+
+	git_oid *stack;
+	size_t sp, stack_alloc;
+
+	git_oid *seen; /* open addressing, all-zero oid is empty */
+	size_t seen_count, seen_size; /* power of 2 */
+
+	char *str;
+	size_t str_len, str_alloc;
+
+	uint32_t *idents; /* open addressing, str offset + 1 */
+	size_t idents_count, idents_size; /* power of 2 */
+
+	uint32_t *oldmap; /* old index -> new index */
+	int oom;
+};
+
+struct cm_writer {
+	int fd;
+	int err;
+	size_t n;
+	uint8_t buf[16384];
+};
+
+/* on failure, p is left as it was and b->oom set */
+
+static void *
+cm_grow(struct cm_build *b, void *p, size_t *alloc, size_t need, size_t size)
+{
+	size_t n = *alloc ? *alloc : 256;
+	void *np;
+
+	if (need <= *alloc)
+		return p;
+
+	while (n < need)
+		n *= 2;
+
+	np = realloc(p, n * size);
+	if (!np) {
+		b->oom = 1;
+
+		return p;
+	}
+	*alloc = n;
+
+	return np;
+}
+
+static uint32_t
+cm_oid_hash(const git_oid *oid)
+{
+	return lws_ser_ru32be(oid->id);
+}
+
+/* returns 1 if oid was seen before, else adds it and returns 0 */
+
+static int
+cm_seen(struct cm_build *b, const git_oid *oid)
+{
+	static const git_oid zero;
+	size_t n, m, size;
+	git_oid *s;
+
+	if ((b->seen_count + 1) * 2 > b->seen_size) {
+		size = b->seen_size ? b->seen_size * 2 : 1024;
+		s = calloc(size, sizeof(*s));
+		if (!s) {
+			b->oom = 1;
+
+			return 1;
+		}
+
+		for (n = 0; n < b->seen_size; n++) {
+			if (!git_oid_cmp(&b->seen[n], &zero))
+				continue;
+			m = cm_oid_hash(&b->seen[n]) & (size - 1);
+			while (git_oid_cmp(&s[m], &zero))
+				m = (m + 1) & (size - 1);
+			git_oid_cpy(&s[m], &b->seen[n]);
+		}
+
+		free(b->seen);
+		b->seen = s;
+		b->seen_size = size;
+	}
+
+	m = cm_oid_hash(oid) & (b->seen_size - 1);
+	while (git_oid_cmp(&b->seen[m], &zero)) {
+		if (!git_oid_cmp(&b->seen[m], oid))
+			return 1;
+		m = (m + 1) & (b->seen_size - 1);
+	}
+
+	git_oid_cpy(&b->seen[m], oid);
+	b->seen_count++;
+
+	return 0;
+}
+
+static void
+cm_push(struct cm_build *b, const git_oid *oid)
+{
+	b->stack = cm_grow(b, b->stack, &b->stack_alloc, b->sp + 1,
+			   sizeof(*b->stack));
+	if (!b->oom)
+		git_oid_cpy(&b->stack[b->sp++], oid);
+}
+
+static uint32_t
+cm_str_add(struct cm_build *b, const void *s, size_t len)
+{
+	uint32_t ofs = (uint32_t)b->str_len;
+
+	if ((b->old ? b->old->strings_len : 0) + b->str_len + len >=
+							0xffffffff) {
+		b->oom = 1;
+
+		return 0;
+	}
+
+	b->str = cm_grow(b, b->str, &b->str_alloc, b->str_len + len, 1);
+	if (b->oom)
+		return 0;
+
+	memcpy(b->str + b->str_len, s, len);
+	b->str_len += len;
+
+	return ofs;
+}
+
+/* an interned ident is the md5, then name\0 email\0 */
+
+static size_t
+cm_ident_len(const char *key)
+{
+	size_t len = JG2_MD5_LEN + strlen(key + JG2_MD5_LEN) + 1;
+
+	return len + strlen(key + len) + 1;
+}
+
+static uint64_t
+cm_key_hash(const char *key, size_t len)
+{
+	struct jg2_xxh64 x;
+
+	jg2_xxh64_init(&x, 0);
+	jg2_xxh64_upd(&x, key, len);
+
+	return jg2_xxh64_fini(&x);
+}
+
+/* interns the ident for sig in the new strings, returning its offset */
+
+static uint32_t
+cm_ident(struct cm_build *b, const git_signature *sig)
+{
+	char key[JG2_MD5_LEN + (JG2_IDENT_LEN * 2)];
+	const char *name = sig->name, *email = sig->email;
+	size_t len, n, m, size;
+	uint32_t *s, ofs;
+
+	if (!name)
+		name = "unknown";
+	if (!email)
+		email = "unknown";
+
+	b->vh->cfg.md5_init(b->md5);
+	b->vh->cfg.md5_upd(b->md5, (const unsigned char *)email,
+			   strlen(email));
+	b->vh->cfg.md5_fini(b->md5, (unsigned char *)key);
+
+	ellipsis_purify(key + JG2_MD5_LEN, name, JG2_IDENT_LEN);
+	ellipsis_purify(key + JG2_MD5_LEN + strlen(key + JG2_MD5_LEN) + 1,
+			email, JG2_IDENT_LEN);
+	len = cm_ident_len(key);
+
+	if ((b->idents_count + 1) * 2 > b->idents_size) {
+		size = b->idents_size ? b->idents_size * 2 : 256;
+		s = calloc(size, sizeof(*s));
+		if (!s) {
+			b->oom = 1;
+
+			return 0;
+		}
+
+		for (n = 0; n < b->idents_size; n++) {
+			if (!b->idents[n])
+				continue;
+			ofs = b->idents[n] - 1;
+			m = cm_key_hash(b->str + ofs,
+					cm_ident_len(b->str + ofs)) & (size - 1);
+			while (s[m])
+				m = (m + 1) & (size - 1);
+			s[m] = b->idents[n];
+		}
+
+		free(b->idents);
+		b->idents = s;
+		b->idents_size = size;
+	}
+
+	m = cm_key_hash(key, len) & (b->idents_size - 1);
+	while (b->idents[m]) {
+		ofs = b->idents[m] - 1;
+		if (ofs + len <= b->str_len && !memcmp(b->str + ofs, key, len))
+			return ofs;
+		m = (m + 1) & (b->idents_size - 1);
+	}
+
+	ofs = cm_str_add(b, key, len);
+	if (!b->oom) {
+		b->idents[m] = ofs + 1;
+		b->idents_count++;
+	}
+
+	return ofs;
+}
+
+static void
+cm_add(struct cm_build *b, git_commit *c)
+{
+	const git_signature *committer = git_commit_committer(c),
+			    *author = git_commit_author(c);
+	char summary[JG2_SUMMARY_LEN];
+	struct cm_rec *r;
+	unsigned int n;
+
+	b->recs = cm_grow(b, b->recs, &b->recs_alloc, b->count + 1,
+			  sizeof(*b->recs));
+	if (b->oom || !committer || !author)
+		return;
+
+	r = &b->recs[b->count];
+	memset(r, 0, sizeof(*r));
+
+	git_oid_cpy(&r->oid, git_commit_id(c));
+	git_oid_cpy(&r->tree, git_commit_tree_id(c));
+	if (git_commit_parentcount(c)) {
+		git_oid_cpy(&r->parent, git_commit_parent_id(c, 0));
+		r->has_parent = 1;
+	}
+
+	r->ctime = (int64_t)git_commit_time(c);
+	r->cofs = (int32_t)git_commit_time_offset(c);
+	r->atime = (int64_t)author->when.time;
+	r->aofs = (int32_t)author->when.offset;
+
+	r->cident = cm_ident(b, committer);
+	r->aident = cm_ident(b, author);
+
+	commit_summary_msg(summary, c);
+	r->subject = cm_str_add(b, summary, strlen(summary) + 1);
+
+	if (b->oom)
+		return;
+
+	b->count++;
+
+	for (n = 0; n < git_commit_parentcount(c); n++)
+		cm_push(b, git_commit_parent_id(c, n));
+}
+
+/* collect the commits reachable from the refs that aren't in the old one */
+
+static void
+cm_walk(struct cm_build *b, const struct jg2_reftab *t)
+{
+	git_object *o, *peeled;
+	git_commit *c;
+	git_oid oid;
+	uint32_t i;
+	unsigned int n;
+
+	for (n = 0; t && n < t->count; n++) {
+		if (git_object_lookup(&o, b->repo, &t->refs[n].oid,
+				      GIT_OBJ_ANY))
+			continue;
+		if (!git_object_peel(&peeled, o, GIT_OBJ_COMMIT)) {
+			cm_push(b, git_object_id(peeled));
+			git_object_free(peeled);
+		}
+		git_object_free(o);
+	}
+
+	/* if the vhost is going away, the walk is abandoned */
+
+	while (b->sp && !b->oom && !b->vh->dying) {
+		git_oid_cpy(&oid, &b->stack[--b->sp]);
+
+		if ((b->old && !jg2_cmeta_find(b->old, &oid, &i)) ||
+		    cm_seen(b, &oid))
+			continue;
+
+		if (git_commit_lookup(&c, b->repo, &oid))
+			continue; /* eg, shallow... its children say UNKNOWN */
+
+		cm_add(b, c);
+		git_commit_free(c);
+	}
+}
+
+static int
+cm_rec_cmp(const void *a, const void *b)
+{
+	return memcmp(((const struct cm_rec *)a)->oid.id,
+		      ((const struct cm_rec *)b)->oid.id, GIT_OID_RAWSZ);
+}
+
+static void
+cm_write(struct cm_writer *w, const void *p, size_t len)
+{
+	size_t n;
+
+	while (len) {
+		n = sizeof(w->buf) - w->n;
+		if (n > len)
+			n = len;
+		memcpy(w->buf + w->n, p, n);
+		w->n += n;
+		p = (const uint8_t *)p + n;
+		len -= n;
+
+		if (w->n == sizeof(w->buf) || !len) {
+			if (!w->err && write(w->fd, w->buf, w->n) !=
+							(ssize_t)w->n)
+				w->err = 1;
+			w->n = 0;
+		}
+	}
+}
+
+/* works out where everything goes in the new file, old and new interleaved */
+
+static uint32_t
+cm_place(struct cm_build *b)
+{
+	uint32_t oc = b->old ? b->old->count : 0, i = 0, k = 0, p;
+	size_t j = 0;
+
+	while (i < oc || j < b->count) {
+		if (j == b->count || (i < oc &&
+		    memcmp(b->old->col[CM_COL_OID] + ((size_t)i * GIT_OID_RAWSZ),
+			   b->recs[j].oid.id, GIT_OID_RAWSZ) < 0))
+			b->oldmap[i++] = k++;
+		else
+			b->recs[j++].idx = k++;
+	}
+
+	for (j = 0; j < b->count; j++) {
+		struct cm_rec key, *r = &b->recs[j], *pr;
+
+		r->pidx = JG2_CMETA_NONE;
+		if (!r->has_parent)
+			continue;
+
+		r->pidx = JG2_CMETA_UNKNOWN;
+		git_oid_cpy(&key.oid, &r->parent);
+		pr = bsearch(&key, b->recs, b->count, sizeof(*b->recs),
+			     cm_rec_cmp);
+		if (pr)
+			r->pidx = pr->idx;
+		else
+			if (b->old && !jg2_cmeta_find(b->old, &r->parent, &p))
+				r->pidx = b->oldmap[p];
+	}
+
+	return k;
+}
+
+static void
+cm_write_col(struct cm_build *b, struct cm_writer *w, int col)
+{
+	uint32_t oc = b->old ? b->old->count : 0, i = 0, u,
+		 base = b->old ? b->old->strings_len : 0;
+	size_t j = 0, wid = cm_col_width[col];
+	uint8_t v[GIT_OID_RAWSZ];
+	const struct cm_rec *r;
+	const uint8_t *s;
+
+	while (i < oc || j < b->count) {
+		if (j == b->count || (i < oc &&
+		    memcmp(b->old->col[CM_COL_OID] + ((size_t)i * GIT_OID_RAWSZ),
+			   b->recs[j].oid.id, GIT_OID_RAWSZ) < 0)) {
+			s = b->old->col[col] + ((size_t)i * wid);
+			if (col == CM_COL_PARENT) {
+				/* the indexes moved up to make room */
+				u = lws_ser_ru32be(s);
+				if (u < oc)
+					u = b->oldmap[u];
+				lws_ser_wu32be(v, u);
+				s = v;
+			}
+			cm_write(w, s, wid);
+			i++;
+			continue;
+		}
+
+		r = &b->recs[j++];
+
+		switch (col) {
+		case CM_COL_OID:
+			memcpy(v, r->oid.id, GIT_OID_RAWSZ);
+			break;
+		case CM_COL_TREE:
+			memcpy(v, r->tree.id, GIT_OID_RAWSZ);
+			break;
+		case CM_COL_PARENT:
+			lws_ser_wu32be(v, r->pidx);
+			break;
+		case CM_COL_CTIME:
+			lws_ser_wu64be(v, (uint64_t)r->ctime);
+			break;
+		case CM_COL_COFS:
+			lws_ser_wu32be(v, (uint32_t)r->cofs);
+			break;
+		case CM_COL_ATIME:
+			lws_ser_wu64be(v, (uint64_t)r->atime);
+			break;
+		case CM_COL_AOFS:
+			lws_ser_wu32be(v, (uint32_t)r->aofs);
+			break;
+		case CM_COL_CIDENT:
+			lws_ser_wu32be(v, base + r->cident);
+			break;
+		case CM_COL_AIDENT:
+			lws_ser_wu32be(v, base + r->aident);
+			break;
+		case CM_COL_SUBJECT:
+			lws_ser_wu32be(v, base + r->subject);
+			break;
+		}
+
+		cm_write(w, v, wid);
+	}
+}
+
+static int
+cm_write_file(struct cm_build *b, int fd)
+{
+	struct cm_writer *w;
+	uint8_t h[CM_HEADER_LEN];
+	uint32_t count;
+	int n;
+
+	w = malloc(sizeof(*w));
+	if (!w)
+		return 1;
+
+	w->fd = fd;
+	w->err = 0;
+	w->n = 0;
+
+	qsort(b->recs, b->count, sizeof(*b->recs), cm_rec_cmp);
+	count = cm_place(b);
+
+	lws_ser_wu32be(h, CM_MAGIC);
+	lws_ser_wu32be(h + 4, CM_VERSION);
+	lws_ser_wu32be(h + 8, count);
+	lws_ser_wu32be(h + 12, (uint32_t)((b->old ? b->old->strings_len : 0) +
+					  b->str_len));
+	cm_write(w, h, sizeof(h));
+
+	for (n = 0; n < CM_COL_COUNT; n++)
+		cm_write_col(b, w, n);
+
+	if (b->old)
+		cm_write(w, b->old->strings, b->old->strings_len);
+	cm_write(w, b->str, b->str_len);
+
+	n = w->err;
+	free(w);
+
+	return n;
+}
+
+/*
+ * Brings r's commit metadata up to date with its refs, returns 0 if it did.
+ * We use our own git_repository, so the repo may be closed meanwhile.
+ */
+
+static int
+cmeta_update(struct jg2_vhost *vh, struct jg2_repo *r)
+{
+	char name[(JG2_CHASH_LEN * 2) + 1], path[256], tmp[264];
+	struct jg2_cmeta *old, *loaded = NULL, *cm = NULL;
+	unsigned char hash[JG2_CHASH_LEN];
+	struct jg2_reftab *t;
+	struct jg2_chash ch;
+	struct cm_build b;
+	int fd, n, ret = 1;
+	size_t size;
+
+	jg2_chash_init(&ch, NULL, NULL);
+	jg2_chash_upd(&ch, "commit-meta", 11);
+	jg2_chash_upd(&ch, r->repo_path, strlen(r->repo_path));
+	jg2_chash_fini(&ch, hash);
+	md5_to_hex_cstr(name, hash);
+
+	n = lws_diskcache_query(vh->cachedir->dcs, 0, name, &fd, path,
+				sizeof(path) - 1, &size);
+	if (n != LWS_DISKCACHE_QUERY_EXISTS &&
+	    n != LWS_DISKCACHE_QUERY_CREATING)
+		return 1;
+
+	old = jg2_cmeta_get(r);
+	if (!old && n == LWS_DISKCACHE_QUERY_EXISTS)
+		/* we have one from before we restarted */
+		loaded = cmeta_open(path);
+
+	memset(&b, 0, sizeof(b));
+	b.vh = vh;
+	b.old = old ? old : loaded;
+
+	if (n == LWS_DISKCACHE_QUERY_EXISTS) {
+		close(fd);
+		fd = -1;
+	}
+
+	b.md5 = vh->cfg.md5_alloc();
+	if (!b.md5 || git_repository_open_ext(&b.repo, r->repo_path, 0, NULL))
+		goto bail;
+
+	t = jg2_reftab_get(r);
+	cm_walk(&b, t);
+	jg2_reftab_put(r, &t);
+
+	if (b.oom || vh->dying)
+		goto bail;
+
+	if (!b.count) {
+		if (loaded) {
+			cmeta_swap(r, loaded);
+			loaded = NULL;
+		}
+		ret = 0;
+		goto bail;
+	}
+
+	if (b.old && b.old->count) {
+		b.oldmap = malloc(b.old->count * sizeof(*b.oldmap));
+		if (!b.oldmap)
+			goto bail;
+	}
+
+	/* a fresh one is written to the temp name the cache gave us */
+
+	lws_strncpy(tmp, path, sizeof(tmp));
+	if (fd == -1) {
+		lws_snprintf(tmp, sizeof(tmp), "%s~cm", path);
+		fd = open(tmp, O_CREAT | O_TRUNC | O_WRONLY | O_CLOEXEC, 0600);
+		if (fd < 0)
+			goto bail;
+	}
+
+	n = cm_write_file(&b, fd);
+	close(fd);
+	fd = -1;
+
+	if (!n)
+		cm = cmeta_open(tmp);
+
+	if (!cm) {
+		unlink(tmp);
+		goto bail;
+	}
+
+	if (strcmp(tmp, path))
+		n = rename(tmp, path);
+	else
+		n = lws_diskcache_finalize_name(path);
+	if (n)
+		lwsl_notice("%s: unable to rename %s\n", __func__, tmp);
+
+	lwsl_info("%s: %s: %u commits (+%u)\n", __func__, r->repo_path,
+		  cm->count, (unsigned int)b.count);
+
+	cmeta_swap(r, cm);
+	ret = 0;
+
+bail:
+	if (fd != -1) {
+		close(fd);
+		unlink(path);
+	}
+	if (b.repo)
+		git_repository_free(b.repo);
+	free(b.md5);
+	free(b.recs);
+	free(b.stack);
+	free(b.seen);
+	free(b.str);
+	free(b.idents);
+	free(b.oldmap);
+	jg2_cmeta_put(r, &old);
+	if (loaded) {
+		munmap((void *)loaded->map, loaded->len);
+		free(loaded);
+	}
+
+	return ret;
+}
+
+/*
+ * Called from the index thread, without the global lock and with vh pinned,
+ * updates the commit metadata for one of the vhost's repos whose refs
+ * changed, if any.  The first time for a big repo takes a while, so we only do
+ * one each time around.
+ */
+
+void
+jg2_vhost_cmeta_update(struct jg2_vhost *vh)
+{
+	struct jg2_repo *r;
+
+	if (!vh->cachedir)
+		return;
+
+	pthread_mutex_lock(&vh->lock); /* ======================== vhost lock */
+	r = vh->repo_list;
+	while (r && !r->cmeta_stale)
+		r = r->next;
+	if (r)
+		r->cmeta_stale = 0;
+	pthread_mutex_unlock(&vh->lock); /* -------------------- vhost unlock */
+
+	if (r && cmeta_update(vh, r))
+		lwsl_notice("%s: unable to update %s\n", __func__,
+			    r->repo_path);
+}
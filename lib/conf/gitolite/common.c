@@ -34,9 +34,22 @@ struct repo_entry_info *
 __jg2_repodir_repo(struct jg2_repodir *rd, const char *repo_name)
 {
 	lws_list_ptr lp = rd->rei_head;
+	struct repo_entry_info *rei;
+
+	if (rd->rei_hash_size) {
+		rei = rd->rei_hash[jg2_name_hash(repo_name) &
+				   (rd->rei_hash_size - 1)];
+		while (rei) {
+			if (!strcmp((const char *)(rei + 1), repo_name))
+				return rei;
+			rei = rei->hash_next;
+		}
+
+		return NULL;
+	}
 
 	while (lp) {
-		struct repo_entry_info *rei = lp_to_rei(lp, next);
+		rei = lp_to_rei(lp, next);
 
 		if (!strcmp((const char *)(rei + 1), repo_name))
 			return rei;
@@ -81,6 +94,112 @@ jg2_acl_check(struct jg2_ctx *ctx, const char *reponame, const char *auth)
 	return ret;
 }
 
+/*
+ * Copies the digest of the config elements of reponame into hash.  Returns 0
+ * if OK or nonzero if no such repo.
+ */
+
+int
+jg2_repodir_conf_hash(struct jg2_ctx *ctx, const char *reponame,
+		      unsigned char *hash)
+{
+	struct jg2_repodir *rd = ctx->vhost->repodir;
+	struct repo_entry_info *rei;
+
+	pthread_mutex_lock(&rd->lock); /* ====================== repodir lock */
+
+	rei = __jg2_repodir_repo(rd, reponame);
+	if (rei)
+		memcpy(hash, rei->conf_hash, sizeof(rei->conf_hash));
+
+	pthread_mutex_unlock(&rd->lock); /* ------------------ repodir unlock */
+
+	return !rei;
+}
+
+/*
+ * Copies a digest of the names of every repo that jg2_acl_check() would allow
+ * for auth into hash.
+ *
+ * Walking every repo doing the acl check is expensive with a lot of repos, so
+ * the result is kept on the repodir keyed by the vhost acl and auth.  The set
+ * can only change when gitolite-admin changes, which drops all of them along
+ * with the rei.
+ *
+ * Returns 0 if OK or nonzero on OOM.
+ */
+
+int
+jg2_acl_visible_hash(struct jg2_ctx *ctx, const char *auth,
+		     unsigned char *hash)
+{
+	struct jg2_vhost *vh = ctx->vhost;
+	struct jg2_repodir *rd = vh->repodir;
+	const char *vacl = vh->cfg.acl_user;
+	int all = auth && !strcmp(auth, "@all"), ret = 1;
+	struct jg2_visible *v;
+	struct jg2_chash ch;
+	lws_list_ptr lp;
+	size_t m, n;
+
+	if (!auth)
+		auth = "";
+
+	pthread_mutex_lock(&rd->lock); /* ====================== repodir lock */
+
+	/* this may rescan the repodir, so do it before looking at anything */
+
+	__jg2_conf_ensure_acl(ctx, vacl);
+	if (auth[0] && !all)
+		__jg2_conf_ensure_acl(ctx, auth);
+
+	v = rd->visible_head;
+	while (v) {
+		if (!strcmp(v->vhost_acl, vacl) && !strcmp(v->acl, auth)) {
+			memcpy(hash, v->hash, sizeof(v->hash));
+			ret = 0;
+			goto bail;
+		}
+		v = v->next;
+	}
+
+	jg2_chash_init(&ch, NULL, NULL);
+
+	lp = rd->rei_head;
+	while (lp) {
+		struct repo_entry_info *rei = lp_to_rei(lp, next);
+		const char *p = (const char *)(rei + 1);
+
+		if (all || !__jg2_gitolite3_acl_valid(rei, vacl) ||
+		    (auth[0] && !__jg2_gitolite3_acl_valid(rei, auth)))
+			jg2_chash_upd(&ch, p, strlen(p));
+
+		lws_list_ptr_advance(lp);
+	}
+
+	m = strlen(vacl) + 1;
+	n = strlen(auth) + 1;
+	v = lwsac_use(&rd->rei_lwsac_head, sizeof(*v) + m + n, 0);
+	if (!v)
+		goto bail;
+
+	v->vhost_acl = (const char *)(v + 1);
+	memcpy((char *)v->vhost_acl, vacl, m);
+	v->acl = v->vhost_acl + m;
+	memcpy((char *)v->acl, auth, n);
+	jg2_chash_fini(&ch, v->hash);
+	memcpy(hash, v->hash, sizeof(v->hash));
+
+	v->next = rd->visible_head;
+	rd->visible_head = v;
+	ret = 0;
+
+bail:
+	pthread_mutex_unlock(&rd->lock); /* ------------------ repodir unlock */
+
+	return ret;
+}
+
 int
 __jg2_conf_gitolite_admin_head(struct jg2_ctx *ctx)
 {
@@ -138,7 +257,10 @@ __jg2_conf_gitolite_admin_head(struct jg2_ctx *ctx)
 
 		lwsac_free(&rd->rei_lwsac_head);
 		rd->rei_head = NULL;
+		rd->rei_hash = NULL;
+		rd->rei_hash_size = 0;
 		rd->acls_known_head = NULL;
+		rd->visible_head = NULL;
 
 		/* re-acquire the basic rei list (repos in the dir) */
 
@@ -683,10 +683,21 @@ int
 __jg2_gitolite3_acl_check(struct jg2_ctx *ctx, struct repo_entry_info *rei,
 			  const char *acl)
 {
-	struct aclv3 *a;
-
 	__jg2_conf_ensure_acl(ctx, acl);
 
+	return __jg2_gitolite3_acl_valid(rei, acl);
+}
+
+/*
+ * must hold repodir lock... like __jg2_gitolite3_acl_check(), but only looks
+ * at what we already know, the caller must have ensured acl already
+ */
+
+int
+__jg2_gitolite3_acl_valid(struct repo_entry_info *rei, const char *acl)
+{
+	struct aclv3 *a;
+
 	a = rei->acls_valid_head;
 	while (a) {
 		if (!strcmp(acl, a->acl))
@@ -35,6 +35,9 @@ int
 __jg2_gitolite3_acl_check(struct jg2_ctx *ctx, struct repo_entry_info *rei,
 			  const char *acl);
 
+int
+__jg2_gitolite3_acl_valid(struct repo_entry_info *rei, const char *acl);
+
 int
 __jg2_conf_gitolite_admin_head(struct jg2_ctx *ctx);
 
@@ -45,3 +48,11 @@ __jg2_repodir_repo(struct jg2_repodir *rd, const char *reponame);
 
 int
 jg2_acl_check(struct jg2_ctx *ctx, const char *reponame, const char *auth);
+
+int
+jg2_acl_visible_hash(struct jg2_ctx *ctx, const char *auth,
+		     unsigned char *hash);
+
+int
+jg2_repodir_conf_hash(struct jg2_ctx *ctx, const char *reponame,
+		      unsigned char *hash);
@@ -40,6 +40,47 @@ rei_alpha_sort(lws_list_ptr a, lws_list_ptr b)
 	return strcmp((const char *)(p1 + 1), (const char *)(p2 + 1));
 }
 
+/*
+ * must have repodir lock
+ *
+ * Index the rei by name, so __jg2_repodir_repo() doesn't have to walk the
+ * list.  The table lives in rei_lwsac_head along with the rei, and is
+ * rebuilt whenever they are.  If we can't allocate it, lookups fall back to
+ * walking the list.
+ */
+
+static void
+__jg2_conf_index_repos(struct jg2_repodir *rd, unsigned int count)
+{
+	unsigned int size = 16, n;
+	struct repo_entry_info *rei;
+	lws_list_ptr lp;
+
+	while (size < count)
+		size <<= 1;
+
+	rd->rei_hash = lwsac_use(&rd->rei_lwsac_head,
+				 size * sizeof(*rd->rei_hash), 0);
+	if (!rd->rei_hash) {
+		rd->rei_hash_size = 0;
+
+		return;
+	}
+
+	memset(rd->rei_hash, 0, size * sizeof(*rd->rei_hash));
+	rd->rei_hash_size = size;
+
+	lp = rd->rei_head;
+	while (lp) {
+		rei = lp_to_rei(lp, next);
+		n = jg2_name_hash((const char *)(rei + 1)) & (size - 1);
+		rei->hash_next = rd->rei_hash[n];
+		rd->rei_hash[n] = rei;
+
+		lws_list_ptr_advance(lp);
+	}
+}
+
 /* must have repodir lock
  *
  * We create a file /tmp/_goh_rl_GITOLITE_ADMIN_HEAD_HASH that contains a list
@@ -50,9 +91,11 @@ int
 __jg2_conf_scan_repos(struct jg2_repodir *rd)
 {
 	int alen, m, ret = -1, fd = -1, f = 0;
+	unsigned int count = 0;
 	char *name, filepath[256], *p;
 	struct repo_entry_info *rei;
 	git_repository *repo;
+	struct jg2_chash ch;
 	struct dirent *de;
 	struct stat s;
 	DIR *dir;
@@ -137,7 +180,19 @@ __jg2_conf_scan_repos(struct jg2_repodir *rd)
 		/* place the config elements */
 		jg2_get_repo_config(repo, rei, p);
 
+		/*
+		 * Cache names for things in this repo need to change if the
+		 * config elements do, precompute a digest to hash into them
+		 */
+
+		jg2_chash_init(&ch, NULL, NULL);
+		jg2_chash_upd(&ch, rei->conf_len, sizeof(rei->conf_len));
+		jg2_chash_upd(&ch, p, rei->conf_len[0] + rei->conf_len[1] +
+				      rei->conf_len[2]);
+		jg2_chash_fini(&ch, rei->conf_hash);
+
 		lws_list_ptr_insert(&rd->rei_head, &rei->next, rei_alpha_sort);
+		count++;
 
 		git_repository_free(repo);
 
@@ -148,6 +203,7 @@ __jg2_conf_scan_repos(struct jg2_repodir *rd)
 
 	} while (de);
 
+	__jg2_conf_index_repos(rd, count);
 	ret = 0;
 
 bail:
@@ -115,6 +115,22 @@ email_md5(struct jg2_vhost *vh, const char *email)
 	return ne->md5;
 }
 
+/*
+ * For an email whose md5 we already know, eg, from the commit metadata, just
+ * tell the avatar hook we saw it, like email_md5() would have
+ */
+
+void
+email_md5_seen(struct jg2_vhost *vh, const unsigned char *md5)
+{
+	if (!vh->cfg.avatar)
+		return;
+
+	pthread_mutex_lock(&vh->lock); /* ======================== vhost lock */
+	vh->cfg.avatar(vh->cfg.avatar_arg, md5);
+	pthread_mutex_unlock(&vh->lock); /*--------------------- vhost unlock */
+}
+
 int
 email_vhost_init(struct jg2_vhost *vh)
 {
@@ -18,3 +18,6 @@ email_vhost_deinit(struct jg2_vhost *vhost);
 
 unsigned char * /* may return NULL on OOM */
 email_md5(struct jg2_vhost *vhost, const char *email);
+
+void
+email_md5_seen(struct jg2_vhost *vhost, const unsigned char *md5);
@@ -0,0 +1,543 @@
+/*
+ * libjsongit2 - gzip content encoding using precompressed cache entries
+ *
+ * Copyright (C) 2018-2025 Andy Green <andy@warmcat.com>
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation:
+ *  version 2.1 of the License.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ *  MA  02110-1301  USA
+ *
+ * The content of a response is a sandwich of the dynamic parts, like the
+ * HTML and the meta JSON with the timing, around the cached JSON.  So we
+ * can't just store and serve a gzipped cache entry as it is.
+ *
+ * Instead, when a cache entry is created, we also store the raw deflate of
+ * it, ending with a sync flush, as "<hash>-gz".  A response is then a single
+ * deflate stream, with the dynamic parts compressed live and sync flushed
+ * around the precompressed blocks.  The live compressor is reset after the
+ * spliced blocks, so nothing refers back across them.  The gzip crc and
+ * length for the whole thing are combined from those of the parts.
+ *
+ * The last byte of the cache entry is left out of the precompressed part, so
+ * it can be emitted live, since the spool sometimes has to change it.
+ */
+
+#include "private.h"
+
+#include <zlib.h>
+
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdio.h>
+
+#define JG2_GZ_MAGIC "JGZ1"
+
+/* at the start of a "<hash>-gz" cache entry */
+
+struct jg2_gz_hdr {
+	char magic[4];
+	uint32_t crc; /* crc32 of the raw data that was compressed */
+	uint64_t len; /* length of the raw data that was compressed */
+	char lfc[6]; /* last 6 bytes of the raw cache entry */
+	char pad[2];
+};
+
+struct jg2_gz_writer {
+	z_stream z;
+	char path[160]; /* temp file we are creating */
+	int fd;
+	uint32_t crc;
+	uint64_t len;
+	char lfc[6];
+	char held; /* the last byte we have seen, not compressed */
+	char have_held;
+};
+
+struct jg2_gz {
+	z_stream z;
+	char raw[4096];
+	unsigned char trailer[8];
+	uint32_t crc;
+	uint64_t len;
+	uint32_t mid_crc; /* precompressed part the user sends for us */
+	uint64_t mid_len;
+	int trailer_left;
+
+	unsigned int header:1;
+	unsigned int raw_done:1;
+	unsigned int splice_pending:1;
+	unsigned int spliced:1;
+	unsigned int unflushed:1;
+};
+
+/*
+ * Accept-Encoding is a list like "gzip, deflate;q=0.5, br".  We are only
+ * interested in gzip not having q=0.
+ */
+
+static int
+jg2_gz_acceptable(const char *ae)
+{
+	const char *p = ae;
+
+	while ((p = strstr(p, "gzip"))) {
+		if ((p == ae || p[-1] == ' ' || p[-1] == ',') &&
+		    (!p[4] || p[4] == ',' || p[4] == ' ' || p[4] == ';')) {
+			const char *q = p + 4;
+
+			while (*q == ' ')
+				q++;
+			if (*q != ';')
+				return 1;
+			q++;
+			while (*q == ' ')
+				q++;
+
+			return !(q[0] == 'q' && q[1] == '=' && q[2] == '0' &&
+				 (q[3] != '.' || (q[4] == '0' || !q[4])));
+		}
+		p += 4;
+	}
+
+	return 0;
+}
+
+/*
+ * The ctx wants its content gzip-encoded, if the vhost allows it and the
+ * client can accept it.  Returns 1 if so.
+ */
+
+int
+jg2_gz_ctx_init(struct jg2_ctx *ctx, const char *accept_encoding)
+{
+	struct jg2_gz *g;
+
+	if (!(ctx->vhost->cfg.flags & JG2_VHOST_GZIP) || !accept_encoding ||
+	    !jg2_gz_acceptable(accept_encoding))
+		return 0;
+
+	g = jg2_zalloc(sizeof(*g));
+	if (!g)
+		return 0;
+
+	if (deflateInit2(&g->z, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -15, 8,
+			 Z_DEFAULT_STRATEGY) != Z_OK) {
+		free(g);
+
+		return 0;
+	}
+
+	g->crc = crc32(0, NULL, 0);
+	ctx->gz = g;
+
+	return 1;
+}
+
+void
+jg2_gz_ctx_destroy(struct jg2_ctx *ctx)
+{
+	if (ctx->gz) {
+		deflateEnd(&ctx->gz->z);
+		free(ctx->gz);
+		ctx->gz = NULL;
+	}
+
+	if (ctx->fd_gz != -1) {
+		close(ctx->fd_gz);
+		ctx->fd_gz = -1;
+	}
+
+	jg2_gz_writer_abandon(ctx);
+}
+
+/*
+ * When we have a cache hit, look for the precompressed variant
+ */
+
+void
+jg2_gz_cache_open(struct jg2_ctx *ctx, const char *md5_hex)
+{
+	char name[48], path[256];
+
+	if (!ctx->gz || ctx->deco_markers ||
+	    !(ctx->flags & JG2_CTX_FLAG_FD_SPOOL))
+		return;
+
+	lws_snprintf(name, sizeof(name), "%s-gz", md5_hex);
+
+	if (lws_diskcache_query(ctx->vhost->cachedir->dcs, 1, name,
+				&ctx->fd_gz, path, sizeof(path) - 1,
+				&ctx->gz_size) != LWS_DISKCACHE_QUERY_EXISTS)
+		ctx->fd_gz = -1;
+}
+
+/*
+ * If we have the precompressed variant, set it up as the range the user
+ * should send for us.  Returns nonzero if it can't be used.
+ */
+
+int
+jg2_gz_spool(struct jg2_ctx *ctx)
+{
+	struct jg2_gz_hdr h;
+
+	if (ctx->fd_gz == -1 || ctx->existing_cache_pos || ctx->follow)
+		return 1;
+
+	if (ctx->gz_size < sizeof(h) ||
+	    pread(ctx->fd_gz, &h, sizeof(h), 0) != (ssize_t)sizeof(h) ||
+	    memcmp(h.magic, JG2_GZ_MAGIC, sizeof(h.magic))) {
+		close(ctx->fd_gz);
+		ctx->fd_gz = -1;
+
+		return 1;
+	}
+
+	ctx->gz->mid_crc = h.crc;
+	ctx->gz->mid_len = h.len;
+
+	memcpy(ctx->last_from_cache, h.lfc, sizeof(ctx->last_from_cache));
+	ctx->range_tail = h.lfc[5];
+	if (h.lfc[4] == ']' && h.lfc[5] == '}') {
+		ctx->range_tail = ' ';
+		ctx->last_from_cache[5] = ' ';
+	}
+
+	ctx->range_ofs = sizeof(h);
+	ctx->range_len = ctx->gz_size - sizeof(h);
+	ctx->existing_cache_pos = (size_t)h.len;
+
+	ctx->range_fd = ctx->fd_gz;
+	ctx->fd_gz = -1;
+	ctx->gz->splice_pending = 1;
+
+	return 0;
+}
+
+/*
+ * Gzip the content from jg2_ctx_fill_raw() into buf
+ */
+
+int
+jg2_gz_fill(struct jg2_ctx *ctx, char *buf, size_t len, size_t *used,
+	    char *outlive)
+{
+	unsigned char *out = (unsigned char *)buf, *end = out + len;
+	struct jg2_gz *g = ctx->gz;
+	int n, flush, starved = 0;
+	size_t m;
+
+	*used = 0;
+
+	if (!g->header) {
+		static const unsigned char gzh[] = {
+			0x1f, 0x8b, 8, 0, 0, 0, 0, 0, 0, 3 };
+
+		if (len < sizeof(gzh))
+			return -1;
+
+		memcpy(out, gzh, sizeof(gzh));
+		out += sizeof(gzh);
+		g->header = 1;
+	}
+
+	if (g->spliced) {
+		/* the user sent the precompressed part, account for it */
+		g->crc = crc32_combine(g->crc, g->mid_crc, (z_off_t)g->mid_len);
+		g->len += g->mid_len;
+		g->spliced = 0;
+		deflateReset(&g->z);
+	}
+
+	while (out < end) {
+
+		if (g->trailer_left) {
+			m = lws_ptr_diff(end, out);
+			if (m > (size_t)g->trailer_left)
+				m = g->trailer_left;
+			memcpy(out, g->trailer + 8 - g->trailer_left, m);
+			out += m;
+			g->trailer_left -= (int)m;
+			if (g->trailer_left)
+				break;
+
+			*used = lws_ptr_diff(out, buf);
+
+			return 1;
+		}
+
+		if (!g->z.avail_in && !g->raw_done && !g->splice_pending &&
+		    !starved) {
+			n = jg2_ctx_fill_raw(ctx, g->raw, sizeof(g->raw), &m,
+					     outlive);
+			if (n < 0)
+				return n;
+
+			g->crc = crc32(g->crc, (unsigned char *)g->raw, (uInt)m);
+			g->len += m;
+			g->z.next_in = (unsigned char *)g->raw;
+			g->z.avail_in = (uInt)m;
+			if (m)
+				g->unflushed = 1;
+
+			if (n == JG2_CTX_FILL_FD_RANGE) {
+				if (!g->splice_pending) {
+					/* not something we can splice */
+					lwsl_err("%s: unexpected range\n",
+						 __func__);
+					return -1;
+				}
+			} else
+				if (n)
+					g->raw_done = 1;
+				else
+					if (!m)
+						starved = 1;
+		}
+
+		if (starved && !g->unflushed)
+			break;
+
+		flush = Z_NO_FLUSH;
+		if (g->raw_done)
+			flush = Z_FINISH;
+		else
+			if (g->splice_pending || starved)
+				flush = Z_SYNC_FLUSH;
+
+		g->z.next_out = out;
+		g->z.avail_out = (uInt)lws_ptr_diff(end, out);
+		n = deflate(&g->z, flush);
+		if (n == Z_STREAM_ERROR)
+			return -1;
+		out = g->z.next_out;
+
+		if (n == Z_STREAM_END) {
+			g->trailer[0] = (unsigned char)g->crc;
+			g->trailer[1] = (unsigned char)(g->crc >> 8);
+			g->trailer[2] = (unsigned char)(g->crc >> 16);
+			g->trailer[3] = (unsigned char)(g->crc >> 24);
+			g->trailer[4] = (unsigned char)g->len;
+			g->trailer[5] = (unsigned char)(g->len >> 8);
+			g->trailer[6] = (unsigned char)(g->len >> 16);
+			g->trailer[7] = (unsigned char)(g->len >> 24);
+			g->trailer_left = 8;
+			continue;
+		}
+
+		if (!g->z.avail_out || g->z.avail_in || flush == Z_NO_FLUSH)
+			continue;
+
+		/* the flush completed */
+
+		g->unflushed = 0;
+
+		if (g->splice_pending) {
+			/* the user sends the precompressed part next */
+			g->splice_pending = 0;
+			g->spliced = 1;
+			*used = lws_ptr_diff(out, buf);
+
+			return JG2_CTX_FILL_FD_RANGE;
+		}
+
+		break;
+	}
+
+	*used = lws_ptr_diff(out, buf);
+
+	return 0;
+}
+
+/*
+ * Creating the precompressed variant alongside a new cache entry
+ */
+
+static int
+jg2_gz_writer_deflate(struct jg2_gz_writer *w, int flush)
+{
+	unsigned char out[4096];
+	size_t m;
+	int n;
+
+	do {
+		w->z.next_out = out;
+		w->z.avail_out = sizeof(out);
+		n = deflate(&w->z, flush);
+		if (n == Z_STREAM_ERROR)
+			return 1;
+
+		m = sizeof(out) - w->z.avail_out;
+		if (m && write(w->fd, out, m) != (ssize_t)m)
+			return 1;
+	} while (!w->z.avail_out);
+
+	return 0;
+}
+
+void
+jg2_gz_writer_start(struct jg2_ctx *ctx)
+{
+	struct jg2_gz_writer *w;
+	struct jg2_gz_hdr h;
+	const char *p;
+
+	if (!(ctx->vhost->cfg.flags & JG2_VHOST_GZIP) || ctx->deco_markers ||
+	    ctx->fd_cache == -1 || ctx->gzw)
+		return;
+
+	p = strchr(ctx->cache, '~');
+	if (!p)
+		return;
+
+	w = jg2_zalloc(sizeof(*w));
+	if (!w)
+		return;
+
+	/* "<hash>~temp" -> "<hash>-gz~temp" */
+
+	lws_snprintf(w->path, sizeof(w->path), "%.*s-gz%s",
+		     lws_ptr_diff(p, ctx->cache), ctx->cache, p);
+
+	w->fd = open(w->path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+	if (w->fd < 0) {
+		free(w);
+		return;
+	}
+
+	/* the header is filled in at the end */
+
+	memset(&h, 0, sizeof(h));
+	if (write(w->fd, &h, sizeof(h)) != (ssize_t)sizeof(h) ||
+	    deflateInit2(&w->z, Z_BEST_COMPRESSION, Z_DEFLATED, -15, 9,
+			 Z_DEFAULT_STRATEGY) != Z_OK) {
+		close(w->fd);
+		unlink(w->path);
+		free(w);
+
+		return;
+	}
+
+	w->crc = crc32(0, NULL, 0);
+	ctx->gzw = w;
+}
+
+/* the same data that went in the cache file goes in here */
+
+void
+jg2_gz_writer_write(struct jg2_ctx *ctx, const char *data, size_t len)
+{
+	struct jg2_gz_writer *w = ctx->gzw;
+	size_t m;
+
+	if (!w || !len)
+		return;
+
+	/* keep the last 6 bytes */
+
+	if (len >= sizeof(w->lfc))
+		memcpy(w->lfc, data + len - sizeof(w->lfc), sizeof(w->lfc));
+	else {
+		memmove(w->lfc, w->lfc + len, sizeof(w->lfc) - len);
+		memcpy(w->lfc + sizeof(w->lfc) - len, data, len);
+	}
+
+	/* the previous last byte wasn't the last after all */
+
+	if (w->have_held) {
+		w->z.next_in = (unsigned char *)&w->held;
+		w->z.avail_in = 1;
+		w->crc = crc32(w->crc, w->z.next_in, 1);
+		w->len++;
+		if (jg2_gz_writer_deflate(w, Z_NO_FLUSH))
+			goto bail;
+	}
+
+	m = len - 1;
+	w->z.next_in = (unsigned char *)data;
+	w->z.avail_in = (uInt)m;
+	w->crc = crc32(w->crc, w->z.next_in, (uInt)m);
+	w->len += m;
+	if (jg2_gz_writer_deflate(w, Z_NO_FLUSH))
+		goto bail;
+
+	w->held = data[m];
+	w->have_held = 1;
+
+	return;
+
+bail:
+	lwsl_notice("%s: failed, errno %d\n", __func__, errno);
+	jg2_gz_writer_abandon(ctx);
+}
+
+/* the cache entry was completed as final_name */
+
+void
+jg2_gz_writer_complete(struct jg2_ctx *ctx, const char *final_name)
+{
+	struct jg2_gz_writer *w = ctx->gzw;
+	struct jg2_gz_hdr h;
+	char name[256];
+
+	if (!w)
+		return;
+
+	if (!w->have_held || jg2_gz_writer_deflate(w, Z_SYNC_FLUSH))
+		goto bail;
+
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, JG2_GZ_MAGIC, sizeof(h.magic));
+	h.crc = w->crc;
+	h.len = w->len;
+	memcpy(h.lfc, w->lfc, sizeof(h.lfc));
+
+	if (pwrite(w->fd, &h, sizeof(h), 0) != (ssize_t)sizeof(h))
+		goto bail;
+
+	lws_snprintf(name, sizeof(name), "%s-gz", final_name);
+
+	close(w->fd);
+	w->fd = -1;
+	if (rename(w->path, name))
+		goto bail;
+
+	deflateEnd(&w->z);
+	free(w);
+	ctx->gzw = NULL;
+
+	return;
+
+bail:
+	jg2_gz_writer_abandon(ctx);
+}
+
+void
+jg2_gz_writer_abandon(struct jg2_ctx *ctx)
+{
+	struct jg2_gz_writer *w = ctx->gzw;
+
+	if (!w)
+		return;
+
+	if (w->fd != -1)
+		close(w->fd);
+	unlink(w->path);
+	deflateEnd(&w->z);
+	free(w);
+	ctx->gzw = NULL;
+}
@@ -0,0 +1,108 @@
+/*
+ * libjsongit2 - hashing for cache entry names
+ *
+ * Copyright (C) 2018-2025 Andy Green <andy@warmcat.com>
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation:
+ *  version 2.1 of the License.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ *  MA  02110-1301  USA
+ *
+ * The cache names only need to be well-distributed and not collide by
+ * accident, they're not exposed to anybody who could choose inputs to make
+ * them collide usefully.  So they don't need md5, two XXH64 lanes with
+ * different seeds are much cheaper and give us the same 128 bits.
+ */
+
+#include "../private.h"
+
+#include <string.h>
+
+#define JG2_CHASH_SEED0 0
+#define JG2_CHASH_SEED1 0x6a67326361636865ULL /* "jg2cache" */
+
+/* well-distributed hash of a NUL-terminated name, for hash tables */
+
+uint32_t
+jg2_name_hash(const char *name)
+{
+	struct jg2_xxh64 x;
+
+	jg2_xxh64_init(&x, 0);
+	jg2_xxh64_upd(&x, name, strlen(name));
+
+	return (uint32_t)jg2_xxh64_fini(&x);
+}
+
+/* nonzero if the vhost wants the old md5 cache names */
+
+int
+jg2_chash_md5(struct jg2_vhost *vh)
+{
+	return !!(vh->cfg.flags & JG2_VHOST_MD5_CACHE_KEYS);
+}
+
+/*
+ * vh may be NULL for digests that are not used as cache names directly, but
+ * get hashed into them later, those always use the fast hash
+ */
+
+void
+jg2_chash_init(struct jg2_chash *ch, struct jg2_vhost *vh,
+	       jg2_md5_context md5)
+{
+	ch->vh = vh;
+	ch->md5 = vh && jg2_chash_md5(vh) ? md5 : NULL;
+
+	if (ch->md5) {
+		vh->cfg.md5_init(ch->md5);
+		return;
+	}
+
+	jg2_xxh64_init(&ch->x[0], JG2_CHASH_SEED0);
+	jg2_xxh64_init(&ch->x[1], JG2_CHASH_SEED1);
+}
+
+void
+jg2_chash_upd(struct jg2_chash *ch, const void *in, size_t len)
+{
+	if (ch->md5) {
+		ch->vh->cfg.md5_upd(ch->md5, (const unsigned char *)in, len);
+		return;
+	}
+
+	jg2_xxh64_upd(&ch->x[0], in, len);
+	jg2_xxh64_upd(&ch->x[1], in, len);
+}
+
+/* out must have room for JG2_CHASH_LEN bytes */
+
+void
+jg2_chash_fini(struct jg2_chash *ch, unsigned char *out)
+{
+	uint64_t h;
+	int n, m;
+
+	if (ch->md5) {
+		ch->vh->cfg.md5_fini(ch->md5, out);
+		return;
+	}
+
+	for (n = 0; n < 2; n++) {
+		h = jg2_xxh64_fini(&ch->x[n]);
+		for (m = 7; m >= 0; m--) {
+			out[(n * 8) + m] = (unsigned char)h;
+			h >>= 8;
+		}
+	}
+}
@@ -0,0 +1,53 @@
+#if !defined(__JG2_HASH_PRIVATE_H__)
+#define __JG2_HASH_PRIVATE_H__
+
+/* length in bytes of the hashes naming cache entries */
+#define JG2_CHASH_LEN 16
+
+struct jg2_xxh64 {
+	uint64_t total;
+	uint64_t v[4];
+	unsigned char mem[32];
+	unsigned int memsize;
+};
+
+/*
+ * Hashing for cache names and refs hashes.  By default it's two XXH64 lanes
+ * with different seeds, giving 128 bits; with JG2_VHOST_MD5_CACHE_KEYS on the
+ * vhost, it uses the vhost md5 callbacks on md5 instead like older versions.
+ *
+ * It lives on the stack, there's nothing to allocate or free.
+ */
+
+struct jg2_chash {
+	struct jg2_vhost *vh;
+	jg2_md5_context md5; /* NULL unless using md5 */
+	struct jg2_xxh64 x[2];
+};
+
+void
+jg2_xxh64_init(struct jg2_xxh64 *x, uint64_t seed);
+
+void
+jg2_xxh64_upd(struct jg2_xxh64 *x, const void *in, size_t len);
+
+uint64_t
+jg2_xxh64_fini(const struct jg2_xxh64 *x);
+
+uint32_t
+jg2_name_hash(const char *name);
+
+int
+jg2_chash_md5(struct jg2_vhost *vh);
+
+void
+jg2_chash_init(struct jg2_chash *ch, struct jg2_vhost *vh,
+	       jg2_md5_context md5);
+
+void
+jg2_chash_upd(struct jg2_chash *ch, const void *in, size_t len);
+
+void
+jg2_chash_fini(struct jg2_chash *ch, unsigned char *out);
+
+#endif
@@ -0,0 +1,165 @@
+/*
+ * XXH64 streaming hash
+ *
+ * This implements the XXH64 algorithm from xxHash by Yann Collet,
+ * https://github.com/Cyan4973/xxHash (BSD 2-Clause), producing the same
+ * results as XXH64() there.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation:
+ *  version 2.1 of the License.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ *  MA  02110-1301  USA
+ */
+
+#include "../private.h"
+
+#include <string.h>
+
+#define P1 0x9E3779B185EBCA87ULL
+#define P2 0xC2B2AE3D27D4EB4FULL
+#define P3 0x165667B19E3779F9ULL
+#define P4 0x85EBCA77C2B2AE63ULL
+#define P5 0x27D4EB2F165667C5ULL
+
+#define ROTL64(x, r) (((x) << (r)) | ((x) >> (64 - (r))))
+
+static uint64_t
+rd64(const unsigned char *p)
+{
+	return (uint64_t)p[0] | ((uint64_t)p[1] << 8) |
+	       ((uint64_t)p[2] << 16) | ((uint64_t)p[3] << 24) |
+	       ((uint64_t)p[4] << 32) | ((uint64_t)p[5] << 40) |
+	       ((uint64_t)p[6] << 48) | ((uint64_t)p[7] << 56);
+}
+
+static uint32_t
+rd32(const unsigned char *p)
+{
+	return (uint32_t)p[0] | ((uint32_t)p[1] << 8) |
+	       ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static uint64_t
+xxh64_round(uint64_t acc, uint64_t in)
+{
+	acc += in * P2;
+	acc = ROTL64(acc, 31);
+
+	return acc * P1;
+}
+
+static uint64_t
+xxh64_merge(uint64_t acc, uint64_t v)
+{
+	acc ^= xxh64_round(0, v);
+
+	return acc * P1 + P4;
+}
+
+void
+jg2_xxh64_init(struct jg2_xxh64 *x, uint64_t seed)
+{
+	memset(x, 0, sizeof(*x));
+
+	x->v[0] = seed + P1 + P2;
+	x->v[1] = seed + P2;
+	x->v[2] = seed;
+	x->v[3] = seed - P1;
+}
+
+static void
+xxh64_stripe(struct jg2_xxh64 *x, const unsigned char *p)
+{
+	x->v[0] = xxh64_round(x->v[0], rd64(p));
+	x->v[1] = xxh64_round(x->v[1], rd64(p + 8));
+	x->v[2] = xxh64_round(x->v[2], rd64(p + 16));
+	x->v[3] = xxh64_round(x->v[3], rd64(p + 24));
+}
+
+void
+jg2_xxh64_upd(struct jg2_xxh64 *x, const void *in, size_t len)
+{
+	const unsigned char *p = (const unsigned char *)in, *end = p + len;
+
+	x->total += len;
+
+	if (x->memsize + len < sizeof(x->mem)) {
+		memcpy(x->mem + x->memsize, p, len);
+		x->memsize += (unsigned int)len;
+
+		return;
+	}
+
+	if (x->memsize) {
+		size_t n = sizeof(x->mem) - x->memsize;
+
+		memcpy(x->mem + x->memsize, p, n);
+		xxh64_stripe(x, x->mem);
+		p += n;
+		x->memsize = 0;
+	}
+
+	while (end - p >= 32) {
+		xxh64_stripe(x, p);
+		p += 32;
+	}
+
+	if (p < end) {
+		memcpy(x->mem, p, (size_t)(end - p));
+		x->memsize = (unsigned int)(end - p);
+	}
+}
+
+uint64_t
+jg2_xxh64_fini(const struct jg2_xxh64 *x)
+{
+	const unsigned char *p = x->mem, *end = p + x->memsize;
+	uint64_t h;
+
+	if (x->total >= 32) {
+		h = ROTL64(x->v[0], 1) + ROTL64(x->v[1], 7) +
+		    ROTL64(x->v[2], 12) + ROTL64(x->v[3], 18);
+		h = xxh64_merge(h, x->v[0]);
+		h = xxh64_merge(h, x->v[1]);
+		h = xxh64_merge(h, x->v[2]);
+		h = xxh64_merge(h, x->v[3]);
+	} else
+		h = x->v[2] /* the seed */ + P5;
+
+	h += x->total;
+
+	while (end - p >= 8) {
+		h ^= xxh64_round(0, rd64(p));
+		h = ROTL64(h, 27) * P1 + P4;
+		p += 8;
+	}
+
+	if (end - p >= 4) {
+		h ^= (uint64_t)rd32(p) * P1;
+		h = ROTL64(h, 23) * P2 + P3;
+		p += 4;
+	}
+
+	while (p < end) {
+		h ^= (*p++) * P5;
+		h = ROTL64(h, 11) * P1;
+	}
+
+	h ^= h >> 33;
+	h *= P2;
+	h ^= h >> 29;
+	h *= P3;
+	h ^= h >> 32;
+
+	return h;
+}
@@ -24,6 +24,28 @@
 #include <stdio.h>
 #include <string.h>
 
+/*
+ * The diff is generated one file at a time as the output buffer drains, so
+ * we only hold the patch text for the file being sent.  Files whose blobs
+ * together, or whose patch text, are bigger than this aren't shown.
+ */
+
+#define JG2_DIFF_SIZE_LIMIT_DEFAULT (16 * MIB)
+
+#if LIBGIT2_HAS_DIFF_FILE_ID
+#define diff_file_oid(f) (&(f)->id)
+#else
+#define diff_file_oid(f) (&(f)->oid)
+#endif
+
+static size_t
+diff_size_limit(struct jg2_ctx *ctx)
+{
+	return ctx->vhost->cfg.diff_size_limit ?
+			(size_t)ctx->vhost->cfg.diff_size_limit :
+			JG2_DIFF_SIZE_LIMIT_DEFAULT;
+}
+
 static int
 common_print_cb(struct jg2_ctx *ctx, int origin,
 		const char *content, size_t content_length)
@@ -31,6 +53,17 @@ common_print_cb(struct jg2_ctx *ctx, int origin,
 	unsigned int u = content_length;
 	char *p, do_pre = 0;
 
+	if (ctx->diff_len + content_length + 1 > diff_size_limit(ctx)) {
+		ctx->diff_len = diff_size_limit(ctx);
+
+		return -1;
+	}
+	ctx->diff_len += content_length + 1;
+
+	/* the client already knows which files a blobdiff is between */
+	if (ctx->blobdiff && origin == GIT_DIFF_LINE_FILE_HDR)
+		return 0;
+
         switch (origin) {
         case GIT_DIFF_LINE_CONTEXT:
         case GIT_DIFF_LINE_ADDITION:
@@ -94,20 +127,337 @@ int patch_print_cb(
 }
 #endif
 
+/*
+ * Sum of the blob sizes either side of the delta, without loading them
+ */
+
+static size_t
+diff_delta_size(struct jg2_ctx *ctx, size_t idx)
+{
+	const git_diff_delta *delta;
+	size_t len, total = 0;
+	git_otype type;
+	git_odb *odb;
+
+#if LIBGIT2_HAS_DIFF
+	delta = git_diff_get_delta(ctx->diff, idx);
+#else
+	if (git_diff_get_patch(NULL, &delta, ctx->diff, idx) < 0)
+		delta = NULL;
+#endif
+	if (!delta || git_repository_odb(&odb, ctx->jrepo->repo) < 0)
+		return 0;
+
+	if (delta->status != GIT_DELTA_ADDED &&
+	    !git_odb_read_header(&len, &type, odb,
+				 diff_file_oid(&delta->old_file)))
+		total += len;
+	if (delta->status != GIT_DELTA_DELETED &&
+	    !git_odb_read_header(&len, &type, odb,
+				 diff_file_oid(&delta->new_file)))
+		total += len;
+
+	git_odb_free(odb);
+
+	return total;
+}
+
+static void
+diff_elided(struct jg2_ctx *ctx, size_t idx, size_t size)
+{
+	const git_diff_delta *delta;
+	char line[384];
+	int n;
+
+#if LIBGIT2_HAS_DIFF
+	delta = git_diff_get_delta(ctx->diff, idx);
+#else
+	if (git_diff_get_patch(NULL, &delta, ctx->diff, idx) < 0)
+		delta = NULL;
+#endif
+	if (!delta)
+		return;
+
+	/* this note always fits, even if it's the patch text that was big */
+	ctx->diff_len = 0;
+
+	n = lws_snprintf(line, sizeof(line), "diff --git a/%s b/%s\n"
+			 "# diff not shown, too large (%llu bytes)\n",
+			 delta->old_file.path, delta->new_file.path,
+			 (unsigned long long)size);
+	common_print_cb(ctx, GIT_DIFF_LINE_FILE_HDR, line, n);
+}
+
+/*
+ * Generate the patch text for the next file in the diff that has any, into
+ * ctx->lwsac_head, and point ctx->lac at it.  ctx->lac is left NULL if there
+ * are no more files.
+ */
+
+static int
+diff_next_file(struct jg2_ctx *ctx)
+{
+#if LIBGIT2_HAS_DIFF
+	git_patch *patch;
+#else
+	git_diff_patch *patch;
+#endif
+	size_t idx, size;
+	int e;
+
+	lwsac_free(&ctx->lwsac_head);
+	ctx->lac = NULL;
+
+	while (ctx->diff && !ctx->lwsac_head &&
+	       ctx->diff_idx < git_diff_num_deltas(ctx->diff)) {
+		idx = ctx->diff_idx++;
+		ctx->diff_len = 0;
+
+		size = diff_delta_size(ctx, idx);
+		if (size > diff_size_limit(ctx)) {
+			diff_elided(ctx, idx, size);
+			continue;
+		}
+
+#if LIBGIT2_HAS_DIFF
+		e = git_patch_from_diff(&patch, ctx->diff, idx);
+#else
+		e = git_diff_get_patch(&patch, NULL, ctx->diff, idx);
+#endif
+		if (e < 0) {
+			lwsl_err("%s: patch for delta %d failed %d\n", __func__,
+				 (int)idx, e);
+			return -1;
+		}
+
+#if LIBGIT2_HAS_DIFF
+		e = git_patch_print(patch, patch_print_cb, ctx);
+		git_patch_free(patch);
+#else
+		e = git_diff_patch_print(patch, patch_print_cb, ctx);
+		git_diff_patch_free(patch);
+#endif
+		if (e < 0) {
+			if (ctx->diff_len < diff_size_limit(ctx)) {
+				lwsl_err("%s: patch print failed\n", __func__);
+				return -1;
+			}
+
+			/* the patch text was too big, just say so */
+			lwsac_free(&ctx->lwsac_head);
+			diff_elided(ctx, idx, size);
+		}
+	}
+
+	ctx->lac = ctx->lwsac_head;
+	ctx->pos = 0;
+	ctx->size = 0;
+	ctx->ofs = lwsac_sizeof(1);
+
+	return 0;
+}
+
+#if LIBGIT2_HAS_DIFF
+
+static const char diff_status[] = " ADMRCI?T";
+
+/*
+ * One entry of the diffstat file list: the paths, status and the blob oids,
+ * which is what the client needs to ask for the file's patch with a blobdiff.
+ * add and del are only emitted for "numstat".
+ */
+
+void
+diffstat_json(struct jg2_ctx *ctx, const git_diff_delta *delta, size_t add,
+	      size_t del, int bin, int large)
+{
+	char pure[256], pure1[256];
+	struct jg2_jw w;
+
+	ellipsis_purify(pure, delta->new_file.path, sizeof(pure));
+	ellipsis_purify(pure1, delta->old_file.path, sizeof(pure1));
+
+	jg2_jw_start(&w, ctx, 160 + (JG2_JW_NUM_MAX * 2) +
+			      (GIT_OID_HEXSZ * 2) + strlen(pure) +
+			      strlen(pure1));
+	jg2_jw_char(&w, ctx->subsequent ? ',' : ' ');
+	JG2_JW_LIT(&w, "\n{ \"path\": \"");
+	jg2_jw_str(&w, pure);
+	JG2_JW_LIT(&w, "\", \"old_path\": \"");
+	jg2_jw_str(&w, pure1);
+	JG2_JW_LIT(&w, "\", \"status\": \"");
+	jg2_jw_char(&w, (size_t)delta->status < sizeof(diff_status) - 1 ?
+				diff_status[delta->status] : '?');
+	jg2_jw_char(&w, '"');
+	if (ctx->numstat) {
+		JG2_JW_LIT(&w, ", \"add\": ");
+		jg2_jw_u64(&w, add);
+		JG2_JW_LIT(&w, ", \"del\": ");
+		jg2_jw_u64(&w, del);
+	}
+	JG2_JW_LIT(&w, ", \"old\": \"");
+	jg2_jw_oid(&w, diff_file_oid(&delta->old_file));
+	JG2_JW_LIT(&w, "\", \"new\": \"");
+	jg2_jw_oid(&w, diff_file_oid(&delta->new_file));
+	jg2_jw_char(&w, '"');
+	if (bin)
+		JG2_JW_LIT(&w, ", \"binary\": 1");
+	if (large)
+		JG2_JW_LIT(&w, ", \"large\": 1");
+	JG2_JW_LIT(&w, " }");
+	jg2_jw_end(&w, ctx);
+
+	ctx->subsequent = 1;
+}
+
+/*
+ * Only "numstat" counts the lines, since that means making the patch for
+ * every file in the commit.
+ */
+
+static void
+diffstat_entry(struct jg2_ctx *ctx)
+{
+	const git_diff_delta *delta;
+	size_t idx = ctx->diff_idx++, add = 0, del = 0;
+	git_patch *patch;
+	int bin = 0, large = 0;
+
+	delta = git_diff_get_delta(ctx->diff, idx);
+	if (!delta)
+		return;
+
+	if (ctx->numstat) {
+		if (diff_delta_size(ctx, idx) > diff_size_limit(ctx))
+			large = 1;
+		else
+			if (!git_patch_from_diff(&patch, ctx->diff, idx)) {
+				git_patch_line_stats(NULL, &add, &del, patch);
+				bin = !!(git_patch_get_delta(patch)->flags &
+					 GIT_DIFF_FLAG_BINARY);
+				git_patch_free(patch);
+			}
+	}
+
+	diffstat_json(ctx, delta, add, del, bin, large);
+}
+
+/*
+ * blobdiff mode: the repopath is "<old blob oid>/<new blob oid>", with an
+ * all-zeros oid for no blob on that side.  The result only depends on the
+ * two blobs, so it's cached without regard to the refs.
+ */
+
+static int
+job_blobdiff_start(struct jg2_ctx *ctx)
+{
+	const char *path = ctx->sr.e[JG2_PE_PATH];
+	git_blob *b[2] = { NULL, NULL };
+	git_patch *patch = NULL;
+	size_t size = 0;
+	int n, ret = -1;
+	git_oid oid;
+
+	if (!path || strlen(path) != (GIT_OID_HEXSZ * 2) + 1 ||
+	    path[GIT_OID_HEXSZ] != '/') {
+		lws_snprintf(ctx->status, sizeof(ctx->status),
+			     "blobdiff needs old/new blob oids");
+
+		return -1;
+	}
+
+	for (n = 0; n < 2; n++) {
+		const char *h = path + (n * (GIT_OID_HEXSZ + 1));
+
+		if (strspn(h, "0") >= GIT_OID_HEXSZ)
+			continue;
+
+		if (git_oid_fromstrn(&oid, h, GIT_OID_HEXSZ) ||
+		    git_blob_lookup(&b[n], ctx->jrepo->repo, &oid) < 0) {
+			lws_snprintf(ctx->status, sizeof(ctx->status),
+				     "no blob %.40s", h);
+			goto bail;
+		}
+
+		size += git_blob_rawsize(b[n]);
+	}
+
+	ctx->u.obj = NULL;
+	ctx->body = NULL;
+	ctx->diff = NULL;
+	ctx->diff_len = 0;
+
+	lwsac_free(&ctx->lwsac_head);
+
+	if (size <= diff_size_limit(ctx)) {
+		if (git_patch_from_blobs(&patch, b[0], NULL, b[1], NULL,
+					 NULL) < 0) {
+			lwsl_err("%s: git_patch_from_blobs failed\n", __func__);
+			goto bail;
+		}
+
+		n = git_patch_print(patch, patch_print_cb, ctx);
+		git_patch_free(patch);
+		if (n < 0 && ctx->diff_len < diff_size_limit(ctx)) {
+			lwsl_err("%s: patch print failed\n", __func__);
+			goto bail;
+		}
+	}
+
+	if (size > diff_size_limit(ctx) ||
+	    ctx->diff_len >= diff_size_limit(ctx)) {
+		char line[64];
+
+		lwsac_free(&ctx->lwsac_head);
+		ctx->diff_len = 0;
+		n = lws_snprintf(line, sizeof(line),
+				 "# diff not shown, too large (%llu bytes)\n",
+				 (unsigned long long)size);
+		common_print_cb(ctx, GIT_DIFF_LINE_HUNK_HDR, line, n);
+	}
+
+	ctx->lac = ctx->lwsac_head;
+	ctx->pos = 0;
+	ctx->size = 0;
+	ctx->ofs = lwsac_sizeof(1);
+
+	meta_header(ctx);
+	job_common_header(ctx);
+
+	CTX_BUF_APPEND("\"blobdiff\": { \"old\": \"%.40s\", "
+		       "\"new\": \"%.40s\" },\n \"diff\": \"",
+		       path, path + GIT_OID_HEXSZ + 1);
+
+	ret = 0;
+
+bail:
+	for (n = 0; n < 2; n++)
+		if (b[n])
+			git_blob_free(b[n]);
+
+	return ret;
+}
+#endif
+
 static int
 job_commit_start(struct jg2_ctx *ctx)
 {
 	git_tree *tp = NULL, *t = NULL;
 	git_commit *parent = NULL;
-#if !LIBGIT2_HAS_DIFF
-	git_diff_list *d = NULL;
-#else
-	git_diff *d = NULL;
-#endif
 	git_generic_ptr u;
 	git_oid oid;
 	int e, ret = 1;
 
+	ctx->raw_patch = !strcmp(ctx->sr.e[JG2_PE_MODE], "patch");
+#if LIBGIT2_HAS_DIFF
+	ctx->numstat = !strcmp(ctx->sr.e[JG2_PE_MODE], "numstat");
+	ctx->diffstat = ctx->numstat ||
+			!strcmp(ctx->sr.e[JG2_PE_MODE], "diffstat");
+	ctx->blobdiff = !strcmp(ctx->sr.e[JG2_PE_MODE], "blobdiff");
+	if (ctx->blobdiff)
+		return job_blobdiff_start(ctx);
+#endif
+
 	if (!ctx->hex_oid[0]) {
 		lwsl_err("%s: no oid\n", __func__);
 		return 1;
@@ -132,8 +482,6 @@ job_commit_start(struct jg2_ctx *ctx)
 		return -1;
 	}
 
-	ctx->raw_patch = !strcmp(ctx->sr.e[JG2_PE_MODE], "patch");
-
 	ctx->u = u;
 	if (!ctx->raw_patch) {
 		meta_header(ctx);
@@ -144,7 +492,8 @@ job_commit_start(struct jg2_ctx *ctx)
 
 		CTX_BUF_APPEND("\"commit\": {");
 
-		commit_summary(ctx->u.commit, ctx);
+		jg2_summary_json(ctx, git_commit_id(ctx->u.commit),
+				 ctx->u.commit);
 	} else {
 
 		/* ... for raw patch, synthesized header info */
@@ -180,41 +529,23 @@ job_commit_start(struct jg2_ctx *ctx)
 		goto bail1;
 	}
 
-	e = git_diff_tree_to_tree(&d, ctx->jrepo->repo, tp, t, NULL);
+	e = git_diff_tree_to_tree(&ctx->diff, ctx->jrepo->repo, tp, t, NULL);
 	if (e < 0) {
 		lwsl_err("%s: git_diff_tree_to_tree failed %d\n", __func__, e);
 		goto bail1;
 	}
 
-#if LIBGIT2_HAS_DIFF
-	if (git_diff_print(d, GIT_DIFF_FORMAT_PATCH, patch_print_cb, ctx) < 0)
-	{
-		lwsl_err("%s: git_diff_print failed\n", __func__);
-		goto bail;
-	}
-#else /* v0.19.0 */
-	if (git_diff_print_patch(d, patch_print_cb, ctx) < 0)
-	{
-		lwsl_err("%s: git_diff_print_patch failed\n", __func__);
-		goto bail;
-	}
-#endif
-	ctx->lac = ctx->lwsac_head;
-	ctx->pos = 0;
-	ctx->size = 0;
-	ctx->ofs = lwsac_sizeof(1);
+	ctx->diff_idx = 0;
+	ctx->subsequent = 0;
+	if (!ctx->diffstat && diff_next_file(ctx))
+		goto bail1;
 
 	if (!ctx->raw_patch && !ctx->body)
-		CTX_BUF_APPEND("},\n \"diff\": \"");
+		CTX_BUF_APPEND(ctx->diffstat ? "},\n \"files\": [" :
+					       "},\n \"diff\": \"");
 
 	ret = 0;
 
-bail:
-#if LIBGIT2_HAS_DIFF
-	git_diff_free(d);
-#else
-	git_diff_list_free(d);
-#endif
 bail1:
 	if (tp)
 		git_tree_free(tp);
@@ -238,7 +569,17 @@ job_commit_destroy(struct jg2_ctx *ctx)
 		ctx->u.commit = NULL;
 	}
 
+	if (ctx->diff) {
+#if LIBGIT2_HAS_DIFF
+		git_diff_free(ctx->diff);
+#else
+		git_diff_list_free(ctx->diff);
+#endif
+		ctx->diff = NULL;
+	}
+
 	lwsac_free(&ctx->lwsac_head);
+	ctx->lac = NULL;
 
 	ctx->job = NULL;
 }
@@ -289,7 +630,9 @@ job_commit(struct jg2_ctx *ctx)
 		if (!ctx->raw_patch && !ctx->body) {
 			CTX_BUF_APPEND("\"\n");
 
-			if (ctx->lac)
+			if (ctx->diffstat)
+				CTX_BUF_APPEND(",\n \"files\": [");
+			else if (ctx->lac)
 				CTX_BUF_APPEND(",\n \"diff\": \"");
 			else
 				CTX_BUF_APPEND("}\n");
@@ -299,6 +642,21 @@ job_commit(struct jg2_ctx *ctx)
 			CTX_BUF_APPEND("\n\n");
 	}
 
+#if LIBGIT2_HAS_DIFF
+	/* diffstat: the list of files instead of the diff */
+
+	if (ctx->diffstat) {
+		while (!ctx->body && JG2_HAS_SPACE(ctx, 1024)) {
+			if (ctx->diff_idx >= git_diff_num_deltas(ctx->diff))
+				goto ended;
+
+			diffstat_entry(ctx);
+		}
+
+		goto done;
+	}
+#endif
+
 	/*
 	 * We're going to walk the lac
 	 */
@@ -345,8 +703,11 @@ job_commit(struct jg2_ctx *ctx)
 			ctx->lac = lwsac_get_next(ctx->lac);
 			ctx->pos = 0;
 			ctx->ofs = lwsac_sizeof(0);
-			if (!ctx->lac)
-				goto ended;
+			if (!ctx->lac) {
+				/* done with this file, on to the next */
+				if (diff_next_file(ctx) || !ctx->lac)
+					goto ended;
+			}
 		}
 	}
 	if (!ctx->body && !ctx->lac)
@@ -356,7 +717,7 @@ job_commit(struct jg2_ctx *ctx)
 
 ended:
 	if (!ctx->raw_patch)
-		meta_trailer(ctx, "\"");
+		meta_trailer(ctx, ctx->diffstat ? "\n]" : "\"");
 	ctx->job = NULL;
 	ctx->final = 1;
 	ctx->body = NULL;
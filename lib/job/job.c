@@ -22,6 +22,7 @@
 #include "../private.h"
 
 #include <string.h>
+#include <ctype.h>
 #include <fcntl.h>
 #include <errno.h>
 #include <unistd.h>
@@ -30,6 +31,7 @@
 #include <sys/stat.h>
 #include <sys/time.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 
 #define lp_to_rei(p, _n) lws_list_ptr_container(p, struct repo_entry_info, _n)
 
@@ -71,12 +73,275 @@ jg2_job_naked(struct jg2_ctx *ctx)
 	return 0; /* nope */
 }
 
+/*
+ * Copy cached data from src to ctx->p, splicing the current alias list for
+ * each oid into the decoration markers.  A marker is never split across
+ * calls, we stop before it and report what we consumed from src.  at_end
+ * means src runs to the end of the cache entry, so a marker that isn't
+ * complete by then never will be.
+ */
+
+static int
+job_spool_deco(struct jg2_ctx *ctx, const char *src, int len, int left,
+	       int at_end)
+{
+	const char *s = src, *e = src + len, *m, *me;
+	char *lim = ctx->p + left;
+	git_oid oid;
+
+	while (s < e) {
+		size_t chunk;
+
+		m = jg2_deco_next(s, e, &me);
+
+		chunk = lws_ptr_diff(m ? m : e, s);
+		if (chunk > (size_t)lws_ptr_diff(lim, ctx->p))
+			chunk = lws_ptr_diff(lim, ctx->p);
+
+		memcpy(ctx->p, s, chunk);
+		ctx->p += chunk;
+		s += chunk;
+
+		if (!m || s != m)
+			break;
+
+		if (!me) {
+			if (!at_end && lws_ptr_diff(e, s) < JG2_DECO_LEN)
+				/* the rest of it comes next time */
+				break;
+
+			/* not one of ours... the control char can't go out */
+			s++;
+			continue;
+		}
+
+		if (lws_ptr_diff(lim, ctx->p) < JG2_DECO_MAX)
+			break;
+
+		if (!git_oid_fromstrn(&oid, m + 1, GIT_OID_HEXSZ))
+			jg2_json_alias_list(&oid, ctx);
+		s = me;
+	}
+
+	return lws_ptr_diff(s, src);
+}
+
+/*
+ * Spool a chunk of the cached job from the hot tier in memory, or the cache
+ * file, reading no more than rlimit from the file.  Returns the number of
+ * bytes of the cached data consumed, 0 only at the end of the cached data,
+ * JG2_SPOOL_NEED_SPACE if nothing could be consumed this time, or -1.
+ */
+
+#define JG2_SPOOL_NEED_SPACE -2
+
+static int
+job_spool_chunk(struct jg2_ctx *ctx, int left, size_t rlimit)
+{
+	char stage[2048];
+	int n, m;
+
+	if (ctx->hot) {
+		const char *src = jg2_lru_data(ctx->hot) +
+				  ctx->existing_cache_pos;
+
+		n = (int)(ctx->hot->len - ctx->existing_cache_pos);
+		if (!n)
+			return 0;
+
+		if (ctx->deco_markers) {
+			m = job_spool_deco(ctx, src, n, left, 1);
+
+			return m ? m : JG2_SPOOL_NEED_SPACE;
+		}
+
+		if (n > left)
+			n = left;
+		memcpy(ctx->p, src, n);
+		ctx->p += n;
+
+		return n;
+	}
+
+	if (!ctx->deco_markers) {
+		n = read(ctx->fd_cache, ctx->p, (size_t)left < rlimit ?
+							(size_t)left : rlimit);
+		if (n > 0)
+			ctx->p += n;
+
+		return n;
+	}
+
+	m = left < (int)sizeof(stage) ? left : (int)sizeof(stage);
+	if ((size_t)m > rlimit)
+		m = (int)rlimit;
+
+	n = read(ctx->fd_cache, stage, m);
+	if (n <= 0)
+		return n;
+
+	m = job_spool_deco(ctx, stage, n, left, ctx->existing_cache_pos +
+				(size_t)n >= ctx->existing_cache_size);
+	if (m != n && lseek(ctx->fd_cache, -(off_t)(n - m), SEEK_CUR) < 0)
+		return -1;
+
+	return m ? m : JG2_SPOOL_NEED_SPACE;
+}
+
+/*
+ * Stop following a cache entry being created, destroying its orphaned leader
+ * if we were the last one interested in it
+ */
+
+static void
+job_unfollow(struct jg2_ctx *ctx)
+{
+	struct jg2_ctx *orphan;
+
+	orphan = jg2_ongoing_unfollow(ctx->vhost->cachedir, &ctx->follow);
+	if (orphan)
+		jg2_ctx_destroy(orphan);
+}
+
+/*
+ * If the leader we're following lost its client, and nobody else is doing
+ * it, move its job on by a buffer's worth, so there's more for us to read.
+ * It's destroyed when its cache entry is finished, one way or the other.
+ */
+
+static void
+job_follow_drive(struct jg2_ctx *ctx)
+{
+	struct jg2_repodir *cd = ctx->vhost->cachedir;
+	struct jg2_ctx *orphan;
+	char buf[4096];
+	size_t used;
+	int n;
+
+	orphan = jg2_ongoing_adopt(cd, ctx->follow);
+	if (!orphan)
+		return;
+
+	n = jg2_ctx_fill(orphan, buf, sizeof(buf), &used, NULL);
+	if (!n && orphan->lead) {
+		jg2_ongoing_release(cd, ctx->follow, 0);
+
+		return;
+	}
+
+	jg2_ongoing_release(cd, ctx->follow, 1);
+	jg2_ctx_destroy(orphan);
+}
+
+/*
+ * We were following somebody else creating the same cache entry, but they
+ * failed before we sent anything.  Forget about it and do the job ourselves.
+ */
+
+static int
+job_follow_fallback(struct jg2_ctx *ctx)
+{
+	lwsl_notice("%s: leader for %s failed, doing it ourselves\n",
+		    __func__, ctx->follow->hash);
+
+	close(ctx->fd_cache);
+	ctx->fd_cache = -1;
+	job_unfollow(ctx);
+
+	ctx->job_cache_query = LWS_DISKCACHE_QUERY_NO_CACHE;
+	ctx->deco_markers = 0;
+	ctx->partway = 0;
+	ctx->job = jg2_get_job(ctx->job_type);
+
+	return ctx->job(ctx);
+}
+
+static void
+job_spool_finished(struct jg2_ctx *ctx)
+{
+	ctx->final = 1;
+	ctx->job = NULL;
+	if (ctx->fd_cache != -1) {
+		close(ctx->fd_cache);
+		ctx->fd_cache = -1;
+	}
+	if (ctx->fd_gz != -1) {
+		close(ctx->fd_gz);
+		ctx->fd_gz = -1;
+	}
+	jg2_lru_put(&ctx->hot);
+	job_unfollow(ctx);
+
+	//if (ctx->meta_last_job)
+		ctx->meta = 1;
+	meta_trailer(ctx, NULL);
+}
+
+/*
+ * If the user can send file ranges itself, and the whole of the cache entry
+ * can go on the wire as it is, we just tell jg2_ctx_fill() to hand the user
+ * the fd and range to send, instead of copying it through our buffers.
+ *
+ * Returns nonzero if it should be spooled the normal way.
+ */
+
+static int
+job_spool_range(struct jg2_ctx *ctx)
+{
+	size_t lfc = sizeof(ctx->last_from_cache);
+
+	if (!(ctx->flags & JG2_CTX_FLAG_FD_SPOOL) || ctx->existing_cache_pos ||
+	    ctx->hot || ctx->follow || ctx->deco_markers || ctx->gz ||
+	    ctx->fd_cache == -1 || ctx->existing_cache_size < lfc)
+		return 1;
+
+	if (pread(ctx->fd_cache, ctx->last_from_cache, lfc,
+		  (off_t)(ctx->existing_cache_size - lfc)) != (ssize_t)lfc)
+		return 1;
+
+	ctx->range_ofs = 0;
+	ctx->range_len = ctx->existing_cache_size;
+
+	/* the ]} hack below means we must send the last } differently */
+
+	ctx->range_tail = 0;
+	if (ctx->last_from_cache[4] == ']' && ctx->last_from_cache[5] == '}') {
+		ctx->range_tail = ' ';
+		ctx->range_len--;
+		ctx->last_from_cache[5] = ' ';
+	}
+	ctx->existing_cache_pos = ctx->range_len;
+
+	ctx->range_fd = ctx->fd_cache;
+	ctx->fd_cache = -1;
+
+	return 0;
+}
+
 int
 job_spool_from_cache(struct jg2_ctx *ctx)
 {
+	size_t rlimit = (size_t)-1, avail;
+	char *start = ctx->p;
 	int left, n;
 
-	if (ctx->fd_cache == -1)
+	if (ctx->range_fd != -1) {
+		/* the user sent the range, we just have to finish up */
+		close(ctx->range_fd);
+		ctx->range_fd = -1;
+
+		if (ctx->destroying)
+			return -1;
+
+		if (ctx->range_tail)
+			*ctx->p++ = ctx->range_tail;
+
+		job_spool_finished(ctx);
+
+		return 0;
+	}
+
+	if (ctx->fd_cache == -1 && !ctx->hot)
 		return -1;
 	// lwsl_err("%s: entry\n", __func__);
 
@@ -89,66 +354,171 @@ job_spool_from_cache(struct jg2_ctx *ctx)
 	}
 	left -= JG2_RESERVE_SEAL;
 
-	n = read(ctx->fd_cache, ctx->p, left);
+	if (ctx->follow) {
+		/*
+		 * We're tailing somebody else's temp file as they create it...
+		 * we can only read what they told us they finished writing
+		 */
+		job_follow_drive(ctx);
+
+		switch (jg2_ongoing_wait(ctx->vhost->cachedir, ctx->follow,
+					 ctx->existing_cache_pos, &avail)) {
+		case -1:
+			if (!ctx->existing_cache_pos)
+				return job_follow_fallback(ctx);
+
+			lwsl_notice("%s: leader for %s failed\n", __func__,
+				    ctx->follow->hash);
+			return -1;
+		case 0: /* it's complete */
+			ctx->existing_cache_size = avail;
+			break;
+		case 2: /* nothing new yet */
+			return 0;
+		}
+
+		rlimit = avail - ctx->existing_cache_pos;
+
+		if (!ctx->meta && !jg2_job_naked(ctx))
+			meta_header(ctx);
+	}
+
+#if defined(JG2_HAVE_ZLIB_H)
+	if (ctx->gz && !jg2_gz_spool(ctx))
+		return 0;
+#endif
+
+	if (!job_spool_range(ctx))
+		return 0;
+
+	n = job_spool_chunk(ctx, left, rlimit);
+	if (n == JG2_SPOOL_NEED_SPACE)
+		/* the next marker needs a fresh buffer, come back */
+		return 0;
+
 	if (n < 0) {
 		lwsl_err("%s: error reading from cache, errno: %d\n",
 			 __func__, errno);
-		close(ctx->fd_cache);
-		ctx->fd_cache = -1;
+		if (ctx->fd_cache != -1) {
+			close(ctx->fd_cache);
+			ctx->fd_cache = -1;
+		}
 
 		return -1;
 	}
 
-	if (n < (int)sizeof(ctx->last_from_cache)) {
-		size_t m, old = sizeof(ctx->last_from_cache) - (size_t)n;
+	/* n is what we consumed from the cache, start -> p what we emitted */
+
+	left = lws_ptr_diff(ctx->p, start);
+	if (left < (int)sizeof(ctx->last_from_cache)) {
+		size_t m, old = sizeof(ctx->last_from_cache) - (size_t)left;
 		for (m = 0; m < old; m++)
-			ctx->last_from_cache[m] = ctx->last_from_cache[old + m];
-		memcpy(ctx->last_from_cache + old, ctx->p, n);
+			ctx->last_from_cache[m] = ctx->last_from_cache[left + m];
+		memcpy(ctx->last_from_cache + old, start, left);
 	} else
-		memcpy(ctx->last_from_cache, ctx->p + (size_t)n - sizeof(ctx->last_from_cache), sizeof(ctx->last_from_cache));
+		memcpy(ctx->last_from_cache, ctx->p - sizeof(ctx->last_from_cache), sizeof(ctx->last_from_cache));
 
-	ctx->p += n;
 	ctx->existing_cache_pos += n;
 
 	if (!n || ctx->existing_cache_pos == ctx->existing_cache_size) {
-		/* finished */
-		ctx->final = 1;
-		ctx->job = NULL;
-		close(ctx->fd_cache);
-		ctx->fd_cache = -1;
-
 		if (ctx->last_from_cache[4] == ']' && ctx->last_from_cache[5] == '}') {
 			ctx->p[-1] = ' ';
 			ctx->existing_cache_pos--;
 			ctx->last_from_cache[5] = ' ';
 		}
 
-		//if (ctx->meta_last_job)
-			ctx->meta = 1;
-		meta_trailer(ctx, NULL);
+		job_spool_finished(ctx);
 	}
 
 	return 0;
 }
 
-/* requires vhost lock */
+/*
+ * A disk cache hit that's small enough gets read into the hot tier in one go,
+ * so following hits on it can be served from memory without any syscalls.
+ */
 
 static void
-__jg2_job_hash_visible_repos(struct jg2_ctx *ctx)
+job_cache_promote(struct jg2_ctx *ctx)
 {
-	struct jg2_vhost *vh = ctx->vhost;
-	lws_list_ptr lp = vh->repodir->rei_head;
+	struct jg2_lru *hot = ctx->vhost->cachedir->hot;
+	struct jg2_lru_entry *e;
+
+	e = jg2_lru_alloc(hot, ctx->job_hash, ctx->existing_cache_size);
+	if (!e)
+		return;
+
+	if (pread(ctx->fd_cache, jg2_lru_data(e), e->len, 0) != (ssize_t)e->len) {
+		free(e);
+		return;
+	}
 
-	while (lp) {
-		struct repo_entry_info *rei = lp_to_rei(lp, next);
-		char *p = (char *)(rei + 1);
+	ctx->hot = jg2_lru_add(hot, e);
+	close(ctx->fd_cache);
+	ctx->fd_cache = -1;
+}
 
-		if (!jg2_acl_check(ctx, p, ctx->acl_user))
-			vh->cfg.md5_upd(ctx->md5_ctx, (unsigned char *)p,
-					strlen(p));
+/*
+ * A job that starts from a full hex oid, rather than a ref name, produces
+ * output that is entirely determined by the immutable objects it walks...
+ * except for the ref alias decorations on the oids it mentions, which are
+ * spliced in live.  So its cache key doesn't need the repo refs hash, and
+ * its cache entries survive pushes to unrelated refs.
+ */
+
+static int
+jg2_job_oid_keyed(struct jg2_ctx *ctx, jg2_job_enum job)
+{
+	const char *hex_oid = ctx->hex_oid;
+	int n;
+
+	/* a blobdiff is keyed by its two blob oids, in the repopath */
+	if (job == JG2_JOB_COMMIT && ctx->sr.e[JG2_PE_MODE] &&
+	    !strcmp(ctx->sr.e[JG2_PE_MODE], "blobdiff"))
+		return 1;
 
-		lws_list_ptr_advance(lp);
+	switch (job) {
+	case JG2_JOB_LOG:
+	case JG2_JOB_COMMIT:
+	case JG2_JOB_PATCH:
+	case JG2_JOB_TREE:
+	case JG2_JOB_PLAIN:
+	case JG2_JOB_BLAME:
+		break;
+	default:
+		return 0;
 	}
+
+	for (n = 0; n < GIT_OID_HEXSZ; n++)
+		if (!isxdigit(hex_oid[n]))
+			return 0;
+
+	return !hex_oid[n];
+}
+
+/*
+ * pin the refs the job decorates oids with, so it sees one consistent set
+ * without locking however the refs change meanwhile, and the commit metadata
+ * it may render summaries from.  A branch tree listing also pins the
+ * branch's last commit index, so whether it has the last commits can't
+ * change between hashing and listing.  The cache hash is computed from the
+ * pinned objects too.
+ */
+
+static void
+jg2_ctx_pin(struct jg2_ctx *ctx, jg2_job_enum job)
+{
+	if (!ctx->jrepo)
+		return;
+
+	jg2_reftab_put(ctx->jrepo, &ctx->reftab);
+	ctx->reftab = jg2_reftab_get(ctx->jrepo);
+	jg2_cmeta_put(ctx->jrepo, &ctx->cmeta);
+	ctx->cmeta = jg2_cmeta_get(ctx->jrepo);
+	jg2_lastc_put(ctx->jrepo, &ctx->lastc);
+	if (job == JG2_JOB_TREE && !jg2_job_oid_keyed(ctx, job))
+		ctx->lastc = jg2_lastc_get(ctx->vhost, ctx->jrepo,
+					   ctx->hex_oid);
 }
 
 /* requires vhost lock (because it may want the jrepo refs) */
@@ -159,50 +529,71 @@ __jg2_job_compute_cache_hash(struct jg2_ctx *ctx, jg2_job_enum job, int count,
 {
 	uint16_t je = job + (JG2_JSON_EPOCH << 8);
 	uint32_t c32 = (uint32_t)count;
+	unsigned char h[JG2_CHASH_LEN];
+	struct jg2_chash ch;
 
 	/* calculate what the cache file would have been called */
 
-	ctx->vhost->cfg.md5_init(ctx->md5_ctx);
+	jg2_chash_init(&ch, ctx->vhost, ctx->md5_ctx);
 
 	/* item 1: the job + an epoch changed when libjsongit2 is updated and
 	 *         older JSON should be invalidated.  Older cache guys will
 	 *         no longer be referenced and get reaped from old age.
 	 */
-	ctx->vhost->cfg.md5_upd(ctx->md5_ctx, (unsigned char *)&je, 2);
+	jg2_chash_upd(&ch, &je, 2);
 
 	/* item 2: the low 32-bits of the count */
 	if (job != JG2_JOB_SEARCH_TRIE) {
-		ctx->vhost->cfg.md5_upd(ctx->md5_ctx, (unsigned char *)&c32, 4);
+		jg2_chash_upd(&ch, &c32, 4);
 
 		if (ctx->sr.e[JG2_PE_SEARCH])
-			ctx->vhost->cfg.md5_upd(ctx->md5_ctx,
-				(unsigned char *)ctx->sr.e[JG2_PE_SEARCH],
-				strlen(ctx->sr.e[JG2_PE_SEARCH]));
+			jg2_chash_upd(&ch, ctx->sr.e[JG2_PE_SEARCH],
+				      strlen(ctx->sr.e[JG2_PE_SEARCH]));
+
+		/* ...and where the log page starts, if not the top */
+		if (job == JG2_JOB_LOG && ctx->sr.offset) {
+			c32 = (uint32_t)ctx->sr.offset;
+			jg2_chash_upd(&ch, &c32, 4);
+		}
+
+		/* ...or the window of lines from a blob */
+		if (job == JG2_JOB_TREE && (ctx->sr.offset || ctx->sr.count)) {
+			c32 = (uint32_t)ctx->sr.offset;
+			jg2_chash_upd(&ch, &c32, 4);
+			c32 = (uint32_t)ctx->sr.count;
+			jg2_chash_upd(&ch, &c32, 4);
+		}
 	}
 
-	/* item 3: the repo refs hash (if we are affiliated with a repo) */
+	/*
+	 * item 3: the repo refs hash (if we are affiliated with a repo), unless
+	 *         the job is keyed on a full oid
+	 */
 	if (ctx->jrepo) {
-		if (job != JG2_JOB_SEARCH_TRIE)
-			ctx->vhost->cfg.md5_upd(ctx->md5_ctx,
-					   ctx->jrepo->md5_refs,
-					   sizeof(ctx->jrepo->md5_refs));
+		if (job != JG2_JOB_SEARCH_TRIE &&
+		    !jg2_job_oid_keyed(ctx, job)) {
+			/* the refs the job pinned, if it did */
+			if (ctx->reftab) {
+				jg2_reftab_digest_bytes(ctx->reftab, h);
+				jg2_chash_upd(&ch, h, sizeof(h));
+			} else
+				jg2_chash_upd(&ch, ctx->jrepo->refs_hash,
+					      sizeof(ctx->jrepo->refs_hash));
+		}
 
 	/* item 4: the repo filepath (if we are affiliated with a repo) */
-		ctx->vhost->cfg.md5_upd(ctx->md5_ctx,
-					(unsigned char *)ctx->jrepo->repo_path,
-					strlen(ctx->jrepo->repo_path));
+		jg2_chash_upd(&ch, ctx->jrepo->repo_path,
+			      strlen(ctx->jrepo->repo_path));
 
 	/* item 5: the mode we are looking for results with, if any */
 		if (ctx->sr.e[JG2_PE_MODE])
-			ctx->vhost->cfg.md5_upd(ctx->md5_ctx,
-					(unsigned char *)ctx->sr.e[JG2_PE_MODE],
-					strlen(ctx->sr.e[JG2_PE_MODE]));
+			jg2_chash_upd(&ch, ctx->sr.e[JG2_PE_MODE],
+				      strlen(ctx->sr.e[JG2_PE_MODE]));
 
 	/* item 6: the path part inside the repo, if any */
 		if (job != JG2_JOB_SEARCH_TRIE && ctx->sr.e[JG2_PE_PATH])
-			ctx->vhost->cfg.md5_upd(ctx->md5_ctx,
-					(unsigned char *)ctx->sr.e[JG2_PE_PATH],
-					strlen(ctx->sr.e[JG2_PE_PATH]));
+			jg2_chash_upd(&ch, ctx->sr.e[JG2_PE_PATH],
+				      strlen(ctx->sr.e[JG2_PE_PATH]));
 
 	/* item 7: the oid if the job could use it (and we have a repo) */
 		switch(job) {
@@ -216,8 +607,15 @@ __jg2_job_compute_cache_hash(struct jg2_ctx *ctx, jg2_job_enum job, int count,
 				char hoid[GIT_OID_HEXSZ + 1];
 
 				oid_to_hex_cstr(hoid, git_blob_id(ctx->u.blob));
-				ctx->vhost->cfg.md5_upd(ctx->md5_ctx,
-					(unsigned char *)hoid, strlen(hoid));
+				jg2_chash_upd(&ch, hoid, strlen(hoid));
+
+				/*
+				 * without the refs hash, we also need the
+				 * commit the blame is from
+				 */
+				if (jg2_job_oid_keyed(ctx, job))
+					jg2_chash_upd(&ch, ctx->hex_oid,
+						      GIT_OID_HEXSZ);
 
 				git_object_free(ctx->u.obj);
 				ctx->u.obj = NULL;
@@ -227,38 +625,26 @@ __jg2_job_compute_cache_hash(struct jg2_ctx *ctx, jg2_job_enum job, int count,
 			break;
 #endif
 		default:
-			ctx->vhost->cfg.md5_upd(ctx->md5_ctx,
-						(unsigned char *)ctx->hex_oid,
-						sizeof(ctx->hex_oid) - 1);
+			jg2_chash_upd(&ch, ctx->hex_oid,
+				      sizeof(ctx->hex_oid) - 1);
 		}
 
-	/* item 8: repo info */
+	/* item 8: repo info, digested when the repodir was scanned */
 
-		if (job != JG2_JOB_SEARCH_TRIE && ctx->sr.e[JG2_PE_NAME]) {
-			lws_list_ptr lp = ctx->vhost->repodir->rei_head;
+		if (job != JG2_JOB_SEARCH_TRIE && ctx->sr.e[JG2_PE_NAME] &&
+		    !jg2_repodir_conf_hash(ctx, ctx->sr.e[JG2_PE_NAME], h))
+			jg2_chash_upd(&ch, h, sizeof(h));
 
-			while (lp) {
-				struct repo_entry_info *rei =
-							lp_to_rei(lp, next);
-				char *p = (char *)(rei + 1);
-				size_t n = LWS_ARRAY_SIZE(rei->conf_len);
-
-				if (!strcmp(p, ctx->sr.e[JG2_PE_NAME]))
-					n = 0;
-
-				for (; n < LWS_ARRAY_SIZE(rei->conf_len); n++) {
-					if (!rei->conf_len[n])
-						continue;
-
-					ctx->vhost->cfg.md5_upd(ctx->md5_ctx,
-							(unsigned char *)p,
-							rei->conf_len[n]);
-					p += rei->conf_len[n];
-				}
+	/*
+	 * item 9: for branch tree listings, the tip the pinned last commit
+	 *	   index was made at, since the listing only has them if the
+	 *	   index caught up with the branch
+	 */
 
-				lws_list_ptr_advance(lp);
-			}
-		}
+		if (job == JG2_JOB_TREE && ctx->lastc &&
+		    jg2_lastc_tip(ctx->lastc))
+			jg2_chash_upd(&ch, jg2_lastc_tip(ctx->lastc)->id,
+				      GIT_OID_RAWSZ);
 
 	} else {
 		/*
@@ -275,20 +661,62 @@ __jg2_job_compute_cache_hash(struct jg2_ctx *ctx, jg2_job_enum job, int count,
 		 * but the gitolite config may change for unrelated reasons.
 		 *
 		 * Start by hashing in the gitolite-admin HEAD oid, since it
-		 * may also change gitweb config strings etc
+		 * may also change gitweb config strings etc.
+		 *
+		 * The visible set is only digested once per vhost acl + ctx
+		 * acl, and kept until gitolite-admin changes.
 		 */
 
-		ctx->vhost->cfg.md5_upd(ctx->md5_ctx, (unsigned char *)
-			ctx->vhost->repodir->hexoid_gitolite_conf,
+		jg2_chash_upd(&ch, ctx->vhost->repodir->hexoid_gitolite_conf,
 			sizeof(ctx->vhost->repodir->hexoid_gitolite_conf) - 1);
 
-		__jg2_job_hash_visible_repos(ctx);
+		if (!jg2_acl_visible_hash(ctx, ctx->acl_user, h))
+			jg2_chash_upd(&ch, h, sizeof(h));
 	}
 
-	ctx->vhost->cfg.md5_fini(ctx->md5_ctx, ctx->job_hash);
+	jg2_chash_fini(&ch, ctx->job_hash);
 	md5_to_hex_cstr(md5_hex33, ctx->job_hash);
 }
 
+/*
+ * Either somebody else is already creating the cache entry we missed on, and
+ * we can follow them, or if we are creating it, others can follow us.
+ *
+ * requires vhost lock
+ */
+
+static void
+__jg2_job_single_flight(struct jg2_ctx *ctx, const char *md5_hex)
+{
+	struct jg2_repodir *cd = ctx->vhost->cachedir;
+	int fd, n = 2;
+
+	while (n--) {
+		ctx->follow = jg2_ongoing_follow(cd, md5_hex, &fd);
+		if (ctx->follow) {
+			/* we don't need our own temp file then */
+			if (ctx->fd_cache != -1) {
+				close(ctx->fd_cache);
+				unlink(ctx->cache);
+			}
+			ctx->fd_cache = fd;
+			ctx->job_cache_query = LWS_DISKCACHE_QUERY_EXISTS;
+			ctx->existing_cache_size = (size_t)-1;
+
+			return;
+		}
+
+		if (ctx->job_cache_query != LWS_DISKCACHE_QUERY_CREATING)
+			return;
+
+		/* if we lost a race to lead, we try to follow once more */
+
+		ctx->lead = jg2_ongoing_lead(cd, md5_hex, ctx->cache);
+		if (ctx->lead)
+			return;
+	}
+}
+
 /**
  * jg2_ctx_set_job() - set the current "job" the context is doing
  *
@@ -312,17 +740,18 @@ static void
 jg2_ctx_set_job(struct jg2_ctx *ctx, jg2_job_enum job, const char *hex_oid,
 		int count, int flags)
 {
-	char md5_hex[(JG2_MD5_LEN * 2) + 1];
+	char md5_hex[(JG2_CHASH_LEN * 2) + 1];
 
-	if (!(flags & JG2_JOB_FLAG_CHAINED)) {
-		if (ctx->fd_cache != -1) {
-			close(ctx->fd_cache);
-			ctx->fd_cache = -1;
-		}
+	if (!(flags & JG2_JOB_FLAG_CHAINED) && !ctx->probed) {
+		jg2_cache_abandon(ctx);
+		jg2_lru_put(&ctx->hot);
+		if (ctx->follow)
+			job_unfollow(ctx);
 	}
 
 	ctx->partway = ctx->final = 0;
 	ctx->job = jg2_get_job(job);
+	ctx->job_type = job;
 
 	if (hex_oid) {
 		strncpy(ctx->hex_oid, hex_oid, sizeof(ctx->hex_oid) - 1);
@@ -340,8 +769,17 @@ jg2_ctx_set_job(struct jg2_ctx *ctx, jg2_job_enum job, const char *hex_oid,
 		 */
 		return;
 
+	/*
+	 * If jg2_ctx_cache_probe() found the entry, it already pinned the refs
+	 * it was keyed on, and those are what the entry must be spooled with
+	 */
+	if (!ctx->probed)
+		jg2_ctx_pin(ctx, job);
+
 	ctx->us_gen = 0;
 	ctx->cache_written_p = ctx->p;
+	ctx->oid_keyed = jg2_job_oid_keyed(ctx, job);
+	ctx->deco_markers = 0;
 
 	/* caching is disabled? */
 	if (!ctx->vhost->cfg.json_cache_base)
@@ -355,22 +793,61 @@ jg2_ctx_set_job(struct jg2_ctx *ctx, jg2_job_enum job, const char *hex_oid,
 	__jg2_job_compute_cache_hash(ctx, job, count, md5_hex);
 
 	ctx->existing_cache_pos = 0;
-	ctx->job_cache_query = lws_diskcache_query(ctx->vhost->cachedir->dcs,
+	ctx->vhost->cache_tries++;
+
+	/* the in-memory hot tier gets first go */
+
+	if (!ctx->probed)
+		ctx->hot = jg2_lru_get(ctx->vhost->cachedir->hot,
+				       ctx->job_hash);
+	if (ctx->hot) {
+		ctx->job_cache_query = LWS_DISKCACHE_QUERY_EXISTS;
+		ctx->existing_cache_size = ctx->hot->len;
+	} else if (ctx->probed)
+		/* jg2_ctx_cache_probe() already found it in the disk cache */
+		ctx->job_cache_query = LWS_DISKCACHE_QUERY_EXISTS;
+	else {
+		ctx->job_cache_query = lws_diskcache_query(
+				ctx->vhost->cachedir->dcs,
 				ctx->flags & JG2_CTX_FLAG_BOT, md5_hex,
 				&ctx->fd_cache, ctx->cache,
 				sizeof(ctx->cache) - 1,
 				&ctx->existing_cache_size);
 
-	if (ctx->job_cache_query == LWS_DISKCACHE_QUERY_EXISTS) {
-		ctx->job = job_spool_from_cache;
-		if (!ctx->sr.e[JG2_PE_MODE] || !jg2_job_naked(ctx)) {
-			pthread_mutex_unlock(&ctx->vhost->lock); /* vh unlock */
-			meta_header(ctx);
-
-			return;
-		}
+		if (ctx->job_cache_query != LWS_DISKCACHE_QUERY_EXISTS)
+			__jg2_job_single_flight(ctx, md5_hex);
 	}
+
+	ctx->probed = 0;
+
+	if (ctx->job_cache_query == LWS_DISKCACHE_QUERY_EXISTS)
+		ctx->vhost->cache_hits++;
+
 	pthread_mutex_unlock(&ctx->vhost->lock); /* ---- vhost unlock */
+
+	/*
+	 * JSON for oid-keyed cache entries has its alias lists bracketed, both
+	 * for creating them and for spooling them
+	 */
+	ctx->deco_markers = ctx->oid_keyed && !jg2_job_naked(ctx) &&
+			    (ctx->fd_cache != -1 || ctx->hot);
+
+#if defined(JG2_HAVE_ZLIB_H)
+	if (ctx->job_cache_query == LWS_DISKCACHE_QUERY_CREATING)
+		jg2_gz_writer_start(ctx);
+	if (ctx->job_cache_query == LWS_DISKCACHE_QUERY_EXISTS && !ctx->follow)
+		jg2_gz_cache_open(ctx, md5_hex);
+#endif
+
+	if (ctx->job_cache_query != LWS_DISKCACHE_QUERY_EXISTS)
+		return;
+
+	if (!ctx->hot && !ctx->follow)
+		job_cache_promote(ctx);
+
+	ctx->job = job_spool_from_cache;
+	if (!jg2_job_naked(ctx))
+		meta_header(ctx);
 }
 
 jg2_job
@@ -464,6 +941,36 @@ timeval_us(struct timeval *t)
 	return ((uint64_t)t->tv_sec * 1000000ull) + t->tv_usec;
 }
 
+/*
+ * If we were creating a cache entry and won't be finishing it, close and
+ * delete the temp file, letting anyone following us know.  If we were reading
+ * from the cache, just close it.
+ */
+
+void
+jg2_cache_abandon(struct jg2_ctx *ctx)
+{
+#if defined(JG2_HAVE_ZLIB_H)
+	jg2_gz_writer_abandon(ctx);
+#endif
+	if (ctx->fd_gz != -1) {
+		close(ctx->fd_gz);
+		ctx->fd_gz = -1;
+	}
+
+	if (ctx->fd_cache == -1)
+		return;
+
+	close(ctx->fd_cache);
+	ctx->fd_cache = -1;
+
+	if (ctx->lead)
+		jg2_ongoing_finish(ctx->vhost->cachedir, &ctx->lead, NULL);
+	else
+		if (ctx->job_cache_query != LWS_DISKCACHE_QUERY_EXISTS)
+			unlink(ctx->cache);
+}
+
 static void
 cache_write_complete(struct jg2_ctx *ctx)
 {
@@ -482,19 +989,79 @@ cache_write_complete(struct jg2_ctx *ctx)
 	 * fail if we lost the race... no worries, the
 	 * job still got done.  Just delete ourselves
 	 * if the rename fails.
+	 *
+	 * If we were registered as leading the creation, the ongoing api
+	 * does the rename while making sure followers are not opening it.
 	 */
 
 	p = strchr(ctx->cache, '~');
-	if (!p)
-		unlink(ctx->cache);
-	else {
+	if (!p) {
+#if defined(JG2_HAVE_ZLIB_H)
+		jg2_gz_writer_abandon(ctx);
+#endif
+		if (ctx->lead)
+			jg2_ongoing_finish(ctx->vhost->cachedir, &ctx->lead,
+					   NULL);
+		else
+			unlink(ctx->cache);
+	} else {
 		int n = lws_ptr_diff(p, ctx->cache);
 
 		memcpy(final_name, ctx->cache, n);
 		final_name[n] = '\0';
-		if (rename(ctx->cache, final_name))
-			unlink(ctx->cache);
+
+#if defined(JG2_HAVE_ZLIB_H)
+		/* the gzip variant goes first, so raw hits can find it */
+		jg2_gz_writer_complete(ctx, final_name);
+#endif
+
+		if (ctx->lead)
+			jg2_ongoing_finish(ctx->vhost->cachedir, &ctx->lead,
+					   final_name);
+		else
+			if (rename(ctx->cache, final_name))
+				unlink(ctx->cache);
+	}
+}
+
+/*
+ * Write [cache_written_p, p) to the cache file, leaving out the live alias
+ * lists inside any decoration markers.  Returns the amount written or -1.
+ */
+
+static int
+cache_write_deco(struct jg2_ctx *ctx)
+{
+	const char *s = ctx->cache_written_p, *m, *me;
+	int n = 0, count = 0, total = 0, w;
+	struct iovec iov[32];
+
+	while (s < ctx->p) {
+		m = jg2_deco_next(s, ctx->p, &me);
+		if (!m || !me) {
+			m = ctx->p;
+			me = NULL;
+		} else
+			/* keep the marker start + hex oid */
+			m += 1 + GIT_OID_HEXSZ;
+
+		iov[n].iov_base = (void *)s;
+		iov[n].iov_len = lws_ptr_diff(m, s);
+		count += iov[n++].iov_len;
+
+		/* resume at the JG2_DECO_END, if any */
+		s = me ? me - 1 : ctx->p;
+
+		if (n == LWS_ARRAY_SIZE(iov) || s == ctx->p) {
+			w = writev(ctx->fd_cache, iov, n);
+			if (w != count)
+				return -1;
+			total += w;
+			n = count = 0;
+		}
 	}
+
+	return total;
 }
 
 static void
@@ -511,13 +1078,28 @@ cache_write(struct jg2_ctx *ctx, jg2_job job_in)
 	if (ctx->cache_written_p == ctx->p)
 		return;
 
-	count = lws_ptr_diff(ctx->p, ctx->cache_written_p);
-	n = write(ctx->fd_cache, ctx->cache_written_p, count);
+	if (ctx->deco_markers) {
+		n = cache_write_deco(ctx);
+		count = n < 0 ? 0 : n;
+	} else {
+		count = lws_ptr_diff(ctx->p, ctx->cache_written_p);
+		n = write(ctx->fd_cache, ctx->cache_written_p, count);
+#if defined(JG2_HAVE_ZLIB_H)
+		if (n == count)
+			jg2_gz_writer_write(ctx, ctx->cache_written_p,
+					    (size_t)count);
+#endif
+	}
 
 	ctx->cache_written_p = ctx->p;
 
-	if (n == count)
+	if (n == count) {
+		/* let anybody following us know there's more */
+		if (ctx->lead)
+			jg2_ongoing_written(ctx->vhost->cachedir, ctx->lead, n);
+
 		return;
+	}
 
 	/*
 	 * ...if we met an error writing into it, close
@@ -528,9 +1110,7 @@ cache_write(struct jg2_ctx *ctx, jg2_job job_in)
 	lwsl_notice("%s: cache write %s, fd %d, "
 		    "failed: errno %d\n", __func__,
 		    ctx->cache, ctx->fd_cache, errno);
-	close(ctx->fd_cache);
-	ctx->fd_cache = -1;
-	unlink(ctx->cache);
+	jg2_cache_abandon(ctx);
 }
 
 void
@@ -735,6 +1315,152 @@ meta_trailer(struct jg2_ctx *ctx, const char *term)
 	ctx->started = ctx->meta = 0;
 }
 
+/*
+ * The job the ctx starts with, according to its urlpath mode
+ */
+
+struct jg2_mode_job {
+	const char *mode;
+	jg2_job_state state;
+	jg2_job_enum job;
+	int count;
+	int flags;
+};
+
+static const struct jg2_mode_job mode_jobs[] = {
+	{ "log",	EMIT_STATE_LOG,		JG2_JOB_LOG,	 50,
+							JG2_JOB_FLAG_FINAL },
+	{ "plain",	EMIT_STATE_PLAIN,	JG2_JOB_PLAIN,	  0,
+							JG2_JOB_FLAG_FINAL },
+	{ "commit",	EMIT_STATE_COMMITBODY,	JG2_JOB_COMMIT,	  0,
+							JG2_JOB_FLAG_FINAL },
+	{ "patch",	EMIT_STATE_PATCH,	JG2_JOB_PATCH,	  0,
+							JG2_JOB_FLAG_FINAL },
+#if LIBGIT2_HAS_DIFF
+	{ "diffstat",	EMIT_STATE_COMMITBODY,	JG2_JOB_COMMIT,	  0,
+							JG2_JOB_FLAG_FINAL },
+	{ "numstat",	EMIT_STATE_COMMITBODY,	JG2_JOB_COMMIT,	  0,
+							JG2_JOB_FLAG_FINAL },
+	{ "blobdiff",	EMIT_STATE_COMMITBODY,	JG2_JOB_COMMIT,	  0,
+							JG2_JOB_FLAG_FINAL },
+#endif
+	{ "tags",	EMIT_STATE_TAGS,	JG2_JOB_REFLIST,  0,
+							JG2_JOB_FLAG_FINAL },
+	{ "branches",	EMIT_STATE_BRANCHES,	JG2_JOB_REFLIST,  0,
+							JG2_JOB_FLAG_FINAL },
+	{ "tree",	EMIT_STATE_TREE,	JG2_JOB_TREE,	  0,
+							JG2_JOB_FLAG_FINAL },
+	{ "lines",	EMIT_STATE_TREE,	JG2_JOB_TREE,	  0,
+							JG2_JOB_FLAG_FINAL },
+	{ "blog",	EMIT_STATE_BLOG,	JG2_JOB_BLOG,	  0,
+							JG2_JOB_FLAG_FINAL },
+	{ "ac",		EMIT_STATE_SEARCH,	JG2_JOB_SEARCH,	  0,
+							JG2_JOB_FLAG_FINAL },
+	{ "fp",		EMIT_STATE_SEARCH,	JG2_JOB_SEARCH,	  0,
+							JG2_JOB_FLAG_FINAL },
+	{ "search",	EMIT_STATE_SEARCH,	JG2_JOB_SEARCH,	  0,
+							JG2_JOB_FLAG_FINAL },
+#if LIBGIT2_HAS_BLAME
+	{ "blame",	EMIT_STATE_TREE,	JG2_JOB_TREE,	  0,
+							JG2_JOB_FLAG_FINAL },
+#endif
+	{ "summary",	EMIT_STATE_SUMMARY,	JG2_JOB_REFLIST,  0, 0 },
+#if defined(JG2_HAVE_ARCHIVE_H)
+	{ "snapshot",	EMIT_STATE_SNAPSHOT,	JG2_JOB_SNAPSHOT, 0, 0 },
+#endif
+};
+
+static const struct jg2_mode_job mj_repolist =
+	{ NULL,		EMIT_STATE_REPOLIST,	JG2_JOB_REPOLIST, 0,
+							JG2_JOB_FLAG_FINAL },
+				 mj_tree =
+	{ NULL,		EMIT_STATE_TREE,	JG2_JOB_TREE,	  0,
+							JG2_JOB_FLAG_FINAL };
+
+static const struct jg2_mode_job *
+jg2_ctx_first_job(struct jg2_ctx *ctx)
+{
+	const char *reponame = jg2_ctx_get_path(ctx, JG2_PE_NAME, NULL, 0),
+		   *mode = jg2_ctx_get_path(ctx, JG2_PE_MODE, NULL, 0);
+	size_t n;
+
+	if (mode)
+		for (n = 0; n < LWS_ARRAY_SIZE(mode_jobs); n++)
+			if (!strcmp(mode, mode_jobs[n].mode))
+				return &mode_jobs[n];
+
+	if (!mode && (!reponame || !reponame[0]))
+		return &mj_repolist;
+
+	return &mj_tree;
+}
+
+/*
+ * Look to see if the whole response for the ctx can be spooled from the
+ * cache, without any git work.  If so, the cache entry is held for the ctx
+ * until it starts the job, so it can't go away in between.
+ *
+ * Returns 1 if so, else 0.
+ */
+
+int
+jg2_ctx_cache_probe(struct jg2_ctx *ctx)
+{
+	const struct jg2_mode_job *mj = jg2_ctx_first_job(ctx);
+	char md5_hex[(JG2_CHASH_LEN * 2) + 1], id[64];
+	const char *vid;
+
+	if (!ctx->vhost->cfg.json_cache_base || ctx->probed)
+		return ctx->probed;
+
+	/*
+	 * summary always goes on to do the log live, autocomplete is never
+	 * cached and snapshots are made on the fly.  Blame mode goes on from
+	 * the tree to the blame, whose cache hash needs the blob looked up,
+	 * which isn't for doing on the event loop.
+	 */
+
+	if (mj->state == EMIT_STATE_SUMMARY || mj->job == JG2_JOB_SNAPSHOT ||
+	    (mj->mode && (!strcmp(mj->mode, "ac") ||
+			  !strcmp(mj->mode, "blame"))))
+		return 0;
+
+	vid = jg2_ctx_get_path(ctx, JG2_PE_VIRT_ID, id, sizeof(id));
+	if (vid) {
+		strncpy(ctx->hex_oid, vid, sizeof(ctx->hex_oid) - 1);
+		ctx->hex_oid[sizeof(ctx->hex_oid) - 1] = '\0';
+	} else
+		ctx->hex_oid[0] = '\0';
+
+	/* the hash has to be for the refs an entry we find is spooled with */
+	jg2_ctx_pin(ctx, mj->job);
+
+	pthread_mutex_lock(&ctx->vhost->lock); /* =================== vh lock */
+	__jg2_job_compute_cache_hash(ctx, mj->job, mj->count, md5_hex);
+	pthread_mutex_unlock(&ctx->vhost->lock); /* ---- vhost unlock */
+
+	ctx->hot = jg2_lru_get(ctx->vhost->cachedir->hot, ctx->job_hash);
+	if (ctx->hot) {
+		ctx->existing_cache_size = ctx->hot->len;
+		ctx->probed = 1;
+
+		return 1;
+	}
+
+	/* query as a bot, so we don't start creating it if it's not there */
+
+	if (lws_diskcache_query(ctx->vhost->cachedir->dcs, 1, md5_hex,
+				&ctx->fd_cache, ctx->cache,
+				sizeof(ctx->cache) - 1,
+				&ctx->existing_cache_size) !=
+						LWS_DISKCACHE_QUERY_EXISTS)
+		return 0;
+
+	ctx->probed = 1;
+
+	return 1;
+}
+
 /*
  * This performs sequencing for delivering a sandwich of
  *
@@ -753,13 +1479,27 @@ meta_trailer(struct jg2_ctx *ctx, const char *term)
  */
 
 int
-jg2_ctx_fill(struct jg2_ctx *ctx, char *buf, size_t len, size_t *used,
-	     char *outlive)
+jg2_ctx_fd_range(struct jg2_ctx *ctx, int *fd, uint64_t *offset,
+		 uint64_t *length)
+{
+	if (ctx->range_fd == -1)
+		return 1;
+
+	*fd = ctx->range_fd;
+	*offset = ctx->range_ofs;
+	*length = ctx->range_len;
+
+	return 0;
+}
+
+int
+jg2_ctx_fill_raw(struct jg2_ctx *ctx, char *buf, size_t len, size_t *used,
+		 char *outlive)
 {
 	const char *mode, *vid, *reponame, *search;
 	size_t m = 0, left = len - 1;
 	struct timeval t2;
-	char id[64];
+	char id[64], *job_p;
 	jg2_job job_in;
 	int more;
 
@@ -833,74 +1573,12 @@ jg2_ctx_fill(struct jg2_ctx *ctx, char *buf, size_t len, size_t *used,
 	case HTML_STATE_JOB1:
 		ctx->html_state = HTML_STATE_JSON;
 
-		if (mode && !strcmp(mode, "log")) {
-			ctx->job_state = EMIT_STATE_LOG;
-			jg2_ctx_set_job(ctx, JG2_JOB_LOG, vid, 50,
-					JG2_JOB_FLAG_FINAL);
-		} else if (mode && !strcmp(mode, "plain")) {
-			ctx->job_state = EMIT_STATE_PLAIN;
-			jg2_ctx_set_job(ctx, JG2_JOB_PLAIN, vid, 0,
-						JG2_JOB_FLAG_FINAL);
-		} else if (mode && !strcmp(mode, "commit")) {
-			ctx->job_state = EMIT_STATE_COMMITBODY;
-			jg2_ctx_set_job(ctx, JG2_JOB_COMMIT,
-					vid, 0, JG2_JOB_FLAG_FINAL);
-		} else if (mode && !strcmp(mode, "patch")) {
-			ctx->job_state = EMIT_STATE_PATCH;
-			jg2_ctx_set_job(ctx, JG2_JOB_PATCH,
-					vid, 0, JG2_JOB_FLAG_FINAL);
-		} else if (mode && !strcmp(mode, "tags")) {
-			ctx->job_state = EMIT_STATE_TAGS;
-			jg2_ctx_set_job(ctx, JG2_JOB_REFLIST,
-					vid, 0, JG2_JOB_FLAG_FINAL);
-		} else if (mode && !strcmp(mode, "branches")) {
-			ctx->job_state = EMIT_STATE_BRANCHES;
-			jg2_ctx_set_job(ctx, JG2_JOB_REFLIST,
-					vid, 0, JG2_JOB_FLAG_FINAL);
-		} else if (mode && !strcmp(mode, "tree")) {
-			ctx->job_state = EMIT_STATE_TREE;
-			jg2_ctx_set_job(ctx, JG2_JOB_TREE,
-					vid, 0, JG2_JOB_FLAG_FINAL);
-		} else if (mode && !strcmp(mode, "blog")) {
-			ctx->job_state = EMIT_STATE_BLOG;
-			jg2_ctx_set_job(ctx, JG2_JOB_BLOG,
-					vid, 0, JG2_JOB_FLAG_FINAL);
-		} else if (mode && !strcmp(mode, "ac")) { /* autocomplete */
-			ctx->job_state = EMIT_STATE_SEARCH;
-			jg2_ctx_set_job(ctx, JG2_JOB_SEARCH,
-					vid, 0, JG2_JOB_FLAG_FINAL);
-		} else if (mode && !strcmp(mode, "fp")) { /* filepath */
-			ctx->job_state = EMIT_STATE_SEARCH;
-			jg2_ctx_set_job(ctx, JG2_JOB_SEARCH,
-					vid, 0, JG2_JOB_FLAG_FINAL);
-		} else if (mode && !strcmp(mode, "search")) {
-			ctx->job_state = EMIT_STATE_SEARCH;
-			jg2_ctx_set_job(ctx, JG2_JOB_SEARCH,
-					vid, 0, JG2_JOB_FLAG_FINAL);
-#if LIBGIT2_HAS_BLAME
-		} else if (mode && !strcmp(mode, "blame")) {
-			ctx->job_state = EMIT_STATE_TREE;
-			jg2_ctx_set_job(ctx, JG2_JOB_TREE,
-					vid, 0, JG2_JOB_FLAG_FINAL);
-#endif
-		} else if (mode && !strcmp(mode, "summary")) {
-			ctx->job_state = EMIT_STATE_SUMMARY;
-			jg2_ctx_set_job(ctx, JG2_JOB_REFLIST,
-					vid, 0, 0);
-#if defined(JG2_HAVE_ARCHIVE_H)
-		} else if (mode && !strcmp(mode, "snapshot")) {
-			ctx->job_state = EMIT_STATE_SNAPSHOT;
-			jg2_ctx_set_job(ctx, JG2_JOB_SNAPSHOT,
-					vid, 0, 0);
-#endif
-		} else if (!mode && (!reponame || !reponame[0])) {
-			ctx->job_state = EMIT_STATE_REPOLIST;
-			jg2_ctx_set_job(ctx, JG2_JOB_REPOLIST,
-					vid, 0, JG2_JOB_FLAG_FINAL);
-		} else {
-			ctx->job_state = EMIT_STATE_TREE;
-			jg2_ctx_set_job(ctx, JG2_JOB_TREE,
-					vid, 0, JG2_JOB_FLAG_FINAL);
+		{
+			const struct jg2_mode_job *mj = jg2_ctx_first_job(ctx);
+
+			ctx->job_state = mj->state;
+			jg2_ctx_set_job(ctx, mj->job, vid, mj->count,
+					mj->flags);
 		}
 
 		/* fallthru */
@@ -917,6 +1595,7 @@ jg2_ctx_fill(struct jg2_ctx *ctx, char *buf, size_t len, size_t *used,
 		 * compute the elapsed time accurately.
 		 */
 		job_in = ctx->job;
+		job_p = ctx->p;
 		gettimeofday(&ctx->tv_last, NULL);
 		more = jg2_ctx_get_job(ctx)(ctx);
 		gettimeofday(&t2, NULL);
@@ -946,6 +1625,22 @@ jg2_ctx_fill(struct jg2_ctx *ctx, char *buf, size_t len, size_t *used,
 
 		cache_write(ctx, job_in);
 
+		if (ctx->range_fd != -1) {
+			/* the user sends the rest of the cache entry itself */
+			*used = lws_ptr_diff(ctx->p, ctx->buf);
+
+			return JG2_CTX_FILL_FD_RANGE;
+		}
+
+		/*
+		 * The cache has what it needs from the buffer, the client
+		 * copy of oid-keyed JSON just wants the live alias lists
+		 */
+		if (ctx->deco_markers && job_in != job_spool_from_cache) {
+			ctx->p = jg2_deco_strip(job_p, ctx->p);
+			ctx->cache_written_p = ctx->p;
+		}
+
 		/*
 		 * final: 0 = still going, 1 = final, 2 = final send but stay
 		 * 					  on job state
@@ -1056,3 +1751,15 @@ jg2_ctx_fill(struct jg2_ctx *ctx, char *buf, size_t len, size_t *used,
 
 	return ctx->html_state == HTML_STATE_COMPLETED;
 }
+
+int
+jg2_ctx_fill(struct jg2_ctx *ctx, char *buf, size_t len, size_t *used,
+	     char *outlive)
+{
+#if defined(JG2_HAVE_ZLIB_H)
+	if (ctx->gz)
+		return jg2_gz_fill(ctx, buf, len, used, outlive);
+#endif
+
+	return jg2_ctx_fill_raw(ctx, buf, len, used, outlive);
+}
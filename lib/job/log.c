@@ -22,18 +22,436 @@
 #include "../private.h"
 
 #include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+/*
+ * With ?ofs=N, the log starts N commits down the first-parent chain from the
+ * requested commit.  We want to get there without inflating the N commits we
+ * skip, only the ones we emit.
+ *
+ * If the repo has a commit-graph, we walk the parents in that, stepping over
+ * any commits newer than the graph with libgit2 until we reach one it has.
+ * Failing that, our own commit metadata has the first parents too.
+ *
+ * Otherwise, for big offsets, we keep the whole first-parent chain from the
+ * tip in the cache dir as a flat array of raw oids, so skipping is one
+ * pread().  It's named by the tip oid, so it can't go stale.  Small offsets,
+ * or if there's no cache, use a first-parent revwalk, which only parses the
+ * commit headers.
+ *
+ * The skippers return 0 if oid was moved down the chain by skip commits, 1 if
+ * the chain is shorter than that, or -1 if they couldn't help.
+ */
+
+#define JG2_LOG_CGRAPH_MAX_MISS	64
+#define JG2_LOG_CHAIN_MIN_OFS	1000
+
+static int
+log_skip_cgraph(struct jg2_ctx *ctx, git_oid *oid, int skip)
+{
+	struct jg2_cgraph *g;
+	int miss = 0, n = 0;
+	uint32_t pos = 0;
+	git_commit *c;
+	git_oid o;
+
+	g = jg2_cgraph_open(git_repository_path(ctx->jrepo->repo));
+	if (!g)
+		return -1;
+
+	git_oid_cpy(&o, oid);
+
+	/* step over anything committed since the graph was written */
+
+	while (skip && jg2_cgraph_find(g, &o, &pos)) {
+		if (miss++ == JG2_LOG_CGRAPH_MAX_MISS ||
+		    git_commit_lookup(&c, ctx->jrepo->repo, &o)) {
+			n = -1;
+			goto bail;
+		}
+
+		if (!git_commit_parentcount(c)) {
+			git_commit_free(c);
+			n = 1;
+			goto bail;
+		}
+
+		git_oid_cpy(&o, git_commit_parent_id(c, 0));
+		git_commit_free(c);
+		skip--;
+	}
+
+	if (skip) {
+		while (skip--) {
+			pos = jg2_cgraph_parent(g, pos);
+			if (pos == JG2_CGRAPH_NONE) {
+				n = 1;
+				goto bail;
+			}
+		}
+		jg2_cgraph_oid(g, pos, &o);
+	}
+
+	git_oid_cpy(oid, &o);
+
+bail:
+	jg2_cgraph_close(&g);
+
+	return n;
+}
+
+static int
+log_skip_cmeta(struct jg2_ctx *ctx, git_oid *oid, int skip)
+{
+	uint32_t i, p;
+
+	if (!ctx->cmeta || jg2_cmeta_find(ctx->cmeta, oid, &i))
+		return -1;
+
+	while (skip--) {
+		p = jg2_cmeta_parent(ctx->cmeta, i);
+		if (p == JG2_CMETA_NONE)
+			return 1;
+		if (p == JG2_CMETA_UNKNOWN)
+			return -1;
+		i = p;
+	}
+
+	jg2_cmeta_oid(ctx->cmeta, i, oid);
+
+	return 0;
+}
+
+static int
+log_revwalk_new(struct jg2_ctx *ctx, git_revwalk **w, const git_oid *oid)
+{
+	if (git_revwalk_new(w, ctx->jrepo->repo))
+		return 1;
+
+	git_revwalk_sorting(*w, GIT_SORT_NONE);
+	git_revwalk_simplify_first_parent(*w);
+
+	if (git_revwalk_push(*w, oid)) {
+		git_revwalk_free(*w);
+
+		return 1;
+	}
+
+	return 0;
+}
+
+static int
+log_skip_revwalk(struct jg2_ctx *ctx, git_oid *oid, int skip)
+{
+	git_revwalk *w;
+	git_oid o;
+	int n = 0;
+
+	if (log_revwalk_new(ctx, &w, oid))
+		return -1;
+
+	/* the first one out is the tip itself */
+
+	while (skip-- >= 0)
+		if (git_revwalk_next(&o, w)) {
+			n = 1;
+			break;
+		}
+
+	git_revwalk_free(w);
+
+	if (!n)
+		git_oid_cpy(oid, &o);
+
+	return n;
+}
+
+/* write the first-parent chain from oid into fd, noting the skip'th one */
+
+static int
+log_chain_create(struct jg2_ctx *ctx, int fd, git_oid *oid, int skip)
+{
+	unsigned char buf[64 * GIT_OID_RAWSZ];
+	int n = 1, count = 0, used = 0;
+	git_revwalk *w;
+	git_oid o;
+
+	if (log_revwalk_new(ctx, &w, oid))
+		return -1;
+
+	while (!git_revwalk_next(&o, w)) {
+		if (count++ == skip) {
+			git_oid_cpy(oid, &o);
+			n = 0;
+		}
+
+		memcpy(buf + (used * GIT_OID_RAWSZ), o.id, GIT_OID_RAWSZ);
+		if (++used == (int)(sizeof(buf) / GIT_OID_RAWSZ)) {
+			if (write(fd, buf, sizeof(buf)) != (ssize_t)sizeof(buf))
+				goto bail;
+			used = 0;
+		}
+	}
+
+	if (used && write(fd, buf, (size_t)used * GIT_OID_RAWSZ) !=
+					(ssize_t)used * GIT_OID_RAWSZ)
+		goto bail;
+
+	git_revwalk_free(w);
+
+	return n;
+
+bail:
+	git_revwalk_free(w);
+
+	return -1;
+}
+
+static int
+log_skip_chain(struct jg2_ctx *ctx, git_oid *oid, int skip)
+{
+	struct jg2_repodir *cd = ctx->vhost->cachedir;
+	char name[(JG2_CHASH_LEN * 2) + 1], path[256];
+	unsigned char h[JG2_CHASH_LEN];
+	struct jg2_ongoing *lead;
+	struct jg2_chash ch;
+	size_t size;
+	int fd, n;
+
+	/*
+	 * It's a new kind of cache file with no older names to match, so it's
+	 * always named with the fast hash
+	 */
+
+	jg2_chash_init(&ch, NULL, NULL);
+	jg2_chash_upd(&ch, "fp-chain", 8);
+	jg2_chash_upd(&ch, oid->id, GIT_OID_RAWSZ);
+	jg2_chash_fini(&ch, h);
+	md5_to_hex_cstr(name, h);
+
+	n = lws_diskcache_query(cd->dcs, 0, name, &fd, path,
+				sizeof(path) - 1, &size);
+
+	if (n == LWS_DISKCACHE_QUERY_EXISTS) {
+		unsigned char raw[GIT_OID_RAWSZ];
+
+		n = 1;
+		if (pread(fd, raw, sizeof(raw), (off_t)skip * GIT_OID_RAWSZ) ==
+							(ssize_t)sizeof(raw)) {
+			git_oid_fromraw(oid, raw);
+			n = 0;
+		}
+		close(fd);
+
+		return n;
+	}
+
+	if (n != LWS_DISKCACHE_QUERY_CREATING)
+		return -1;
+
+	/* if someone else is already creating it, don't duplicate the work */
+
+	lead = jg2_ongoing_lead(cd, name, NULL);
+	if (!lead) {
+		close(fd);
+		unlink(path);
+
+		return -1;
+	}
+
+	n = log_chain_create(ctx, fd, oid, skip);
+	close(fd);
+
+	if (n < 0)
+		unlink(path);
+	else
+		lws_diskcache_finalize_name(path);
+
+	jg2_ongoing_finish(cd, &lead, NULL);
+
+	return n;
+}
+
+static int
+log_skip(struct jg2_ctx *ctx, git_oid *oid, int skip)
+{
+	int n = log_skip_cgraph(ctx, oid, skip);
+
+	if (n >= 0)
+		return n;
+
+	n = log_skip_cmeta(ctx, oid, skip);
+	if (n >= 0)
+		return n;
+
+	if (ctx->vhost->cachedir && skip >= JG2_LOG_CHAIN_MIN_OFS) {
+		n = log_skip_chain(ctx, oid, skip);
+		if (n >= 0)
+			return n;
+	}
+
+	return log_skip_revwalk(ctx, oid, skip);
+}
+
+/*
+ * With a path after the mode, like /repo/log/src/main.c, we only list the
+ * commits that changed what's at that path compared to their first parent.
+ *
+ * If the commit-graph has changed-path Bloom filters, most commits can be
+ * passed over from the graph alone.  For the others, we look up the path in
+ * the commit's tree and its parent's tree and compare the entries, which only
+ * reads the trees along the path.  The parent's entry is kept for the next
+ * step, since it's the next commit's own entry.
+ *
+ * Each page looks at most JG2_LOG_PATH_MAX_SCAN commits, if the path didn't
+ * change in them, the page just ends early with a "next" to carry on from.
+ */
+
+#define JG2_LOG_PATH_MAX_SCAN	10000
+
+static int
+log_path_entry(struct jg2_ctx *ctx, git_commit *c, git_oid *oid,
+	       unsigned int *mode)
+{
+	git_tree_entry *te;
+	git_tree *t;
+	int n;
+
+	if (git_commit_tree(&t, c))
+		return -1;
+
+	n = git_tree_entry_bypath(&te, t, ctx->log_path);
+	git_tree_free(t);
+	if (n == GIT_ENOTFOUND)
+		return 0;
+	if (n)
+		return -1;
+
+	git_oid_cpy(oid, git_tree_entry_id(te));
+	*mode = (unsigned int)git_tree_entry_filemode(te);
+	git_tree_entry_free(te);
+
+	return 1;
+}
+
+/*
+ * Looks at ctx->log_oid and moves it on to its first parent, or clears
+ * ctx->log_more if it was a root commit.  Returns 1 with the commit in *pc
+ * if it changed the path, 0 if not, or -1 on error.
+ */
+
+static int
+log_path_step(struct jg2_ctx *ctx, git_commit **pc)
+{
+	unsigned int pmode = 0;
+	int state, pstate, n;
+	git_commit *c, *p;
+	uint32_t pos, pp;
+	git_oid eoid;
+
+	*pc = NULL;
+
+	if (ctx->cgraph && !jg2_cgraph_find(ctx->cgraph, &ctx->log_oid, &pos)) {
+		pp = jg2_cgraph_parent(ctx->cgraph, pos);
+		if (pp != JG2_CGRAPH_NONE &&
+		    !jg2_cgraph_maybe_changed(ctx->cgraph, pos, ctx->log_path,
+					      ctx->log_path_len)) {
+			/* any entry we have is also the parent's entry */
+			jg2_cgraph_oid(ctx->cgraph, pp, &ctx->log_oid);
+
+			return 0;
+		}
+	}
+
+	if (git_commit_lookup(&c, ctx->jrepo->repo, &ctx->log_oid)) {
+		ctx->log_more = 0;
+
+		return -1;
+	}
+
+	state = ctx->log_entry_state;
+	if (state < 0) {
+		state = log_path_entry(ctx, c, &ctx->log_entry,
+				       &ctx->log_entry_mode);
+		if (state < 0)
+			goto bail;
+	}
+
+	if (!git_commit_parentcount(c)) {
+		/* the root commit created the path, if it has it */
+		ctx->log_more = 0;
+		n = state;
+		goto done;
+	}
+
+	git_oid_cpy(&ctx->log_oid, git_commit_parent_id(c, 0));
+
+	if (git_commit_lookup(&p, ctx->jrepo->repo, &ctx->log_oid))
+		goto bail;
+	pstate = log_path_entry(ctx, p, &eoid, &pmode);
+	git_commit_free(p);
+	if (pstate < 0)
+		goto bail;
+
+	n = state != pstate || (state && (pmode != ctx->log_entry_mode ||
+				git_oid_cmp(&eoid, &ctx->log_entry)));
+
+	ctx->log_entry_state = pstate;
+	if (pstate) {
+		git_oid_cpy(&ctx->log_entry, &eoid);
+		ctx->log_entry_mode = pmode;
+	}
+
+done:
+	if (n)
+		*pc = c;
+	else
+		git_commit_free(c);
+
+	return n;
+
+bail:
+	ctx->log_more = 0;
+	git_commit_free(c);
+
+	return -1;
+}
 
 static int
 job_log_start(struct jg2_ctx *ctx)
 {
+	const char *path = ctx->sr.e[JG2_PE_PATH];
 	git_generic_ptr u;
 	git_oid oid;
 	int error;
 
+	ctx->log_path_len = 0;
+	if (path) {
+		while (*path == '/')
+			path++;
+		lws_strncpy(ctx->log_path, path, sizeof(ctx->log_path));
+		ctx->log_path_len = strlen(ctx->log_path);
+		while (ctx->log_path_len &&
+		       ctx->log_path[ctx->log_path_len - 1] == '/')
+			ctx->log_path[--ctx->log_path_len] = '\0';
+	}
+
 	error = jg2_oid_lookup(ctx->jrepo->repo, &oid, ctx->hex_oid);
 	if (error)
 		return error;
 
+	u.obj = NULL;
+
+	if (ctx->sr.offset > 0) {
+		error = log_skip(ctx, &oid, ctx->sr.offset);
+		if (error < 0)
+			return -1;
+		if (error)
+			/* the offset is past the start of history */
+			goto empty;
+	}
+
 	error = git_object_lookup(&u.obj, ctx->jrepo->repo, &oid, GIT_OBJ_ANY);
 	if (error < 0)
 		return -1;
@@ -44,7 +462,24 @@ job_log_start(struct jg2_ctx *ctx)
 		return -1;
 	}
 
-	ctx->u = u;
+empty:
+	/* we walk ctx->log_oid from here */
+
+	ctx->log_more = 0;
+	if (u.obj) {
+		git_oid_cpy(&ctx->log_oid, &oid);
+		git_object_free(u.obj);
+		ctx->log_more = 1;
+	}
+	ctx->u.obj = NULL;
+	ctx->log_scanned = 0;
+
+	if (ctx->log_path_len) {
+		ctx->log_entry_state = -1;
+		ctx->cgraph = jg2_cgraph_open(
+				git_repository_path(ctx->jrepo->repo));
+	}
+
 	meta_header(ctx);
 
 	job_common_header(ctx);
@@ -58,16 +493,89 @@ job_log_start(struct jg2_ctx *ctx)
 static void
 job_log_destroy(struct jg2_ctx *ctx)
 {
-	if (ctx->u.commit) {
-		git_commit_free(ctx->u.commit);
-		ctx->u.commit = NULL;
-	}
+	if (ctx->cgraph)
+		jg2_cgraph_close(&ctx->cgraph);
 	ctx->job = NULL;
 }
 
+/* c may be NULL, then the summary comes from the cache or is looked up */
+
+int
+job_log_entry(struct jg2_ctx *ctx, const git_oid *oid, git_commit *c)
+{
+	struct jg2_jw w;
+	int r;
+
+	jg2_jw_start(&w, ctx, 16);
+	jg2_jw_char(&w, ctx->subsequent ? ',' : ' ');
+	JG2_JW_LIT(&w, "\n{ \"name\": ");
+	jg2_jw_end(&w, ctx);
+
+	ctx->subsequent = 1;
+
+	jg2_json_oid(oid, ctx);
+
+	jg2_jw_start(&w, ctx, 16);
+	JG2_JW_LIT(&w, ",\n\"summary\": {\n");
+	jg2_jw_end(&w, ctx);
+
+	r = jg2_summary_json(ctx, oid, c);
+
+	jg2_jw_start(&w, ctx, 2);
+	JG2_JW_LIT(&w, "}}");
+	jg2_jw_end(&w, ctx);
+
+	return r ? -1 : 0;
+}
+
+/*
+ * Emits ctx->log_oid and moves it on to its first parent, from the commit
+ * metadata if it has it, without touching the odb.
+ */
+
+static int
+log_plain_step(struct jg2_ctx *ctx)
+{
+	git_commit *c;
+	uint32_t i, p;
+
+	if (ctx->cmeta && !jg2_cmeta_find(ctx->cmeta, &ctx->log_oid, &i)) {
+		p = jg2_cmeta_parent(ctx->cmeta, i);
+		if (p != JG2_CMETA_UNKNOWN) {
+			if (job_log_entry(ctx, &ctx->log_oid, NULL) ||
+			    p == JG2_CMETA_NONE)
+				ctx->log_more = 0;
+			else
+				jg2_cmeta_oid(ctx->cmeta, p, &ctx->log_oid);
+
+			return 0;
+		}
+	}
+
+	if (git_commit_lookup(&c, ctx->jrepo->repo, &ctx->log_oid)) {
+		ctx->log_more = 0;
+
+		return -1;
+	}
+
+	job_log_entry(ctx, git_commit_id(c), c);
+
+	if (git_commit_parentcount(c))
+		git_oid_cpy(&ctx->log_oid, git_commit_parent_id(c, 0));
+	else
+		ctx->log_more = 0;
+
+	git_commit_free(c);
+
+	return 0;
+}
+
 int
 job_log(struct jg2_ctx *ctx)
 {
+	git_commit *c;
+	int n;
+
 	if (ctx->destroying) {
 		job_log_destroy(ctx);
 
@@ -80,20 +588,14 @@ job_log(struct jg2_ctx *ctx)
 	}
 
 	while (JG2_HAS_SPACE(ctx, 768)) {
-		git_commit *c;
 
-		if (!ctx->u.obj || !ctx->count) {
+		if (!ctx->log_more || !ctx->count ||
+		    ctx->log_scanned == JG2_LOG_PATH_MAX_SCAN) {
 			CTX_BUF_APPEND("\n]");
 
-			if (ctx->u.obj) {
-				git_commit_parent(&c, ctx->u.commit, 0);
-				if (c) {
-					CTX_BUF_APPEND(", \"next\": ");
-
-					jg2_json_oid(git_commit_id(c), ctx);
-
-					git_commit_free(c);
-				}
+			if (ctx->log_more) {
+				CTX_BUF_APPEND(", \"next\": ");
+				jg2_json_oid(&ctx->log_oid, ctx);
 			}
 
 			meta_trailer(ctx, "");
@@ -101,24 +603,22 @@ job_log(struct jg2_ctx *ctx)
 			return 0;
 		}
 
-		CTX_BUF_APPEND("%c\n{ \"name\": ",
-			       ctx->subsequent ? ',' : ' ');
+		if (!ctx->log_path_len) {
+			if (log_plain_step(ctx))
+				lwsl_err("%s: unable to follow %s\n", __func__,
+					 ctx->hex_oid);
+		} else {
+			ctx->log_scanned++;
+			n = log_path_step(ctx, &c);
+			if (n < 0)
+				lwsl_err("%s: unable to follow %s\n", __func__,
+					 ctx->log_path);
+			if (n <= 0)
+				continue;
 
-		ctx->subsequent = 1;
-
-		jg2_json_oid(git_commit_id(ctx->u.commit), ctx);
-
-		CTX_BUF_APPEND(",\n"
-				"\"summary\": {\n");
-
-		commit_summary(ctx->u.commit, ctx);
-
-		CTX_BUF_APPEND("}}");
-
-		c = NULL;
-		git_commit_parent(&c, ctx->u.commit, 0);
-		git_commit_free(ctx->u.commit);
-		ctx->u.commit = c;
+			job_log_entry(ctx, git_commit_id(c), c);
+			git_commit_free(c);
+		}
 
 		if (ctx->count)
 			ctx->count--;
@@ -125,6 +125,21 @@ jg2_rei_string(const struct repo_entry_info *rei, enum rei_string_index n);
 int
 job_search_check_indexed(struct jg2_ctx *ctx, uint32_t *files, uint32_t *done);
 
+/* single records of the job JSON, also used by examples/bench/jw.c */
+
+int
+job_log_entry(struct jg2_ctx *ctx, const git_oid *oid, git_commit *c);
+
+void
+tree_entry_json(struct jg2_ctx *ctx, int first, const char *name,
+		unsigned int mode, uint64_t size, const git_oid *lastc);
+
+#if LIBGIT2_HAS_DIFF
+void
+diffstat_json(struct jg2_ctx *ctx, const git_diff_delta *delta, size_t add,
+	      size_t del, int bin, int large);
+#endif
+
 /* jobs */
 
 int
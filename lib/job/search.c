@@ -35,32 +35,12 @@
 static void
 remove_ongoing(struct jg2_ctx *ctx)
 {
-	struct ongoing_index **pon;
-	int n = ctx->destroying;
-
 	if (!ctx->ongoing)
 		return;
 
-	/*
-	 * on the ctx->destroying / __jg2_ctx_destroy() path, the vh lock
-	 * is already held
-	 */
+	/* the indexing is over one way or another, nothing to rename */
 
-	if (!n)
-		pthread_mutex_lock(&ctx->vhost->lock); /* ======== vhost lock */
-	pon = &ctx->jrepo->indexing_list;
-	while (*pon) {
-		if (*pon == ctx->ongoing) {
-			*pon = ctx->ongoing->next;
-			lwsl_err("---------- ongoing free %p\n", ctx->ongoing);
-			ctx->ongoing = NULL;
-			free(ctx->ongoing);
-			break;
-		}
-		pon = &(*pon)->next;
-	}
-	if (!n)
-		pthread_mutex_unlock(&ctx->vhost->lock); /* ---- vhost unlock */
+	jg2_ongoing_finish(ctx->vhost->cachedir, &ctx->ongoing, NULL);
 }
 
 static void
@@ -136,7 +116,6 @@ struct wl whitelist[] = {
 int
 job_search_check_indexed(struct jg2_ctx *ctx, uint32_t *files, uint32_t *done)
 {
-	struct ongoing_index *ongoing = NULL;
 	char hex[33], path[256];
 	int fd, n;
 
@@ -149,16 +128,7 @@ job_search_check_indexed(struct jg2_ctx *ctx, uint32_t *files, uint32_t *done)
 
 	pthread_mutex_lock(&ctx->vhost->lock); /* ================ vhost lock */
 	__jg2_job_compute_cache_hash(ctx, JG2_JOB_SEARCH_TRIE, 1, hex);
-	ongoing = ctx->jrepo->indexing_list;
-	while (ongoing) {
-		if (!strcmp(hex, ongoing->hash)) {
-			*files = ongoing->index_files_to_do;
-			*done = ongoing->index_files_done;
-			break;
-		}
-		ongoing = ongoing->next;
-	}
-	if (!ongoing) {
+	if (jg2_ongoing_progress(ctx->vhost->cachedir, hex, files, done)) {
 		ctx->existing_cache_pos = 0;
 		n = lws_diskcache_query(ctx->vhost->cachedir->dcs,
 					JG2_CTX_FLAG_BOT, hex, &fd,
@@ -179,9 +149,9 @@ job_search_check_indexed(struct jg2_ctx *ctx, uint32_t *files, uint32_t *done)
 static int
 job_search_start(struct jg2_ctx *ctx)
 {
-	struct ongoing_index *ongoing = NULL;
 	const git_tree_entry *te;
 	char pure[256], hex[33];
+	uint32_t files, done;
 	git_generic_ptr u;
 	git_commit *c;
 	struct wl *w;
@@ -203,13 +173,7 @@ job_search_start(struct jg2_ctx *ctx)
 
 	pthread_mutex_lock(&ctx->vhost->lock); /* ================ vhost lock */
 	__jg2_job_compute_cache_hash(ctx, JG2_JOB_SEARCH_TRIE, 1, hex);
-	ongoing = ctx->jrepo->indexing_list;
-	while (ongoing) {
-		if (!strcmp(hex, ongoing->hash))
-			break;
-		ongoing = ongoing->next;
-	}
-	if (!ongoing) {
+	if (jg2_ongoing_progress(ctx->vhost->cachedir, hex, &files, &done)) {
 		ctx->existing_cache_pos = 0;
 
 		/*
@@ -225,19 +189,15 @@ job_search_start(struct jg2_ctx *ctx)
 		n = LWS_DISKCACHE_QUERY_ONGOING;
 
 	if (n == LWS_DISKCACHE_QUERY_CREATING) {
-		ongoing = malloc(sizeof(*ongoing));
-		lwsl_err("---------- ongoing alloc %p\n", ongoing);
-		if (ongoing) {
-			ongoing->started = time(NULL);
-			strcpy(ongoing->hash, hex);
-			ongoing->index_files_to_do = 0;
-			ongoing->index_files_done = 0;
-
-			ongoing->next = ctx->jrepo->indexing_list;
-			ctx->jrepo->indexing_list = ongoing;
-
-			ctx->ongoing = ongoing;
-
+		/*
+		 * The trie file is not something anyone can follow, we just
+		 * register so others can see it's being indexed, and how far
+		 * along we are
+		 */
+		ctx->ongoing = jg2_ongoing_lead(ctx->vhost->cachedir, hex,
+						NULL);
+		lwsl_err("---------- ongoing alloc %p\n", ctx->ongoing);
+		if (ctx->ongoing) {
 			/*
 			 * mark our task as wanting to continue independent
 			 * of the lifetime of the initial wsi
@@ -263,11 +223,18 @@ job_search_start(struct jg2_ctx *ctx)
 			 * it (this is not the cached index file... this is the
 			 * cached query response, currently "ongoing")
 			 */
-			close(ctx->fd_cache);
-			ctx->fd_cache = -1;
-			unlink(ctx->cache);
+			jg2_cache_abandon(ctx);
 
 			CTX_BUF_APPEND("{\"creating\":[");
+		} else {
+			/*
+			 * somebody else got in first (or OOM)... leave the
+			 * indexing to them
+			 */
+			close(ctx->trie_fd);
+			ctx->trie_fd = -1;
+			unlink(ctx->trie_filepath);
+			n = LWS_DISKCACHE_QUERY_ONGOING;
 		}
 	}
 
@@ -279,10 +246,6 @@ job_search_start(struct jg2_ctx *ctx)
 	 */
 
 	if (n == LWS_DISKCACHE_QUERY_ONGOING) {
-		if (!ongoing) {
-			lwsl_err("oom\n");
-			return -1;
-		}
 		ctx->indexing = 0;
 		ctx->index_open_ro = 0;
 		ctx->ac = 0;
@@ -304,9 +267,7 @@ job_search_start(struct jg2_ctx *ctx)
 		 * it (this is not the cached index file... this is the
 		 * cached query response, currently "ongoing")
 		 */
-		close(ctx->fd_cache);
-		ctx->fd_cache = -1;
-		unlink(ctx->cache);
+		jg2_cache_abandon(ctx);
 
 		CTX_BUF_APPEND("{\"ongoing\":[");
 
@@ -487,8 +448,8 @@ job_search_start(struct jg2_ctx *ctx)
 			if (!w->suff)
 				continue;
 
-			if (ongoing) /* coverity */
-				ongoing->index_files_to_do++;
+			if (ctx->ongoing) /* coverity */
+				ctx->ongoing->index_files_to_do++;
 			break;
 
 		default:
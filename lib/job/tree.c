@@ -23,6 +23,8 @@
 
 #include <stdio.h>
 #include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
 
 #define lp_to_te(p, _n) lws_list_ptr_container(p, struct tree_entry_info, _n)
 
@@ -39,6 +41,420 @@ tei_alpha_sort(lws_list_ptr a, lws_list_ptr b)
 	return strcmp((const char *)(p1 + 1), (const char *)(p2 + 1));
 }
 
+/*
+ * Listing a dir shows the size of each blob in it.  We get those from the
+ * object headers rather than loading the blobs, and since a tree is
+ * immutable, we also keep the sizes for its entries, in entry order as
+ * u64be, in the hot tier and the disk cache named by the tree oid.  Later
+ * listings of the same tree just use that.
+ */
+
+struct tree_walk {
+	struct jg2_ctx *ctx;
+	git_odb *odb;
+	const uint8_t *have; /* the sizes from the cache, or NULL */
+	uint8_t *make; /* the sizes we're collecting for the cache, or NULL */
+	size_t count;
+	size_t idx;
+
+	const struct jg2_lastc *lastc; /* if it's up to date with the listing */
+	char path[256]; /* the dir path, then the entry name */
+	size_t plen;
+};
+
+static void
+tree_sizes_name(const git_oid *oid, unsigned char *h)
+{
+	struct jg2_chash ch;
+
+	/* a new kind of cache file, always named with the fast hash */
+
+	jg2_chash_init(&ch, NULL, NULL);
+	jg2_chash_upd(&ch, "tree-sizes", 10);
+	jg2_chash_upd(&ch, oid->id, GIT_OID_RAWSZ);
+	jg2_chash_fini(&ch, h);
+}
+
+static void
+side_cache_hot(struct jg2_repodir *cd, const unsigned char *h,
+	       const uint8_t *data, size_t len)
+{
+	struct jg2_lru_entry *e = jg2_lru_alloc(cd->hot, h, len);
+
+	if (!e)
+		return;
+
+	memcpy(jg2_lru_data(e), data, len);
+	e = jg2_lru_add(cd->hot, e);
+	jg2_lru_put(&e);
+}
+
+/*
+ * Find the sizes for the tree in the hot tier or the disk cache.  If they
+ * aren't there, we have a go at making them as we walk the tree, with *fd
+ * open on the cache file to write them into after.
+ */
+
+static struct jg2_lru_entry *
+tree_sizes_get(struct jg2_ctx *ctx, struct tree_walk *tw, const git_oid *oid,
+	       int *fd, char *path, size_t path_len, struct jg2_ongoing **lead)
+{
+	struct jg2_repodir *cd = ctx->vhost->cachedir;
+	char name[(JG2_CHASH_LEN * 2) + 1];
+	unsigned char h[JG2_CHASH_LEN];
+	size_t len = tw->count * 8, size;
+	struct jg2_lru_entry *e;
+	uint8_t *sizes;
+	int n;
+
+	*fd = -1;
+	*lead = NULL;
+
+	if (!cd || !len)
+		return NULL;
+
+	tree_sizes_name(oid, h);
+
+	e = jg2_lru_get(cd->hot, h);
+	if (e) {
+		if (e->len == len) {
+			tw->have = (const uint8_t *)jg2_lru_data(e);
+
+			return e;
+		}
+		jg2_lru_put(&e);
+	}
+
+	md5_to_hex_cstr(name, h);
+
+	n = lws_diskcache_query(cd->dcs, 0, name, fd, path, path_len, &size);
+	if (n == LWS_DISKCACHE_QUERY_EXISTS) {
+		sizes = size == len ? malloc(len) : NULL;
+		if (sizes && read(*fd, sizes, len) == (ssize_t)len)
+			side_cache_hot(cd, h, sizes, len);
+		free(sizes);
+		close(*fd);
+		*fd = -1;
+
+		/* it's in the hot tier now, unless it was too big */
+
+		e = jg2_lru_get(cd->hot, h);
+		if (e)
+			tw->have = (const uint8_t *)jg2_lru_data(e);
+
+		return e;
+	}
+
+	if (n != LWS_DISKCACHE_QUERY_CREATING) {
+		*fd = -1;
+
+		return NULL;
+	}
+
+	/* if someone else is already creating it, don't duplicate the work */
+
+	*lead = jg2_ongoing_lead(cd, name, NULL);
+	tw->make = *lead ? malloc(len) : NULL;
+	if (!tw->make) {
+		if (*lead)
+			jg2_ongoing_finish(cd, lead, NULL);
+		close(*fd);
+		*fd = -1;
+		unlink(path);
+	}
+
+	return NULL;
+}
+
+static void
+tree_sizes_store(struct jg2_ctx *ctx, struct tree_walk *tw, const git_oid *oid,
+		 int fd, const char *path, struct jg2_ongoing **lead, int ok)
+{
+	struct jg2_repodir *cd = ctx->vhost->cachedir;
+	size_t len = tw->count * 8;
+	unsigned char h[JG2_CHASH_LEN];
+
+	if (ok && tw->idx == tw->count &&
+	    write(fd, tw->make, len) == (ssize_t)len) {
+		close(fd);
+		lws_diskcache_finalize_name((char *)path);
+		tree_sizes_name(oid, h);
+		side_cache_hot(cd, h, tw->make, len);
+	} else {
+		close(fd);
+		unlink(path);
+	}
+
+	jg2_ongoing_finish(cd, lead, NULL);
+	free(tw->make);
+	tw->make = NULL;
+}
+
+static uint64_t
+tree_entry_size(struct tree_walk *tw, const git_tree_entry *entry)
+{
+	git_otype type;
+	size_t len;
+
+	if (tw->idx >= tw->count)
+		return 0;
+
+	if (tw->have)
+		return lws_ser_ru64be(tw->have + (tw->idx * 8));
+
+	len = 0;
+	if (git_tree_entry_type(entry) != GIT_OBJ_BLOB ||
+	    !tw->odb || git_odb_read_header(&len, &type, tw->odb,
+					    git_tree_entry_id(entry)))
+		len = 0;
+
+	if (tw->make)
+		lws_ser_wu64be(tw->make + (tw->idx * 8), len);
+
+	return len;
+}
+
+/*
+ * "lines" mode shows a window of a blob's lines, rather than all of it.  To
+ * find where the window starts and ends without scanning the blob up to
+ * there, we keep an index for the blob: its line count, then the offset of
+ * every LINES_STRIDE-th line, all u64be.  Like the tree sizes, it's kept in
+ * the hot tier and the disk cache named by the blob oid.
+ */
+
+#define JG2_BLOB_LINES_DEFAULT	1000
+#define JG2_BLOB_LINES_MAX	10000
+#define JG2_BLOB_LINES_MAX_BYTES	(1024 * 1024)
+#define LINES_STRIDE		64
+
+static const char *
+next_line(const char *p, const char *end)
+{
+	p = memchr(p, '\n', (size_t)lws_ptr_diff(end, p));
+
+	return p ? p + 1 : end;
+}
+
+static uint8_t *
+blob_lines_make(const char *b, size_t size, size_t *len)
+{
+	const char *p = b, *end = b + size;
+	uint64_t lines = 0;
+	uint8_t *idx;
+
+	while (p < end) {
+		p = next_line(p, end);
+		lines++;
+	}
+
+	*len = 8 + (size_t)(((lines + LINES_STRIDE - 1) / LINES_STRIDE) * 8);
+	idx = malloc(*len);
+	if (!idx)
+		return NULL;
+
+	lws_ser_wu64be(idx, lines);
+
+	for (p = b, lines = 0; p < end; p = next_line(p, end), lines++)
+		if (!(lines % LINES_STRIDE))
+			lws_ser_wu64be(idx + 8 + ((lines / LINES_STRIDE) * 8),
+				       (uint64_t)lws_ptr_diff(p, b));
+
+	return idx;
+}
+
+static int
+blob_lines_valid(const uint8_t *idx, size_t len, size_t size)
+{
+	uint64_t lines;
+
+	if (len < 8)
+		return 0;
+
+	lines = lws_ser_ru64be(idx);
+
+	return lines <= size && len == 8 + (size_t)(((lines +
+				LINES_STRIDE - 1) / LINES_STRIDE) * 8) &&
+	       (len == 8 || lws_ser_ru64be(idx + len - 8) < size);
+}
+
+/* the offset in the blob where line starts, or size if it's past the end */
+
+static size_t
+blob_line_ofs(const uint8_t *idx, const char *b, size_t size, uint64_t line)
+{
+	const char *p, *end = b + size;
+	unsigned int n;
+
+	if (line >= lws_ser_ru64be(idx))
+		return size;
+
+	p = b + lws_ser_ru64be(idx + 8 + ((line / LINES_STRIDE) * 8));
+	for (n = 0; n < line % LINES_STRIDE; n++)
+		p = next_line(p, end);
+
+	return (size_t)lws_ptr_diff(p, b);
+}
+
+/*
+ * Sets *idx to the line index for the blob from the caches, or made now.
+ * Either *hot or *made holds it and must be released after.
+ */
+
+static int
+blob_lines_get(struct jg2_ctx *ctx, const git_oid *oid, const char *b,
+	       size_t size, const uint8_t **idx, struct jg2_lru_entry **hot,
+	       uint8_t **made)
+{
+	struct jg2_repodir *cd = ctx->vhost->cachedir;
+	char name[(JG2_CHASH_LEN * 2) + 1], path[256];
+	unsigned char h[JG2_CHASH_LEN];
+	struct jg2_ongoing *lead;
+	struct jg2_chash ch;
+	size_t len;
+	int fd, n;
+
+	*hot = NULL;
+	*made = NULL;
+
+	if (cd) {
+		jg2_chash_init(&ch, NULL, NULL);
+		jg2_chash_upd(&ch, "blob-lines", 10);
+		jg2_chash_upd(&ch, oid->id, GIT_OID_RAWSZ);
+		jg2_chash_fini(&ch, h);
+
+		*hot = jg2_lru_get(cd->hot, h);
+		if (*hot) {
+			if (blob_lines_valid((uint8_t *)jg2_lru_data(*hot),
+					     (*hot)->len, size)) {
+				*idx = (const uint8_t *)jg2_lru_data(*hot);
+
+				return 0;
+			}
+			jg2_lru_put(hot);
+		}
+
+		md5_to_hex_cstr(name, h);
+		n = lws_diskcache_query(cd->dcs, 0, name, &fd, path,
+					sizeof(path) - 1, &len);
+		if (n == LWS_DISKCACHE_QUERY_EXISTS) {
+			*made = len >= 8 && len <= size + 8 ? malloc(len) : NULL;
+			if (*made && (read(fd, *made, len) != (ssize_t)len ||
+				      !blob_lines_valid(*made, len, size))) {
+				free(*made);
+				*made = NULL;
+			}
+			close(fd);
+			if (*made) {
+				side_cache_hot(cd, h, *made, len);
+				*idx = *made;
+
+				return 0;
+			}
+		}
+
+		if (n == LWS_DISKCACHE_QUERY_CREATING) {
+			lead = jg2_ongoing_lead(cd, name, NULL);
+			*made = lead ? blob_lines_make(b, size, &len) : NULL;
+			if (*made && write(fd, *made, len) == (ssize_t)len) {
+				close(fd);
+				lws_diskcache_finalize_name(path);
+				side_cache_hot(cd, h, *made, len);
+			} else {
+				close(fd);
+				unlink(path);
+			}
+			if (lead)
+				jg2_ongoing_finish(cd, &lead, NULL);
+		}
+	}
+
+	/* no cache, or somebody else is making it, we just make our own */
+
+	if (!*made)
+		*made = blob_lines_make(b, size, &len);
+	*idx = *made;
+
+	return !*made;
+}
+
+/*
+ * Sets up ctx->pos and ctx->size to send the window of lines from the blob
+ * the url asked for, and emits where it is in the blob.
+ *
+ * The window is also kept to JG2_BLOB_LINES_MAX_BYTES of the blob, ending at
+ * the last whole line that fits.  If even the first line doesn't fit, like in
+ * minified files, the window is just the start of that line, and flagged as
+ * truncated.  end_line is always the line after the window, so the client
+ * can carry on from there.
+ */
+
+static int
+blob_lines_window(struct jg2_ctx *ctx, const git_oid *oid)
+{
+	uint64_t lines, first, count, end, lo, mid;
+	struct jg2_lru_entry *hot;
+	const uint8_t *idx;
+	int truncated = 0;
+	uint8_t *made;
+	size_t limit;
+
+	if (blob_lines_get(ctx, oid, ctx->body, ctx->size, &idx, &hot, &made))
+		return 1;
+
+	lines = lws_ser_ru64be(idx);
+	first = ctx->sr.offset > 0 ? (uint64_t)ctx->sr.offset : 0;
+	if (first > lines)
+		first = lines;
+	count = ctx->sr.count > 0 ? (uint64_t)ctx->sr.count :
+				    JG2_BLOB_LINES_DEFAULT;
+	if (count > JG2_BLOB_LINES_MAX)
+		count = JG2_BLOB_LINES_MAX;
+	end = first + count > lines ? lines : first + count;
+
+	ctx->pos = blob_line_ofs(idx, ctx->body, ctx->size, first);
+	limit = ctx->pos + JG2_BLOB_LINES_MAX_BYTES;
+
+	if (blob_line_ofs(idx, ctx->body, ctx->size, end) > limit) {
+		/* the last line in the window that ends inside the limit */
+
+		lo = first;
+		while (lo < end) {
+			mid = lo + ((end - lo + 1) / 2);
+			if (blob_line_ofs(idx, ctx->body, ctx->size, mid) <=
+									limit)
+				lo = mid;
+			else
+				end = mid - 1;
+		}
+
+		if (end == first) {
+			/* the first line alone is too big, cut it short */
+			end = first + 1;
+			truncated = 1;
+		}
+	}
+
+	if (truncated) {
+		/* don't split a utf-8 sequence */
+		while (limit > ctx->pos &&
+		       (((const uint8_t *)ctx->body)[limit] & 0xc0) == 0x80)
+			limit--;
+		ctx->size = limit;
+	} else
+		ctx->size = blob_line_ofs(idx, ctx->body, ctx->size, end);
+
+	jg2_lru_put(&hot);
+	free(made);
+
+	CTX_BUF_APPEND("\"lines\": %llu, \"first_line\": %llu, "
+		       "\"end_line\": %llu, ", (unsigned long long)lines,
+		       (unsigned long long)first, (unsigned long long)end);
+	if (truncated)
+		CTX_BUF_APPEND("\"truncated\": 1, ");
+
+	return 0;
+}
+
 /*
  * For efficiency, we dump results linearly in a linked-list of "chunk"
  * allocations, adding to it as needed.  It means we have much less allocation
@@ -56,10 +472,10 @@ tei_alpha_sort(lws_list_ptr a, lws_list_ptr b)
 static int
 treewalk_cb(const char *root, const git_tree_entry *entry, void *payload)
 {
-	struct jg2_ctx *ctx = payload;
+	struct tree_walk *tw = payload;
+	struct jg2_ctx *ctx = tw->ctx;
 	struct tree_entry_info *tei;
 	const char *name;
-	git_blob *blob;
 	git_otype type;
 	size_t m;
 
@@ -78,18 +494,22 @@ treewalk_cb(const char *root, const git_tree_entry *entry, void *payload)
 	tei->mode = git_tree_entry_filemode(entry);
 	tei->namelen = m - 1;
 	tei->type = type;
-	tei->size = 0;
-
-	if (type == GIT_OBJ_BLOB &&
-	    !git_blob_lookup(&blob, ctx->jrepo->repo, tei->oid)) {
-		tei->size = git_blob_rawsize(blob);
-		git_blob_free(blob);
-	}
+	tei->size = tree_entry_size(tw, entry);
+	tei->lastc = NULL;
+	tw->idx++;
 
 	/* copy the name into place; lac is already advanced and aligned */
 
 	memcpy(tei + 1, name, m);
 
+	if (tw->lastc && tw->plen + m <= sizeof(tw->path)) {
+		git_oid *lc = lwsac_use(&ctx->lwsac_head, sizeof(*lc), 0);
+
+		memcpy(tw->path + tw->plen, name, m);
+		if (lc && !jg2_lastc_find(tw->lastc, tw->path, lc))
+			tei->lastc = lc;
+	}
+
 	lws_list_ptr_insert(&ctx->sorted_head, &tei->next, tei_alpha_sort);
 
 	return type == GIT_OBJ_TREE; /* don't go inside trees */
@@ -115,10 +535,13 @@ job_tree_start(struct jg2_ctx *ctx)
 	git_tree_entry *te;
 	git_generic_ptr u;
 	const char *epath = ctx->sr.e[JG2_PE_PATH];
-	char pure[256], entry_did_inline = ctx->did_inline;
+	char pure[256], entry_did_inline = ctx->did_inline, cpath[256];
+	struct jg2_lru_entry *hot = NULL;
+	struct jg2_ongoing *lead = NULL;
+	struct tree_walk tw;
 	git_commit *c;
 	git_oid oid;
-	int e;
+	int e, fd;
 
 	if (!ctx->hex_oid[0]) {
 		lwsl_err("%s: no oid\n", __func__);
@@ -257,6 +680,14 @@ job_tree_start(struct jg2_ctx *ctx)
 		CTX_BUF_APPEND(",\"blobname\": \"%s\", ", pure);
 
 		if (!git_blob_is_binary(u.blob)) {
+			if (ctx->sr.e[JG2_PE_MODE] &&
+			    !strcmp(ctx->sr.e[JG2_PE_MODE], "lines") &&
+			    blob_lines_window(ctx, git_blob_id(u.blob))) {
+				ctx->u.obj = NULL;
+				ctx->body = NULL;
+				goto bail;
+			}
+
 			CTX_BUF_APPEND("\"blob\": \"");
 			return 0;
 		}
@@ -287,7 +718,38 @@ job_tree_start(struct jg2_ctx *ctx)
 
 	/* so the first part is walk the tree level and collect the objects */
 
-	e = git_tree_walk(ctx->u.tree, GIT_TREEWALK_PRE, treewalk_cb, ctx);
+	memset(&tw, 0, sizeof(tw));
+	tw.ctx = ctx;
+	tw.count = git_tree_entrycount(ctx->u.tree);
+
+	hot = tree_sizes_get(ctx, &tw, git_tree_id(ctx->u.tree), &fd, cpath,
+			     sizeof(cpath) - 1, &lead);
+
+	/*
+	 * Listing a branch, we can also show the last commit to touch each
+	 * entry, if the index pinned for the job has caught up with it
+	 */
+
+	if (ctx->lastc && jg2_lastc_tip(ctx->lastc) &&
+	    git_oid_equal(jg2_lastc_tip(ctx->lastc), &oid)) {
+		tw.lastc = ctx->lastc;
+		if (epath && epath[0])
+			tw.plen = (size_t)lws_snprintf(tw.path, sizeof(tw.path),
+				"%s%s", epath,
+				epath[strlen(epath) - 1] == '/' ? "" : "/");
+	}
+	if (!tw.have && git_repository_odb(&tw.odb, ctx->jrepo->repo) < 0)
+		tw.odb = NULL;
+
+	e = git_tree_walk(ctx->u.tree, GIT_TREEWALK_PRE, treewalk_cb, &tw);
+
+	if (tw.odb)
+		git_odb_free(tw.odb);
+	if (tw.make)
+		tree_sizes_store(ctx, &tw, git_tree_id(ctx->u.tree), fd, cpath,
+				 &lead, e >= 0);
+	jg2_lru_put(&hot);
+
 	if (e < 0) {
 		const git_error *er = giterr_last();
 
@@ -340,11 +802,41 @@ static struct inline_match inline_match[] = {
 	{ ".md", 3 },
 };
 
+/* one entry of a tree listing, lastc may be NULL */
+
+void
+tree_entry_json(struct jg2_ctx *ctx, int first, const char *name,
+		unsigned int mode, uint64_t size, const git_oid *lastc)
+{
+	struct jg2_jw w;
+	char pure[128];
+
+	ellipsis_purify(pure, name, sizeof(pure));
+
+	jg2_jw_start(&w, ctx, 64 + (JG2_JW_NUM_MAX * 2) + GIT_OID_HEXSZ +
+			      strlen(pure));
+	jg2_jw_char(&w, first ? ' ' : ',');
+	JG2_JW_LIT(&w, "\n{ \"name\": \"");
+	jg2_jw_str(&w, pure);
+	JG2_JW_LIT(&w, "\",\"mode\": \"");
+	jg2_jw_u64(&w, mode);
+	JG2_JW_LIT(&w, "\", \"size\":");
+	jg2_jw_u64(&w, size);
+
+	if (lastc) {
+		JG2_JW_LIT(&w, ",\"last_commit\":\"");
+		jg2_jw_oid(&w, lastc);
+		jg2_jw_char(&w, '"');
+	}
+
+	jg2_jw_char(&w, '}');
+	jg2_jw_end(&w, ctx);
+}
+
 int
 job_tree(struct jg2_ctx *ctx)
 {
 	struct tree_entry_info *head;
-	char name[128];
 	size_t m;
 
 	if (ctx->destroying) {
@@ -406,12 +898,9 @@ job_tree(struct jg2_ctx *ctx)
 			break;
 		}
 
-		CTX_BUF_APPEND("%c\n{ \"name\": \"%s\","
-			       "\"mode\": \"%u\", \"size\":%llu}",
-			       ctx->tei != head ? ',' : ' ',
-			       ellipsis_purify(name, tei_name, sizeof(name)),
-			       (unsigned int)ctx->tei->mode,
-			       (unsigned long long)ctx->tei->size);
+		tree_entry_json(ctx, ctx->tei == head, tei_name,
+				(unsigned int)ctx->tei->mode, ctx->tei->size,
+				ctx->tei->lastc);
 
 		/* is this file in the file listing an inline doc file? */
 
@@ -0,0 +1,164 @@
+/*
+ * libjsongit2 - typed JSON emitters
+ *
+ * Copyright (C) 2018-2025 Andy Green <andy@warmcat.com>
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation:
+ *  version 2.1 of the License.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ *  MA  02110-1301  USA
+ *
+ * The per-commit and per-entry JSON is mostly literals, numbers, oids and
+ * strings that were already escaped, and formatting it with CTX_BUF_APPEND()
+ * spent most of the time parsing the format strings.
+ *
+ * Instead a record is started with the most it may write, and if that fits,
+ * the pieces are just copied in.  If it might not fit, each piece is copied
+ * with the same truncation lws_snprintf() does, so the buffer always ends up
+ * exactly as the equivalent CTX_BUF_APPEND()s would have left it.
+ */
+
+#include "private.h"
+
+#include <string.h>
+
+/* every byte as two lowercase hex chars */
+
+static const char hex2[] =
+	"000102030405060708090a0b0c0d0e0f101112131415161718191a1b1c1d1e1f"
+	"202122232425262728292a2b2c2d2e2f303132333435363738393a3b3c3d3e3f"
+	"404142434445464748494a4b4c4d4e4f505152535455565758595a5b5c5d5e5f"
+	"606162636465666768696a6b6c6d6e6f707172737475767778797a7b7c7d7e7f"
+	"808182838485868788898a8b8c8d8e8f909192939495969798999a9b9c9d9e9f"
+	"a0a1a2a3a4a5a6a7a8a9aaabacadaeafb0b1b2b3b4b5b6b7b8b9babbbcbdbebf"
+	"c0c1c2c3c4c5c6c7c8c9cacbcccdcecfd0d1d2d3d4d5d6d7d8d9dadbdcdddedf"
+	"e0e1e2e3e4e5e6e7e8e9eaebecedeeeff0f1f2f3f4f5f6f7f8f9fafbfcfdfeff";
+
+void
+jg2_jw_start(struct jg2_jw *w, struct jg2_ctx *ctx, size_t need)
+{
+	w->p = ctx->p;
+	w->end = ctx->end;
+
+	/* it has to fit with the NUL after it */
+	w->fits = (size_t)lws_ptr_diff(ctx->end, ctx->p) > need;
+}
+
+void
+jg2_jw_end(struct jg2_jw *w, struct jg2_ctx *ctx)
+{
+	if (w->p < w->end)
+		*w->p = '\0';
+
+	ctx->p = w->p;
+}
+
+void
+jg2_jw_mem(struct jg2_jw *w, const void *s, size_t len)
+{
+	size_t size;
+
+	if (w->fits) {
+		memcpy(w->p, s, len);
+		w->p += len;
+
+		return;
+	}
+
+	/* like lws_snprintf(): it's truncated with a NUL, and we end at end */
+
+	size = (size_t)lws_ptr_diff(w->end, w->p);
+	if (!size)
+		return;
+
+	if (len >= size) {
+		memcpy(w->p, s, size - 1);
+		w->p[size - 1] = '\0';
+		w->p = w->end;
+
+		return;
+	}
+
+	memcpy(w->p, s, len);
+	w->p += len;
+}
+
+void
+jg2_jw_str(struct jg2_jw *w, const char *s)
+{
+	if (!s)
+		s = "(null)"; /* what %s did */
+
+	jg2_jw_mem(w, s, strlen(s));
+}
+
+void
+jg2_jw_char(struct jg2_jw *w, char c)
+{
+	jg2_jw_mem(w, &c, 1);
+}
+
+void
+jg2_jw_u64(struct jg2_jw *w, uint64_t v)
+{
+	char b[20], *p = b + sizeof(b);
+
+	do {
+		*--p = (char)('0' + (v % 10));
+		v /= 10;
+	} while (v);
+
+	jg2_jw_mem(w, p, lws_ptr_diff(b + sizeof(b), p));
+}
+
+void
+jg2_jw_s64(struct jg2_jw *w, int64_t v)
+{
+	if (v >= 0) {
+		jg2_jw_u64(w, (uint64_t)v);
+
+		return;
+	}
+
+	jg2_jw_char(w, '-');
+	jg2_jw_u64(w, (uint64_t)0 - (uint64_t)v);
+}
+
+void
+jg2_jw_hex(struct jg2_jw *w, const unsigned char *b, size_t len)
+{
+	char h[GIT_OID_RAWSZ * 2];
+	size_t n, m;
+
+	while (len) {
+		m = len > sizeof(h) / 2 ? sizeof(h) / 2 : len;
+		for (n = 0; n < m; n++)
+			memcpy(h + (n * 2), hex2 + (b[n] * 2), 2);
+
+		jg2_jw_mem(w, h, m * 2);
+		b += m;
+		len -= m;
+	}
+}
+
+void
+jg2_jw_oid(struct jg2_jw *w, const git_oid *oid)
+{
+	if (!oid) {
+		jg2_jw_char(w, 'x'); /* what oid_to_hex_cstr() gave */
+
+		return;
+	}
+
+	jg2_jw_hex(w, oid->id, GIT_OID_RAWSZ);
+}
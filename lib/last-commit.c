@@ -0,0 +1,940 @@
+/*
+ * libjsongit2 - per-branch last commit to touch each path
+ *
+ * Copyright (C) 2018-2025 Andy Green <andy@warmcat.com>
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation:
+ *  version 2.1 of the License.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ *  MA  02110-1301  USA
+ *
+ * Tree listings of a branch show the last commit that touched each entry.
+ * Finding that per request would mean walking the history for every entry,
+ * so if there is a cache dir, the index thread keeps a file per repo and
+ * branch there, with the commit for every path in the branch tip's tree,
+ * sorted by path.  Jobs mmap it and look the entries up in it.
+ *
+ * A branch gets one the first time its tree is listed, up to a few per
+ * repo.  When its tip moves, we only walk the commits that are new since
+ * the tip it was made at, and take the rest from the old one.  If the old tip
+ * isn't an ancestor of the new one, eg, after a force-push or rebase, the old
+ * one may credit commits that are no longer on the branch, so it's made again
+ * from scratch.  Jobs pin the one that was current when they started, like
+ * the reftab.
+ *
+ * A commit touches a path if the path differs from its first parent's, and
+ * for merges, from all of its parents', like git log's default history
+ * simplification.  A dir is touched by whatever touched anything under it.
+ */
+
+#include "private.h"
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define LC_MAGIC	0x4a47324c /* "JG2L" */
+#define LC_VERSION	1
+#define LC_HEADER_LEN	(16 + GIT_OID_RAWSZ)
+#define LC_REC_LEN	(4 + GIT_OID_RAWSZ) /* path offset, commit oid */
+
+/* how many branches per repo may have one */
+#define JG2_LASTC_BRANCHES	4
+
+struct jg2_lastc {
+	struct jg2_lastc *next; /* on the jrepo list, protected by jrepo lock */
+	int refcount; /* protected by the jrepo lock */
+	char ref[64];
+	git_oid tip; /* the branch tip it was made at */
+	char built; /* otherwise, it's just asking to be made */
+	const uint8_t *map;
+	size_t len;
+	uint32_t count;
+	const uint8_t *recs;
+	const char *strings;
+	uint32_t strings_len;
+};
+
+static struct jg2_lastc *
+lastc_open(const char *path, const char *ref)
+{
+	struct jg2_lastc *lc;
+	struct stat s;
+	void *map;
+	int fd;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return NULL;
+
+	if (fstat(fd, &s) || s.st_size < LC_HEADER_LEN) {
+		close(fd);
+
+		return NULL;
+	}
+
+	map = mmap(NULL, (size_t)s.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return NULL;
+
+	lc = jg2_zalloc(sizeof(*lc));
+	if (!lc)
+		goto bail;
+
+	lc->map = map;
+	lc->len = (size_t)s.st_size;
+
+	if (lws_ser_ru32be(lc->map) != LC_MAGIC ||
+	    lws_ser_ru32be(lc->map + 4) != LC_VERSION)
+		goto bail;
+
+	lc->count = lws_ser_ru32be(lc->map + 8);
+	lc->strings_len = lws_ser_ru32be(lc->map + 12);
+	git_oid_fromraw(&lc->tip, lc->map + 16);
+
+	lc->recs = lc->map + LC_HEADER_LEN;
+	lc->strings = (const char *)lc->recs + ((size_t)lc->count * LC_REC_LEN);
+
+	/* the string table must end with a NUL, so strcmp() stays inside */
+
+	if ((size_t)lc->count * LC_REC_LEN + lc->strings_len !=
+						lc->len - LC_HEADER_LEN ||
+	    (lc->strings_len && lc->map[lc->len - 1]))
+		goto bail;
+
+	lws_strncpy(lc->ref, ref, sizeof(lc->ref));
+	lc->built = 1;
+	lc->refcount = 1;
+
+	return lc;
+
+bail:
+	lwsl_notice("%s: ignoring bad %s\n", __func__, path);
+	munmap(map, (size_t)s.st_size);
+	free(lc);
+
+	return NULL;
+}
+
+static void
+lastc_free(struct jg2_lastc *lc)
+{
+	if (lc->map)
+		munmap((void *)lc->map, lc->len);
+	free(lc);
+}
+
+/*
+ * Pins the one for ref, if any.  If the branch doesn't have one yet, it's
+ * asked for and the index thread will make it.
+ */
+
+struct jg2_lastc *
+jg2_lastc_get(struct jg2_vhost *vh, struct jg2_repo *jrepo, const char *ref)
+{
+	struct jg2_lastc *lc;
+	int n = 0;
+
+	if (!vh->cachedir || strncmp(ref, "refs/heads/", 11))
+		return NULL;
+
+	pthread_mutex_lock(&vh->lock); /* ======================== vhost lock */
+	pthread_mutex_lock(&jrepo->lock); /* ===================== jrepo lock */
+
+	lc = jrepo->lastc;
+	while (lc && strcmp(lc->ref, ref)) {
+		n++;
+		lc = lc->next;
+	}
+
+	if (lc)
+		lc->refcount++;
+	else
+		if (n < JG2_LASTC_BRANCHES && strlen(ref) < sizeof(lc->ref)) {
+			lc = jg2_zalloc(sizeof(*lc));
+			if (lc) {
+				lws_strncpy(lc->ref, ref, sizeof(lc->ref));
+				lc->refcount = 1;
+				lc->next = jrepo->lastc;
+				jrepo->lastc = lc;
+				jrepo->lastc_stale = 1;
+
+				/* nothing to pin yet */
+				lc = NULL;
+			}
+		}
+
+	pthread_mutex_unlock(&jrepo->lock); /*------------------ jrepo unlock */
+	pthread_mutex_unlock(&vh->lock); /* -------------------- vhost unlock */
+
+	return lc;
+}
+
+void
+jg2_lastc_put(struct jg2_repo *jrepo, struct jg2_lastc **plc)
+{
+	struct jg2_lastc *lc = *plc;
+	int n;
+
+	if (!lc)
+		return;
+
+	*plc = NULL;
+
+	pthread_mutex_lock(&jrepo->lock); /* ===================== jrepo lock */
+	n = !--lc->refcount;
+	pthread_mutex_unlock(&jrepo->lock); /*------------------ jrepo unlock */
+
+	if (n)
+		lastc_free(lc);
+}
+
+/* the jrepo is going away */
+
+void
+jg2_lastc_destroy_all(struct jg2_repo *jrepo)
+{
+	struct jg2_lastc *lc;
+
+	while (jrepo->lastc) {
+		lc = jrepo->lastc;
+		jrepo->lastc = lc->next;
+		jg2_lastc_put(jrepo, &lc);
+	}
+}
+
+/* returns the tip it was made at, or NULL if it hasn't been made yet */
+
+const git_oid *
+jg2_lastc_tip(const struct jg2_lastc *lc)
+{
+	return lc->built ? &lc->tip : NULL;
+}
+
+/*
+ * Without pinning it... returns 0 and the tip the one for ref was made at in
+ * *tip, or 1 if it has none yet
+ */
+
+int
+jg2_lastc_ref_tip(struct jg2_repo *jrepo, const char *ref, git_oid *tip)
+{
+	struct jg2_lastc *lc;
+	int n = 1;
+
+	pthread_mutex_lock(&jrepo->lock); /* ===================== jrepo lock */
+	lc = jrepo->lastc;
+	while (lc && strcmp(lc->ref, ref))
+		lc = lc->next;
+	if (lc && lc->built) {
+		git_oid_cpy(tip, &lc->tip);
+		n = 0;
+	}
+	pthread_mutex_unlock(&jrepo->lock); /*------------------ jrepo unlock */
+
+	return n;
+}
+
+/* returns 0 and the raw oid for path in *raw, or 1 if it's not in it */
+
+static int
+lastc_find_raw(const struct jg2_lastc *lc, const char *path,
+	       const uint8_t **raw)
+{
+	uint32_t lo = 0, hi = lc->count, mid, ofs;
+	const uint8_t *r;
+	int n;
+
+	while (lo < hi) {
+		mid = lo + ((hi - lo) / 2);
+		r = lc->recs + ((size_t)mid * LC_REC_LEN);
+		ofs = lws_ser_ru32be(r);
+		if (ofs >= lc->strings_len)
+			return 1;
+
+		n = strcmp(path, lc->strings + ofs);
+		if (!n) {
+			*raw = r + 4;
+
+			return 0;
+		}
+		if (n < 0)
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+
+	return 1;
+}
+
+/* returns 0 and the last commit to touch path in *oid, or 1 if not known */
+
+int
+jg2_lastc_find(const struct jg2_lastc *lc, const char *path, git_oid *oid)
+{
+	const uint8_t *raw;
+
+	if (!lc->built || lastc_find_raw(lc, path, &raw))
+		return 1;
+
+	git_oid_fromraw(oid, raw);
+
+	return 0;
+}
+
+/* lc's creation reference passes to jrepo, in place of old */
+
+static void
+lastc_swap(struct jg2_repo *jrepo, struct jg2_lastc *old,
+	   struct jg2_lastc *lc)
+{
+	struct jg2_lastc **plc;
+
+	pthread_mutex_lock(&jrepo->lock); /* ===================== jrepo lock */
+	plc = &jrepo->lastc;
+	while (*plc && *plc != old)
+		plc = &(*plc)->next;
+	if (*plc) {
+		lc->next = old->next;
+		*plc = lc;
+	} else
+		/* it's gone from the list meanwhile */
+		old = lc;
+	pthread_mutex_unlock(&jrepo->lock); /*------------------ jrepo unlock */
+
+	jg2_lastc_put(jrepo, &old);
+}
+
+#if LIBGIT2_HAS_DIFF
+
+/*
+ * Updating it, from the index thread
+ */
+
+struct lc_rec {
+	const char *path; /* once the strings stop moving */
+	uint32_t ofs; /* in the strings */
+	git_oid oid;
+	char set;
+};
+
+struct lc_build {
+	struct jg2_vhost *vh;
+	git_repository *repo;
+	const struct jg2_lastc *old;
+
+	struct lc_rec *recs; /* one per path in the tip tree */
+	size_t count, recs_alloc, unset;
+
+	uint32_t *index; /* open addressing, rec index + 1 */
+	size_t index_size; /* power of 2 */
+
+	char *str;
+	size_t str_len, str_alloc;
+
+	int oom;
+};
+
+struct lc_writer {
+	int fd;
+	int err;
+	size_t n;
+	uint8_t buf[16384];
+};
+
+/* on failure, p is left as it was and b->oom set */
+
+static void *
+lc_grow(struct lc_build *b, void *p, size_t *alloc, size_t need, size_t size)
+{
+	size_t n = *alloc ? *alloc : 256;
+	void *np;
+
+	if (need <= *alloc)
+		return p;
+
+	while (n < need)
+		n *= 2;
+
+	np = realloc(p, n * size);
+	if (!np) {
+		b->oom = 1;
+
+		return p;
+	}
+	*alloc = n;
+
+	return np;
+}
+
+static uint64_t
+lc_path_hash(const char *path, size_t len)
+{
+	struct jg2_xxh64 x;
+
+	jg2_xxh64_init(&x, 0);
+	jg2_xxh64_upd(&x, path, len);
+
+	return jg2_xxh64_fini(&x);
+}
+
+static int
+lc_index_grow(struct lc_build *b)
+{
+	size_t size = b->index_size ? b->index_size * 2 : 1024, n, m;
+	uint32_t *s;
+	const char *p;
+
+	s = calloc(size, sizeof(*s));
+	if (!s) {
+		b->oom = 1;
+
+		return 1;
+	}
+
+	for (n = 0; n < b->index_size; n++) {
+		if (!b->index[n])
+			continue;
+		p = b->str + b->recs[b->index[n] - 1].ofs;
+		m = lc_path_hash(p, strlen(p)) & (size - 1);
+		while (s[m])
+			m = (m + 1) & (size - 1);
+		s[m] = b->index[n];
+	}
+
+	free(b->index);
+	b->index = s;
+	b->index_size = size;
+
+	return 0;
+}
+
+/* returns the rec for the first len chars of path, or NULL */
+
+static struct lc_rec *
+lc_lookup(struct lc_build *b, const char *path, size_t len)
+{
+	size_t m;
+	const char *p;
+
+	if (!b->index_size)
+		return NULL;
+
+	m = lc_path_hash(path, len) & (b->index_size - 1);
+	while (b->index[m]) {
+		p = b->str + b->recs[b->index[m] - 1].ofs;
+		if (!strncmp(p, path, len) && !p[len])
+			return &b->recs[b->index[m] - 1];
+		m = (m + 1) & (b->index_size - 1);
+	}
+
+	return NULL;
+}
+
+static void
+lc_path_add(struct lc_build *b, const char *root, const char *name)
+{
+	size_t rl = strlen(root), nl = strlen(name), m;
+	struct lc_rec *r;
+
+	if ((b->count + 1) * 2 > b->index_size && lc_index_grow(b))
+		return;
+
+	b->recs = lc_grow(b, b->recs, &b->recs_alloc, b->count + 1,
+			  sizeof(*b->recs));
+	b->str = lc_grow(b, b->str, &b->str_alloc, b->str_len + rl + nl + 1, 1);
+	if (b->oom || b->str_len + rl + nl + 1 >= 0xffffffff) {
+		b->oom = 1;
+
+		return;
+	}
+
+	r = &b->recs[b->count];
+	memset(r, 0, sizeof(*r));
+	r->ofs = (uint32_t)b->str_len;
+
+	memcpy(b->str + b->str_len, root, rl);
+	memcpy(b->str + b->str_len + rl, name, nl + 1);
+	b->str_len += rl + nl + 1;
+
+	m = lc_path_hash(b->str + r->ofs, rl + nl) & (b->index_size - 1);
+	while (b->index[m])
+		m = (m + 1) & (b->index_size - 1);
+	b->index[m] = (uint32_t)++b->count;
+	b->unset++;
+}
+
+static int
+lc_tree_cb(const char *root, const git_tree_entry *entry, void *payload)
+{
+	struct lc_build *b = payload;
+
+	lc_path_add(b, root, git_tree_entry_name(entry));
+
+	return b->oom ? -1 : 0;
+}
+
+/* returns 0 if path is the same in both trees, including both not having it */
+
+static int
+lc_differs(git_tree *t1, git_tree *t2, const char *path)
+{
+	git_tree_entry *e1 = NULL, *e2 = NULL;
+	int n;
+
+	git_tree_entry_bypath(&e1, t1, path);
+	git_tree_entry_bypath(&e2, t2, path);
+
+	n = !e1 != !e2 || (e1 && !git_oid_equal(git_tree_entry_id(e1),
+						 git_tree_entry_id(e2)));
+
+	if (e1)
+		git_tree_entry_free(e1);
+	if (e2)
+		git_tree_entry_free(e2);
+
+	return n;
+}
+
+/*
+ * Credits c with path and the dirs above it, where they're in the tip tree
+ * and nothing newer touched them.  For a merge, pt[] are its parents' trees,
+ * it only touched the path if it differs from all of them.
+ */
+
+static void
+lc_credit(struct lc_build *b, const git_oid *c, git_tree *tree,
+	  git_tree **pt, unsigned int np, const char *path)
+{
+	size_t len = strlen(path);
+	char sub[512];
+	struct lc_rec *r;
+	unsigned int n;
+
+	while (len) {
+		r = lc_lookup(b, path, len);
+		if (r && !r->set) {
+			n = 1;
+			if (np > 1 && len < sizeof(sub)) {
+				memcpy(sub, path, len);
+				sub[len] = '\0';
+
+				for (n = 0; n < np; n++)
+					if (!lc_differs(tree, pt[n], sub))
+						break;
+				n = n == np;
+			}
+
+			if (n) {
+				git_oid_cpy(&r->oid, c);
+				r->set = 1;
+				b->unset--;
+			}
+		}
+
+		/* go up to the dir it's in */
+
+		while (len && path[len - 1] != '/')
+			len--;
+		if (len)
+			len--;
+	}
+}
+
+static int
+lc_commit(struct lc_build *b, const git_oid *oid)
+{
+	git_tree *tree = NULL, *pt[8];
+	const git_diff_delta *d;
+	git_commit *c, *p;
+	unsigned int np, n;
+	git_diff *diff;
+	size_t m;
+	int e, ret = 1;
+
+	if (git_commit_lookup(&c, b->repo, oid))
+		return 1;
+
+	np = git_commit_parentcount(c);
+	if (np > LWS_ARRAY_SIZE(pt))
+		np = LWS_ARRAY_SIZE(pt);
+	memset(pt, 0, sizeof(pt));
+
+	if (git_commit_tree(&tree, c))
+		goto bail;
+
+	for (n = 0; n < np; n++) {
+		if (git_commit_parent(&p, c, n))
+			goto bail;
+		e = git_commit_tree(&pt[n], p);
+		git_commit_free(p);
+		if (e)
+			goto bail;
+	}
+
+	if (git_diff_tree_to_tree(&diff, b->repo, np ? pt[0] : NULL, tree,
+				  NULL))
+		goto bail;
+
+	for (m = 0; m < git_diff_num_deltas(diff) && b->unset; m++) {
+		d = git_diff_get_delta(diff, m);
+		lc_credit(b, oid, tree, pt, np, d->new_file.path ?
+				d->new_file.path : d->old_file.path);
+	}
+
+	git_diff_free(diff);
+	ret = 0;
+
+bail:
+	for (n = 0; n < LWS_ARRAY_SIZE(pt); n++)
+		if (pt[n])
+			git_tree_free(pt[n]);
+	if (tree)
+		git_tree_free(tree);
+	git_commit_free(c);
+
+	return ret;
+}
+
+/*
+ * Finds the last commit for every path in the tree at tip, walking back
+ * until they're all found or we reach the old one's tip
+ */
+
+static int
+lc_walk(struct lc_build *b, const git_oid *tip)
+{
+	git_revwalk *w;
+	git_commit *c;
+	git_tree *tree;
+	git_oid oid;
+	int n;
+
+	if (git_commit_lookup(&c, b->repo, tip))
+		return 1;
+	n = git_commit_tree(&tree, c);
+	git_commit_free(c);
+	if (n)
+		return 1;
+
+	n = git_tree_walk(tree, GIT_TREEWALK_PRE, lc_tree_cb, b);
+	git_tree_free(tree);
+	if (n || b->oom)
+		return 1;
+
+	if (git_revwalk_new(&w, b->repo))
+		return 1;
+
+	git_revwalk_sorting(w, GIT_SORT_TOPOLOGICAL | GIT_SORT_TIME);
+	if (git_revwalk_push(w, tip) ||
+	    (b->old && git_revwalk_hide(w, &b->old->tip))) {
+		git_revwalk_free(w);
+
+		return 1;
+	}
+
+	/* if the vhost is going away, the walk is abandoned */
+
+	while (b->unset && !b->oom && !b->vh->dying &&
+	       !git_revwalk_next(&oid, w))
+		lc_commit(b, &oid);
+
+	git_revwalk_free(w);
+
+	return b->oom || b->vh->dying;
+}
+
+/* nonzero if ancestor is in the history of commit */
+
+static int
+lastc_descends(git_repository *repo, const git_oid *commit,
+	       const git_oid *ancestor)
+{
+#if LIBGIT2_HAS_DESCENDANT_OF
+	return git_graph_descendant_of(repo, commit, ancestor) == 1;
+#else
+	git_oid base;
+
+	return !git_merge_base(&base, repo, commit, ancestor) &&
+	       git_oid_equal(&base, ancestor);
+#endif
+}
+
+static int
+lc_rec_cmp(const void *a, const void *b)
+{
+	return strcmp(((const struct lc_rec *)a)->path,
+		      ((const struct lc_rec *)b)->path);
+}
+
+static void
+lc_write(struct lc_writer *w, const void *p, size_t len)
+{
+	size_t n;
+
+	while (len) {
+		n = sizeof(w->buf) - w->n;
+		if (n > len)
+			n = len;
+		memcpy(w->buf + w->n, p, n);
+		w->n += n;
+		p = (const uint8_t *)p + n;
+		len -= n;
+
+		if (w->n == sizeof(w->buf) || !len) {
+			if (!w->err && write(w->fd, w->buf, w->n) !=
+							(ssize_t)w->n)
+				w->err = 1;
+			w->n = 0;
+		}
+	}
+}
+
+static int
+lc_write_file(struct lc_build *b, const git_oid *tip, int fd)
+{
+	uint8_t h[LC_HEADER_LEN], v[LC_REC_LEN];
+	const uint8_t *raw;
+	struct lc_writer *w;
+	uint32_t count = 0, slen = 0;
+	size_t n;
+
+	/* paths the new commits didn't touch keep what they had */
+
+	for (n = 0; n < b->count; n++) {
+		b->recs[n].path = b->str + b->recs[n].ofs;
+		if (!b->recs[n].set && b->old &&
+		    !lastc_find_raw(b->old, b->recs[n].path, &raw)) {
+			git_oid_fromraw(&b->recs[n].oid, raw);
+			b->recs[n].set = 1;
+		}
+		if (b->recs[n].set) {
+			count++;
+			slen += (uint32_t)strlen(b->recs[n].path) + 1;
+		}
+	}
+
+	w = malloc(sizeof(*w));
+	if (!w)
+		return 1;
+
+	w->fd = fd;
+	w->err = 0;
+	w->n = 0;
+
+	qsort(b->recs, b->count, sizeof(*b->recs), lc_rec_cmp);
+
+	lws_ser_wu32be(h, LC_MAGIC);
+	lws_ser_wu32be(h + 4, LC_VERSION);
+	lws_ser_wu32be(h + 8, count);
+	lws_ser_wu32be(h + 12, slen);
+	memcpy(h + 16, tip->id, GIT_OID_RAWSZ);
+	lc_write(w, h, sizeof(h));
+
+	slen = 0;
+	for (n = 0; n < b->count; n++) {
+		if (!b->recs[n].set)
+			continue;
+		lws_ser_wu32be(v, slen);
+		memcpy(v + 4, b->recs[n].oid.id, GIT_OID_RAWSZ);
+		lc_write(w, v, sizeof(v));
+		slen += (uint32_t)strlen(b->recs[n].path) + 1;
+	}
+
+	for (n = 0; n < b->count; n++)
+		if (b->recs[n].set)
+			lc_write(w, b->recs[n].path,
+				 strlen(b->recs[n].path) + 1);
+
+	n = (size_t)w->err;
+	free(w);
+
+	return (int)n;
+}
+
+/*
+ * Brings cur up to date with its branch tip, returns 0 if it did.  We use
+ * our own git_repository, so the repo may be closed meanwhile.
+ */
+
+static int
+lastc_update(struct jg2_vhost *vh, struct jg2_repo *r, struct jg2_lastc *cur)
+{
+	char name[(JG2_CHASH_LEN * 2) + 1], path[256], tmp[264];
+	struct jg2_lastc *loaded = NULL, *lc = NULL;
+	unsigned char hash[JG2_CHASH_LEN];
+	git_repository *repo = NULL;
+	struct jg2_chash ch;
+	struct lc_build b;
+	int fd = -1, n, ret = 1;
+	git_oid tip;
+	size_t size;
+
+	memset(&b, 0, sizeof(b));
+
+	if (git_repository_open_ext(&repo, r->repo_path, 0, NULL))
+		return 1;
+
+	if (jg2_oid_lookup(repo, &tip, cur->ref))
+		goto bail;
+
+	if (cur->built && git_oid_equal(&tip, &cur->tip)) {
+		ret = 0;
+		goto bail;
+	}
+
+	jg2_chash_init(&ch, NULL, NULL);
+	jg2_chash_upd(&ch, "last-commit", 11);
+	jg2_chash_upd(&ch, r->repo_path, strlen(r->repo_path) + 1);
+	jg2_chash_upd(&ch, cur->ref, strlen(cur->ref));
+	jg2_chash_fini(&ch, hash);
+	md5_to_hex_cstr(name, hash);
+
+	n = lws_diskcache_query(vh->cachedir->dcs, 0, name, &fd, path,
+				sizeof(path) - 1, &size);
+	if (n != LWS_DISKCACHE_QUERY_EXISTS &&
+	    n != LWS_DISKCACHE_QUERY_CREATING) {
+		fd = -1;
+		goto bail;
+	}
+
+	if (n == LWS_DISKCACHE_QUERY_EXISTS) {
+		close(fd);
+		fd = -1;
+
+		if (!cur->built) {
+			/* we have one from before we restarted */
+			loaded = lastc_open(path, cur->ref);
+			if (loaded && git_oid_equal(&tip, &loaded->tip)) {
+				lastc_swap(r, cur, loaded);
+				loaded = NULL;
+				ret = 0;
+				goto bail;
+			}
+		}
+	}
+
+	b.vh = vh;
+	b.repo = repo;
+	b.old = cur->built ? cur : loaded;
+
+	if (b.old && !lastc_descends(repo, &tip, &b.old->tip)) {
+		lwsl_info("%s: %s %s: rewound, rebuilding\n", __func__,
+			  r->repo_path, cur->ref);
+		b.old = NULL;
+	}
+
+	if (lc_walk(&b, &tip))
+		goto bail;
+
+	/* a fresh one is written to the temp name the cache gave us */
+
+	lws_strncpy(tmp, path, sizeof(tmp));
+	if (fd == -1) {
+		lws_snprintf(tmp, sizeof(tmp), "%s~lc", path);
+		fd = open(tmp, O_CREAT | O_TRUNC | O_WRONLY | O_CLOEXEC, 0600);
+		if (fd < 0)
+			goto bail;
+	}
+
+	n = lc_write_file(&b, &tip, fd);
+	close(fd);
+	fd = -1;
+
+	if (!n)
+		lc = lastc_open(tmp, cur->ref);
+
+	if (!lc) {
+		unlink(tmp);
+		goto bail;
+	}
+
+	if (strcmp(tmp, path))
+		n = rename(tmp, path);
+	else
+		n = lws_diskcache_finalize_name(path);
+	if (n)
+		lwsl_notice("%s: unable to rename %s\n", __func__, tmp);
+
+	lwsl_info("%s: %s %s: %u paths\n", __func__, r->repo_path, cur->ref,
+		  lc->count);
+
+	lastc_swap(r, cur, lc);
+	ret = 0;
+
+bail:
+	if (fd != -1) {
+		close(fd);
+		unlink(path);
+	}
+	git_repository_free(repo);
+	free(b.recs);
+	free(b.index);
+	free(b.str);
+	if (loaded)
+		lastc_free(loaded);
+
+	return ret;
+}
+
+#endif
+
+/*
+ * Called from the index thread, without the global lock and with vh pinned,
+ * brings the last commit indexes for one of the vhost's repos whose refs
+ * changed, or that had a new branch asked for, up to date with their branch
+ * tips.
+ */
+
+void
+jg2_vhost_lastc_update(struct jg2_vhost *vh)
+{
+#if LIBGIT2_HAS_DIFF
+	struct jg2_lastc *lcs[JG2_LASTC_BRANCHES], *lc;
+	struct jg2_repo *r;
+	int n = 0, m;
+
+	if (!vh->cachedir)
+		return;
+
+	pthread_mutex_lock(&vh->lock); /* ======================== vhost lock */
+	r = vh->repo_list;
+	while (r && !r->lastc_stale)
+		r = r->next;
+	if (r) {
+		pthread_mutex_lock(&r->lock); /* ================= jrepo lock */
+		/* jobs asking for a new one set it under the jrepo lock */
+		r->lastc_stale = 0;
+		lc = r->lastc;
+		while (lc && n < JG2_LASTC_BRANCHES) {
+			lc->refcount++;
+			lcs[n++] = lc;
+			lc = lc->next;
+		}
+		pthread_mutex_unlock(&r->lock); /*-------------- jrepo unlock */
+	}
+	pthread_mutex_unlock(&vh->lock); /* -------------------- vhost unlock */
+
+	for (m = 0; m < n; m++) {
+		if (lastc_update(vh, r, lcs[m]))
+			lwsl_notice("%s: unable to update %s %s\n", __func__,
+				    r->repo_path, lcs[m]->ref);
+		jg2_lastc_put(r, &lcs[m]);
+	}
+#endif
+}
@@ -0,0 +1,307 @@
+/*
+ * libjsongit2 - size-bounded, sharded in-memory LRU
+ *
+ * Copyright (C) 2018-2025 Andy Green <andy@warmcat.com>
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation:
+ *  version 2.1 of the License.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ *  MA  02110-1301  USA
+ *
+ * Entries are immutable blobs keyed by a 16-byte hash, like the job_hash used
+ * to name disk cache entries.  Since the keys are already well-distributed
+ * hashes, we use the key bytes directly to pick the shard and hash bucket.
+ *
+ * Each shard has its own lock, so threads looking up unrelated entries don't
+ * contend.  Entries are refcounted, so a user can keep using one it got from
+ * jg2_lru_get() after it has been evicted; it's freed on the last
+ * jg2_lru_put().
+ */
+
+#include "private.h"
+
+#include <string.h>
+#include <stdlib.h>
+
+#define JG2_LRU_SHARDS		16
+#define JG2_LRU_BUCKETS		64
+
+struct jg2_lru_shard {
+	pthread_mutex_t lock;
+	struct jg2_lru_entry *bucket[JG2_LRU_BUCKETS];
+	struct jg2_lru_entry *mru; /* most recently used */
+	struct jg2_lru_entry *lru; /* least recently used */
+	size_t size;
+
+	uint64_t hits;
+	uint64_t misses;
+};
+
+struct jg2_lru {
+	struct jg2_lru_shard shard[JG2_LRU_SHARDS];
+	size_t shard_limit;
+};
+
+#define lru_shard(lru, key) (&(lru)->shard[(key)[0] & (JG2_LRU_SHARDS - 1)])
+#define lru_bucket(key) ((key)[1] & (JG2_LRU_BUCKETS - 1))
+
+struct jg2_lru *
+jg2_lru_create(size_t size_limit)
+{
+	struct jg2_lru *lru = jg2_zalloc(sizeof(*lru));
+	int n;
+
+	if (!lru)
+		return NULL;
+
+	lru->shard_limit = size_limit / JG2_LRU_SHARDS;
+
+	for (n = 0; n < JG2_LRU_SHARDS; n++)
+		pthread_mutex_init(&lru->shard[n].lock, NULL);
+
+	return lru;
+}
+
+/* requires shard lock */
+
+static void
+__jg2_lru_unlink(struct jg2_lru_shard *s, struct jg2_lru_entry *e)
+{
+	struct jg2_lru_entry **pe = &s->bucket[lru_bucket(e->key)];
+
+	while (*pe) {
+		if (*pe == e) {
+			*pe = e->hash_next;
+			break;
+		}
+		pe = &(*pe)->hash_next;
+	}
+
+	if (e->prev)
+		e->prev->next = e->next;
+	else
+		s->mru = e->next;
+
+	if (e->next)
+		e->next->prev = e->prev;
+	else
+		s->lru = e->prev;
+
+	e->prev = e->next = NULL;
+	s->size -= sizeof(*e) + e->len;
+	e->detached = 1;
+
+	if (!e->refcount)
+		free(e);
+}
+
+/* requires shard lock */
+
+static void
+__jg2_lru_to_head(struct jg2_lru_shard *s, struct jg2_lru_entry *e)
+{
+	if (s->mru == e)
+		return;
+
+	/* take it out of its current place, it can't be the head */
+
+	e->prev->next = e->next;
+	if (e->next)
+		e->next->prev = e->prev;
+	else
+		s->lru = e->prev;
+
+	e->prev = NULL;
+	e->next = s->mru;
+	s->mru->prev = e;
+	s->mru = e;
+}
+
+void
+jg2_lru_destroy(struct jg2_lru **plru)
+{
+	struct jg2_lru *lru = *plru;
+	int n;
+
+	if (!lru)
+		return;
+
+	for (n = 0; n < JG2_LRU_SHARDS; n++) {
+		struct jg2_lru_shard *s = &lru->shard[n];
+
+		pthread_mutex_lock(&s->lock); /* ================ shard lock */
+		while (s->lru)
+			__jg2_lru_unlink(s, s->lru);
+		pthread_mutex_unlock(&s->lock); /* ------------ shard unlock */
+
+		pthread_mutex_destroy(&s->lock);
+	}
+
+	free(lru);
+	*plru = NULL;
+}
+
+/*
+ * Returns a referenced entry matching key, or NULL.  The caller must give the
+ * reference back with jg2_lru_put() when it has finished with the data.
+ */
+
+struct jg2_lru_entry *
+jg2_lru_get(struct jg2_lru *lru, const unsigned char *key)
+{
+	struct jg2_lru_shard *s;
+	struct jg2_lru_entry *e;
+
+	if (!lru)
+		return NULL;
+
+	s = lru_shard(lru, key);
+
+	pthread_mutex_lock(&s->lock); /* ======================== shard lock */
+
+	e = s->bucket[lru_bucket(key)];
+	while (e) {
+		if (!memcmp(e->key, key, sizeof(e->key))) {
+			__jg2_lru_to_head(s, e);
+			e->refcount++;
+			s->hits++;
+			break;
+		}
+		e = e->hash_next;
+	}
+
+	if (!e)
+		s->misses++;
+
+	pthread_mutex_unlock(&s->lock); /* -------------------- shard unlock */
+
+	return e;
+}
+
+void
+jg2_lru_put(struct jg2_lru_entry **pe)
+{
+	struct jg2_lru_entry *e = *pe;
+	struct jg2_lru_shard *s;
+
+	if (!e)
+		return;
+
+	*pe = NULL;
+	s = e->shard;
+
+	pthread_mutex_lock(&s->lock); /* ======================== shard lock */
+	if (!--e->refcount && e->detached)
+		free(e);
+	pthread_mutex_unlock(&s->lock); /* -------------------- shard unlock */
+}
+
+/*
+ * Allocates an entry that can hold len bytes of data, the caller fills
+ * jg2_lru_data(e) and then gives it to jg2_lru_add().  Returns NULL if
+ * it is too big to be worth holding, or OOM.
+ */
+
+struct jg2_lru_entry *
+jg2_lru_alloc(struct jg2_lru *lru, const unsigned char *key, size_t len)
+{
+	struct jg2_lru_entry *e;
+
+	/* don't let one entry take more than a quarter of its shard */
+
+	if (!lru || sizeof(*e) + len > lru->shard_limit / 4)
+		return NULL;
+
+	e = malloc(sizeof(*e) + len);
+	if (!e)
+		return NULL;
+
+	memset(e, 0, sizeof(*e));
+	memcpy(e->key, key, sizeof(e->key));
+	e->shard = lru_shard(lru, key);
+	e->len = len;
+
+	return e;
+}
+
+/*
+ * Adds a filled entry from jg2_lru_alloc() to the LRU, evicting the least
+ * recently used entries in the shard as needed.  The entry is returned
+ * referenced, so it must be given back with jg2_lru_put() after use.
+ *
+ * If someone added the same key meanwhile, our entry is discarded and the
+ * existing one is returned instead; since the keys are content hashes, the
+ * data is the same.
+ */
+
+struct jg2_lru_entry *
+jg2_lru_add(struct jg2_lru *lru, struct jg2_lru_entry *e)
+{
+	struct jg2_lru_shard *s = e->shard;
+	struct jg2_lru_entry *e1;
+	int b = lru_bucket(e->key);
+
+	pthread_mutex_lock(&s->lock); /* ======================== shard lock */
+
+	e1 = s->bucket[b];
+	while (e1) {
+		if (!memcmp(e1->key, e->key, sizeof(e->key))) {
+			__jg2_lru_to_head(s, e1);
+			e1->refcount++;
+			pthread_mutex_unlock(&s->lock); /* ---- shard unlock */
+			free(e);
+
+			return e1;
+		}
+		e1 = e1->hash_next;
+	}
+
+	while (s->lru && s->size + sizeof(*e) + e->len > lru->shard_limit)
+		__jg2_lru_unlink(s, s->lru);
+
+	e->hash_next = s->bucket[b];
+	s->bucket[b] = e;
+
+	e->next = s->mru;
+	if (s->mru)
+		s->mru->prev = e;
+	else
+		s->lru = e;
+	s->mru = e;
+
+	s->size += sizeof(*e) + e->len;
+	e->refcount = 1;
+
+	pthread_mutex_unlock(&s->lock); /* -------------------- shard unlock */
+
+	return e;
+}
+
+void
+jg2_lru_stats(struct jg2_lru *lru, uint64_t *hits, uint64_t *misses,
+	      size_t *size)
+{
+	int n;
+
+	*hits = *misses = 0;
+	*size = 0;
+
+	if (!lru)
+		return;
+
+	for (n = 0; n < JG2_LRU_SHARDS; n++) {
+		*hits += lru->shard[n].hits;
+		*misses += lru->shard[n].misses;
+		*size += lru->shard[n].size;
+	}
+}
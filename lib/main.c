@@ -29,50 +29,307 @@
 #include <sys/types.h>
 #include <sys/time.h>
 
-static struct jg2_global jg2_global;
+static struct jg2_global jg2_global = {
+	.refwatch_fd = -1,
+	.refwatch_lock = PTHREAD_MUTEX_INITIALIZER,
+};
 
-void
-jg2_repo_ref_destroy(struct jg2_ref *r)
+/*
+ * requires vhost lock, r must already be on vhost->repo_list
+ *
+ * The vhost repo_list is indexed by repo_path, so finding an open repo
+ * doesn't depend on how many are open.  The index grows to keep about one
+ * repo per bucket; if it can't, it just works with longer chains.
+ */
+
+#define JG2_REPO_HASH_INITIAL 64
+
+static void
+__jg2_vhost_repo_hash_insert(struct jg2_vhost *vh, struct jg2_repo *r)
 {
-	free(r->ref_name);
-	free(r);
+	unsigned int n = r->path_hash & (vh->repo_hash_size - 1);
+
+	r->hash_next = vh->repo_hash[n];
+	vh->repo_hash[n] = r;
 }
 
-void
-jg2_repo_reflist_destroy(struct jg2_ref *r)
+static void
+__jg2_vhost_repo_index(struct jg2_vhost *vh, struct jg2_repo *r)
 {
-	struct jg2_ref *r1;
+	unsigned int size = vh->repo_hash_size;
+	struct jg2_repo **rh, *r1;
+
+	r->path_hash = jg2_name_hash(r->repo_path);
+	vh->repo_count++;
+
+	if (vh->repo_count > size) {
+		size = size ? size * 2 : JG2_REPO_HASH_INITIAL;
+		rh = jg2_zalloc(size * sizeof(*rh));
+		if (rh) {
+			/* reindex everything, including r, in the new table */
+			free(vh->repo_hash);
+			vh->repo_hash = rh;
+			vh->repo_hash_size = size;
+
+			for (r1 = vh->repo_list; r1; r1 = r1->next)
+				__jg2_vhost_repo_hash_insert(vh, r1);
+
+			return;
+		}
+
+		if (!vh->repo_hash_size)
+			return;
+	}
+
+	__jg2_vhost_repo_hash_insert(vh, r);
+}
+
+/* requires vhost lock */
+
+struct jg2_repo *
+__jg2_vhost_repo_find(struct jg2_vhost *vh, const char *repo_path)
+{
+	uint32_t h = jg2_name_hash(repo_path);
+	struct jg2_repo *r;
+
+	if (!vh->repo_hash_size) {
+		/* we never managed to allocate the index */
+		r = vh->repo_list;
+		while (r && strcmp(r->repo_path, repo_path))
+			r = r->next;
+
+		return r;
+	}
 
+	r = vh->repo_hash[h & (vh->repo_hash_size - 1)];
 	while (r) {
-		r1 = r->next;
-		jg2_repo_ref_destroy(r);
+		if (r->path_hash == h && !strcmp(r->repo_path, repo_path))
+			return r;
+		r = r->hash_next;
+	}
+
+	return NULL;
+}
+
+/*
+ * requires vhost lock
+ *
+ * Open repos are kept on a per-vhost LRU, so we can limit how many are open
+ * at once.  Each open git_repository holds pack mmaps and an object cache,
+ * so after something walked every repo, keeping them all open costs a lot.
+ *
+ * Repos that any ctx is using are never closed, so the limit can be exceeded
+ * while they are busy.  Closing a repo keeps its jrepo, with its refs and
+ * refs hash, so reopening it is just the git_repository_open() and a few
+ * stat()s to confirm the refs didn't change meanwhile.
+ */
+
+#define JG2_MAX_OPEN_REPOS_DEFAULT 256
+#define JG2_REPO_IDLE_SECS_DEFAULT 300
+
+static void
+__jg2_repo_lru_unlink(struct jg2_vhost *vh, struct jg2_repo *r)
+{
+	if (r->lru_prev)
+		r->lru_prev->lru_next = r->lru_next;
+	else
+		vh->repo_mru = r->lru_next;
+
+	if (r->lru_next)
+		r->lru_next->lru_prev = r->lru_prev;
+	else
+		vh->repo_lru = r->lru_prev;
+
+	r->lru_prev = r->lru_next = NULL;
+}
+
+static void
+__jg2_repo_lru_to_head(struct jg2_vhost *vh, struct jg2_repo *r)
+{
+	r->last_used = time(NULL);
+
+	if (vh->repo_mru == r)
+		return;
+
+	if (r->lru_prev || r->lru_next || vh->repo_lru == r)
+		__jg2_repo_lru_unlink(vh, r);
+
+	r->lru_next = vh->repo_mru;
+	if (vh->repo_mru)
+		vh->repo_mru->lru_prev = r;
+	else
+		vh->repo_lru = r;
+	vh->repo_mru = r;
+}
+
+/* requires vhost lock */
+
+static void
+__jg2_repo_close(struct jg2_vhost *vh, struct jg2_repo *r)
+{
+	__jg2_repo_lru_unlink(vh, r);
+
+#if defined(JG2_HAVE_SYS_INOTIFY_H)
+	__jg2_refwatch_remove(&jg2_global, r);
+#endif
+
+	git_repository_free(r->repo);
+	r->repo = NULL;
+
+	vh->repos_open--;
+	vh->repo_evictions++;
+}
+
+/*
+ * requires vhost lock
+ *
+ * Close the least recently used repos nobody is using until there are no more
+ * than limit open, and any that nobody used for idle_secs.
+ */
+
+static void
+__jg2_vhost_repo_evict(struct jg2_vhost *vh, unsigned int limit,
+		       unsigned int idle_secs)
+{
+	struct jg2_repo *r = vh->repo_lru, *r1;
+	time_t t = time(NULL);
+
+	while (r) {
+		r1 = r->lru_prev;
+
+		/* ctx only join or leave the repo under the vhost lock */
+
+		if (!r->ctx_repo_list &&
+		    (vh->repos_open > limit ||
+		     (unsigned int)(t - r->last_used) >= idle_secs))
+			__jg2_repo_close(vh, r);
+
 		r = r1;
 	}
 }
 
+static unsigned int
+jg2_vhost_max_open_repos(struct jg2_vhost *vh)
+{
+	return vh->cfg.max_open_repos ? vh->cfg.max_open_repos :
+					JG2_MAX_OPEN_REPOS_DEFAULT;
+}
+
+static unsigned int
+jg2_vhost_repo_idle_secs(struct jg2_vhost *vh)
+{
+	return vh->cfg.repo_idle_secs ? vh->cfg.repo_idle_secs :
+					JG2_REPO_IDLE_SECS_DEFAULT;
+}
+
+/* requires vhost lock */
+
+static int
+__jg2_repo_open(struct jg2_vhost *vh, struct jg2_repo *r)
+{
+	const git_error *err;
+	int m;
+
+	/* make room for the one we're opening */
+
+	__jg2_vhost_repo_evict(vh, jg2_vhost_max_open_repos(vh) - 1,
+			       jg2_vhost_repo_idle_secs(vh));
+
+	m = git_repository_open_ext(&r->repo, r->repo_path, 0, NULL);
+	if (m < 0) {
+		err = giterr_last();
+
+		lwsl_err("repo open failed %s: %d\n", r->repo_path, m);
+		if (err)
+			lwsl_err("Error %d: %s\n", err->klass, err->message);
+		r->repo = NULL;
+
+		return 1;
+	}
+
+	vh->repos_open++;
+	vh->repo_opens++;
+	__jg2_repo_lru_to_head(vh, r);
+
+#if defined(JG2_HAVE_SYS_INOTIFY_H)
+	__jg2_refwatch_add(&jg2_global, r);
+#endif
+
+	if (r->reftab) {
+		/*
+		 * We were open before and kept the refs.  If the stat()s say
+		 * nothing changed, we don't need to iterate them again yet.
+		 */
+		r->last_update = 0;
+		r->last_full = time(NULL);
+	}
+
+	__repo_reflist_update(vh, r);
+
+	return 0;
+}
+
+/*
+ * Called from the cache thread from time to time, closes repos nobody used
+ * for repo_idle_secs.
+ */
+
+void
+jg2_vhost_repo_evict_idle(struct jg2_vhost *vh)
+{
+	pthread_mutex_lock(&vh->lock); /* ======================== vhost lock */
+	__jg2_vhost_repo_evict(vh, jg2_vhost_max_open_repos(vh),
+			       jg2_vhost_repo_idle_secs(vh));
+	pthread_mutex_unlock(&vh->lock); /* -------------------- vhost unlock */
+}
+
 void
 jg2_repo_destroy(struct jg2_repo *r)
 {
 	struct jg2_repo *r1 = r->vhost->repo_list, **ro = &r->vhost->repo_list;
+	struct jg2_vhost *vh = r->vhost;
+
+	/* remove from vhost repo index */
+
+	if (vh->repo_hash_size) {
+		ro = &vh->repo_hash[r->path_hash & (vh->repo_hash_size - 1)];
+		while (*ro) {
+			if (*ro == r) {
+				*ro = r->hash_next;
+				break;
+			}
+			ro = &(*ro)->hash_next;
+		}
+		ro = &vh->repo_list;
+	}
 
-	free(r->repo_path);
 	if (r->repo) {
+		__jg2_repo_lru_unlink(vh, r);
+#if defined(JG2_HAVE_SYS_INOTIFY_H)
+		/* other vhosts may still be sharing the watches */
+		__jg2_refwatch_remove(&jg2_global, r);
+#endif
+		vh->repos_open--;
 		git_repository_free(r->repo);
 		r->repo = NULL;
 	}
+	free(r->repo_path);
 
 	/* remove from vhost repo list */
 
 	while (r1) {
 		if (r1 == r) {
 			*ro = r1->next;
+			vh->repo_count--;
 			break;
 		}
 		ro = &r1->next;
 		r1 = r1->next;
 	}
 
-	jg2_repo_reflist_destroy(r->ref_list);
+	jg2_reftab_put(r, &r->reftab);
+	jg2_cmeta_put(r, &r->cmeta);
+	jg2_lastc_destroy_all(r);
 
 	pthread_mutex_destroy(&r->lock);
 
@@ -147,17 +404,27 @@ jg2_repodir_find_create(struct jg2_repodir **phead, const char *path)
 
 	if (phead == &jg2_global.cachedir_head) {
 		jg2_global.count_cachedirs++;
+#if defined(JG2_HAVE_SYS_INOTIFY_H)
+		if (jg2_global.count_cachedirs == 1)
+			/* failure is OK, the cache thread polls instead */
+			jg2_refwatch_init(&jg2_global);
+#endif
 		if (jg2_global.count_cachedirs == 1 &&
 		    cache_trim_thread_spawn(&jg2_global)) {
 			lwsl_err("cache trim thread creation failed\n");
 			free(rd);
 			jg2_global.count_cachedirs--;
+#if defined(JG2_HAVE_SYS_INOTIFY_H)
+			jg2_refwatch_deinit(&jg2_global);
+#endif
 
 			return NULL;
 		}
 	}
 
 	pthread_mutex_init(&rd->lock, NULL);
+	pthread_mutex_init(&rd->ongoing_lock, NULL);
+	pthread_cond_init(&rd->ongoing_cond, NULL);
 
 	strncpy(rd->repo_base_dir, path, sizeof(rd->repo_base_dir) - 1);
 	rd->repo_base_dir[sizeof(rd->repo_base_dir) - 1] = '\0';
@@ -182,8 +449,11 @@ jg2_repodir_destroy(struct jg2_repodir **phead, struct jg2_repodir *repodir)
 lwsl_err("match %p\n", rd->dcs);
 			if (rd->dcs)
 				lws_diskcache_destroy(&rd->dcs);
+			jg2_lru_destroy(&rd->hot);
 
 			pthread_mutex_destroy(&rd->lock);
+			pthread_mutex_destroy(&rd->ongoing_lock);
+			pthread_cond_destroy(&rd->ongoing_cond);
 			lwsac_free(&rd->rei_lwsac_head);
 			free(rd);
 			break;
@@ -237,8 +507,14 @@ jg2_vhost_create(const struct jg2_vhost_config *config)
 
 	email_vhost_init(vhost);
 
+	vhost->summaries = jg2_lru_create(config->summary_cache_size_limit ?
+			config->summary_cache_size_limit : 4 * MIB);
+	if (!vhost->summaries)
+		goto bail;
+
 	if (!jg2_global.vhost_head) {
 		pthread_mutex_init(&jg2_global.lock, NULL);
+		pthread_cond_init(&jg2_global.unpinned, NULL);
 
 		if (jg2_gitolite3_interface(&jg2_global, config->repo_base_dir)) {
 			lwsl_err("couldn't init gl3 interface\n");
@@ -249,6 +525,13 @@ jg2_vhost_create(const struct jg2_vhost_config *config)
 				__func__, jg2_global.gitolite_version);
 	}
 
+	/* the cache thread looks after the fifo, so only if we have a cache */
+
+	vhost->refchange_fd = -1;
+	if (config->json_cache_base)
+		/* failure is OK, refchanges are still noticed, just later */
+		jg2_refchange_fifo_open(vhost);
+
 	/* add ourselves to the global vhost list */
 
 	pthread_mutex_lock(&jg2_global.lock); /* ================ global lock */
@@ -284,6 +567,14 @@ jg2_vhost_create(const struct jg2_vhost_config *config)
 
 		if (!vhost->cachedir->dcs)
 			goto bail;
+
+		if (!vhost->cachedir->hot) {
+			vhost->cachedir->hot = jg2_lru_create(
+				config->hot_cache_size_limit ?
+				   config->hot_cache_size_limit : 16 * MIB);
+			if (!vhost->cachedir->hot)
+				goto bail;
+		}
 	}
 
 	if (vhost->cfg.vhost_html_filepath) {
@@ -303,17 +594,42 @@ bail:
 	lwsl_err("%s: failed\n", __func__);
 	pthread_mutex_unlock(&vhost->lock); /* ----------------- vhost unlock */
 
+	jg2_refchange_fifo_close(vhost);
+	jg2_lru_destroy(&vhost->summaries);
 	free(vhost);
 
 	return NULL;
 }
 
+void
+jg2_vhost_get_stats(struct jg2_vhost *vhost, struct jg2_vhost_stats *stats)
+{
+	size_t size;
+
+	pthread_mutex_lock(&vhost->lock); /* ===================== vhost lock */
+
+	stats->repo_opens = vhost->repo_opens;
+	stats->repo_evictions = vhost->repo_evictions;
+	stats->repos_open = vhost->repos_open;
+	stats->repos_known = vhost->repo_count;
+
+	stats->cache_hits = vhost->cache_hits;
+	stats->cache_tries = vhost->cache_tries;
+	stats->etag_hits = vhost->etag_hits;
+	stats->etag_tries = vhost->etag_tries;
+
+	jg2_lru_stats(vhost->summaries, &stats->summary_hits,
+		      &stats->summary_misses, &size);
+
+	pthread_mutex_unlock(&vhost->lock); /* ----------------- vhost unlock */
+}
+
 /* must hold vhost lock */
 
 static int
 __jg2_ctx_destroy(struct jg2_ctx *ctx)
 {
-	struct jg2_ctx **oc = NULL, *c = NULL;
+	struct jg2_ctx **oc = NULL, *c = NULL, *orphan;
 
 	if (!ctx)
 		return 0;
@@ -329,16 +645,38 @@ __jg2_ctx_destroy(struct jg2_ctx *ctx)
 	 */
 	if (ctx->job) {
 		ctx->job(ctx);
-		if (ctx->fd_cache != -1) {
-			close(ctx->fd_cache);
-			unlink(ctx->cache);
-		}
+		jg2_cache_abandon(ctx);
 	} else
 		if (ctx->fd_cache != -1) {
 			close(ctx->fd_cache);
 			ctx->fd_cache = -1;
 		}
 
+	if (ctx->range_fd != -1) {
+		close(ctx->range_fd);
+		ctx->range_fd = -1;
+	}
+
+#if defined(JG2_HAVE_ZLIB_H)
+	jg2_gz_ctx_destroy(ctx);
+#endif
+
+	jg2_lru_put(&ctx->hot);
+	if (ctx->jrepo) {
+		jg2_reftab_put(ctx->jrepo, &ctx->reftab);
+		jg2_cmeta_put(ctx->jrepo, &ctx->cmeta);
+		jg2_lastc_put(ctx->jrepo, &ctx->lastc);
+	}
+	if (ctx->vhost->cachedir) {
+		orphan = jg2_ongoing_unfollow(ctx->vhost->cachedir,
+					      &ctx->follow);
+		if (orphan)
+			/* we were the last one waiting on it */
+			__jg2_ctx_destroy(orphan);
+
+		jg2_ongoing_finish(ctx->vhost->cachedir, &ctx->lead, NULL);
+	}
+
 	/* remove ourselves from "ctx using vhost" list */
 
 	c = NULL;
@@ -376,6 +714,9 @@ __jg2_ctx_destroy(struct jg2_ctx *ctx)
 			c = c->ctx_using_repo_next;
 		}
 
+		/* the repo is idle from when the last ctx stops using it */
+		ctx->jrepo->last_used = time(NULL);
+
 		pthread_mutex_unlock(&ctx->jrepo->lock);
 	}
 
@@ -402,6 +743,7 @@ __jg2_ctx_destroy(struct jg2_ctx *ctx)
 
 	jg2_repopath_destroy(&ctx->sr);
 
+	free(ctx->acl_user_copy);
 	free(ctx->md5_ctx);
 
 	free(ctx);
@@ -409,12 +751,70 @@ __jg2_ctx_destroy(struct jg2_ctx *ctx)
 	return 0;
 }
 
+/*
+ * If we are creating a cache entry that other ctx are following, when our
+ * client goes away we don't want to let them down.  The ctx is handed to
+ * the ongoing entry instead of being destroyed, and the followers drive it to
+ * the end of the entry.  It can't use anything the user gave it any more.
+ *
+ * Returns 0 if the ctx was orphaned, or nonzero if it should be destroyed.
+ *
+ * must hold vhost lock
+ */
+
+static int
+__jg2_ctx_orphan(struct jg2_ctx *ctx)
+{
+	if (ctx->orphaned || !ctx->lead || !ctx->job || ctx->destroying ||
+	    !ctx->vhost->cachedir)
+		return 1;
+
+	if (ctx->acl_user) {
+		ctx->acl_user_copy = strdup(ctx->acl_user);
+		if (!ctx->acl_user_copy)
+			return 1;
+		ctx->acl_user = ctx->acl_user_copy;
+	}
+
+	ctx->user = NULL;
+	ctx->orphaned = 1;
+
+	/* once it's orphaned, a follower may finish and destroy it any time */
+
+	return jg2_ongoing_orphan(ctx->vhost->cachedir, ctx->lead, ctx);
+}
+
 void
 jg2_vhost_destroy(struct jg2_vhost *vhost)
 {
 	struct jg2_repo *r, *r1;
 	struct jg2_vhost *vh, **ovh;
 
+	/*
+	 * remove ourselves from the global vhost list, so the cache thread
+	 * can't find us any more, and wait for anything it is still doing
+	 * with us outside the global lock
+	 */
+
+	pthread_mutex_lock(&jg2_global.lock); /* ================ global lock */
+
+	ovh = &jg2_global.vhost_head;
+	vh = *ovh;
+	while (vh) {
+		if (vh == vhost) {
+			*ovh = vh->vhost_list;
+			break;
+		}
+		ovh = &vh->vhost_list;
+		vh = vh->vhost_list;
+	}
+
+	vhost->dying = 1;
+	while (vhost->pinned)
+		pthread_cond_wait(&jg2_global.unpinned, &jg2_global.lock);
+
+	pthread_mutex_unlock(&jg2_global.lock); /* ------------ global unlock */
+
 	pthread_mutex_lock(&vhost->lock); /* ===================== vhost lock */
 
 	r = vhost->repo_list;
@@ -425,11 +825,16 @@ jg2_vhost_destroy(struct jg2_vhost *vhost)
 		r = r1;
 	}
 
+	free(vhost->repo_hash);
+	vhost->repo_hash = NULL;
+	vhost->repo_hash_size = 0;
+
 	giterr_clear();
 
 	jg2_safe_libgit2_deinit();
 
 	email_vhost_deinit(vhost);
+	jg2_lru_destroy(&vhost->summaries);
 
 	if (vhost->html_content)
 		lwsac_use_cached_file_detach(&vhost->html_content);
@@ -439,14 +844,19 @@ jg2_vhost_destroy(struct jg2_vhost *vhost)
 	if (vhost->cachedir && !--vhost->cachedir->refcount) {
 		void *retval;
 
-		if (!--jg2_global.count_cachedirs)
+		if (!--jg2_global.count_cachedirs) {
 
 			/*
-			 * we're about to destroy things the cache thread relies
-			 * on.  Bring the cache thread to an end.
+			 * we're about to destroy things the cache and index
+			 * threads rely on.  Bring them to an end.
 			 */
 
 			pthread_join(jg2_global.cache_thread, &retval);
+			pthread_join(jg2_global.index_thread, &retval);
+#if defined(JG2_HAVE_SYS_INOTIFY_H)
+			jg2_refwatch_deinit(&jg2_global);
+#endif
+		}
 	}
 
 	/*
@@ -464,26 +874,14 @@ jg2_vhost_destroy(struct jg2_vhost *vhost)
 	if (vhost->cachedir && !vhost->cachedir->refcount)
 		jg2_repodir_destroy(&jg2_global.cachedir_head, vhost->cachedir);
 
-	/* remove ourselves from the global vhost list */
+	/* the cache thread can no longer find us to poll the fifo */
 
-	pthread_mutex_lock(&jg2_global.lock); /* ================ global lock */
-
-	ovh = &jg2_global.vhost_head;
-	vh = *ovh;
-	while (vh) {
-		if (vh == vhost) {
-			*ovh = vh->vhost_list;
-			break;
-		}
-		ovh = &vh->vhost_list;
-		vh = vh->vhost_list;
-	}
-
-	pthread_mutex_unlock(&jg2_global.lock); /* ------------ global unlock */
+	jg2_refchange_fifo_close(vhost);
 
 	if (!jg2_global.vhost_head) {
 		jg2_gitolite3_interface_destroy(&jg2_global);
 		/* we were the last vhost going away, destroy global assets */
+		pthread_cond_destroy(&jg2_global.unpinned);
 		pthread_mutex_destroy(&jg2_global.lock);
 	}
 
@@ -540,6 +938,8 @@ jg2_ctx_create(struct jg2_vhost *vhost, struct jg2_ctx **_ctx,
 	ctx->vhost = vhost;
 	ctx->user = args->user;
 	ctx->fd_cache = -1;
+	ctx->range_fd = -1;
+	ctx->fd_gz = -1;
 	gettimeofday(&ctx->tv_gen, NULL);
 
 	if (args->etag_length)
@@ -607,6 +1007,18 @@ jg2_ctx_create(struct jg2_vhost *vhost, struct jg2_ctx **_ctx,
 		flags &= ~JG2_CTX_FLAG_HTML;
 
 	ctx->flags = flags;
+
+	if (args->content_encoding)
+		*args->content_encoding = NULL;
+
+#if defined(JG2_HAVE_ZLIB_H)
+	/* naked content goes out as it is */
+	if (args->content_encoding &&
+	    !(ctx->sr.e[JG2_PE_MODE] && jg2_job_naked(ctx)) &&
+	    jg2_gz_ctx_init(ctx, args->accept_encoding))
+		*args->content_encoding = "gzip";
+#endif
+
 	ctx->html_state = (flags & JG2_CTX_FLAG_HTML) ? HTML_STATE_HTML_META :
 							HTML_STATE_JOB1;
 
@@ -636,7 +1048,8 @@ jg2_ctx_create(struct jg2_vhost *vhost, struct jg2_ctx **_ctx,
 		goto bail1;
 	}
 
-	ctx->md5_ctx = vhost->cfg.md5_alloc();
+	if (jg2_chash_md5(vhost))
+		ctx->md5_ctx = vhost->cfg.md5_alloc();
 
 	if (!ctx->sr.e[JG2_PE_NAME] ||
 	    !ctx->sr.e[JG2_PE_NAME][0]) {
@@ -659,25 +1072,28 @@ jg2_ctx_create(struct jg2_vhost *vhost, struct jg2_ctx **_ctx,
 
 	/* is the repo already open? */
 
-	r = vhost->repo_list;
-	while (r) {
-
-		if (!strcmp(r->repo_path, filepath)) {
-			/* the new ctx knows its using this jrepo then... */
-			ctx->jrepo = r;
-			/*
-			 * insert into ctx into the jrepo's
-			 * list of ctx using it
-			 */
-			pthread_mutex_lock(&r->lock); /* ==========jrepo lock */
-			ctx->ctx_using_repo_next = r->ctx_repo_list;
-			r->ctx_repo_list = ctx;
-			pthread_mutex_unlock(&r->lock); /*-------jrepo unlock */
-			/* (keep vhost lock) */
-			goto do_mime;
+	r = __jg2_vhost_repo_find(vhost, filepath);
+	if (r) {
+		/* we know it, but it may have been closed while idle */
+		if (!r->repo && __jg2_repo_open(vhost, r)) {
+			pthread_mutex_unlock(&vhost->lock); /* - vhost unlock */
+			m = JG2_CTX_CREATE_REPO_OPEN_FAIL;
+			goto bail1;
 		}
-
-		r = r->next;
+		__jg2_repo_lru_to_head(vhost, r);
+
+		/* the new ctx knows its using this jrepo then... */
+		ctx->jrepo = r;
+		/*
+		 * insert into ctx into the jrepo's
+		 * list of ctx using it
+		 */
+		pthread_mutex_lock(&r->lock); /* ================== jrepo lock */
+		ctx->ctx_using_repo_next = r->ctx_repo_list;
+		r->ctx_repo_list = ctx;
+		pthread_mutex_unlock(&r->lock); /* -------------- jrepo unlock */
+		/* (keep vhost lock) */
+		goto do_mime;
 	}
 
 	/* no, we have to create it */
@@ -699,14 +1115,7 @@ jg2_ctx_create(struct jg2_vhost *vhost, struct jg2_ctx **_ctx,
 		goto bail2;
 	}
 
-	m = git_repository_open_ext(&r->repo, r->repo_path, 0, NULL);
-	if (m < 0) {
-		const git_error *err = giterr_last();
-
-		lwsl_err("repo open failed %s: %d\n", r->repo_path, m);
-		if (err)
-			lwsl_err("Error %d: %s\n", err->klass, err->message);
-
+	if (__jg2_repo_open(vhost, r)) {
 		pthread_mutex_unlock(&vhost->lock); /* --------- vhost unlock */
 		m = JG2_CTX_CREATE_REPO_OPEN_FAIL;
 		goto bail3;
@@ -714,13 +1123,12 @@ jg2_ctx_create(struct jg2_vhost *vhost, struct jg2_ctx **_ctx,
 
 	ctx->jrepo = r;
 
-	__repo_reflist_update(vhost, r);
-
 	/* we start the new jrepo's "ctx using repo" list with ourselves */
 	r->ctx_repo_list = ctx;
 
 	r->next = vhost->repo_list;
 	vhost->repo_list = r;
+	__jg2_vhost_repo_index(vhost, r);
 
 do_mime:
 
@@ -818,6 +1226,9 @@ bail2:
 	}
 
 bail1:
+#if defined(JG2_HAVE_ZLIB_H)
+	jg2_gz_ctx_destroy(ctx);
+#endif
 	jg2_repopath_destroy(&ctx->sr);
 
 	if (ctx->md5_ctx)
@@ -842,6 +1253,13 @@ jg2_ctx_destroy(struct jg2_ctx *ctx)
 
 	pthread_mutex_lock(&vh->lock); /* ======================== vhost lock */
 
+	if (!__jg2_ctx_orphan(ctx)) {
+		/* it carries on for its followers without us */
+		pthread_mutex_unlock(&vh->lock); /*------------- vhost unlock */
+
+		return 0;
+	}
+
 	ctx->destroying = 1;
 
 	__jg2_ctx_destroy(ctx);
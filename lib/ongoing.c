@@ -0,0 +1,388 @@
+/*
+ * libjsongit2 - tracking of cache entries being generated
+ *
+ * Copyright (C) 2018-2025 Andy Green <andy@warmcat.com>
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation:
+ *  version 2.1 of the License.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ *  MA  02110-1301  USA
+ *
+ * When a ctx starts creating a cache entry, it registers it here on the
+ * cachedir as "ongoing", keyed by the cache hash.  Anyone else wanting the
+ * same thing meanwhile can then find it instead of doing all the same work
+ * again.
+ *
+ * For JSON jobs, the leader's temp cache file is recorded, and followers
+ * tail it as the leader writes it, waiting on the cachedir condition when
+ * they caught up.  The search trie indexing uses it to track the progress
+ * of the indexing, which can't be followed but can be reported.
+ *
+ * Entries are refcounted, since followers may still be reading the temp
+ * file after the leader finished and removed the entry from the list.
+ *
+ * If the leader's client goes away while there are followers, the leader ctx
+ * is left on the entry as an "orphan" instead of being destroyed.  Whichever
+ * follower finds it has caught up with the temp file adopts it for a moment
+ * and drives its job on, so the entry still gets finished.  If the last
+ * follower leaves first, it gets the orphan back to destroy.
+ */
+
+#include "private.h"
+
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdio.h>
+#include <time.h>
+
+/* requires ongoing lock */
+
+static struct jg2_ongoing *
+__jg2_ongoing_find(struct jg2_repodir *cd, const char *hash)
+{
+	struct jg2_ongoing *o = cd->ongoing_head;
+
+	while (o) {
+		if (!strcmp(hash, o->hash))
+			return o;
+		o = o->next;
+	}
+
+	return NULL;
+}
+
+/* requires ongoing lock */
+
+static void
+__jg2_ongoing_remove(struct jg2_repodir *cd, struct jg2_ongoing *o)
+{
+	struct jg2_ongoing **po = &cd->ongoing_head;
+
+	while (*po) {
+		if (*po == o) {
+			*po = o->next;
+			o->next = NULL;
+			break;
+		}
+		po = &(*po)->next;
+	}
+}
+
+/*
+ * Register that we are creating the cache entry for hash, in temp file path
+ * (which may be NULL if nobody can follow it).  Returns the referenced entry,
+ * or NULL if someone else is already creating it, or OOM.
+ */
+
+struct jg2_ongoing *
+jg2_ongoing_lead(struct jg2_repodir *cd, const char *hash, const char *path)
+{
+	struct jg2_ongoing *o;
+
+	pthread_mutex_lock(&cd->ongoing_lock); /* ============= ongoing lock */
+
+	if (__jg2_ongoing_find(cd, hash)) {
+		o = NULL;
+		goto bail;
+	}
+
+	o = jg2_zalloc(sizeof(*o));
+	if (!o)
+		goto bail;
+
+	lws_strncpy(o->hash, hash, sizeof(o->hash));
+	if (path)
+		lws_strncpy(o->path, path, sizeof(o->path));
+	o->started = time(NULL);
+	o->refcount = 1;
+
+	o->next = cd->ongoing_head;
+	cd->ongoing_head = o;
+
+bail:
+	pthread_mutex_unlock(&cd->ongoing_lock); /* --------- ongoing unlock */
+
+	return o;
+}
+
+/*
+ * If someone is creating the cache entry for hash in a temp file, open it
+ * for read and return the referenced entry.  Else NULL.
+ */
+
+struct jg2_ongoing *
+jg2_ongoing_follow(struct jg2_repodir *cd, const char *hash, int *fd)
+{
+	struct jg2_ongoing *o;
+
+	pthread_mutex_lock(&cd->ongoing_lock); /* ============= ongoing lock */
+
+	o = __jg2_ongoing_find(cd, hash);
+	if (!o || !o->path[0])
+		goto bail;
+
+	/*
+	 * While it's listed, the leader can't rename or unlink the temp file
+	 * without taking the ongoing lock we're holding
+	 */
+
+	*fd = open(o->path, O_RDONLY);
+	if (*fd < 0) {
+		lwsl_notice("%s: unable to open %s: errno %d\n", __func__,
+			    o->path, errno);
+		o = NULL;
+		goto bail;
+	}
+
+	o->refcount++;
+
+bail:
+	pthread_mutex_unlock(&cd->ongoing_lock); /* --------- ongoing unlock */
+
+	return o;
+}
+
+/*
+ * Copy out the search indexing progress for hash, returns 0 if found or
+ * nonzero if nothing ongoing for hash
+ */
+
+int
+jg2_ongoing_progress(struct jg2_repodir *cd, const char *hash,
+		     uint32_t *files, uint32_t *done)
+{
+	struct jg2_ongoing *o;
+
+	pthread_mutex_lock(&cd->ongoing_lock); /* ============= ongoing lock */
+
+	o = __jg2_ongoing_find(cd, hash);
+	if (o) {
+		*files = o->index_files_to_do;
+		*done = o->index_files_done;
+	}
+
+	pthread_mutex_unlock(&cd->ongoing_lock); /* --------- ongoing unlock */
+
+	return !o;
+}
+
+/* the leader wrote len more bytes into the temp file */
+
+void
+jg2_ongoing_written(struct jg2_repodir *cd, struct jg2_ongoing *o, size_t len)
+{
+	pthread_mutex_lock(&cd->ongoing_lock); /* ============= ongoing lock */
+	o->written += len;
+	pthread_cond_broadcast(&cd->ongoing_cond);
+	pthread_mutex_unlock(&cd->ongoing_lock); /* --------- ongoing unlock */
+}
+
+/*
+ * The leader has finished, successfully if final is non-NULL, in which case
+ * the temp file is renamed to final.  The entry is no longer findable, but
+ * followers can finish reading it.  The leader's reference is given up.
+ *
+ * Returns nonzero if the rename failed.
+ */
+
+int
+jg2_ongoing_finish(struct jg2_repodir *cd, struct jg2_ongoing **po,
+		   const char *final)
+{
+	struct jg2_ongoing *o = *po;
+	int n = 0;
+
+	if (!o)
+		return 0;
+
+	pthread_mutex_lock(&cd->ongoing_lock); /* ============= ongoing lock */
+
+	__jg2_ongoing_remove(cd, o);
+
+	if (final && o->path[0]) {
+		n = rename(o->path, final);
+		if (n)
+			unlink(o->path);
+	} else
+		if (o->path[0])
+			unlink(o->path);
+
+	if (final && !n)
+		o->done = 1;
+	else
+		o->failed = 1;
+
+	pthread_cond_broadcast(&cd->ongoing_cond);
+	pthread_mutex_unlock(&cd->ongoing_lock); /* --------- ongoing unlock */
+
+	jg2_ongoing_put(cd, po);
+
+	return n;
+}
+
+/*
+ * Follower waits up to 100ms for the leader to have written more than pos
+ * bytes.  Returns 1 if there is more to read, setting *avail, 0 if the leader
+ * finished and we have read everything (*avail is then the total size), 2 if
+ * there is nothing more yet, and -1 if the leader failed.
+ */
+
+int
+jg2_ongoing_wait(struct jg2_repodir *cd, struct jg2_ongoing *o, size_t pos,
+		 size_t *avail)
+{
+	struct timespec ts;
+	int n = 2;
+
+	pthread_mutex_lock(&cd->ongoing_lock); /* ============= ongoing lock */
+
+	if (o->written == pos && !o->done && !o->failed) {
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_nsec += 100000000;
+		if (ts.tv_nsec >= 1000000000) {
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000;
+		}
+		pthread_cond_timedwait(&cd->ongoing_cond, &cd->ongoing_lock,
+				       &ts);
+	}
+
+	*avail = o->written;
+
+	if (o->written > pos)
+		n = 1;
+	else
+		if (o->done)
+			n = 0;
+		else
+			if (o->failed)
+				n = -1;
+
+	pthread_mutex_unlock(&cd->ongoing_lock); /* --------- ongoing unlock */
+
+	return n;
+}
+
+/*
+ * The leader ctx lost its client.  If anybody is following, the entry takes
+ * the ctx as its orphan and returns 0.  Else it returns nonzero and the ctx
+ * should just be destroyed.
+ */
+
+int
+jg2_ongoing_orphan(struct jg2_repodir *cd, struct jg2_ongoing *o,
+		   struct jg2_ctx *ctx)
+{
+	int n = 1;
+
+	pthread_mutex_lock(&cd->ongoing_lock); /* ============= ongoing lock */
+
+	if (o->refcount > 1 && !o->done && !o->failed) {
+		o->orphan = ctx;
+		n = 0;
+	}
+
+	pthread_mutex_unlock(&cd->ongoing_lock); /* --------- ongoing unlock */
+
+	return n;
+}
+
+/*
+ * A follower wants to drive the orphaned leader, if there is one and nobody
+ * else is doing it.  It must give it back with jg2_ongoing_release().
+ */
+
+struct jg2_ctx *
+jg2_ongoing_adopt(struct jg2_repodir *cd, struct jg2_ongoing *o)
+{
+	struct jg2_ctx *ctx = NULL;
+
+	pthread_mutex_lock(&cd->ongoing_lock); /* ============= ongoing lock */
+
+	if (o->orphan && !o->adopted) {
+		o->adopted = 1;
+		ctx = o->orphan;
+	}
+
+	pthread_mutex_unlock(&cd->ongoing_lock); /* --------- ongoing unlock */
+
+	return ctx;
+}
+
+/* gone means the adopter is destroying the orphan */
+
+void
+jg2_ongoing_release(struct jg2_repodir *cd, struct jg2_ongoing *o, int gone)
+{
+	pthread_mutex_lock(&cd->ongoing_lock); /* ============= ongoing lock */
+
+	o->adopted = 0;
+	if (gone)
+		o->orphan = NULL;
+
+	pthread_mutex_unlock(&cd->ongoing_lock); /* --------- ongoing unlock */
+}
+
+/*
+ * A follower gives up its reference.  If it was the last follower of an
+ * orphaned leader, nobody needs the entry any more: it's delisted and the
+ * orphan is returned for the caller to destroy.
+ */
+
+struct jg2_ctx *
+jg2_ongoing_unfollow(struct jg2_repodir *cd, struct jg2_ongoing **po)
+{
+	struct jg2_ongoing *o = *po;
+	struct jg2_ctx *ctx = NULL;
+
+	if (!o)
+		return NULL;
+
+	pthread_mutex_lock(&cd->ongoing_lock); /* ============= ongoing lock */
+
+	if (o->refcount == 2 && o->orphan && !o->adopted) {
+		ctx = o->orphan;
+		o->orphan = NULL;
+		__jg2_ongoing_remove(cd, o);
+	}
+
+	pthread_mutex_unlock(&cd->ongoing_lock); /* --------- ongoing unlock */
+
+	jg2_ongoing_put(cd, po);
+
+	return ctx;
+}
+
+void
+jg2_ongoing_put(struct jg2_repodir *cd, struct jg2_ongoing **po)
+{
+	struct jg2_ongoing *o = *po;
+	int n;
+
+	if (!o)
+		return;
+
+	*po = NULL;
+
+	pthread_mutex_lock(&cd->ongoing_lock); /* ============= ongoing lock */
+	n = !--o->refcount;
+	if (n)
+		__jg2_ongoing_remove(cd, o);
+	pthread_mutex_unlock(&cd->ongoing_lock); /* --------- ongoing unlock */
+
+	if (n)
+		free(o);
+}
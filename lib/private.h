@@ -35,7 +35,9 @@
 #define LIBGIT2_HAS_BLAME_MAILMAP	(LG2_VERSION(0, 28) >= 0)
 #define LIBGIT2_HAS_BLAME		(LG2_VERSION(0, 21) >= 0)
 #define LIBGIT2_HAS_REPO_CONFIG_SNAP	(LG2_VERSION(0, 21) >= 0)
+#define LIBGIT2_HAS_DIFF_FILE_ID	(LG2_VERSION(0, 21) >= 0)
 #define LIBGIT2_HAS_GIT_BUF		(LG2_VERSION(0, 24) > 0)
+#define LIBGIT2_HAS_DESCENDANT_OF	(LG2_VERSION(0, 24) >= 0)
 #define LIBGIT2_HAS_DIFF		(LG2_VERSION(0, 19) > 0)
 #define LIBGIT2_HAS_STR_BUF		(LG2_VERSION(0, 19) > 0)
 #define LIBGIT2_HAS_REFCOUNTED_INIT	(LG2_VERSION(0, 19) > 0)
@@ -54,7 +56,7 @@
 #include <archive_entry.h>
 #endif
 
-#define JG2_JSON_EPOCH 1
+#define JG2_JSON_EPOCH 2
 
 struct jg2_ctx;
 struct jg2_vhost;
@@ -68,13 +70,31 @@ struct jg2_vhost;
 
 #define CTX_BUF_APPEND(...) ctx->p += lws_snprintf(ctx->p, \
 				lws_ptr_diff(ctx->end, ctx->p), __VA_ARGS__)
+
+/*
+ * One record of typed JSON emitters, see json-writer.c.  need must be at
+ * least the most the record's emitters may write.
+ */
+
+struct jg2_jw {
+	char *p;
+	char *end;
+	char fits; /* the whole record fits, no need to check */
+};
+
+#define JG2_JW_LIT(w, lit) jg2_jw_mem(w, lit, sizeof(lit) - 1)
+#define JG2_JW_NUM_MAX 20 /* the most a 64-bit number formats to */
+
 #define JG2_MD5_LEN 16
+#define JG2_IDENT_LEN 64 /* purified name or email in summaries */
+#define JG2_SUMMARY_LEN 100 /* purified commit subject in summaries */
 #define MIB (1024 * 1024)
 #define KIB (1024)
 
 #include "conf/private.h"
 #include "job/private.h"
 #include "email/private.h"
+#include "hash/private.h"
 
 #define JG2_HTML_META	 "<!-- libjsongit2:meta-description -->"
 #define JG2_HTML_META_LEN 37
@@ -92,6 +112,22 @@ struct jg2_vhost;
 #define JG2_HAS_SPACE(ctx, num) (lws_ptr_diff(ctx->end, ctx->p) > \
 				 JG2_RESERVE_SEAL + num)
 
+/*
+ * Oid-keyed cache entries don't contain the ref "alias" decorations for the
+ * oids they mention, since the refs can move without the content changing.
+ * Instead they carry a marker made from these control chars around the hex
+ * oid, and the decorations are spliced in when the entry is used.  These
+ * chars can't appear in our JSON otherwise, since jg2_json_purify() escapes
+ * them.
+ *
+ * JG2_DECO_MAX is the most a spliced alias list can expand to.
+ */
+#define JG2_DECO_START	'\x1d'
+#define JG2_DECO_END	'\x1e'
+#define JG2_DECO_LEN	(1 + GIT_OID_HEXSZ + 1)
+#define JG2_DECO_ALIASES 8
+#define JG2_DECO_MAX	(JG2_DECO_ALIASES * 34)
+
 /**
  * jg2_path_element: which parsed path element to receive
  *
@@ -122,9 +158,24 @@ struct aclv3 {
 	const char *acl;
 };
 
+/*
+ * digest of the names of all the repos visible to a vhost acl + ctx acl
+ * combination, computed on first use.  Allocated in rei_lwsac_head too, so it
+ * goes away with the rei it was computed from.
+ */
+
+struct jg2_visible {
+	struct jg2_visible *next;
+	const char *vhost_acl;
+	const char *acl;
+	unsigned char hash[JG2_CHASH_LEN];
+};
+
 struct repo_entry_info {
 	lws_list_ptr next;
+	struct repo_entry_info *hash_next; /* next in same rei_hash bucket */
 	struct aclv3 *acls_valid_head;	/* user acls that are valid for read */
+	unsigned char conf_hash[JG2_CHASH_LEN]; /* digest of config elements */
 	short name_len;
 	short conf_len[3];
 
@@ -153,64 +204,149 @@ struct jg2_repodir {
 	struct lwsac *rei_lwsac_head;
 	/* repo_entry_info list */
 	lws_list_ptr rei_head;
+	/* index of the rei by name, built when the repodir is scanned */
+	struct repo_entry_info **rei_hash;
+	unsigned int rei_hash_size; /* power of 2 */
 	struct aclv3 *acls_known_head;	/* user acls that have been computed */
+	struct jg2_visible *visible_head; /* visible repo set digests */
 
 	/* cache trimming */
 
 	struct lws_diskcache_scan *dcs;
 
+	/* in-memory hot tier in front of the disk cache */
+
+	struct jg2_lru *hot;
+
+	/* cache entries being created */
+
+	pthread_mutex_t ongoing_lock;
+	pthread_cond_t ongoing_cond; /* signalled when an entry progresses */
+	struct jg2_ongoing *ongoing_head;
+
 	char subsequent;
 };
 
+struct jg2_lru;
+struct jg2_lru_shard;
+
+struct jg2_lru_entry {
+	struct jg2_lru_entry *hash_next; /* next in same hash bucket */
+	struct jg2_lru_entry *prev; /* more recently used */
+	struct jg2_lru_entry *next; /* less recently used */
+	struct jg2_lru_shard *shard;
+	unsigned char key[JG2_CHASH_LEN];
+	size_t len;
+	int refcount; /* protected by shard lock */
+	unsigned int detached:1; /* evicted, free when refcount hits 0 */
+
+	/* len bytes of data follow */
+};
+
+#define jg2_lru_data(e) ((char *)((e) + 1))
+
 struct jg2_ref {
-	struct jg2_ref *next; /* next in linear list */
-	struct jg2_ref *hash_next; /* next in same hash list */
 	git_oid oid;
-	char *ref_name;
+	const char *ref_name;
+};
+
+/* immutable table of a repo's heads and tags, see reftab.c */
+
+struct jg2_reftab {
+	int refcount; /* protected by the jrepo lock */
+	uint64_t digest[2]; /* order-independent digest of the refs */
+	unsigned int count;
+	unsigned int index_size; /* power of 2 */
+	struct jg2_ref *refs; /* sorted by name */
+	uint32_t *index; /* oid-keyed open addressing, ref index + 1 */
+	/* the ref names follow */
 };
 
-struct ongoing_index {
-	struct ongoing_index *next;
+/*
+ * A cache entry somebody is in the middle of creating.  For JSON jobs, path
+ * is the leader's temp cache file that followers can tail; for search
+ * indexing it's empty and the progress counts are used instead.
+ */
+
+struct jg2_ongoing {
+	struct jg2_ongoing *next;
 	char hash[33];
+	char path[128];
 	time_t started;
+	size_t written; /* bytes the leader has written to path so far */
+	int refcount; /* leader and followers */
 	uint32_t index_files_to_do;
 	uint32_t index_files_done;
+
+	struct jg2_ctx *orphan; /* leader whose client went away, if any */
+
+	unsigned int done:1; /* path was renamed to final cache name */
+	unsigned int failed:1; /* path was abandoned */
+	unsigned int adopted:1; /* a follower is driving the orphan now */
 };
 
-#define REF_HASH_SIZE 16
-#define jg2_oidbin(oid) ((oid)->id[0] & (REF_HASH_SIZE - 1))
 
 struct jg2_split_repopath {
 	const char *e[JG2_PE_COUNT];
 	int offset;
+	int count; /* ?n=, how many items from offset, or 0 for default */
 };
 
 struct jg2_repo {
 	struct jg2_vhost *vhost;
 	struct jg2_repo *next;
+	struct jg2_repo *hash_next; /* next in same vhost repo_hash bucket */
+	uint32_t path_hash;
 	char *repo_path;
-	git_repository *repo;
+	git_repository *repo; /* NULL while closed */
+	/* open repos are on the vhost repo lru, most recently used first */
+	struct jg2_repo *lru_prev;
+	struct jg2_repo *lru_next;
+	time_t last_used;
 
 	pthread_mutex_t lock;
 
 	struct jg2_ctx *ctx_repo_list; /* linked-list of ctx using repo */
 
-	/* linked-list of oids being indexed */
-	struct ongoing_index *indexing_list;
-
-	struct jg2_ref *ref_list; /* linked-list of refs */
-	struct jg2_ref *ref_list_hash[REF_HASH_SIZE];
-		/* set of linked-lists into the ref objects based on hash */
+	struct jg2_reftab *reftab; /* current refs, swapped under lock */
+	struct jg2_cmeta *cmeta; /* commit metadata, swapped under lock */
+	struct jg2_lastc *lastc; /* last commit per path, per branch */
 
-	unsigned char md5_refs[JG2_MD5_LEN]; /* hash of all refs in repo */
+	unsigned char refs_hash[JG2_CHASH_LEN]; /* hash of all refs in repo */
 
 	time_t last_update;
+	time_t last_full; /* last time we iterated the refs */
+	uint64_t refstat[8]; /* packed-refs + ref dir stat when we did */
+
+	int wd[3]; /* inotify watches on the ref dirs, or 0 */
+	char dirty; /* refs may have changed, check without rate limit */
+	char cmeta_stale; /* refs changed since the commit metadata update */
+	char lastc_stale; /* refs changed or a branch wants a last commit index */
+};
+
+/* the threads that pin vhosts, see cache.c */
+
+enum {
+	JG2_PIN_CACHE,
+	JG2_PIN_INDEX,
+
+	JG2_PIN_LISTS
 };
 
 struct jg2_vhost {
 	struct jg2_email_hash_bin *bins;
 	struct jg2_vhost_config cfg;
 	struct jg2_repo *repo_list;
+	/* index of repo_list by repo_path */
+	struct jg2_repo **repo_hash;
+	unsigned int repo_hash_size; /* power of 2 */
+	unsigned int repo_count;
+	/* repos with an open git_repository, by last use */
+	struct jg2_repo *repo_mru;
+	struct jg2_repo *repo_lru;
+	unsigned int repos_open;
+	uint64_t repo_opens,
+		 repo_evictions;
 	struct jg2_vhost *vhost_list;
 	struct jg2_ctx *ctx_on_vh_list;
 
@@ -228,10 +364,26 @@ struct jg2_vhost {
 		 etag_hits,
 		 etag_tries;
 
+	/* recently rendered commit and tag summaries, keyed by oid */
+	struct jg2_lru *summaries;
+
 	lwsac_cached_file_t html_content;
 	size_t html_len;
 	size_t meta;
 	size_t dynamic;
+
+	int refchange_fd; /* refchange_fifo, or -1 */
+	char refchange_line[128]; /* partial line read from the fifo */
+	size_t refchange_len;
+	/* repo names notified on the fifo, waiting to be prewarmed */
+	char prewarm[8][64];
+	int prewarm_count;
+
+	/* global lock: cache or index thread using us without global lock */
+	int pinned;
+	/* each thread's list of vhosts it pinned */
+	struct jg2_vhost *pinned_next[JG2_PIN_LISTS];
+	int dying; /* global lock: being destroyed, abandon long work */
 };
 
 typedef union {
@@ -257,6 +409,7 @@ struct tree_entry_info {
 	git_filemode_t mode;
 	int type;
 	uint64_t size;
+	const git_oid *lastc; /* last commit to touch it, or NULL */
 	short namelen;
 
 	/* then the name */
@@ -317,12 +470,16 @@ struct jg2_ctx {
 	struct jg2_ctx *ctx_on_vh_next;
 	struct jg2_ctx *ctx_on_thread_pool_queue_next;
 	void *user;
+	struct jg2_reftab *reftab; /* jrepo refs pinned for the current job */
+	struct jg2_cmeta *cmeta; /* jrepo commit metadata pinned for the job */
+	struct jg2_lastc *lastc; /* branch last commit index pinned for tree */
 
 	jg2_md5_context md5_ctx;
-	unsigned char job_hash[JG2_MD5_LEN];
+	unsigned char job_hash[JG2_CHASH_LEN];
 
 	/* job parameters */
 	const char *acl_user;
+	char *acl_user_copy; /**< our own copy, once we're orphaned */
 	char hex_oid[64]; /**< may also be a ref like refs/head/master */
 	char cache[128];
 	char alang[128]; /**< accept-language string, or NUL */
@@ -354,7 +511,10 @@ struct jg2_ctx {
 	struct repo_entry_info *rei;
 	struct lws_fts *t;
 	int trie_fd;
-	struct ongoing_index *ongoing;
+	struct jg2_ongoing *ongoing; /**< search indexing we are doing */
+	struct jg2_ongoing *lead; /**< cache entry we are creating */
+	struct jg2_ongoing *follow; /**< cache entry we are tailing */
+	jg2_job_enum job_type; /**< the job we set, if we may have to do it */
 
 	/* search */
 	char trie_filepath[256];
@@ -374,10 +534,20 @@ struct jg2_ctx {
 	lws_list_ptr contrib;
 #endif
 	int fd_cache;
+	struct jg2_lru_entry *hot; /**< cached job data we are spooling */
 	int job_cache_query;
 	char *cache_written_p;
 	size_t existing_cache_pos;
 	size_t existing_cache_size;
+	int range_fd; /**< cache fd the user is sending a range from for us */
+	size_t range_ofs;
+	size_t range_len;
+	char range_tail; /**< 0, or char to emit after the range */
+
+	struct jg2_gz *gz; /**< gzip content encoding state, if any */
+	struct jg2_gz_writer *gzw; /**< creating precompressed cache variant */
+	int fd_gz; /**< precompressed variant of cache hit, if any */
+	size_t gz_size;
 
 #if defined(JG2_HAVE_ARCHIVE_H)
 	/* for snapshot state */
@@ -389,6 +559,26 @@ struct jg2_ctx {
 	struct tree_iter_level stack[16];
 	int sp;
 
+	/* commit diff, generated a file at a time */
+#if LIBGIT2_HAS_DIFF
+	git_diff *diff;
+#else
+	git_diff_list *diff;
+#endif
+	size_t diff_idx; /**< next delta to generate */
+	size_t diff_len; /**< patch text for the current delta so far */
+
+	/* path-filtered log */
+	struct jg2_cgraph *cgraph;
+	char log_path[256];
+	size_t log_path_len;
+	git_oid log_oid; /**< next commit to look at */
+	git_oid log_entry; /**< log_path in log_oid, if log_entry_state 1 */
+	unsigned int log_entry_mode;
+	int log_entry_state; /**< -1 unknown, 0 no log_path, 1 log_entry */
+	int log_scanned;
+	unsigned int log_more:1;
+
 	/* chunk buffer state */
 	char *buf, *p, *end;
 	size_t len;
@@ -404,6 +594,8 @@ struct jg2_ctx {
 	/**< 0= not started, or finished JSON, 1 = in progress */
 	unsigned int final:2; /* final chunk of JSON for job has been done */
 	unsigned int destroying:1; /**< context destruction is underway */
+	unsigned int orphaned:1; /**< client went away, we're only finishing
+				   *  the cache entry for our followers */
 	unsigned int meta:1; /**< tracks if first job for outer brackets */
 	unsigned int meta_last_job:1; /**< last job for outer brackets */
 	unsigned int blame_after_tree:1; /**< did a blob, so do blame after */
@@ -419,6 +611,9 @@ struct jg2_ctx {
 
 	unsigned int blame_init_phase:1;
 	unsigned int raw_patch:1;
+	unsigned int diffstat:1; /**< commit file list instead of the diff */
+	unsigned int numstat:1; /**< ...with line counts for each file */
+	unsigned int blobdiff:1; /**< patch between a pair of blobs */
 	unsigned int blog_mode:1;
 	unsigned int bot:1;
 	unsigned int failed_in_start:1;
@@ -428,17 +623,35 @@ struct jg2_ctx {
 	unsigned int index_open_ro:1;
 	unsigned int no_rider:1;
 	unsigned int onetime:1;
+	unsigned int oid_keyed:1; /**< cache key doesn't depend on the refs */
+	unsigned int deco_markers:1; /**< bracket alias lists for the cache */
+	unsigned int probed:1; /**< holding a cache hit for the first job */
+};
+
+/* how many open repos use an inotify watch, on any vhost */
+
+struct jg2_refwatch {
+	struct jg2_refwatch *next;
+	int wd;
+	int refcount;
 };
 
+#define JG2_REFWATCH_BUCKETS 64
+
 struct jg2_global {
 	struct jg2_repodir *repodir_head;
 	struct jg2_repodir *cachedir_head;
 	struct jg2_vhost *vhost_head;
 
 	pthread_mutex_t lock;
+	pthread_cond_t unpinned; /* signalled when a vhost is unpinned */
 
 	pthread_t cache_thread;
+	pthread_t index_thread;
 	int count_cachedirs;
+	int refwatch_fd; /* inotify fd watching ref dirs, or -1 */
+	pthread_mutex_t refwatch_lock; /* protects refwatch_hash */
+	struct jg2_refwatch *refwatch_hash[JG2_REFWATCH_BUCKETS];
 #if !LIBGIT2_HAS_REFCOUNTED_INIT
 	int thread_init_refcount;
 #endif
@@ -464,17 +677,39 @@ jg2_safe_libgit2_deinit(void);
 void *
 jg2_zalloc(size_t s);
 
+struct jg2_reftab *
+jg2_reftab_create(git_repository *repo);
+
+int
+jg2_reftab_digest(struct jg2_reftab *t, const struct jg2_reftab *old);
+
 void
-jg2_repo_ref_destroy(struct jg2_ref *r);
+jg2_reftab_digest_bytes(const struct jg2_reftab *t, unsigned char *out);
+
+int
+jg2_reftab_lookup(const struct jg2_reftab *t, const git_oid *oid,
+		  const struct jg2_ref **result, int max);
+
+struct jg2_reftab *
+jg2_reftab_get(struct jg2_repo *jrepo);
 
 void
-jg2_repo_reflist_destroy(struct jg2_ref *r);
+jg2_reftab_put(struct jg2_repo *jrepo, struct jg2_reftab **pt);
+
+void
+jg2_reftab_swap(struct jg2_repo *jrepo, struct jg2_reftab *t);
 
 void
 jg2_repo_destroy(struct jg2_repo *r);
 
+struct jg2_repo *
+__jg2_vhost_repo_find(struct jg2_vhost *vh, const char *repo_path);
+
+void
+jg2_vhost_repo_evict_idle(struct jg2_vhost *vh);
+
 int
-jg2_vhost_repo_reflist_update(struct jg2_vhost *vhost);
+jg2_vhost_repo_reflist_update(struct jg2_vhost *vhost, int dirty_only);
 
 const char *
 oid_to_hex_cstr(char *oid_hex, const git_oid *oid);
@@ -485,6 +720,40 @@ ellipsis_string(char *out, const char *in, int max);
 const char *
 ellipsis_purify(char *out, const char *in, int max);
 
+void
+jg2_jw_start(struct jg2_jw *w, struct jg2_ctx *ctx, size_t need);
+
+void
+jg2_jw_end(struct jg2_jw *w, struct jg2_ctx *ctx);
+
+void
+jg2_jw_mem(struct jg2_jw *w, const void *s, size_t len);
+
+void
+jg2_jw_str(struct jg2_jw *w, const char *s);
+
+void
+jg2_jw_char(struct jg2_jw *w, char c);
+
+void
+jg2_jw_u64(struct jg2_jw *w, uint64_t v);
+
+void
+jg2_jw_s64(struct jg2_jw *w, int64_t v);
+
+void
+jg2_jw_hex(struct jg2_jw *w, const unsigned char *b, size_t len);
+
+void
+jg2_jw_oid(struct jg2_jw *w, const git_oid *oid);
+
+/* the most jg2_jw_sig() writes, besides the name and email */
+#define JG2_JW_SIG_MAX 160
+
+void
+jg2_jw_sig(struct jg2_jw *w, const git_time *t, const char *name,
+	   const char *email, const unsigned char *md5);
+
 void
 time_json(const git_time *t, struct jg2_ctx *ctx);
 
@@ -506,9 +775,15 @@ lws_snprintf(char *str, size_t size, const char *format, ...);
 int
 commit_summary(git_commit *commit, struct jg2_ctx *ctx);
 
+int
+tag_summary(git_tag *tag, struct jg2_ctx *ctx);
+
 int
 generic_object_summary(const git_oid *oid, struct jg2_ctx *ctx);
 
+int
+jg2_summary_json(struct jg2_ctx *ctx, const git_oid *oid, git_commit *c);
+
 jg2_md5_context
 jg2_md5_alloc(void);
 void
@@ -524,16 +799,32 @@ md5_to_hex_cstr(char *md5_hex_33, const unsigned char *md5);
 void
 identity_json(const char *name_email, struct jg2_ctx *ctx);
 
+void
+name_email_json_pure(const char *name, const char *email,
+		     const unsigned char *md5, struct jg2_ctx *ctx);
+
+const char *
+commit_summary_msg(char *summary, git_commit *commit);
+
 int
 __repo_reflist_update(struct jg2_vhost *vh, struct jg2_repo *repo);
 
 int
 jg2_oid_to_ref_names(const git_oid *oid, struct jg2_ctx *ctx,
-		     struct jg2_ref **result, int max);
+		     const struct jg2_ref **result, int max);
 
 int
 jg2_json_oid(const git_oid *oid, struct jg2_ctx *ctx);
 
+void
+jg2_json_alias_list(const git_oid *oid, struct jg2_ctx *ctx);
+
+const char *
+jg2_deco_next(const char *p, const char *end, const char **deco_end);
+
+char *
+jg2_deco_strip(char *p, char *end);
+
 int
 jg2_repopath_split(const char *urlpath, struct jg2_split_repopath *sr);
 
@@ -554,6 +845,207 @@ __jg2_cache_query_v(struct jg2_ctx *ctx, int flags, const char *suffix, int *_fd
 int
 cache_trim_thread_spawn(struct jg2_global *jg2_global);
 
+#if defined(JG2_HAVE_SYS_INOTIFY_H)
+int
+jg2_refwatch_init(struct jg2_global *jg2_global);
+
+void
+jg2_refwatch_deinit(struct jg2_global *jg2_global);
+
+void
+__jg2_refwatch_add(struct jg2_global *jg2_global, struct jg2_repo *r);
+
+int
+jg2_refwatch_read(struct jg2_global *jg2_global, int *wds, int max);
+
+void
+__jg2_refwatch_remove(struct jg2_global *jg2_global, struct jg2_repo *r);
+
+void
+__jg2_refwatch_mark(struct jg2_vhost *vh, const int *wds, int count);
+#endif
+
+int
+jg2_refchange_fifo_open(struct jg2_vhost *vh);
+
+void
+jg2_refchange_fifo_close(struct jg2_vhost *vh);
+
+int
+jg2_refchange_fifo_service(struct jg2_vhost *vh);
+
+void
+jg2_refchange_prewarm(struct jg2_vhost *vh);
+
+struct jg2_cgraph;
+
+#define JG2_CGRAPH_NONE 0xffffffff
+
+struct jg2_cgraph *
+jg2_cgraph_open(const char *gitdir);
+
+void
+jg2_cgraph_close(struct jg2_cgraph **pg);
+
+int
+jg2_cgraph_find(const struct jg2_cgraph *g, const git_oid *oid, uint32_t *pos);
+
+void
+jg2_cgraph_oid(const struct jg2_cgraph *g, uint32_t pos, git_oid *oid);
+
+uint32_t
+jg2_cgraph_parent(const struct jg2_cgraph *g, uint32_t pos);
+
+int
+jg2_cgraph_maybe_changed(const struct jg2_cgraph *g, uint32_t pos,
+			 const char *path, size_t len);
+
+struct jg2_cmeta;
+
+#define JG2_CMETA_NONE		0xffffffff /* root commit */
+#define JG2_CMETA_UNKNOWN	0xfffffffe /* parent isn't in it */
+
+struct jg2_cmeta *
+jg2_cmeta_get(struct jg2_repo *jrepo);
+
+void
+jg2_cmeta_put(struct jg2_repo *jrepo, struct jg2_cmeta **pcm);
+
+int
+jg2_cmeta_find(const struct jg2_cmeta *cm, const git_oid *oid, uint32_t *i);
+
+void
+jg2_cmeta_oid(const struct jg2_cmeta *cm, uint32_t i, git_oid *oid);
+
+uint32_t
+jg2_cmeta_parent(const struct jg2_cmeta *cm, uint32_t i);
+
+int
+jg2_cmeta_summary(const struct jg2_cmeta *cm, uint32_t i,
+		  struct jg2_ctx *ctx);
+
+void
+jg2_vhost_cmeta_update(struct jg2_vhost *vh);
+
+struct jg2_lastc;
+
+struct jg2_lastc *
+jg2_lastc_get(struct jg2_vhost *vh, struct jg2_repo *jrepo, const char *ref);
+
+void
+jg2_lastc_put(struct jg2_repo *jrepo, struct jg2_lastc **plc);
+
+void
+jg2_lastc_destroy_all(struct jg2_repo *jrepo);
+
+const git_oid *
+jg2_lastc_tip(const struct jg2_lastc *lc);
+
+int
+jg2_lastc_ref_tip(struct jg2_repo *jrepo, const char *ref, git_oid *tip);
+
+int
+jg2_lastc_find(const struct jg2_lastc *lc, const char *path, git_oid *oid);
+
+void
+jg2_vhost_lastc_update(struct jg2_vhost *vh);
+
+struct jg2_ongoing *
+jg2_ongoing_lead(struct jg2_repodir *cd, const char *hash, const char *path);
+
+struct jg2_ongoing *
+jg2_ongoing_follow(struct jg2_repodir *cd, const char *hash, int *fd);
+
+int
+jg2_ongoing_progress(struct jg2_repodir *cd, const char *hash,
+		     uint32_t *files, uint32_t *done);
+
+void
+jg2_ongoing_written(struct jg2_repodir *cd, struct jg2_ongoing *o, size_t len);
+
+int
+jg2_ongoing_finish(struct jg2_repodir *cd, struct jg2_ongoing **po,
+		   const char *final);
+
+int
+jg2_ongoing_wait(struct jg2_repodir *cd, struct jg2_ongoing *o, size_t pos,
+		 size_t *avail);
+
+void
+jg2_ongoing_put(struct jg2_repodir *cd, struct jg2_ongoing **po);
+
+int
+jg2_ongoing_orphan(struct jg2_repodir *cd, struct jg2_ongoing *o,
+		   struct jg2_ctx *ctx);
+
+struct jg2_ctx *
+jg2_ongoing_adopt(struct jg2_repodir *cd, struct jg2_ongoing *o);
+
+void
+jg2_ongoing_release(struct jg2_repodir *cd, struct jg2_ongoing *o, int gone);
+
+struct jg2_ctx *
+jg2_ongoing_unfollow(struct jg2_repodir *cd, struct jg2_ongoing **po);
+
+void
+jg2_cache_abandon(struct jg2_ctx *ctx);
+
+int
+jg2_ctx_fill_raw(struct jg2_ctx *ctx, char *buf, size_t len, size_t *used,
+		 char *outlive);
+
+#if defined(JG2_HAVE_ZLIB_H)
+int
+jg2_gz_ctx_init(struct jg2_ctx *ctx, const char *accept_encoding);
+
+void
+jg2_gz_ctx_destroy(struct jg2_ctx *ctx);
+
+void
+jg2_gz_cache_open(struct jg2_ctx *ctx, const char *md5_hex);
+
+int
+jg2_gz_spool(struct jg2_ctx *ctx);
+
+int
+jg2_gz_fill(struct jg2_ctx *ctx, char *buf, size_t len, size_t *used,
+	    char *outlive);
+
+void
+jg2_gz_writer_start(struct jg2_ctx *ctx);
+
+void
+jg2_gz_writer_write(struct jg2_ctx *ctx, const char *data, size_t len);
+
+void
+jg2_gz_writer_complete(struct jg2_ctx *ctx, const char *final_name);
+
+void
+jg2_gz_writer_abandon(struct jg2_ctx *ctx);
+#endif
+
+struct jg2_lru *
+jg2_lru_create(size_t size_limit);
+
+void
+jg2_lru_destroy(struct jg2_lru **plru);
+
+struct jg2_lru_entry *
+jg2_lru_get(struct jg2_lru *lru, const unsigned char *key);
+
+void
+jg2_lru_put(struct jg2_lru_entry **pe);
+
+struct jg2_lru_entry *
+jg2_lru_alloc(struct jg2_lru *lru, const unsigned char *key, size_t len);
+
+struct jg2_lru_entry *
+jg2_lru_add(struct jg2_lru *lru, struct jg2_lru_entry *e);
+
+void
+jg2_lru_stats(struct jg2_lru *lru, uint64_t *hits, uint64_t *misses,
+	      size_t *size);
+
 int
 jg2_oid_lookup(git_repository *repo, git_oid *oid, const char *hex_oid);
 
@@ -0,0 +1,236 @@
+/*
+ * libjsongit2 - refchange notification FIFO
+ *
+ * Copyright (C) 2018-2025 Andy Green <andy@warmcat.com>
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation:
+ *  version 2.1 of the License.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ *  MA  02110-1301  USA
+ *
+ * If the vhost config gives a refchange_fifo path, we create a FIFO there
+ * that something like a gitolite post-receive hook can write repo names
+ * into, one per line.  The cache thread reads it, and looks at the refs of
+ * the named repos straight away, firing the refchange callbacks if they
+ * changed, and then regenerates the usual views of the repo so the next
+ * visitor finds them in the cache.
+ *
+ * We open the FIFO read-write, so there is always a writer and we never see
+ * EOF between hooks, and writers never block waiting for a reader while we
+ * are up.
+ */
+
+#include "private.h"
+
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+/* the views of a repo we regenerate after a refchange notification */
+
+static const char * const prewarm_modes[] = {
+	"", "log",
+};
+
+int
+jg2_refchange_fifo_open(struct jg2_vhost *vh)
+{
+	const char *path = vh->cfg.refchange_fifo;
+
+	vh->refchange_fd = -1;
+
+	if (!path)
+		return 0;
+
+	if (mkfifo(path, 0660) && errno != EEXIST) {
+		lwsl_err("%s: unable to create %s: errno %d\n", __func__,
+			 path, errno);
+
+		return 1;
+	}
+
+	vh->refchange_fd = open(path, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+	if (vh->refchange_fd < 0) {
+		lwsl_err("%s: unable to open %s: errno %d\n", __func__,
+			 path, errno);
+		vh->refchange_fd = -1;
+
+		return 1;
+	}
+
+	lwsl_notice("%s: listening for refchanges on %s\n", __func__, path);
+
+	return 0;
+}
+
+void
+jg2_refchange_fifo_close(struct jg2_vhost *vh)
+{
+	if (vh->refchange_fd != -1)
+		close(vh->refchange_fd);
+
+	vh->refchange_fd = -1;
+}
+
+/* requires vhost lock, returns 0 if name was usable */
+
+static int
+__jg2_refchange_repo(struct jg2_vhost *vh, char *name)
+{
+	char path[256];
+	struct jg2_repo *r;
+	size_t n;
+
+	/* we take the gitolite repo name, with or without .git */
+
+	n = strlen(name);
+	if (n > 4 && !strcmp(name + n - 4, ".git"))
+		name[n - 4] = '\0';
+
+	if (!name[0] || strstr(name, "..") || name[0] == '/' ||
+	    !strcmp(name, "gitolite-admin"))
+		return 1;
+
+	lws_snprintf(path, sizeof(path), "%s/%s.git", vh->cfg.repo_base_dir,
+		     name);
+
+	r = __jg2_vhost_repo_find(vh, path);
+	if (r)
+		r->dirty = 1;
+
+	/*
+	 * Even if nobody has the repo open right now, it's worth having the
+	 * cache ready for whoever comes to look at the new refs
+	 */
+
+	if (strlen(name) >= sizeof(vh->prewarm[0]))
+		return 0;
+
+	for (n = 0; n < (size_t)vh->prewarm_count; n++)
+		if (!strcmp(vh->prewarm[n], name))
+			return 0;
+
+	if (vh->prewarm_count < (int)LWS_ARRAY_SIZE(vh->prewarm))
+		lws_strncpy(vh->prewarm[vh->prewarm_count++], name,
+			    sizeof(vh->prewarm[0]));
+
+	return 0;
+}
+
+/*
+ * Called from the cache thread when the vhost's FIFO is readable, reads what
+ * is there and marks the named repos dirty.  Returns the number of repos
+ * named.
+ */
+
+int
+jg2_refchange_fifo_service(struct jg2_vhost *vh)
+{
+	char buf[512], *p, *end;
+	int count = 0;
+	ssize_t len;
+
+	pthread_mutex_lock(&vh->lock); /* ======================== vhost lock */
+
+	while (1) {
+		len = read(vh->refchange_fd, buf, sizeof(buf));
+		if (len <= 0)
+			break;
+
+		for (p = buf, end = buf + len; p < end; p++) {
+			if (*p != '\n' && *p != '\r' && *p != ' ') {
+				/* lines longer than we can use are dropped */
+				if (vh->refchange_len <
+						sizeof(vh->refchange_line) - 1)
+					vh->refchange_line[vh->refchange_len++] =
+									*p;
+				else
+					vh->refchange_len =
+						sizeof(vh->refchange_line);
+				continue;
+			}
+
+			if (vh->refchange_len &&
+			    vh->refchange_len < sizeof(vh->refchange_line)) {
+				vh->refchange_line[vh->refchange_len] = '\0';
+				if (!__jg2_refchange_repo(vh,
+							vh->refchange_line))
+					count++;
+			}
+			vh->refchange_len = 0;
+		}
+	}
+
+	pthread_mutex_unlock(&vh->lock); /* -------------------- vhost unlock */
+
+	return count;
+}
+
+/*
+ * Called from the cache thread after the refs were updated, without the
+ * global lock and with vh pinned.  Takes the queue of repos that were
+ * notified and regenerates their usual views, if they aren't already in the
+ * cache for the current refs.  Repos notified meanwhile queue up for next
+ * time.
+ */
+
+void
+jg2_refchange_prewarm(struct jg2_vhost *vh)
+{
+	char url[128], buf[4096], queue[LWS_ARRAY_SIZE(vh->prewarm)][64];
+	struct jg2_ctx_create_args args;
+	unsigned long length;
+	const char *mimetype;
+	struct jg2_ctx *ctx;
+	size_t n, used;
+	int m, count, done;
+
+	pthread_mutex_lock(&vh->lock); /* ======================== vhost lock */
+	count = vh->cachedir ? vh->prewarm_count : 0;
+	memcpy(queue, vh->prewarm, (size_t)count * sizeof(queue[0]));
+	vh->prewarm_count = 0;
+	pthread_mutex_unlock(&vh->lock); /* -------------------- vhost unlock */
+
+	for (m = 0; m < count; m++) {
+		for (n = 0; n < LWS_ARRAY_SIZE(prewarm_modes); n++) {
+			lws_snprintf(url, sizeof(url), "/%s/%s", queue[m],
+				     prewarm_modes[n]);
+
+			memset(&args, 0, sizeof(args));
+			args.repo_path = url;
+			args.mimetype = &mimetype;
+			args.length = &length;
+
+			if (jg2_ctx_create(vh, &ctx, &args)) {
+				lwsl_info("%s: unable to create ctx for %s\n",
+					  __func__, url);
+				continue;
+			}
+
+			do {
+				done = jg2_ctx_fill(ctx, buf, sizeof(buf),
+						    &used, NULL);
+			} while (!done);
+
+			if (done < 0)
+				lwsl_info("%s: prewarm of %s failed\n",
+					  __func__, url);
+
+			jg2_ctx_destroy(ctx);
+		}
+	}
+}
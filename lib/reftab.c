@@ -0,0 +1,410 @@
+/*
+ * libjsongit2 - immutable per-repo ref tables
+ *
+ * Copyright (C) 2018-2025 Andy Green <andy@warmcat.com>
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation:
+ *  version 2.1 of the License.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ *  MA  02110-1301  USA
+ *
+ * The heads and tags of a repo are held in a single allocation: an array of
+ * refs sorted by name, an open-addressing index on the oids sized to at least
+ * twice the ref count, and the names packed one after another in the same
+ * order as the refs.
+ *
+ * A table is never changed after it's built.  When the refs change, a new one
+ * is built and swapped in on the jrepo, and the old one is freed when the last
+ * ctx that pinned it lets go of it.  So looking up the refs for an oid, which
+ * happens for every commit in a log, needs no locking; the jrepo lock is only
+ * taken once per job to pin the current table.
+ */
+
+#include "private.h"
+
+#include <string.h>
+#include <stdlib.h>
+
+struct jg2_reftab_build {
+	struct jg2_ref *refs;
+	size_t count;
+	size_t alloc;
+	char *names;
+	size_t names_len;
+	size_t names_alloc;
+};
+
+#define reftab_index_slot(t, oid) \
+		(((uint32_t)(oid)->id[0] | ((uint32_t)(oid)->id[1] << 8) | \
+		  ((uint32_t)(oid)->id[2] << 16) | \
+		  ((uint32_t)(oid)->id[3] << 24)) & ((t)->index_size - 1))
+
+static int
+reftab_name_sort(const void *a, const void *b)
+{
+	return strcmp(((const struct jg2_ref *)a)->ref_name,
+		      ((const struct jg2_ref *)b)->ref_name);
+}
+
+static int
+reftab_build_add(struct jg2_reftab_build *b, const char *name,
+		 const git_oid *oid)
+{
+	size_t n = strlen(name) + 1;
+	void *p;
+
+	if (b->count == b->alloc) {
+		b->alloc = b->alloc ? b->alloc * 2 : 64;
+		p = realloc(b->refs, b->alloc * sizeof(*b->refs));
+		if (!p)
+			return 1;
+		b->refs = p;
+	}
+
+	if (b->names_len + n > b->names_alloc) {
+		b->names_alloc = b->names_alloc ? b->names_alloc * 2 : 4096;
+		while (b->names_len + n > b->names_alloc)
+			b->names_alloc *= 2;
+		p = realloc(b->names, b->names_alloc);
+		if (!p)
+			return 1;
+		b->names = p;
+	}
+
+	git_oid_cpy(&b->refs[b->count].oid, oid);
+	/* the arena may move while we build, so just keep the offset */
+	b->refs[b->count].ref_name = (const char *)(uintptr_t)b->names_len;
+	b->count++;
+
+	memcpy(b->names + b->names_len, name, n);
+	b->names_len += n;
+
+	return 0;
+}
+
+static struct jg2_reftab *
+reftab_build_finalize(struct jg2_reftab_build *b)
+{
+	unsigned int index_size = 16;
+	struct jg2_reftab *t;
+	uint32_t slot;
+	size_t n;
+	char *p;
+
+	while (index_size < b->count * 2)
+		index_size <<= 1;
+
+	for (n = 0; n < b->count; n++)
+		b->refs[n].ref_name = b->names +
+				      (uintptr_t)b->refs[n].ref_name;
+
+	if (b->count)
+		qsort(b->refs, b->count, sizeof(*b->refs), reftab_name_sort);
+
+	t = malloc(sizeof(*t) + (b->count * sizeof(struct jg2_ref)) +
+		   (index_size * sizeof(uint32_t)) + b->names_len);
+	if (!t)
+		return NULL;
+
+	t->refcount = 1;
+	t->count = (unsigned int)b->count;
+	t->index_size = index_size;
+	t->refs = (struct jg2_ref *)(t + 1);
+	t->index = (uint32_t *)(t->refs + b->count);
+	p = (char *)(t->index + index_size);
+
+	memset(t->index, 0, index_size * sizeof(uint32_t));
+
+	for (n = 0; n < b->count; n++) {
+		size_t l = strlen(b->refs[n].ref_name) + 1;
+
+		git_oid_cpy(&t->refs[n].oid, &b->refs[n].oid);
+		memcpy(p, b->refs[n].ref_name, l);
+		t->refs[n].ref_name = p;
+		p += l;
+
+		/* index slots hold the ref index + 1, 0 is empty */
+
+		slot = reftab_index_slot(t, &t->refs[n].oid);
+		while (t->index[slot])
+			slot = (slot + 1) & (index_size - 1);
+		t->index[slot] = (uint32_t)n + 1;
+	}
+
+	return t;
+}
+
+/*
+ * Build a new table from the heads and tags currently in repo.  Returns NULL
+ * on error or OOM.
+ */
+
+struct jg2_reftab *
+jg2_reftab_create(git_repository *repo)
+{
+	struct jg2_reftab_build b;
+	git_reference_iterator *iter_ref;
+	struct jg2_reftab *t = NULL;
+	git_reference *ref;
+	const git_oid *oid;
+	const char *name;
+	int bad = 0;
+
+	memset(&b, 0, sizeof(b));
+
+	if (git_reference_iterator_new(&iter_ref, repo) < 0) {
+		if (giterr_last())
+			giterr_clear();
+
+		return NULL;
+	}
+
+	if (giterr_last())
+		giterr_clear();
+
+	while (!bad && git_reference_next(&ref, iter_ref) >= 0) {
+		name = git_reference_name(ref);
+		oid = git_reference_target(ref);
+
+		/* symbolic refs have no direct target, skip them */
+
+		if (oid && (!strncmp(name, "refs/heads/", 11) ||
+			    !strncmp(name, "refs/tags/", 10)))
+			bad = reftab_build_add(&b, name, oid);
+
+		git_reference_free(ref);
+	}
+
+	git_reference_iterator_free(iter_ref);
+
+	if (!bad)
+		t = reftab_build_finalize(&b);
+
+	free(b.refs);
+	free(b.names);
+
+	return t;
+}
+
+/*
+ * The refs digest is the sum of a 128-bit hash of each ref's name and oid, so
+ * it doesn't depend on the order and can be patched for just the refs that
+ * changed: subtract the old ref's hash and add the new one's.  It's always
+ * the fast hash, the md5 option only affects the cache names it goes into.
+ */
+
+static void
+reftab_ref_hash(const struct jg2_ref *ref, uint64_t *h)
+{
+	struct jg2_chash ch;
+	unsigned char b[JG2_CHASH_LEN];
+	int n, m;
+
+	jg2_chash_init(&ch, NULL, NULL);
+	jg2_chash_upd(&ch, ref->ref_name, strlen(ref->ref_name) + 1);
+	jg2_chash_upd(&ch, ref->oid.id, sizeof(ref->oid.id));
+	jg2_chash_fini(&ch, b);
+
+	for (n = 0; n < 2; n++) {
+		h[n] = 0;
+		for (m = 0; m < 8; m++)
+			h[n] = (h[n] << 8) | b[(n * 8) + m];
+	}
+}
+
+static void
+reftab_digest_add(uint64_t *d, const struct jg2_ref *ref, int sub)
+{
+	uint64_t h[2];
+
+	reftab_ref_hash(ref, h);
+
+	if (sub) {
+		d[0] -= h[0];
+		d[1] -= h[1];
+	} else {
+		d[0] += h[0];
+		d[1] += h[1];
+	}
+}
+
+/*
+ * Sets the digest of t.  If old is given, it's computed by patching old's
+ * digest with the refs that differ between them, otherwise from scratch.
+ *
+ * Returns how many refs were added, removed or moved compared to old, so 0
+ * means t has the same refs pointing to the same oids as old.
+ */
+
+int
+jg2_reftab_digest(struct jg2_reftab *t, const struct jg2_reftab *old)
+{
+	unsigned int i = 0, j = 0;
+	int changes = 0, n;
+
+	if (!old) {
+		t->digest[0] = t->digest[1] = 0;
+		for (j = 0; j < t->count; j++)
+			reftab_digest_add(t->digest, &t->refs[j], 0);
+
+		return (int)t->count;
+	}
+
+	t->digest[0] = old->digest[0];
+	t->digest[1] = old->digest[1];
+
+	/* both are sorted by name, so we can walk them together */
+
+	while (i < old->count || j < t->count) {
+		if (i == old->count)
+			n = 1;
+		else
+			if (j == t->count)
+				n = -1;
+			else
+				n = strcmp(old->refs[i].ref_name,
+					   t->refs[j].ref_name);
+
+		if (n < 0) { /* old ref went away */
+			reftab_digest_add(t->digest, &old->refs[i++], 1);
+			changes++;
+			continue;
+		}
+
+		if (n > 0) { /* new ref appeared */
+			reftab_digest_add(t->digest, &t->refs[j++], 0);
+			changes++;
+			continue;
+		}
+
+		if (git_oid_cmp(&old->refs[i].oid, &t->refs[j].oid)) {
+			/* ref moved */
+			reftab_digest_add(t->digest, &old->refs[i], 1);
+			reftab_digest_add(t->digest, &t->refs[j], 0);
+			changes++;
+		}
+		i++;
+		j++;
+	}
+
+	return changes;
+}
+
+/* out must have room for JG2_CHASH_LEN bytes */
+
+void
+jg2_reftab_digest_bytes(const struct jg2_reftab *t, unsigned char *out)
+{
+	uint64_t h;
+	int n, m;
+
+	for (n = 0; n < 2; n++) {
+		h = t->digest[n];
+		for (m = 7; m >= 0; m--) {
+			out[(n * 8) + m] = (unsigned char)h;
+			h >>= 8;
+		}
+	}
+}
+
+/*
+ * Fills result with up to max refs in t pointing to oid, returns how many.
+ * The refs are valid while t is.
+ *
+ * They come out sorted by name: the refs were put in the index in name order,
+ * and refs with the same oid probe from the same slot, so a later one always
+ * sits further along.  The old per-repo ref list gave them in libgit2
+ * iteration order, which was loose refs before packed ones; if there are more
+ * than max, it's now the first max by name that are kept.
+ */
+
+int
+jg2_reftab_lookup(const struct jg2_reftab *t, const git_oid *oid,
+		  const struct jg2_ref **result, int max)
+{
+	uint32_t slot;
+	int n = 0;
+
+	if (!t || !max)
+		return 0;
+
+	slot = reftab_index_slot(t, oid);
+	while (t->index[slot]) {
+		const struct jg2_ref *ref = &t->refs[t->index[slot] - 1];
+
+		if (!git_oid_cmp(&ref->oid, oid)) {
+			*result++ = ref;
+			if (++n == max)
+				break;
+		}
+		slot = (slot + 1) & (t->index_size - 1);
+	}
+
+	return n;
+}
+
+/*
+ * Get a reference on the current table for jrepo, give it back with
+ * jg2_reftab_put().  May be NULL if we couldn't build one.
+ */
+
+struct jg2_reftab *
+jg2_reftab_get(struct jg2_repo *jrepo)
+{
+	struct jg2_reftab *t;
+
+	pthread_mutex_lock(&jrepo->lock); /* ===================== jrepo lock */
+	t = jrepo->reftab;
+	if (t)
+		t->refcount++;
+	pthread_mutex_unlock(&jrepo->lock); /*------------------ jrepo unlock */
+
+	return t;
+}
+
+void
+jg2_reftab_put(struct jg2_repo *jrepo, struct jg2_reftab **pt)
+{
+	struct jg2_reftab *t = *pt;
+	int n;
+
+	if (!t)
+		return;
+
+	*pt = NULL;
+
+	pthread_mutex_lock(&jrepo->lock); /* ===================== jrepo lock */
+	n = !--t->refcount;
+	pthread_mutex_unlock(&jrepo->lock); /*------------------ jrepo unlock */
+
+	if (n)
+		free(t);
+}
+
+/*
+ * Make t the current table for jrepo, giving up jrepo's reference on the
+ * previous one.  t's creation reference passes to jrepo.
+ */
+
+void
+jg2_reftab_swap(struct jg2_repo *jrepo, struct jg2_reftab *t)
+{
+	struct jg2_reftab *old;
+
+	pthread_mutex_lock(&jrepo->lock); /* ===================== jrepo lock */
+	old = jrepo->reftab;
+	jrepo->reftab = t;
+	pthread_mutex_unlock(&jrepo->lock); /*------------------ jrepo unlock */
+
+	jg2_reftab_put(jrepo, &old);
+}
@@ -0,0 +1,294 @@
+/*
+ * libjsongit2 - inotify-driven ref change detection
+ *
+ * Copyright (C) 2018-2025 Andy Green <andy@warmcat.com>
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation:
+ *  version 2.1 of the License.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ *  MA  02110-1301  USA
+ *
+ * Without this, the cache thread has to iterate the refs of every open repo
+ * through libgit2 every few seconds to notice anything changed.  Instead we
+ * watch the places git changes when refs are updated, and only look at the
+ * repos that had something happen.
+ *
+ * git updates a ref by writing "<ref>.lock" and renaming it over the ref, and
+ * the same for packed-refs, so we see IN_MOVED_TO on the ref name.  Deleting
+ * a ref shows as IN_DELETE on the loose ref, or packed-refs being replaced.
+ *
+ * inotify is not recursive, so we watch the git dir (for packed-refs and
+ * HEAD), refs/heads and refs/tags.  Refs in nested dirs like
+ * refs/heads/feature/x are missed, those are still picked up by the slower
+ * polling fallback.
+ *
+ * The same repo open on several vhosts gets the same watch descriptors, since
+ * inotify only has one watch per inode.  So we count how many open repos are
+ * using each watch descriptor, and only remove the watch when the last one
+ * closes.  The counts are shared by all the vhosts, so they have their own
+ * lock, which is only ever taken innermost.
+ */
+
+#include "private.h"
+
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/inotify.h>
+
+static const char * const watch_subdirs[] = {
+	"", "/refs/heads", "/refs/tags"
+};
+
+int
+jg2_refwatch_init(struct jg2_global *jg2_global)
+{
+	jg2_global->refwatch_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (jg2_global->refwatch_fd < 0) {
+		lwsl_notice("%s: inotify unavailable, errno %d, polling refs\n",
+			    __func__, errno);
+		jg2_global->refwatch_fd = -1;
+
+		return 1;
+	}
+
+	return 0;
+}
+
+void
+jg2_refwatch_deinit(struct jg2_global *jg2_global)
+{
+	struct jg2_refwatch *rw, *rw1;
+	size_t n;
+
+	pthread_mutex_lock(&jg2_global->refwatch_lock); /* ==== refwatch lock */
+
+	if (jg2_global->refwatch_fd != -1)
+		close(jg2_global->refwatch_fd);
+
+	jg2_global->refwatch_fd = -1;
+
+	for (n = 0; n < LWS_ARRAY_SIZE(jg2_global->refwatch_hash); n++) {
+		rw = jg2_global->refwatch_hash[n];
+		while (rw) {
+			rw1 = rw->next;
+			free(rw);
+			rw = rw1;
+		}
+		jg2_global->refwatch_hash[n] = NULL;
+	}
+
+	pthread_mutex_unlock(&jg2_global->refwatch_lock); /* refwatch unlock */
+}
+
+/*
+ * requires refwatch lock
+ *
+ * Adjusts the count of repos using wd by delta, and returns the new count.
+ * Returns -1 if we couldn't allocate the count for a new wd.
+ */
+
+static int
+__jg2_refwatch_ref(struct jg2_global *jg2_global, int wd, int delta)
+{
+	struct jg2_refwatch **prw, *rw;
+
+	prw = &jg2_global->refwatch_hash[(unsigned int)wd %
+					 LWS_ARRAY_SIZE(jg2_global->refwatch_hash)];
+	while (*prw && (*prw)->wd != wd)
+		prw = &(*prw)->next;
+
+	rw = *prw;
+	if (!rw) {
+		if (delta < 0)
+			return 0;
+
+		rw = jg2_zalloc(sizeof(*rw));
+		if (!rw)
+			return -1;
+
+		rw->wd = wd;
+		*prw = rw;
+	}
+
+	rw->refcount += delta;
+	if (rw->refcount > 0)
+		return rw->refcount;
+
+	*prw = rw->next;
+	free(rw);
+
+	return 0;
+}
+
+/* requires vhost lock */
+
+void
+__jg2_refwatch_add(struct jg2_global *jg2_global, struct jg2_repo *r)
+{
+	char path[256];
+	size_t n;
+
+	pthread_mutex_lock(&jg2_global->refwatch_lock); /* ==== refwatch lock */
+
+	if (jg2_global->refwatch_fd == -1)
+		goto bail;
+
+	for (n = 0; n < LWS_ARRAY_SIZE(watch_subdirs); n++) {
+		lws_snprintf(path, sizeof(path), "%s%s", r->repo_path,
+			     watch_subdirs[n]);
+
+		r->wd[n] = inotify_add_watch(jg2_global->refwatch_fd, path,
+					     IN_MOVED_TO | IN_CLOSE_WRITE |
+					     IN_DELETE | IN_ONLYDIR);
+		if (r->wd[n] < 0) {
+			lwsl_info("%s: unable to watch %s: errno %d\n",
+				  __func__, path, errno);
+			r->wd[n] = 0;
+			continue;
+		}
+
+		if (__jg2_refwatch_ref(jg2_global, r->wd[n], 1) < 0) {
+			/* OOM... nobody else was counted on it, drop it */
+			inotify_rm_watch(jg2_global->refwatch_fd, r->wd[n]);
+			r->wd[n] = 0;
+		}
+	}
+
+bail:
+	pthread_mutex_unlock(&jg2_global->refwatch_lock); /* refwatch unlock */
+}
+
+/*
+ * requires vhost lock
+ *
+ * r is being closed, stop using its watches.  If the same repo is open on
+ * another vhost, it's sharing the same watches, so they are only removed
+ * when the last user of them goes.
+ */
+
+void
+__jg2_refwatch_remove(struct jg2_global *jg2_global, struct jg2_repo *r)
+{
+	size_t n;
+
+	pthread_mutex_lock(&jg2_global->refwatch_lock); /* ==== refwatch lock */
+
+	for (n = 0; n < LWS_ARRAY_SIZE(r->wd); n++) {
+		if (r->wd[n] && jg2_global->refwatch_fd != -1 &&
+		    !__jg2_refwatch_ref(jg2_global, r->wd[n], -1))
+			inotify_rm_watch(jg2_global->refwatch_fd, r->wd[n]);
+		r->wd[n] = 0;
+	}
+
+	pthread_mutex_unlock(&jg2_global->refwatch_lock); /* refwatch unlock */
+}
+
+static int
+refwatch_interesting(const struct inotify_event *ev)
+{
+	size_t n;
+
+	if (ev->mask & IN_Q_OVERFLOW)
+		return 1;
+
+	if (!ev->len || !ev->name[0])
+		return 0;
+
+	n = strlen(ev->name);
+
+	/* the temp files git writes before renaming them into place */
+	if (n > 5 && !strcmp(ev->name + n - 5, ".lock"))
+		return 0;
+
+	return 1;
+}
+
+/*
+ * Called when the inotify fd is readable, collects up to max watch
+ * descriptors that saw a change in the watched dirs into wds.
+ *
+ * Returns the number of wds collected, or -1 if we lost track (the inotify
+ * queue overflowed, or there were more than max) and everything should be
+ * checked.
+ */
+
+int
+jg2_refwatch_read(struct jg2_global *jg2_global, int *wds, int max)
+{
+	char buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+	const struct inotify_event *ev;
+	int count = 0, n;
+	ssize_t len;
+	char *p;
+
+	while (1) {
+		len = read(jg2_global->refwatch_fd, buf, sizeof(buf));
+		if (len <= 0)
+			break;
+
+		for (p = buf; p < buf + len;
+		     p += sizeof(struct inotify_event) + ev->len) {
+			ev = (const struct inotify_event *)p;
+
+			if (!refwatch_interesting(ev))
+				continue;
+
+			if ((ev->mask & IN_Q_OVERFLOW) || count < 0) {
+				count = -1;
+				continue;
+			}
+
+			for (n = 0; n < count; n++)
+				if (wds[n] == ev->wd)
+					break;
+
+			if (n != count)
+				continue;
+
+			if (count == max) {
+				count = -1;
+				continue;
+			}
+
+			wds[count++] = ev->wd;
+		}
+	}
+
+	return count;
+}
+
+/*
+ * requires vhost lock
+ *
+ * Mark the repos using any of the count watch descriptors in wds as dirty, so
+ * the next reflist update looks at them immediately.
+ */
+
+void
+__jg2_refwatch_mark(struct jg2_vhost *vh, const int *wds, int count)
+{
+	struct jg2_repo *r = vh->repo_list;
+	size_t m;
+	int n;
+
+	while (r) {
+		for (m = 0; m < LWS_ARRAY_SIZE(r->wd); m++)
+			for (n = 0; n < count; n++)
+				if (r->wd[m] && r->wd[m] == wds[n])
+					r->dirty = 1;
+
+		r = r->next;
+	}
+}
@@ -22,213 +22,167 @@
 #include "private.h"
 
 #include <string.h>
+#include <stdlib.h>
+#include <sys/stat.h>
 
-/* vhost lock must be held on entry */
+/*
+ * Even with the stat precheck saying nothing changed, iterate the refs at
+ * least this often, since updates to refs in nested dirs like
+ * refs/heads/feature/x don't change anything we stat
+ */
+#define JG2_REFS_FULL_CHECK_SECS 60
+
+static void
+repo_stat_one(const char *repo_path, const char *sub, uint64_t *v, int ino)
+{
+	char path[256];
+	struct stat s;
+
+	lws_snprintf(path, sizeof(path), "%s/%s", repo_path, sub);
+	if (stat(path, &s)) {
+		v[0] = v[1] = 0;
+		if (ino)
+			v[2] = v[3] = 0;
+		return;
+	}
+
+	v[0] = (uint64_t)s.st_mtim.tv_sec;
+	v[1] = (uint64_t)s.st_mtim.tv_nsec;
+	if (ino) {
+		v[2] = (uint64_t)s.st_ino;
+		v[3] = (uint64_t)s.st_size;
+	}
+}
+
+/*
+ * git updates refs and packed-refs by renaming a new file into place, which
+ * gives packed-refs a new inode and changes the mtime of the dir a loose ref
+ * is in.  So a few stat() calls tell us if it's worth asking libgit2.
+ */
+
+static void
+repo_refs_stat(struct jg2_repo *jrepo, uint64_t *v)
+{
+	repo_stat_one(jrepo->repo_path, "packed-refs", &v[0], 1);
+	repo_stat_one(jrepo->repo_path, "refs/heads", &v[4], 0);
+	repo_stat_one(jrepo->repo_path, "refs/tags", &v[6], 0);
+}
+
+/*
+ * vhost lock must be held on entry
+ *
+ * Returns 0 if the refs didn't change (or we didn't look), 2 if they changed
+ * and a new ref table was swapped in, or -1 on error.
+ */
 
 int
 __repo_reflist_update(struct jg2_vhost *vh, struct jg2_repo *jrepo)
 {
-	struct jg2_ref **er_prev = &jrepo->ref_list, *er = *er_prev, *er1,
-		       **er_hash_prev[REF_HASH_SIZE];
-	unsigned char entry[REF_HASH_SIZE];
-	git_reference_iterator *iter_ref;
-	int change_seen = 0, n, ret = -1;
-	time_t t = time(NULL);
+	unsigned char entry[JG2_CHASH_LEN];
+	uint64_t st[LWS_ARRAY_SIZE(jrepo->refstat)];
+	struct jg2_reftab *t;
+	time_t t1 = time(NULL);
 	struct jg2_ctx *ctx;
-	git_reference *ref;
+	int full;
 
-	/* limit how often we are willing to do this */
+	/* closed repos are looked at again when they are reopened */
 
-	if (t - jrepo->last_update <= 3)
+	if (!jrepo->repo)
 		return 0;
 
-	pthread_mutex_lock(&jrepo->lock); /* ===================== jrepo lock */
+	/*
+	 * limit how often we are willing to do this, unless we were told
+	 * something changed
+	 */
+
+	if (!jrepo->dirty && t1 - jrepo->last_update <= 3)
+		return 0;
+
+	full = jrepo->dirty || !jrepo->reftab ||
+	       t1 - jrepo->last_full >= JG2_REFS_FULL_CHECK_SECS;
+	jrepo->dirty = 0;
+	jrepo->last_update = t1;
 
-	memcpy(entry, jrepo->md5_refs, sizeof(entry));
+	/* most of the time, nothing changed and a few stat()s can tell us */
 
-	jrepo->last_update = t;
+	repo_refs_stat(jrepo, st);
+	if (!full && !memcmp(st, jrepo->refstat, sizeof(st)))
+		return 0;
 
-	for (n = 0; n < REF_HASH_SIZE; n++)
-		er_hash_prev[n] = &jrepo->ref_list_hash[n];
+	memcpy(jrepo->refstat, st, sizeof(st));
+	jrepo->last_full = t1;
 
 	/*
-	 * First we iterate all the interesting refs and check against our
-	 * existing reflist.  Most commonly, they are unchanged and we exit
-	 * with 0 indicating no change.
-	 *
-	 * We keep track of if the only difference was an oid change on an
-	 * existing ref.  If so we update it on to go, recompute the repo hash
-	 * and we exit with 1, indicating change found.
+	 * If it looks like something changed, we build a complete new table of
+	 * the interesting refs, without holding the jrepo lock, since nobody
+	 * changes the current one.  If it turns out to be the same as the
+	 * existing one, we throw it away and exit with 0 indicating no change.
 	 *
-	 * If the iterated refs and reflist lose coherence on the names, we
-	 * delete and reacquire the whole reflist, recompute the repo hash, and
-	 * exit with 2 indicating a change found.
+	 * Otherwise we recompute the repo hash, swap the new table in and exit
+	 * with 2 indicating a change found.  Jobs that pinned the old table
+	 * keep using it until they finish.
 	 *
 	 * Because we may mark, eg, commit logs with decorations from any
 	 * other ref, if any ref changes all views are potentially affected.
 	 */
 
-	if (git_reference_iterator_new(&iter_ref, jrepo->repo) < 0) {
-		if (giterr_last())
-			giterr_clear();
-		goto bail;
-	}
-
-	if (giterr_last())
-		giterr_clear();
-
-	while (git_reference_next(&ref, iter_ref) >= 0) {
-		const char *name = git_reference_name(ref);
-
-		if (!strncmp(name, "refs/heads/", 11) ||
-		    !strncmp(name, "refs/tags/", 10)) {
-			const git_oid *oid;
-
-			if (!er) { /* lost coherence: extra new refs */
-				change_seen |= 2;
-				break;
-			}
-
-			if (strcmp(name, er->ref_name)) {
-				/* lost coherence: wrong name */
-				change_seen |= 2;
-				break;
-			}
-
-			oid = git_reference_target(ref);
-
-			if (git_oid_cmp(&er->oid, oid)) {
-				change_seen |= 1; /* existing ref changed oid */
-				/* snip us out of existing hash table */
-				*er_hash_prev[jg2_oidbin(&er->oid)] =
-						er->hash_next;
-				/* update our oid */
-				git_oid_cpy(&er->oid, oid);
-				/* patch us into hash table of the new oid */
-				er->hash_next = *er_hash_prev[jg2_oidbin(oid)];
-				*er_hash_prev[jg2_oidbin(oid)] = er;
-			}
-			er_hash_prev[jg2_oidbin(oid)] = &er->hash_next;
-			er_prev = &er->next;
-			er = er->next;
-		}
-		git_reference_free(ref);
-		ref = NULL;
-	}
+	t = jg2_reftab_create(jrepo->repo);
+	if (!t)
+		return -1;
 
-	if (er) /* lost coherence: less refs than before */
-		change_seen |= 2;
-
-	if (!change_seen) {
-		git_reference_iterator_free(iter_ref);
-
-		ret = 0;
-		goto bail;
-	}
-
-	if (!(change_seen & 2))
-		/* ref has always been freed if !(change_seen & 2) */
-		goto changed1;
-
-	/* snip all the existing refs past the point we lost coherence */
-
-	*er_prev = NULL;
-	while (er) {
-		/* snip us out of existing hash table */
-		*er_hash_prev[jg2_oidbin(&er->oid)] = er->hash_next;
-		er1 = er->next;
-		jg2_repo_ref_destroy(er);
-		er = er1;
-	}
-
-	if (!ref)
-		/*
-		 * we actually handled all the refs.  The only problem was
-		 * some left over in the original list...
-		 */
-		goto changed1;
-
-	/* regenerate the ref list from the point it lost coherence */
-
-	do {
-		const char *name = git_reference_name(ref);
-
-		if (!strncmp(name, "refs/heads/", 11) ||
-		    !strncmp(name, "refs/tags/", 10)) {
-			const git_oid *oid;
-
-			oid = git_reference_target(ref);
-
-			er = jg2_zalloc(sizeof(*er));
-			if (!er)
-				goto bail;
-
-			er->ref_name = strdup(name);
-			git_oid_cpy(&er->oid, oid);
-
-			*er_prev = er;
-			er->next = NULL;
-			*er_hash_prev[jg2_oidbin(&er->oid)] = er;
-			er_hash_prev[jg2_oidbin(&er->oid)] = &er->hash_next;
-			er_prev = &er->next;
-		}
-
-		git_reference_free(ref);
-	} while (git_reference_next(&ref, iter_ref) >= 0);
-
-changed1:
-	git_reference_iterator_free(iter_ref);
-
-	/* create a new hash representing all the refs in this repo */
-
-	vh->cfg.md5_init(vh->md5_ctx);
-
-	er = jrepo->ref_list;
-	while (er) {
-		// lwsl_debug("%s: %s\n", __func__, er->ref_name);
+	/*
+	 * The refs hash is patched from the current table's for just the refs
+	 * that changed, if nothing did we can drop the new table.  The
+	 * current table can't go away under us, since only we replace it.
+	 */
 
-		vh->cfg.md5_upd(vh->md5_ctx, (unsigned char *)er->ref_name,
-				   strlen(er->ref_name));
-		vh->cfg.md5_upd(vh->md5_ctx, er->oid.id, sizeof(er->oid.id));
+	if (!jg2_reftab_digest(t, jrepo->reftab) && jrepo->reftab) {
+		free(t);
 
-		er = er->next;
+		return 0;
 	}
 
-	vh->cfg.md5_fini(vh->md5_ctx, jrepo->md5_refs);
+	memcpy(entry, jrepo->refs_hash, sizeof(entry));
+	jg2_reftab_digest_bytes(t, jrepo->refs_hash);
 
 	{
 		char hash33[33];
 
-		md5_to_hex_cstr(hash33, jrepo->md5_refs);
+		md5_to_hex_cstr(hash33, jrepo->refs_hash);
 
-		if (memcmp(entry, jrepo->md5_refs, sizeof(entry)))
+		if (memcmp(entry, jrepo->refs_hash, sizeof(entry)))
 			lwsl_notice("%s: %s: ref hash: %s\n", __func__,
 				    jrepo->repo_path, hash33);
 	}
 
+	jg2_reftab_swap(jrepo, t);
+	jrepo->cmeta_stale = 1;
+	jrepo->lastc_stale = 1;
+
 	/*
 	 * Inform all ctx that use this repo about the refchange... this is
 	 * useful if the client is on a long poll...
 	 */
 
+	pthread_mutex_lock(&jrepo->lock); /* ===================== jrepo lock */
+
 	ctx = jrepo->ctx_repo_list;
 	while (ctx) {
-		if (ctx->vhost->cfg.refchange)
+		if (ctx->vhost->cfg.refchange && !ctx->orphaned)
 			ctx->vhost->cfg.refchange(ctx->user);
 
 		ctx = ctx->ctx_using_repo_next;
 	}
 
-	ret = 2;
-
-bail:
 	pthread_mutex_unlock(&jrepo->lock); /*------------------ jrepo unlock */
 
-	return ret;
+	return 2;
 }
 
+/* if dirty_only, only repos we were told changed are looked at */
+
 int
-jg2_vhost_repo_reflist_update(struct jg2_vhost *vhost)
+jg2_vhost_repo_reflist_update(struct jg2_vhost *vhost, int dirty_only)
 {
 	struct jg2_repo *r;
 	int m = 0;
@@ -238,7 +192,8 @@ jg2_vhost_repo_reflist_update(struct jg2_vhost *vhost)
 	r = vhost->repo_list;
 
 	while (r) {
-		m |= __repo_reflist_update(vhost, r);
+		if (!dirty_only || r->dirty)
+			m |= __repo_reflist_update(vhost, r);
 
 		r = r->next;
 	}
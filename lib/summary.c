@@ -0,0 +1,219 @@
+/*
+ * libjsongit2 - per-oid summary fragment cache
+ *
+ * Copyright (C) 2018-2025 Andy Green <andy@warmcat.com>
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation:
+ *  version 2.1 of the License.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ *  MA  02110-1301  USA
+ *
+ * The same commit and tag summaries turn up on the log, refs, summary and
+ * blog pages, and again for every ref near them.  The JSON for a summary
+ * only depends on the object, except for the ref aliases of the oids in it,
+ * so the vhost keeps recently rendered ones in an LRU keyed by the oid.
+ *
+ * They're stored like oid-keyed cache entries, with a decoration marker in
+ * place of each alias list, and the current aliases are spliced in each time
+ * one is used.
+ */
+
+#include "private.h"
+
+#include <string.h>
+
+/* a summary has at most two oids with alias lists in it */
+#define JG2_SUMMARY_DECOS 2
+
+/*
+ * Emit a cached fragment, splicing in the current alias lists.  If the ctx
+ * is making an oid-keyed cache entry itself, the markers are kept around them.
+ */
+
+static void
+summary_splice(struct jg2_ctx *ctx, const char *s, size_t len)
+{
+	const char *end = s + len, *m, *me;
+	git_oid oid;
+	size_t n;
+
+	while (s < end) {
+		m = jg2_deco_next(s, end, &me);
+		if (!me)
+			m = NULL;
+
+		n = lws_ptr_diff(m ? m : end, s);
+		memcpy(ctx->p, s, n);
+		ctx->p += n;
+
+		if (!m)
+			break;
+
+		if (ctx->deco_markers) {
+			memcpy(ctx->p, m, 1 + GIT_OID_HEXSZ);
+			ctx->p += 1 + GIT_OID_HEXSZ;
+		}
+
+		if (!git_oid_fromstrn(&oid, m + 1, GIT_OID_HEXSZ))
+			jg2_json_alias_list(&oid, ctx);
+
+		if (ctx->deco_markers)
+			*ctx->p++ = JG2_DECO_END;
+
+		s = me;
+	}
+}
+
+/*
+ * Keep a copy of the rendered summary in [p, end), which has markers around
+ * the alias lists, leaving the alias lists out
+ */
+
+static void
+summary_store(struct jg2_vhost *vh, const git_oid *oid, const char *p,
+	      const char *end)
+{
+	const char *s, *m, *me;
+	struct jg2_lru_entry *e;
+	size_t len = 0, n;
+	char *d = NULL;
+
+	/* first pass measures it, second pass copies it */
+
+	do {
+		s = p;
+		while (s < end) {
+			m = jg2_deco_next(s, end, &me);
+			if (!m || !me) {
+				m = end;
+				me = NULL;
+			} else
+				/* keep the marker start + hex oid */
+				m += 1 + GIT_OID_HEXSZ;
+
+			n = lws_ptr_diff(m, s);
+			if (d) {
+				memcpy(d, s, n);
+				d += n;
+			} else
+				len += n;
+
+			/* resume at the JG2_DECO_END, if any */
+			s = me ? me - 1 : end;
+		}
+
+		if (d)
+			break;
+
+		e = jg2_lru_alloc(vh->summaries, oid->id, len);
+		if (!e)
+			return;
+
+		d = (char *)jg2_lru_data(e);
+	} while (1);
+
+	e = jg2_lru_add(vh->summaries, e);
+	jg2_lru_put(&e);
+}
+
+static int
+summary_render(struct jg2_ctx *ctx, const git_oid *oid, git_commit *c)
+{
+	git_generic_ptr u;
+	uint32_t i;
+	int r = 1;
+
+	if (c)
+		return commit_summary(c, ctx);
+
+	if (ctx->cmeta && !jg2_cmeta_find(ctx->cmeta, oid, &i) &&
+	    !jg2_cmeta_summary(ctx->cmeta, i, ctx))
+		return 0;
+
+	if (git_object_lookup(&u.obj, ctx->jrepo->repo, oid, GIT_OBJ_ANY) < 0)
+		return 1;
+
+	switch (git_object_type(u.obj)) {
+	case GIT_OBJ_COMMIT:
+		r = commit_summary(u.commit, ctx);
+		break;
+	case GIT_OBJ_TAG:
+		r = tag_summary(u.tag, ctx);
+		break;
+	default:
+		break;
+	}
+
+	git_object_free(u.obj);
+
+	return r;
+}
+
+/*
+ * Emits the inside of the summary object for a commit or tag oid, from the
+ * vhost's fragment cache if possible.  c may be given if the caller already
+ * has the commit.
+ *
+ * Returns nonzero without emitting anything if oid isn't a commit or tag we
+ * can find.
+ */
+
+int
+jg2_summary_json(struct jg2_ctx *ctx, const git_oid *oid, git_commit *c)
+{
+	struct jg2_vhost *vh = ctx->vhost;
+	struct jg2_lru_entry *e;
+	unsigned int dm;
+	char *start;
+	int r;
+
+	e = jg2_lru_get(vh->summaries, oid->id);
+	if (e) {
+		if (lws_ptr_diff(ctx->end, ctx->p) > (int)e->len +
+				JG2_SUMMARY_DECOS * JG2_DECO_MAX + 1) {
+			summary_splice(ctx, jg2_lru_data(e), e->len);
+			jg2_lru_put(&e);
+
+			return 0;
+		}
+
+		/* let it be rendered and truncated the usual way */
+		jg2_lru_put(&e);
+	}
+
+	/* render it with the markers in, so we can store it without aliases */
+
+	start = ctx->p;
+	dm = ctx->deco_markers;
+	ctx->deco_markers = 1;
+
+	r = summary_render(ctx, oid, c);
+
+	ctx->deco_markers = dm;
+
+	if (r) {
+		ctx->p = start;
+
+		return 1;
+	}
+
+	/* don't keep it if it didn't all fit */
+
+	if (lws_ptr_diff(ctx->end, ctx->p) > 1)
+		summary_store(vh, oid, start, ctx->p);
+
+	if (!dm)
+		ctx->p = jg2_deco_strip(start, ctx->p);
+
+	return 0;
+}
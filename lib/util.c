@@ -29,6 +29,12 @@
 
 #include <sys/time.h>
 
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) && \
+    defined(__SSE2__)
+#include <immintrin.h>
+#define JG2_PURIFY_X86
+#endif
+
 static const char *hex = "0123456789abcdef";
 
 /*
@@ -120,6 +126,9 @@ jg2_repopath_split(const char *urlpath, struct jg2_split_repopath *sr)
 		if (p[-1] == 's') { /* ofs */
 			sr->offset = atoi(p + 1);
 		}
+		if (p[-1] == 'n') { /* n */
+			sr->count = atoi(p + 1);
+		}
 		if (p[-1] == 'q') {
 			pp =  strdup(p + 1);
 			sr->e[JG2_PE_SEARCH] = (const char *)pp;
@@ -220,10 +229,130 @@ jg2_repopath_destroy(struct jg2_split_repopath *sr)
 	}
 }
 
+/*
+ * The bytes jg2_json_purify() can't just copy: a NUL ends the string, and
+ * control chars and anything that might end the string or be taken as html
+ * are escaped.
+ */
+
+static const uint8_t purify_special[256] = {
+	1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+	1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+	['"'] = 1, ['&'] = 1, ['<'] = 1, ['='] = 1, ['>'] = 1, ['\\'] = 1,
+};
+
+/*
+ * These return how many of the n bytes at p can be copied as they are, ie,
+ * the index of the first special one, or n
+ */
+
+static size_t
+purify_span_scalar(const uint8_t *p, size_t n)
+{
+	size_t m = 0;
+
+	while (m < n && !purify_special[p[m]])
+		m++;
+
+	return m;
+}
+
+#if defined(JG2_PURIFY_X86)
+
+static size_t
+purify_span_sse2(const uint8_t *p, size_t n)
+{
+	const __m128i ctl = _mm_set1_epi8(0x1f), quot = _mm_set1_epi8('"'),
+		      amp = _mm_set1_epi8('&'), lt = _mm_set1_epi8('<'),
+		      eq = _mm_set1_epi8('='), gt = _mm_set1_epi8('>'),
+		      bsl = _mm_set1_epi8('\\');
+	unsigned int mask;
+	size_t m = 0;
+	__m128i v, s;
+
+	while (n - m >= 16) {
+		v = _mm_loadu_si128((const __m128i *)(p + m));
+
+		/* unsigned v <= 0x1f, or one of the others */
+		s = _mm_cmpeq_epi8(_mm_min_epu8(v, ctl), v);
+		s = _mm_or_si128(s, _mm_cmpeq_epi8(v, quot));
+		s = _mm_or_si128(s, _mm_cmpeq_epi8(v, amp));
+		s = _mm_or_si128(s, _mm_cmpeq_epi8(v, lt));
+		s = _mm_or_si128(s, _mm_cmpeq_epi8(v, eq));
+		s = _mm_or_si128(s, _mm_cmpeq_epi8(v, gt));
+		s = _mm_or_si128(s, _mm_cmpeq_epi8(v, bsl));
+
+		mask = (unsigned int)_mm_movemask_epi8(s);
+		if (mask)
+			return m + (size_t)__builtin_ctz(mask);
+
+		m += 16;
+	}
+
+	return m + purify_span_scalar(p + m, n - m);
+}
+
+__attribute__((target("avx2"))) static size_t
+purify_span_avx2(const uint8_t *p, size_t n)
+{
+	const __m256i ctl = _mm256_set1_epi8(0x1f), quot = _mm256_set1_epi8('"'),
+		      amp = _mm256_set1_epi8('&'), lt = _mm256_set1_epi8('<'),
+		      eq = _mm256_set1_epi8('='), gt = _mm256_set1_epi8('>'),
+		      bsl = _mm256_set1_epi8('\\');
+	unsigned int mask;
+	size_t m = 0;
+	__m256i v, s;
+
+	while (n - m >= 32) {
+		v = _mm256_loadu_si256((const __m256i *)(p + m));
+
+		s = _mm256_cmpeq_epi8(_mm256_min_epu8(v, ctl), v);
+		s = _mm256_or_si256(s, _mm256_cmpeq_epi8(v, quot));
+		s = _mm256_or_si256(s, _mm256_cmpeq_epi8(v, amp));
+		s = _mm256_or_si256(s, _mm256_cmpeq_epi8(v, lt));
+		s = _mm256_or_si256(s, _mm256_cmpeq_epi8(v, eq));
+		s = _mm256_or_si256(s, _mm256_cmpeq_epi8(v, gt));
+		s = _mm256_or_si256(s, _mm256_cmpeq_epi8(v, bsl));
+
+		mask = (unsigned int)_mm256_movemask_epi8(s);
+		if (mask)
+			return m + (size_t)__builtin_ctz(mask);
+
+		m += 32;
+	}
+
+	return m + purify_span_sse2(p + m, n - m);
+}
+
+#endif
+
+static size_t
+purify_span(const uint8_t *p, size_t n)
+{
+#if defined(JG2_PURIFY_X86)
+	static int avx2 = -1; /* racing to set it is harmless */
+
+	if (avx2 < 0) {
+		__builtin_cpu_init();
+		avx2 = !!__builtin_cpu_supports("avx2");
+	}
+
+	if (avx2)
+		return purify_span_avx2(p, n);
+
+	return purify_span_sse2(p, n);
+#else
+	return purify_span_scalar(p, n);
+#endif
+}
+
 /* returns amount written to escaped.
  *
  * if inlim_totlen is non-null, it restricts the amount of input that can be
  * used on input, and contains the amount of input used on output.
+ *
+ * Runs of bytes that don't need escaping are found a vector at a time and
+ * copied in one go, only the bytes that end them go through the loop.
  */
 
 int
@@ -232,6 +361,7 @@ jg2_json_purify(char *escaped, const char *string, int len,
 {
 	const char *p = string, *op = p;
 	char *q = escaped;
+	size_t lim, run;
 	int inlim = -1;
 
 	if (inlim_totlen)
@@ -242,7 +372,30 @@ jg2_json_purify(char *escaped, const char *string, int len,
 		return 0;
 	}
 
-	while (len-- > 6 && (p - op) != inlim && *p) {
+	/*
+	 * The runs may only look as far as the input limit, or without one,
+	 * the NUL, so we don't read past the end of a string
+	 */
+
+	if (inlim >= 0)
+		lim = (size_t)inlim;
+	else
+		lim = strnlen(string, len > 6 ? (size_t)(len - 6) : 0);
+
+	do {
+		run = len > 6 ? (size_t)(len - 6) : 0;
+		if (run > lim - (size_t)(p - op))
+			run = lim - (size_t)(p - op);
+
+		run = purify_span((const uint8_t *)p, run);
+		memcpy(q, p, run);
+		p += run;
+		q += run;
+		len -= (int)run;
+
+		if (!(len-- > 6 && (p - op) != inlim && *p))
+			break;
+
 		if (*p == '\t') {
 			p++;
 			*q++ = '\\';
@@ -276,7 +429,7 @@ jg2_json_purify(char *escaped, const char *string, int len,
 			p++;
 		} else
 			*q++ = *p++;
-	}
+	} while (1);
 	*q = '\0';
 
 	if (inlim_totlen)
@@ -360,17 +513,76 @@ ellipsis_purify(char *out, const char *in, int max)
 	return out;
 }
 
+#define JW_TIME_MAX (24 + (JG2_JW_NUM_MAX * 2))
+
+static void
+jw_time(struct jg2_jw *w, const git_time *t)
+{
+	JG2_JW_LIT(w, "{ \"time\": ");
+	jg2_jw_u64(w, (uint64_t)t->time);
+	JG2_JW_LIT(w, ", \"offset\": ");
+	jg2_jw_s64(w, t->offset);
+	JG2_JW_LIT(w, " }");
+}
+
 void
 time_json(const git_time *t, struct jg2_ctx *ctx)
 {
-	CTX_BUF_APPEND("{ \"time\": %llu, \"offset\": %d }",
-		       (unsigned long long)t->time, t->offset);
+	struct jg2_jw w;
+
+	jg2_jw_start(&w, ctx, JW_TIME_MAX);
+	jw_time(&w, t);
+	jg2_jw_end(&w, ctx);
+}
+
+/* writes 68 chars besides the name and email */
+
+static void
+jw_name_email(struct jg2_jw *w, const char *name, const char *email,
+	      const unsigned char *md5)
+{
+	JG2_JW_LIT(w, " \"name\": \"");
+	jg2_jw_str(w, name);
+	JG2_JW_LIT(w, "\", \"email\": \"");
+	jg2_jw_str(w, email);
+	JG2_JW_LIT(w, "\", \"md5\": \"");
+	if (md5)
+		jg2_jw_hex(w, md5, JG2_MD5_LEN);
+	else
+		jg2_jw_char(w, '?');
+	JG2_JW_LIT(w, "\" ");
+}
+
+/* name and email are already ellipsis_purify()'d to JG2_IDENT_LEN */
+
+void
+name_email_json_pure(const char *name, const char *email,
+		     const unsigned char *md5, struct jg2_ctx *ctx)
+{
+	struct jg2_jw w;
+
+	jg2_jw_start(&w, ctx, 68 + strlen(name) + strlen(email));
+	jw_name_email(&w, name, email, md5);
+	jg2_jw_end(&w, ctx);
+}
+
+/* a whole signature object, with the name and email already purified */
+
+void
+jg2_jw_sig(struct jg2_jw *w, const git_time *t, const char *name,
+	   const char *email, const unsigned char *md5)
+{
+	JG2_JW_LIT(w, "{ \"git_time\": ");
+	jw_time(w, t);
+	jg2_jw_char(w, ',');
+	jw_name_email(w, name, email, md5);
+	JG2_JW_LIT(w, " }");
 }
 
 void
 name_email_json(const char *name, const char *email, struct jg2_ctx *ctx)
 {
-	char e[64], e1[64], md5_hex[33];
+	char e[JG2_IDENT_LEN], e1[JG2_IDENT_LEN];
 
 	if (!name)
 		name = "unknown";
@@ -378,11 +590,9 @@ name_email_json(const char *name, const char *email, struct jg2_ctx *ctx)
 	if (!email)
 		email = "unknown";
 
-	md5_to_hex_cstr(md5_hex, email_md5(ctx->vhost, email));
-
-	CTX_BUF_APPEND(" \"name\": \"%s\", \"email\": \"%s\", \"md5\": \"%s\" ",
-		       ellipsis_purify(e, name, sizeof(e)),
-		       ellipsis_purify(e1, email, sizeof(e1)), md5_hex);
+	name_email_json_pure(ellipsis_purify(e, name, sizeof(e)),
+			     ellipsis_purify(e1, email, sizeof(e1)),
+			     email_md5(ctx->vhost, email), ctx);
 }
 
 /* try to parse out Name Name <name@name.com> into name and email */
@@ -450,13 +660,24 @@ try:
 void
 signature_json(const git_signature *sig, struct jg2_ctx *ctx)
 {
-	CTX_BUF_APPEND("{ \"git_time\": ");
-	time_json(&sig->when, ctx);
+	const char *name = sig->name, *email = sig->email;
+	char e[JG2_IDENT_LEN], e1[JG2_IDENT_LEN];
+	const unsigned char *md5;
+	struct jg2_jw w;
 
-	CTX_BUF_APPEND(",");
-	name_email_json(sig->name, sig->email, ctx);
+	if (!name)
+		name = "unknown";
+
+	if (!email)
+		email = "unknown";
 
-	CTX_BUF_APPEND(" }");
+	md5 = email_md5(ctx->vhost, email);
+	ellipsis_purify(e, name, sizeof(e));
+	ellipsis_purify(e1, email, sizeof(e1));
+
+	jg2_jw_start(&w, ctx, JG2_JW_SIG_MAX + strlen(e) + strlen(e1));
+	jg2_jw_sig(&w, &sig->when, e, e1, md5);
+	jg2_jw_end(&w, ctx);
 }
 
 void
@@ -502,88 +723,242 @@ otype_name(git_otype type)
 
 int
 jg2_oid_to_ref_names(const git_oid *oid, struct jg2_ctx *ctx,
-		     struct jg2_ref **result, int max)
+		     const struct jg2_ref **result, int max)
 {
-	struct jg2_ref *ref = ctx->jrepo->ref_list_hash[jg2_oidbin(oid)];
-	int n = 0;
+	return jg2_reftab_lookup(ctx->reftab, oid, result, max);
+}
 
-	while (ref) {
-		if (!git_oid_cmp(&ref->oid, oid)) {
-			*result++ = ref;
-			if (++n == max)
-				return n;
-		}
-		ref = ref->hash_next;
-	}
+void
+jg2_json_alias_list(const git_oid *oid, struct jg2_ctx *ctx)
+{
+	const struct jg2_ref *aliases[JG2_DECO_ALIASES];
+	struct jg2_jw w;
+	char pure[32];
+	int n, m = 0;
 
-	return n;
+	n = jg2_oid_to_ref_names(oid, ctx, aliases, LWS_ARRAY_SIZE(aliases));
+
+	while (m < n) {
+		ellipsis_purify(pure, aliases[m]->ref_name, sizeof(pure));
+
+		jg2_jw_start(&w, ctx, 3 + strlen(pure));
+		jg2_jw_char(&w, !m ? ' ' : ',');
+		jg2_jw_char(&w, '"');
+		jg2_jw_str(&w, pure);
+		jg2_jw_char(&w, '"');
+		jg2_jw_end(&w, ctx);
+		m++;
+	}
 }
 
 int
 jg2_json_oid(const git_oid *oid, struct jg2_ctx *ctx)
 {
-	char oid_hex[GIT_OID_HEXSZ + 1], pure[32];
-	struct jg2_ref *aliases[8];
-	int n, m = 0;
+	struct jg2_jw w;
 
-	n = jg2_oid_to_ref_names(oid, ctx, aliases, LWS_ARRAY_SIZE(aliases));
+	jg2_jw_start(&w, ctx, 24 + (GIT_OID_HEXSZ * 2));
+	JG2_JW_LIT(&w, "{ \"oid\": \"");
+	jg2_jw_oid(&w, oid);
+	JG2_JW_LIT(&w, "\", \"alias\": [");
 
-	CTX_BUF_APPEND("{ \"oid\": \"%s\", "
-		       "\"alias\": [", oid_to_hex_cstr(oid_hex, oid));
+	/*
+	 * If we're making an oid-keyed cache entry, bracket the live alias
+	 * list so the cache write can leave it out, and the client copy can
+	 * have the brackets removed
+	 */
 
-	while (m < n) {
-		CTX_BUF_APPEND("%c\"%s\"", !m ? ' ' : ',', ellipsis_purify(pure,
-			       aliases[m]->ref_name, sizeof(pure)));
-		m++;
+	if (ctx->deco_markers) {
+		jg2_jw_char(&w, JG2_DECO_START);
+		jg2_jw_oid(&w, oid);
 	}
+	jg2_jw_end(&w, ctx);
+
+	jg2_json_alias_list(oid, ctx);
 
-	CTX_BUF_APPEND("]}");
+	jg2_jw_start(&w, ctx, 3);
+	if (ctx->deco_markers)
+		jg2_jw_char(&w, JG2_DECO_END);
+	JG2_JW_LIT(&w, "]}");
+	jg2_jw_end(&w, ctx);
 
 	return 0;
 }
 
+/*
+ * Find the next decoration marker in [p, end).  Returns NULL if none, or the
+ * start of the marker.  *deco_end is set to just after the JG2_DECO_END, or
+ * NULL if the marker is not complete inside [p, end).
+ */
+
+const char *
+jg2_deco_next(const char *p, const char *end, const char **deco_end)
+{
+	const char *q;
+	int n;
+
+	while (p < end) {
+		p = memchr(p, JG2_DECO_START, lws_ptr_diff(end, p));
+		if (!p)
+			return NULL;
+
+		if (lws_ptr_diff(end, p) < JG2_DECO_LEN) {
+			*deco_end = NULL;
+
+			return p;
+		}
+
+		for (n = 1; n <= GIT_OID_HEXSZ && isxdigit(p[n]); n++)
+			;
+
+		if (n == GIT_OID_HEXSZ + 1) {
+			q = memchr(p + n, JG2_DECO_END,
+				   lws_ptr_diff(end, p + n));
+			*deco_end = q ? q + 1 : NULL;
+
+			return p;
+		}
+
+		p++;
+	}
+
+	return NULL;
+}
+
+/*
+ * Remove the decoration markers from [p, end) in place, leaving the live
+ * alias lists.  Returns the new end.
+ */
+
+char *
+jg2_deco_strip(char *p, char *end)
+{
+	const char *m, *me;
+	char *d;
+
+	m = jg2_deco_next(p, end, &me);
+	if (!m)
+		return end;
+
+	d = (char *)m;
+	p = (char *)m;
+
+	while (m) {
+		size_t n = lws_ptr_diff(m, p);
+
+		if (!me) {
+			/* incomplete... it's not one of ours, leave it */
+			n = lws_ptr_diff(end, p);
+			memmove(d, p, n);
+
+			return d + n;
+		}
+
+		memmove(d, p, n);
+		d += n;
+
+		/* the alias list inside the marker */
+		n = lws_ptr_diff(me, m) - JG2_DECO_LEN;
+		memmove(d, m + 1 + GIT_OID_HEXSZ, n);
+		d += n;
+
+		p = (char *)me;
+		m = jg2_deco_next(p, end, &me);
+	}
+
+	memmove(d, p, lws_ptr_diff(end, p));
+
+	return d + lws_ptr_diff(end, p);
+}
+
+const char *
+commit_summary_msg(char *summary, git_commit *commit)
+{
+	return ellipsis_purify(summary,
+#if LIBGIT2_HAS_DIFF
+			       git_commit_summary(commit),
+#else
+			       git_commit_message(commit),
+#endif
+			       JG2_SUMMARY_LEN);
+}
+
 int
 commit_summary(git_commit *commit, struct jg2_ctx *ctx)
 {
-	char summary[100];
+	char summary[JG2_SUMMARY_LEN];
+	struct jg2_jw w;
 
-	CTX_BUF_APPEND("\"type\":\"commit\",\n \"time\": %llu,\n"
-			"\"time_ofs\": %llu,\n \"oid_tree\": ",
-			(unsigned long long)git_commit_time(commit),
-			(unsigned long long)git_commit_time_offset(commit));
+	jg2_jw_start(&w, ctx, 64 + (JG2_JW_NUM_MAX * 2));
+	JG2_JW_LIT(&w, "\"type\":\"commit\",\n \"time\": ");
+	jg2_jw_u64(&w, (uint64_t)git_commit_time(commit));
+	JG2_JW_LIT(&w, ",\n\"time_ofs\": ");
+	jg2_jw_u64(&w, (uint64_t)(int64_t)git_commit_time_offset(commit));
+	JG2_JW_LIT(&w, ",\n \"oid_tree\": ");
+	jg2_jw_end(&w, ctx);
 
 	jg2_json_oid(git_commit_tree_id(commit), ctx);
 
-	CTX_BUF_APPEND(",\n\"oid\":");
+	jg2_jw_start(&w, ctx, 16);
+	JG2_JW_LIT(&w, ",\n\"oid\":");
+	jg2_jw_end(&w, ctx);
 
 	jg2_json_oid(git_commit_id(commit), ctx);
 
-	CTX_BUF_APPEND(",\n \"msg\": \"%s\",\n \"sig_commit\": ",
-		ellipsis_purify(summary,
-#if LIBGIT2_HAS_DIFF
-				git_commit_summary(commit),
-#else
-				git_commit_message(commit),
-#endif
-				sizeof(summary)));
+	commit_summary_msg(summary, commit);
+
+	jg2_jw_start(&w, ctx, 40 + strlen(summary));
+	JG2_JW_LIT(&w, ",\n \"msg\": \"");
+	jg2_jw_str(&w, summary);
+	JG2_JW_LIT(&w, "\",\n \"sig_commit\": ");
+	jg2_jw_end(&w, ctx);
 
 	signature_json(git_commit_committer(commit), ctx);
 
-	CTX_BUF_APPEND(",\n\"sig_author\": ");
+	jg2_jw_start(&w, ctx, 20);
+	JG2_JW_LIT(&w, ",\n\"sig_author\": ");
+	jg2_jw_end(&w, ctx);
 
 	signature_json(git_commit_author(commit), ctx);
 
 	return 0;
 }
 
+int
+tag_summary(git_tag *tag, struct jg2_ctx *ctx)
+{
+	const char *type = otype_name(git_tag_target_type(tag));
+	char summary[JG2_SUMMARY_LEN];
+	struct jg2_jw w;
+
+	jg2_jw_start(&w, ctx, 32);
+	JG2_JW_LIT(&w, "\"type\":\"tag\",\n \"oid_tag\": ");
+	jg2_jw_end(&w, ctx);
+
+	jg2_json_oid(git_tag_target_id(tag), ctx);
+
+	ellipsis_purify(summary, git_tag_message(tag), sizeof(summary));
+
+	jg2_jw_start(&w, ctx, 56 + strlen(type) + strlen(summary));
+	JG2_JW_LIT(&w, ",\n \"type_tag\": \"");
+	jg2_jw_str(&w, type);
+	JG2_JW_LIT(&w, "\",\n\"msg_tag\": \"");
+	jg2_jw_str(&w, summary);
+	JG2_JW_LIT(&w, "\",\n \"sig_tagger\": ");
+	jg2_jw_end(&w, ctx);
+
+	signature_json(git_tag_tagger(tag), ctx);
+
+	return 0;
+}
+
 /* these summaries have restricted sizes below 512 bytes */
 
 int
 generic_object_summary(const git_oid *oid, struct jg2_ctx *ctx)
 {
-	char summary[100];
 	git_generic_ptr u;
 	git_otype type;
+	char *p;
 	int e;
 
 	if (!oid) {
@@ -592,6 +967,17 @@ generic_object_summary(const git_oid *oid, struct jg2_ctx *ctx)
 		return 0;
 	}
 
+	/* commits and tags come from the summary fragment cache */
+
+	p = ctx->p;
+	CTX_BUF_APPEND("{ ");
+	if (!jg2_summary_json(ctx, oid, NULL)) {
+		CTX_BUF_APPEND("}");
+
+		return 0;
+	}
+	ctx->p = p;
+
 	e = git_object_lookup(&u.obj, ctx->jrepo->repo, oid, GIT_OBJ_ANY);
 	if (e < 0) {
 		CTX_BUF_APPEND("{}");
@@ -601,6 +987,7 @@ generic_object_summary(const git_oid *oid, struct jg2_ctx *ctx)
 
 	type = git_object_type(u.obj);
 	if (type < GIT_OBJ_COMMIT || type > GIT_OBJ_TAG) {
+		git_object_free(u.obj);
 		CTX_BUF_APPEND("{}");
 
 		return 0;
@@ -609,10 +996,6 @@ generic_object_summary(const git_oid *oid, struct jg2_ctx *ctx)
 	CTX_BUF_APPEND("{ ");
 
 	switch (type) {
-	case GIT_OBJ_COMMIT:
-		commit_summary(u.commit, ctx);
-		break;
-
 	case GIT_OBJ_TREE:
 		CTX_BUF_APPEND("\"type\":\"tree\"\n");
 		break;
@@ -620,20 +1003,6 @@ generic_object_summary(const git_oid *oid, struct jg2_ctx *ctx)
 		CTX_BUF_APPEND("\"type\":\"blob\",\n \"size\":\"%llu\"",
 			(unsigned long long)git_blob_rawsize(u.blob));
 		break;
-	case GIT_OBJ_TAG:
-		CTX_BUF_APPEND("\"type\":\"tag\",\n \"oid_tag\": ");
-
-		jg2_json_oid(git_tag_target_id(u.tag), ctx);
-
-		CTX_BUF_APPEND(",\n \"type_tag\": \"%s\",\n"
-			"\"msg_tag\": \"%s\",\n \"sig_tagger\": ",
-			otype_name(git_tag_target_type(u.tag)),
-			ellipsis_purify(summary, git_tag_message(u.tag),
-					sizeof(summary)));
-
-		signature_json(git_tag_tagger(u.tag), ctx);
-		break;
-
 	default:
 		break;
 	}
@@ -24,6 +24,7 @@
 #include <libwebsockets.h>
 #include <string.h>
 #include <stdlib.h>
+#include <unistd.h>
 
 #include <libjsongit2.h>
 
@@ -34,16 +35,21 @@
 
 struct task_data_gitohashi {
 	char buf[LWS_PRE + 4096];
-	char url[1024], alang[128], ua[256], inm[36];
+	char url[1024], alang[128], ua[256], inm[36], aenc[128];
 	int frametype;
 	struct jg2_ctx *ctx;
 	size_t used;
+	uint64_t range_pos, range_end; /* cache file range we are sending */
+	lws_usec_t us_start;
+	int range_fd;
 	char final;
 	char outlive;
+	char started;
 };
 
 struct pss_gitohashi {
 	struct lws *wsi;
+	struct task_data_gitohashi *fast; /* served from the cache by us */
 	int state;
 };
 
@@ -55,6 +61,10 @@ struct vhd_gitohashi {
 	lws_sorted_usec_list_t sul;
 	struct lws_threadpool *tp;
 	struct lws_vhost *vhost;
+
+	/* completed transactions, served from cache here or by the workers */
+	uint64_t fast_count, fast_us, fast_count_last;
+	uint64_t worker_count, worker_us, worker_count_last;
 };
 
 
@@ -76,13 +86,6 @@ task_function(void *user, enum lws_threadpool_task_status s)
 	int n, flags = 0, opa;
 	char outlive = 0;
 
-	/*
-	 * first time, we must do the http reply, and either acquire the
-	 * jg2 ctx or finish the transaction
-	 */
-	if (!priv->ctx)
-		return LWS_TP_RETURN_SYNC;
-
 	/* we sent the last bit already */
 
 	if (!priv->outlive && priv->frametype == LWS_WRITE_HTTP_FINAL)
@@ -101,6 +104,23 @@ task_function(void *user, enum lws_threadpool_task_status s)
 	if (n < 0)
 		return LWS_TP_RETURN_STOPPED;
 
+	if (n == JG2_CTX_FILL_FD_RANGE) {
+		uint64_t length;
+
+		/*
+		 * The rest of a cache entry can go on the wire as it is... the
+		 * event loop sends it straight from the file after whatever
+		 * is in the buffer, then lets us continue with the remainder
+		 */
+		if (jg2_ctx_fd_range(priv->ctx, &priv->range_fd,
+				     &priv->range_pos, &length))
+			return LWS_TP_RETURN_STOPPED;
+
+		priv->range_end = priv->range_pos + length;
+
+		return LWS_TP_RETURN_SYNC | flags;
+	}
+
 	if (n || priv->final) {
 		priv->frametype = LWS_WRITE_HTTP_FINAL;
 		priv->final = 1;
@@ -120,13 +140,110 @@ task_function(void *user, enum lws_threadpool_task_status s)
 	return LWS_TP_RETURN_CHECKING_IN | flags;
 }
 
+/*
+ * Runs on the event loop thread: read the next part of the cache file range
+ * straight into our send buffer and write it, without involving the task.
+ */
+
+static int
+range_write(struct lws *wsi, struct task_data_gitohashi *priv)
+{
+	size_t len = sizeof(priv->buf) - LWS_PRE;
+	ssize_t n;
+
+	if (len > priv->range_end - priv->range_pos)
+		len = (size_t)(priv->range_end - priv->range_pos);
+
+	n = pread(priv->range_fd, priv->buf + LWS_PRE, len,
+		  (off_t)priv->range_pos);
+	if (n <= 0) {
+		lwsl_err("%s: cache read failed\n", __func__);
+
+		return -1;
+	}
+
+	if (lws_write(wsi, (unsigned char *)priv->buf + LWS_PRE, (size_t)n,
+		      LWS_WRITE_HTTP) != (int)n) {
+		lwsl_err("%s: lws_write failed\n", __func__);
+
+		return -1;
+	}
+
+	priv->range_pos += (uint64_t)n;
+
+	return 0;
+}
+
+/*
+ * Runs on the event loop thread: the ctx content is all in the cache, so we
+ * can produce it here without blocking on git work, and without needing a
+ * threadpool task.
+ */
+
+static int
+fast_writeable(struct lws *wsi, struct vhd_gitohashi *vhd,
+	       struct pss_gitohashi *pss)
+{
+	struct task_data_gitohashi *priv = pss->fast;
+	uint64_t length;
+	int n;
+
+	if (priv->range_pos != priv->range_end) {
+		if (range_write(wsi, priv))
+			return -1;
+
+		goto more;
+	}
+
+	n = jg2_ctx_fill(priv->ctx, priv->buf + LWS_PRE,
+			 sizeof(priv->buf) - LWS_PRE, &priv->used, NULL);
+	if (n < 0)
+		return -1;
+
+	if (n == JG2_CTX_FILL_FD_RANGE) {
+		if (jg2_ctx_fd_range(priv->ctx, &priv->range_fd,
+				     &priv->range_pos, &length))
+			return -1;
+
+		priv->range_end = priv->range_pos + length;
+		n = 0;
+	}
+
+	if ((priv->used || n) &&
+	    lws_write(wsi, (unsigned char *)priv->buf + LWS_PRE, priv->used,
+		      n ? LWS_WRITE_HTTP_FINAL : LWS_WRITE_HTTP) !=
+							(int)priv->used) {
+		lwsl_err("%s: lws_write failed\n", __func__);
+
+		return -1;
+	}
+
+	if (n) {
+		vhd->fast_count++;
+		vhd->fast_us += (uint64_t)(lws_now_usecs() - priv->us_start);
+
+		pss->fast = NULL;
+		cleanup_task_private_data(wsi, priv);
+
+		if (lws_http_transaction_completed(wsi))
+			return -1;
+
+		return 0;
+	}
+
+more:
+	lws_callback_on_writable(wsi);
+
+	return 0;
+}
+
 static int
 http_reply(struct lws *wsi, struct vhd_gitohashi *vhd,
 	   struct pss_gitohashi *pss, struct task_data_gitohashi *priv)
 {
 	unsigned char *p = (unsigned char *)&priv->buf[LWS_PRE], *start = p,
 		      *end = (unsigned char *)priv->buf + sizeof(priv->buf);
-	const char *mimetype = NULL;
+	const char *mimetype = NULL, *content_encoding = NULL;
 	struct jg2_ctx_create_args args;
 	unsigned long length = 0;
 	char etag[36];
@@ -134,7 +251,7 @@ http_reply(struct lws *wsi, struct vhd_gitohashi *vhd,
 
 	memset(&args, 0, sizeof(args));
 	args.repo_path = priv->url;
-	args.flags = JG2_CTX_FLAG_HTML;
+	args.flags = JG2_CTX_FLAG_HTML | JG2_CTX_FLAG_FD_SPOOL;
 	args.mimetype = &mimetype;
 	args.length = &length;
 	args.etag = etag;
@@ -146,6 +263,10 @@ http_reply(struct lws *wsi, struct vhd_gitohashi *vhd,
 	if (priv->inm[0])
 		args.client_etag = priv->inm;
 
+	if (priv->aenc[0])
+		args.accept_encoding = priv->aenc;
+	args.content_encoding = &content_encoding;
+
 
 	/*
 	 * Let's assess from his user agent if he's a bot.  Caching
@@ -223,6 +344,20 @@ http_reply(struct lws *wsi, struct vhd_gitohashi *vhd,
 						    strlen(etag), &p, end))
 		return 1;
 
+	/* the content may be compressed according to his accept-encoding */
+
+	if (content_encoding &&
+	    lws_add_http_header_by_name(wsi,
+				(unsigned char *)"content-encoding:",
+				(unsigned char *)content_encoding,
+				(int)strlen(content_encoding), &p, end))
+		return 1;
+
+	if (lws_add_http_header_by_name(wsi,
+				(unsigned char *)"vary:",
+				(unsigned char *)"Accept-Encoding", 15, &p, end))
+		return 1;
+
 	if (lws_finalize_write_http_header(wsi, start, &p, end))
 		return 1;
 
@@ -309,6 +444,21 @@ dump_cb(lws_sorted_usec_list_t *sul)
 	 * a second
 	 */
 	//lws_threadpool_dump(vhd->tp);
+
+	if (vhd->fast_count != vhd->fast_count_last ||
+	    vhd->worker_count != vhd->worker_count_last) {
+		lwsl_info("%s: cached: %llu, avg %lluus, worker: %llu, "
+			  "avg %lluus\n", __func__,
+			  (unsigned long long)vhd->fast_count,
+			  (unsigned long long)(vhd->fast_count ?
+				vhd->fast_us / vhd->fast_count : 0),
+			  (unsigned long long)vhd->worker_count,
+			  (unsigned long long)(vhd->worker_count ?
+				vhd->worker_us / vhd->worker_count : 0));
+		vhd->fast_count_last = vhd->fast_count;
+		vhd->worker_count_last = vhd->worker_count;
+	}
+
 	lws_sul_schedule(vhd->context, 0, &vhd->sul, dump_cb, 1 * LWS_US_PER_SEC);
 }
 
@@ -398,8 +548,26 @@ callback_gitohashi(struct lws *wsi, enum lws_callback_reasons reason,
 			/* optional, default size if not set */
 			if (!lws_pvo_get_str(in, "cache-size", &csize))
 				config.cache_size_limit = atoi(csize);
+
+			/* optional, default in-memory hot tier size if not set */
+			if (!lws_pvo_get_str(in, "hot-cache-size", &csize))
+				config.hot_cache_size_limit = atoi(csize);
+
+			/* optional, fifo hooks can notify refchanges on */
+			lws_pvo_get_str(in, "refchange-fifo",
+					&config.refchange_fifo);
 		}
 
+		/* optional, defaults if not set */
+		if (!lws_pvo_get_str(in, "summary-cache-size", &csize))
+			config.summary_cache_size_limit = atoi(csize);
+		if (!lws_pvo_get_str(in, "diff-size", &csize))
+			config.diff_size_limit = atoi(csize);
+		if (!lws_pvo_get_str(in, "max-open-repos", &csize))
+			config.max_open_repos = atoi(csize);
+		if (!lws_pvo_get_str(in, "repo-idle-secs", &csize))
+			config.repo_idle_secs = atoi(csize);
+
 		/* optional... flags */
 		if (!lws_pvo_get_str(in, "flags", &flags))
 			config.flags = atoi(flags);
@@ -440,9 +608,9 @@ callback_gitohashi(struct lws *wsi, enum lws_callback_reasons reason,
 	case LWS_CALLBACK_HTTP:
 
 		/*
-		 * The jg2 ctx is not going to be created until a thread
-		 * becomes available.  But our headers will be scrubbed when
-		 * we return from this.
+		 * Our headers will be scrubbed when we return from this, and
+		 * any work on the jg2 ctx content may have to wait until a
+		 * thread becomes available.
 		 *
 		 * So we must stash any interesting header content in the user
 		 * priv struct before queuing the task.
@@ -506,22 +674,54 @@ callback_gitohashi(struct lws *wsi, enum lws_callback_reasons reason,
 				 WSI_TOKEN_HTTP_ACCEPT_LANGUAGE) < 0)
 			priv->alang[0] = '\0';
 
+		if (lws_hdr_total_length(wsi, WSI_TOKEN_HTTP_ACCEPT_ENCODING) &&
+		    lws_hdr_copy(wsi, priv->aenc, sizeof(priv->aenc),
+				 WSI_TOKEN_HTTP_ACCEPT_ENCODING) < 0)
+			priv->aenc[0] = '\0';
+
 		n = lws_hdr_total_length(wsi, WSI_TOKEN_HTTP_IF_NONE_MATCH);
 		if (n && lws_hdr_copy(wsi, priv->inm,
 				      sizeof(priv->inm),
 				      WSI_TOKEN_HTTP_IF_NONE_MATCH) < 0)
 			priv->inm[0] = '\0';
 
-		/*
-		 * that's all the info we need... queue the task to do the
-		 * actual business (priv is passed by targs.user)
-		 */
-
 		if (!vhd) {
 			lwsl_err("%s: NULL vhd\n", __func__);
+			free(priv);
 			return -1;
 		}
 
+		/*
+		 * Do the http response and maybe acquire the jg2 ctx.
+		 * Sometimes that was all we needed to do (eg, ETAG matched)
+		 * and there's no jg2_ctx: the transaction is completed then.
+		 */
+
+		priv->us_start = lws_now_usecs();
+		n = http_reply(wsi, vhd, pss, priv);
+		if (n || !priv->ctx) {
+			cleanup_task_private_data(wsi, priv);
+
+			return n;
+		}
+
+		/*
+		 * If it's all in the cache, we can just spool it from here
+		 * without waiting behind whatever the threadpool is busy with
+		 */
+
+		if (jg2_ctx_cache_probe(priv->ctx)) {
+			pss->fast = priv;
+			lws_callback_on_writable(wsi);
+
+			return 0;
+		}
+
+		/*
+		 * that's all the info we need... queue the task to do the
+		 * actual business (priv is passed by targs.user)
+		 */
+
 		if (!lws_threadpool_enqueue(vhd->tp, &targs, "goh-%s",
 					    (const char *)in)) {
 			lwsl_user("%s: Couldn't enqueue task\n", __func__);
@@ -532,11 +732,8 @@ callback_gitohashi(struct lws *wsi, enum lws_callback_reasons reason,
 		lws_set_timeout(wsi, PENDING_TIMEOUT_THREADPOOL, 30);
 
 		/*
-		 * the task will get serviced, see that it doesn't have any
-		 * jg2 ctx yet, and SYNC until we got a WRITEABLE callback
-		 * (which will usually be very quickly, because this HTTP
-		 * callback only happens when we are writeable, and we didn't
-		 * write anything yet)
+		 * the task will get serviced, fill a buffer from the jg2 ctx
+		 * and SYNC until we got a WRITEABLE callback to send it
 		 */
 
 		return 0;
@@ -545,6 +742,10 @@ callback_gitohashi(struct lws *wsi, enum lws_callback_reasons reason,
 		if (pss) {
 			lwsl_info("%s: HTTP_DROP_PROTOCOL: %s %p\n", __func__,
 				   (const char *)in, wsi);
+			if (pss->fast) {
+				cleanup_task_private_data(wsi, pss->fast);
+				pss->fast = NULL;
+			}
 			if (lws_threadpool_get_task_wsi(wsi))
 				lws_threadpool_dequeue_task(lws_threadpool_get_task_wsi(wsi));
 		}
@@ -558,6 +759,9 @@ callback_gitohashi(struct lws *wsi, enum lws_callback_reasons reason,
 		if (!pss)
 			break;
 
+		if (pss->fast)
+			return fast_writeable(wsi, vhd, pss);
+
 		n = lws_threadpool_task_status(lws_threadpool_get_task_wsi(wsi), &_user);
 		lwsl_info("%s: LWS_CALLBACK_SERVER_WRITEABLE: %p: "
 			   "priv %p, status %d\n", __func__, wsi, _user, n);
@@ -582,31 +786,11 @@ callback_gitohashi(struct lws *wsi, enum lws_callback_reasons reason,
 
 		priv = (struct task_data_gitohashi *)_user;
 
-		if (!priv->ctx) {
-			/*
-			 * Do the http response and maybe acquire the jg2 ctx.
-			 * Sometimes that was all we needed to do (eg, ETAG
-			 * matched) and there's no jg2_ctx: the transaction is
-			 * completed then.
-			 */
-			n = http_reply(wsi, vhd, pss, priv);
-			if (!priv->ctx) {
-				/* unblock him and stop him as we are done */
-				lws_threadpool_task_sync(lws_threadpool_get_task_wsi(wsi), 1);
-
-				return n;
-			}
-
+		if (!priv->started) {
+			/* the worker got started on it */
 			lws_set_timeout(wsi, PENDING_TIMEOUT_THREADPOOL_TASK,
 					60);
-
-			/*
-			 * otherwise we are just getting started... unblock the
-			 * worker thread and start the business of filling
-			 * buffers and sending them on.
-			 */
-
-			goto sync_end;
+			priv->started = 1;
 		}
 
 		if (priv->used) {
@@ -622,12 +806,31 @@ callback_gitohashi(struct lws *wsi, enum lws_callback_reasons reason,
 			priv->used = 0;
 
 			if (priv->frametype == LWS_WRITE_HTTP_FINAL) {
+				vhd->worker_count++;
+				vhd->worker_us += (uint64_t)(lws_now_usecs() -
+							     priv->us_start);
 				lws_threadpool_task_sync(lws_threadpool_get_task_wsi(wsi), !priv->outlive);
 				goto transaction_completed;
 			}
-		}
 
-sync_end:
+			if (priv->range_pos != priv->range_end) {
+				/* the cache file range goes next */
+				lws_callback_on_writable(wsi);
+
+				return 0;
+			}
+		} else
+			if (priv->range_pos != priv->range_end) {
+				if (range_write(wsi, priv))
+					return -1;
+
+				if (priv->range_pos != priv->range_end) {
+					lws_callback_on_writable(wsi);
+
+					return 0;
+				}
+			}
+
 		lws_threadpool_task_sync(lws_threadpool_get_task_wsi(wsi), 0);
 
 		return 0;